@@ -0,0 +1,52 @@
+-- Compare qpack.to_json() with qpack.decode() followed by cjson.encode() and
+-- qpack.from_json() with cjson.decode() followed by qpack.encode().
+--
+-- Usage: lua bench/json.lua [rows] [rounds]
+local qpack = require 'qpack'
+local cjson = require 'cjson'
+
+local rows = tonumber(arg and arg[1]) or 10000
+local rounds = tonumber(arg and arg[2]) or 20
+
+local function sample(n)
+    local t = {}
+    for i = 1, n do
+        local ts = 1637979480080 + i * 5000
+        t['SAMPLE.w' .. i .. '.flag.string'] = {{ts, 'N'}, {ts + 5000, 'N'}}
+        t['SAMPLE.w' .. i .. '.value.float'] = {{ts, 29.1100001}, {ts + 5000, i / 7}}
+        t['SAMPLE.w' .. i .. '.cou.float'] = {{ts, 206.09879787908}, {ts + 5000, 145.5500001}}
+    end
+    return t
+end
+
+local function bench(name, fn)
+    local start = os.clock()
+    for _ = 1, rounds do
+        fn()
+    end
+    local elapsed = os.clock() - start
+    print(string.format('%-24s %8.2f ms/op', name, elapsed * 1000 / rounds))
+    return elapsed
+end
+
+local buf = qpack.encode(sample(rows))
+print(string.format('qpack input: %d bytes', #buf))
+
+local a = bench('decode + cjson.encode', function()
+    return cjson.encode(qpack.decode(buf))
+end)
+local b = bench('qpack.to_json', function()
+    return qpack.to_json(buf)
+end)
+print(string.format('speedup: %.1fx', a / b))
+
+local json = qpack.to_json(buf)
+print(string.format('JSON input: %d bytes', #json))
+
+a = bench('cjson.decode + encode', function()
+    return qpack.encode(cjson.decode(json))
+end)
+b = bench('qpack.from_json', function()
+    return qpack.from_json(json)
+end)
+print(string.format('speedup: %.1fx', a / b))
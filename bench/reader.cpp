@@ -0,0 +1,183 @@
+/*
+ * reader.cpp - Compare qpack::reader with a hand-written qp_next() loop.
+ *
+ * Both read the same list of records
+ *
+ *      {"id": int, "name": string, "vals": [double, ...]}
+ *
+ * and sum the ids, the values and the length of the names.
+ *
+ *      make bench && ./bench/reader [records]
+ */
+#include <qpack/qpack.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+int siri_err = 0;
+
+struct result
+{
+    int64_t ids = 0;
+    double vals = 0.0;
+    size_t names = 0;
+};
+
+static qp_packer_t * make_data(int n)
+{
+    qp_packer_t * pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    char name[32];
+
+    qp_add_type(pk, QP_ARRAY_OPEN);
+    for (int i = 0; i < n; i++)
+    {
+        qp_add_type(pk, QP_MAP3);
+        qp_add_string(pk, "id");
+        qp_add_int64(pk, i * 7);
+        qp_add_string(pk, "name");
+        snprintf(name, sizeof(name), "sensor-%d", i);
+        qp_add_string(pk, name);
+        qp_add_string(pk, "vals");
+        qp_add_type(pk, QP_ARRAY_OPEN);
+        for (int j = 0; j < 8; j++)
+        {
+            qp_add_double(pk, i * 0.5 + j);
+        }
+        qp_add_type(pk, QP_ARRAY_CLOSE);
+    }
+    qp_add_type(pk, QP_ARRAY_CLOSE);
+    return pk;
+}
+
+static result read_c(unsigned char * data, size_t len)
+{
+    result res;
+    qp_unpacker_t up;
+    qp_obj_t obj, key;
+    int count;
+
+    qp_unpacker_init(&up, data, len);
+    if (qp_next(&up, NULL) != QP_ARRAY_OPEN)
+    {
+        abort();
+    }
+
+    while (qp_next(&up, &obj) != QP_ARRAY_CLOSE && obj.tp != QP_END)
+    {
+        if (!qp_is_map((qp_types_t) obj.tp))
+        {
+            abort();
+        }
+        count = obj.tp == QP_MAP_OPEN ? -1 : obj.tp - QP_MAP0;
+        while (count--)
+        {
+            if (qp_next(&up, &key) != QP_RAW)
+            {
+                break;
+            }
+            if (key.len == 2 && memcmp(key.via.raw, "id", 2) == 0)
+            {
+                if (qp_next(&up, &obj) != QP_INT64)
+                {
+                    abort();
+                }
+                res.ids += obj.via.int64;
+            }
+            else if (key.len == 4 && memcmp(key.via.raw, "name", 4) == 0)
+            {
+                if (qp_next(&up, &obj) != QP_RAW)
+                {
+                    abort();
+                }
+                res.names += obj.len;
+            }
+            else if (key.len == 4 && memcmp(key.via.raw, "vals", 4) == 0)
+            {
+                qp_types_t tp = qp_next(&up, &obj);
+                int n = tp == QP_ARRAY_OPEN ? -1 : tp - QP_ARRAY0;
+                while (n-- && qp_next(&up, &obj) == QP_DOUBLE)
+                {
+                    res.vals += obj.via.real;
+                }
+            }
+            else
+            {
+                qp_skip_next(&up);
+            }
+        }
+    }
+    return res;
+}
+
+static result read_cpp(unsigned char * data, size_t len)
+{
+    result res;
+    qpack::reader reader(data, len);
+
+    for (auto & rec : reader.next().array())
+    {
+        for (auto & [key, val] : rec.map())
+        {
+            auto k = key.as<std::string_view>();
+            if (k == "id")
+            {
+                res.ids += val.as<int64_t>();
+            }
+            else if (k == "name")
+            {
+                res.names += val.as<std::string_view>().size();
+            }
+            else if (k == "vals")
+            {
+                for (auto & v : val.array())
+                {
+                    res.vals += v.as<double>();
+                }
+            }
+        }
+    }
+    return res;
+}
+
+template <typename F>
+static double bench(F f, unsigned char * data, size_t len, result & res)
+{
+    double best = 1e30;
+    for (int r = 0; r < 7; r++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        res = f(data, len);
+        std::chrono::duration<double> d =
+                std::chrono::steady_clock::now() - start;
+        if (d.count() < best)
+        {
+            best = d.count();
+        }
+    }
+    return best;
+}
+
+int main(int argc, char * argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    qp_packer_t * pk = make_data(n);
+    result rc, rcpp;
+
+    double tc = bench(read_c, pk->buffer, pk->len, rc);
+    double tcpp = bench(read_cpp, pk->buffer, pk->len, rcpp);
+
+    if (rc.ids != rcpp.ids || rc.vals != rcpp.vals || rc.names != rcpp.names)
+    {
+        fprintf(stderr, "results differ\n");
+        return 1;
+    }
+
+    printf("%d records, %zu bytes\n", n, pk->len);
+    printf("qp_next:       %8.2f ms  %6.1f ns/record\n",
+            tc * 1e3, tc * 1e9 / n);
+    printf("qpack::reader: %8.2f ms  %6.1f ns/record  (%.2fx)\n",
+            tcpp * 1e3, tcpp * 1e9 / n, tc / tcpp);
+
+    qp_packer_free(pk);
+    return 0;
+}
@@ -0,0 +1,72 @@
+-- Compare arrays with runs of repeated values (encode_run_length) with plain
+-- arrays, for flag and status series as found in time series data.
+--
+-- Usage: lua bench/runs.lua [values] [rounds]
+local qpack = require 'qpack'
+
+local values = tonumber(arg and arg[1]) or 100000
+local rounds = tonumber(arg and arg[2]) or 20
+
+-- mostly 'N' with a short error now and then
+local function flags(n)
+    local t = {}
+    for i = 1, n do
+        t[i] = (i % 1000 < 990) and 'N' or 'E'
+    end
+    return t
+end
+
+-- an idle sensor which reports the same value for a while
+local function levels(n)
+    local t, v = {}, 29.11
+    for i = 1, n do
+        if i % 250 == 0 then
+            v = v + 0.01
+        end
+        t[i] = v
+    end
+    return t
+end
+
+-- status codes which change about every 20 values
+local function status(n)
+    local t, v = {}, 0
+    for i = 1, n do
+        if i % 20 == 0 then
+            v = (v + 1) % 3
+        end
+        t[i] = v
+    end
+    return t
+end
+
+local function bench(fn, v)
+    local start = os.clock()
+    for _ = 1, rounds do
+        fn(v)
+    end
+    return (os.clock() - start) * 1000 / rounds
+end
+
+local function report(name, data)
+    qpack.encode_run_length(false)
+    local plain = qpack.encode(data)
+    local enc_plain = bench(qpack.encode, data)
+    local dec_plain = bench(qpack.decode, plain)
+
+    qpack.encode_run_length(true)
+    local runs = qpack.encode(data)
+    local enc_runs = bench(qpack.encode, data)
+    local dec_runs = bench(qpack.decode, runs)
+    qpack.encode_run_length(false)
+
+    print(string.format('%-8s %9d %9d bytes  encode %7.2f %7.2f ms' ..
+                        '  decode %7.2f %7.2f ms (%.1fx)',
+                        name, #plain, #runs, enc_plain, enc_runs,
+                        dec_plain, dec_runs, dec_plain / dec_runs))
+end
+
+print(string.format('%-8s %9s %9s', '', 'plain', 'runs'))
+report('flags', flags(values))
+report('levels', levels(values))
+report('status', status(values))
@@ -2,8 +2,13 @@
  */
 
 #include <qpack/qpack.h>
+#include <qpack/json.h>
+#include <qpack/msgpack.h>
+#include <qpack/freader.h>
+#include <qpack/splice.h>
 #include <assert.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 #include <limits.h>
 #include <lua.h>
@@ -33,19 +38,67 @@ int siri_err;
 #define DEFAULT_ENCODE_MAX_DEPTH 1000
 #define DEFAULT_DECODE_MAX_DEPTH 1000
 #define DEFAULT_ENCODE_EMPTY_TABLE_AS_ARRAY 0
+#define DEFAULT_ENCODE_COMPACT_DOUBLES 0
+#define DEFAULT_ENCODE_RUN_LENGTH 0
+#define DEFAULT_ENCODE_PACKED_BOOLS 0
+#define DEFAULT_ENCODE_DICT_STRINGS 0
+#define DEFAULT_DECODE_BITSETS 0
+#define DEFAULT_ENCODE_SHARED_TABLES 0
+#define DEFAULT_ENCODE_SIZED_CONTAINERS 0
+
+/* Most distinct strings in a dictionary encoded array */
+#define QPACK_DICT_MAX 4096
+
+/* encode_compact_doubles settings */
+#define QPACK_COMPACT_OFF           0
+#define QPACK_COMPACT_ON            1   /* integral doubles decode as ints */
+#define QPACK_COMPACT_KEEP_FLOAT    2
 
 typedef struct {
     int encode_max_depth;
     int decode_max_depth;
     int encode_empty_table_as_array;
+    int encode_compact_doubles;
+    int encode_run_length;
+    int encode_packed_bools;
+    int encode_dict_strings;
+    int decode_bitsets;
+    int encode_shared_tables;
+    int encode_sized_containers;
+    /* encode_shared_tables state, only set on a copy for one value */
+    int shared_index;           /* stack index of the numbered tables */
+    struct qpack_shared_slot_s *shared_slots;
+    struct qpack_shared_slot_s *shared_free;   /* from the last lookup */
+    size_t shared_mask;
+    lua_Integer shared_count;   /* numbered tables */
+    lua_Integer shared_refs;    /* back-references written */
 } qpack_config_t;
 
+/* Numbered table for encode_shared_tables, found by its address */
+typedef struct qpack_shared_slot_s {
+    const void *table;
+    lua_Integer number;
+} qpack_shared_slot_t;
+
 typedef struct {
     const char *data;
     const char *ptr;
     qpack_config_t *cfg;
+    int shared_index;           /* stack index of number -> table */
+    lua_Integer shared_count;
 } qpack_parse_t;
 
+#define QPACK_BITSET_MT "qpack.bitset"
+
+/* Registry field with the extension types of qpack.register_ext() */
+#define QPACK_EXT_REG "qpack.ext"
+
+/* Booleans, as decoded from a QP_HOOK_BOOLS with decode_bitsets */
+typedef struct {
+    size_t n;
+    unsigned char bits[];   /* bit i is bit i % 8 of byte i / 8 */
+} qpack_bitset_t;
+
 /* ===== CONFIGURATION ===== */
 
 static qpack_config_t *qpack_fetch_config(lua_State *l)
@@ -141,6 +194,67 @@ static int qpack_cfg_encode_empty_tables_as_array(lua_State *l)
     return qpack_enum_option(l, 1, &cfg->encode_empty_table_as_array, NULL, 1);
 }
 
+/* Configures how doubles are encoded:
+ * - "off":        always 9 bytes (except -1.0, 0.0 and 1.0)
+ * - "on":         integral doubles as integers and doubles which are exact
+ *                 as float32 in 5 bytes; integral doubles decode as integers
+ * - "keep_float": as "on", but integral doubles are flagged and decode as
+ *                 floats again */
+static int qpack_cfg_encode_compact_doubles(lua_State *l)
+{
+    static const char *options[] = { "off", "on", "keep_float", NULL };
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+
+    return qpack_enum_option(l, 1, &cfg->encode_compact_doubles, options, 1);
+}
+
+/* Configures whether arrays with runs of repeated values are encoded as
+ * QP_HOOK_RUNS, which keeps each run as a value and a count */
+static int qpack_cfg_encode_run_length(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->encode_run_length, NULL, 1);
+}
+
+/* Configures whether arrays of booleans are packed 8 per byte */
+static int qpack_cfg_encode_packed_bools(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->encode_packed_bools, NULL, 1);
+}
+
+/* Configures whether arrays with few distinct strings are encoded as a
+ * dictionary and an index per value */
+static int qpack_cfg_encode_dict_strings(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->encode_dict_strings, NULL, 1);
+}
+
+/* Configures whether a table which is encoded more than once, or within
+ * itself, is written as a back-reference after its first time */
+static int qpack_cfg_encode_shared_tables(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->encode_shared_tables, NULL, 1);
+}
+
+/* Configures whether maps and arrays start with their size in bytes and
+ * number of items, so readers can skip them at once */
+static int qpack_cfg_encode_sized_containers(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->encode_sized_containers, NULL, 1);
+}
+
+/* Configures whether packed booleans decode as a qpack.bitset instead of a
+ * table */
+static int qpack_cfg_decode_bitsets(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_arg_init(l, 1);
+    return qpack_enum_option(l, 1, &cfg->decode_bitsets, NULL, 1);
+}
+
 static int qpack_destroy_config(lua_State *l)
 {
     /*
@@ -168,6 +282,19 @@ static void qpack_create_config(lua_State *l)
     cfg->encode_max_depth = DEFAULT_ENCODE_MAX_DEPTH;
     cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
     cfg->encode_empty_table_as_array = DEFAULT_ENCODE_EMPTY_TABLE_AS_ARRAY;
+    cfg->encode_compact_doubles = DEFAULT_ENCODE_COMPACT_DOUBLES;
+    cfg->encode_run_length = DEFAULT_ENCODE_RUN_LENGTH;
+    cfg->encode_packed_bools = DEFAULT_ENCODE_PACKED_BOOLS;
+    cfg->encode_dict_strings = DEFAULT_ENCODE_DICT_STRINGS;
+    cfg->decode_bitsets = DEFAULT_DECODE_BITSETS;
+    cfg->encode_shared_tables = DEFAULT_ENCODE_SHARED_TABLES;
+    cfg->encode_sized_containers = DEFAULT_ENCODE_SIZED_CONTAINERS;
+    cfg->shared_index = 0;
+    cfg->shared_slots = NULL;
+    cfg->shared_free = NULL;
+    cfg->shared_mask = 0;
+    cfg->shared_count = 0;
+    cfg->shared_refs = 0;
 }
 
 /* ===== ENCODING ===== */
@@ -244,6 +371,190 @@ static void qpack_check_encode_depth(lua_State *l, qpack_config_t *cfg, int curr
 
 static void qpack_append_data(lua_State *l, qpack_config_t *cfg, int current_depth, qp_packer_t *pk);
 
+/* Find the slot of a table address; an empty slot when it is not numbered */
+static qpack_shared_slot_t *qpack_shared_find(qpack_config_t *cfg,
+                                              const void *table)
+{
+    /* tables are allocated at steps of 64 bytes or so; the high bits of the
+     * product have all address bits mixed in */
+    size_t h = ((uint64_t)(uintptr_t)table * 0x9e3779b97f4a7c15u >> 32) &
+               cfg->shared_mask;
+
+    while (cfg->shared_slots[h].table != NULL &&
+           cfg->shared_slots[h].table != table)
+        h = (h + 1) & cfg->shared_mask;
+    return &cfg->shared_slots[h];
+}
+
+/* Create the slots, or twice as many when they are half full; they are a
+ * userdata at the stack index after the numbered tables */
+static void qpack_shared_grow(lua_State *l, qpack_config_t *cfg)
+{
+    qpack_shared_slot_t *old = cfg->shared_slots;
+    size_t i, n = old == NULL ? 0 : cfg->shared_mask + 1;
+
+    cfg->shared_mask = n ? n * 2 - 1 : 63;
+    cfg->shared_slots = lua_newuserdata(l, (cfg->shared_mask + 1) *
+                                           sizeof(qpack_shared_slot_t));
+    memset(cfg->shared_slots, 0,
+           (cfg->shared_mask + 1) * sizeof(qpack_shared_slot_t));
+    for (i = 0; i < n; i++)
+        if (old[i].table != NULL)
+            *qpack_shared_find(cfg, old[i].table) = old[i];
+    cfg->shared_free = NULL;
+    lua_replace(l, cfg->shared_index + 1);
+}
+
+/* Number the table on the top of the Lua stack, which is about to be written
+ * as a container, for back-references to it (encode_shared_tables). The
+ * table is kept in the numbered tables, so its address is not reused while
+ * encoding. */
+static void qpack_share_table(lua_State *l, qpack_config_t *cfg)
+{
+    const void *table;
+    qpack_shared_slot_t *slot;
+
+    if (cfg->shared_index == 0)
+        return;
+    table = lua_topointer(l, -1);
+    if ((size_t)cfg->shared_count >= (cfg->shared_mask + 1) / 2)
+        qpack_shared_grow(l, cfg);
+    /* the table was just looked up by qpack_append_data(), which saves a
+     * second cache miss in a large set of slots */
+    slot = cfg->shared_free != NULL ? cfg->shared_free :
+                                      qpack_shared_find(cfg, table);
+    cfg->shared_free = NULL;
+    slot->table = table;
+    slot->number = cfg->shared_count++;
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, cfg->shared_index, cfg->shared_count);
+}
+
+/* Append the array of n values on the top of the Lua stack as packed
+ * booleans (QP_HOOK_BOOLS). Returns 1 when written, 0 when not all values
+ * are booleans and -1 in case of an error */
+static int qpack_append_bools(lua_State *l, qp_packer_t *pk, int n)
+{
+    unsigned char *values;
+    int i;
+
+    if (n == 0 || lua_geti(l, -1, 1) != LUA_TBOOLEAN) {
+        lua_pop(l, 1);
+        return 0;
+    }
+    lua_pop(l, 1);
+
+    values = lua_newuserdata(l, n);
+    for (i = 0; i < n; i++) {
+        if (lua_geti(l, -2, i + 1) != LUA_TBOOLEAN) {
+            lua_pop(l, 2);
+            return 0;
+        }
+        values[i] = lua_toboolean(l, -1);
+        lua_pop(l, 1);
+    }
+    i = qp_add_bools(pk, values, n);
+    lua_pop(l, 1);
+    return i ? -1 : 1;
+}
+
+/* Append the array of n values on the top of the Lua stack as a dictionary
+ * of its strings and an index per value (QP_HOOK_DICT). Strings are found
+ * in the dictionary by their pointer, which is the same for equal short
+ * strings as Lua keeps one copy of those; an equal long string may get a
+ * second entry. The strings stay alive in the array, which therefore must
+ * not have a metatable. Returns 1 when written, 0 when the array is not
+ * all strings or has more than n / 2 distinct ones and -1 in case of an
+ * error */
+static int qpack_append_dict(lua_State *l, qp_packer_t *pk, int n)
+{
+    typedef struct { const char *str; uint32_t index; } slot_t;
+    slot_t *slots;
+    const char **strs;
+    size_t *lens, len, k = 0, max, nslots = 8, h;
+    uint32_t *indexes;
+    const char *str;
+    int i, ret;
+
+    if (lua_getmetatable(l, -1)) {
+        lua_pop(l, 1);
+        return 0;
+    }
+    if (n == 0 || lua_rawgeti(l, -1, 1) != LUA_TSTRING) {
+        lua_pop(l, 1);
+        return 0;
+    }
+    lua_pop(l, 1);
+
+    max = n / 2 < QPACK_DICT_MAX ? n / 2 : QPACK_DICT_MAX;
+    while (nslots < max * 2)
+        nslots *= 2;
+    slots = lua_newuserdata(l, nslots * sizeof(slot_t) +
+                               max * (sizeof(char *) + sizeof(size_t)) +
+                               n * sizeof(uint32_t));
+    strs = (const char **)(slots + nslots);
+    lens = (size_t *)(strs + max);
+    indexes = (uint32_t *)(lens + max);
+    memset(slots, 0, nslots * sizeof(slot_t));
+
+    for (i = 0; i < n; i++) {
+        if (lua_rawgeti(l, -2, i + 1) != LUA_TSTRING) {
+            lua_pop(l, 2);
+            return 0;
+        }
+        str = lua_tolstring(l, -1, &len);
+        lua_pop(l, 1);
+
+        h = ((uintptr_t)str >> 4) * 0x9e3779b1u & (nslots - 1);
+        while (slots[h].str != NULL && slots[h].str != str)
+            h = (h + 1) & (nslots - 1);
+        if (slots[h].str == NULL) {
+            if (k == max) {
+                lua_pop(l, 1);
+                return 0;
+            }
+            slots[h].str = str;
+            slots[h].index = k;
+            strs[k] = str;
+            lens[k] = len;
+            k++;
+        }
+        indexes[i] = slots[h].index;
+    }
+
+    ret = qp_add_dict(pk, strs, lens, k, indexes, n);
+    lua_pop(l, 1);
+    return ret ? -1 : 1;
+}
+
+/* Append the array of n values on the top of the Lua stack as packed
+ * booleans or as a string dictionary, when the options allow it and the
+ * values fit. Returns 1 when written, 0 when not and -1 in case of an
+ * error */
+static int qpack_append_packed(lua_State *l, qpack_config_t *cfg,
+                               qp_packer_t *pk, int n)
+{
+    int ret;
+
+    if (cfg->encode_packed_bools &&
+        (ret = qpack_append_bools(l, pk, n)) != 0)
+        return ret;
+
+    if (cfg->encode_dict_strings && n > 5 &&
+        (ret = qpack_append_dict(l, pk, n)) != 0)
+        return ret;
+
+    return 0;
+}
+
+/* Open a container which is finished with qp_add_close() */
+static int qpack_add_open(qpack_config_t *cfg, qp_packer_t *pk, qp_types_t tp,
+                          size_t *pos)
+{
+    return cfg->encode_sized_containers ?
+            qp_add_open_sized(pk, tp, pos) : qp_add_open(pk, tp, pos);
+}
+
 /* qpack_append_array args:
  * - lua_State
  * - JSON strbuf
@@ -252,6 +563,36 @@ static int qpack_append_array(lua_State *l, qpack_config_t *cfg, int current_dep
                               qp_packer_t *pk, int array_length)
 {
     int ret, i;
+    qp_runs_t runs;
+
+    if ((ret = qpack_append_packed(l, cfg, pk, array_length)) != 0)
+        return ret < 0 ? ret : 0;
+
+    qpack_share_table(l, cfg);
+
+    /* a short array has too little to gain from runs */
+    if (cfg->encode_run_length && array_length > 5) {
+        ret = qp_runs_open(pk, &runs, array_length);
+        for (i = 1; i <= array_length && !ret; i++) {
+            lua_geti(l, -1, i);
+            qpack_append_data(l, cfg, current_depth, pk);
+            lua_pop(l, 1);
+            ret = qp_runs_next(pk, &runs);
+        }
+        return ret || qp_runs_close(pk, &runs);
+    }
+
+    if (cfg->encode_sized_containers) {
+        size_t pos;
+        ret = qp_add_open_sized(pk, QP_ARRAY_OPEN, &pos);
+        for (i = 1; i <= array_length && !ret; i++) {
+            lua_geti(l, -1, i);
+            qpack_append_data(l, cfg, current_depth, pk);
+            lua_pop(l, 1);
+        }
+        return ret || qp_add_close(pk, pos, array_length);
+    }
+
     ret = qp_add_type(pk, QP_ARRAY_OPEN);
     if (ret)
         return ret;
@@ -280,6 +621,15 @@ static int qpack_append_bool(lua_State *l, qpack_config_t *cfg,
         return qp_add_false(pk);
 }
 
+static int qpack_append_double(qpack_config_t *cfg, qp_packer_t *pk,
+                               double num)
+{
+    if (cfg->encode_compact_doubles == QPACK_COMPACT_OFF)
+        return qp_add_double(pk, num);
+    return qp_add_double_compact(pk, num,
+            cfg->encode_compact_doubles == QPACK_COMPACT_KEEP_FLOAT);
+}
+
 static int qpack_append_number(lua_State *l, qpack_config_t *cfg,
         qp_packer_t *pk, int lindex)
 {
@@ -290,15 +640,40 @@ static int qpack_append_number(lua_State *l, qpack_config_t *cfg,
     }
 #endif
     double num = lua_tonumber(l, lindex);
-    return qp_add_double(pk, num); 
+    return qpack_append_double(cfg, pk, num);
+}
+
+/* Collect the n numbers of the array at lindex for qp_add_decimal_array().
+ * Pushes a buffer with the values, or returns NULL without pushing anything
+ * when an element is not a number. */
+static double *qpack_decimal_values(lua_State *l, int lindex, size_t n)
+{
+    double *values;
+    size_t i;
+
+    lindex = lua_absindex(l, lindex);
+    values = lua_newuserdata(l, n * sizeof(double));
+    for (i = 0; i < n; i++) {
+        if (lua_rawgeti(l, lindex, i + 1) != LUA_TNUMBER) {
+            lua_pop(l, 2);
+            return NULL;
+        }
+        values[i] = lua_tonumber(l, -1);
+        lua_pop(l, 1);
+    }
+    return values;
 }
 
 static int qpack_append_object(lua_State *l, qpack_config_t *cfg,
         int current_depth, qp_packer_t *pk)
 {
     int keytype, ret;
+    size_t pos, count = 0;
 
-    ret = qp_add_type(pk, QP_MAP_OPEN);
+    qpack_share_table(l, cfg);
+    ret = cfg->encode_sized_containers ?
+            qp_add_open_sized(pk, QP_MAP_OPEN, &pos) :
+            qp_add_type(pk, QP_MAP_OPEN);
     if (ret)
         return ret;
 
@@ -320,17 +695,118 @@ static int qpack_append_object(lua_State *l, qpack_config_t *cfg,
         qpack_append_data(l, cfg, current_depth, pk);
         lua_pop(l, 1);
         /* table, key */
+        count++;
     }
 
+    if (cfg->encode_sized_containers)
+        return qp_add_close(pk, pos, count);
     return qp_add_type(pk, QP_MAP_CLOSE);
 }
 
+/* Find how the table on the top of the Lua stack is serialised
+ * -1   object
+ * >=0  elements in array (from __len or lua_array_length())
+ */
+static int qpack_table_length(lua_State *l, qpack_config_t *cfg, qp_packer_t *pk)
+{
+    int len;
+
+    if (luaL_getmetafield(l, -1, "__len") != LUA_TNIL) {
+        lua_pushvalue(l, -2);
+        lua_call(l, 1, 1);
+        if (!lua_isinteger(l, -1)) {
+            luaL_error(l, "__len should return integer");
+        }
+        len = lua_tointeger(l, -1);
+        lua_pop(l, 1);
+        return len;
+    }
+
+    len = lua_array_length(l, cfg, pk);
+    if (len > 0 || (cfg->encode_empty_table_as_array && len == 0))
+        return len;
+
+    return -1;
+}
+
+/* Append the value on the top of the Lua stack as an extension value, when
+ * a codec takes it: a C codec (qp_register_ext()) for userdata with the
+ * metatable name of the codec, a Lua encoder for values with the metatable
+ * it was registered with, or else a Lua encoder without a metatable for
+ * values which cannot be encoded otherwise. Returns 1 when written and 0
+ * when no codec takes the value. */
+static int qpack_append_ext(lua_State *l, qp_packer_t *pk)
+{
+    const qp_ext_t *ext = NULL;
+    const char *data;
+    size_t pos, len;
+    uint8_t id;
+    int top = lua_gettop(l), i, n, mt;
+
+    luaL_checkstack(l, 6, NULL);
+    if (lua_type(l, top) == LUA_TUSERDATA) {
+        if (luaL_getmetafield(l, top, "__name") != LUA_TNIL) {
+            if (lua_type(l, -1) == LUA_TSTRING)
+                ext = qp_ext_find_name(lua_tostring(l, -1), &id);
+            lua_pop(l, 1);
+        }
+        if (ext != NULL) {
+            pos = pk->len;
+            if (ext->encode(pk, lua_touserdata(l, top), lua_rawlen(l, top)) ||
+                qp_ext_close(pk, id, pos))
+                luaL_error(l, "QPACK extension %d failed to encode", id);
+            return 1;
+        }
+    }
+
+    if (lua_getfield(l, LUA_REGISTRYINDEX, QPACK_EXT_REG) != LUA_TTABLE) {
+        lua_settop(l, top);
+        return 0;
+    }
+    mt = lua_getmetatable(l, top) && lua_rawget(l, top + 1) == LUA_TNUMBER;
+    if (mt) {
+        n = 1;
+    } else if (lua_type(l, top) == LUA_TTABLE) {
+        lua_settop(l, top);
+        return 0;
+    } else {
+        lua_settop(l, top + 1);
+        lua_getfield(l, top + 1, "any");
+        n = lua_rawlen(l, -1);
+    }
+
+    /* with a metatable, the id is on the top; otherwise try each in "any" */
+    for (i = 1; i <= n; i++) {
+        if (!mt)
+            lua_rawgeti(l, top + 2, i);
+        id = lua_tointeger(l, -1);
+        lua_rawgeti(l, top + 1, id);
+        lua_rawgeti(l, -1, 1);
+        lua_pushvalue(l, top);
+        lua_call(l, 1, 1);
+        data = lua_tolstring(l, -1, &len);
+        if (data != NULL) {
+            if (qp_add_ext(pk, id, (const unsigned char*)data, len))
+                luaL_error(l, "QPACK extension %d failed to encode", id);
+            lua_settop(l, top);
+            return 1;
+        }
+        if (mt)
+            luaL_error(l, "QPACK extension %d encoder must return a string",
+                       id);
+        lua_pop(l, 3);
+    }
+    lua_settop(l, top);
+    return 0;
+}
+
 /* Serialise Lua data into QPacker string. */
 static void qpack_append_data(lua_State *l, qpack_config_t *cfg,
                                 int current_depth, qp_packer_t *pk)
 {
     int len, ret = 0;
     int dtype = lua_type(l, -1);
+    qpack_bitset_t *bs;
 
     switch (dtype) {
     case LUA_TSTRING:
@@ -343,28 +819,41 @@ static void qpack_append_data(lua_State *l, qpack_config_t *cfg,
         ret = qpack_append_bool(l, cfg, pk, -1);
         break;
     case LUA_TTABLE:
+        if (lua_getmetatable(l, -1)) {
+            lua_pop(l, 1);
+            if (qpack_append_ext(l, pk))
+                break;
+        }
+        if (cfg->shared_index) {
+            qpack_shared_slot_t *slot =
+                    qpack_shared_find(cfg, lua_topointer(l, -1));
+            if (slot->table != NULL) {
+                ret = qp_add_ref(pk, slot->number);
+                cfg->shared_refs++;
+                break;
+            }
+            cfg->shared_free = slot;
+        }
         current_depth++;
         qpack_check_encode_depth(l, cfg, current_depth, pk);
-        if (luaL_getmetafield(l, -1, "__len") != LUA_TNIL) {
-            lua_pushvalue(l, -2);
-            lua_call(l, 1, 1);
-            if (!lua_isinteger(l, -1)) {
-                luaL_error(l, "__len should return integer");
-            }
-            len = lua_tointeger(l, -1);
-            lua_pop(l, 1);
+        len = qpack_table_length(l, cfg, pk);
+        if (len >= 0)
             ret = qpack_append_array(l, cfg, current_depth, pk, len);
-        } else {
-            len = lua_array_length(l, cfg, pk);
-            if (len > 0 || (cfg->encode_empty_table_as_array && len == 0))
-                ret = qpack_append_array(l, cfg, current_depth, pk, len);
-            else
-                ret = qpack_append_object(l, cfg, current_depth, pk);
-        }
+        else
+            ret = qpack_append_object(l, cfg, current_depth, pk);
         break;
     case LUA_TNIL:
         ret = qpack_append_null(l, cfg, pk, -1);
         break;
+    case LUA_TUSERDATA:
+        bs = luaL_testudata(l, -1, QPACK_BITSET_MT);
+        if (bs != NULL) {
+            ret = qp_add_bits(pk, bs->bits, bs->n);
+            break;
+        }
+        if (!qpack_append_ext(l, pk))
+            qpack_encode_exception(l, cfg, pk, -1, "type not supported");
+        break;
     case LUA_TLIGHTUSERDATA:
         if (lua_touserdata(l, -1) == NULL) {
             ret = qpack_append_null(l, cfg, pk, -1);
@@ -372,15 +861,96 @@ static void qpack_append_data(lua_State *l, qpack_config_t *cfg,
         }
     default:
         /* Remaining types (LUA_TFUNCTION, LUA_TUSERDATA, LUA_TTHREAD,
-         * and LUA_TLIGHTUSERDATA) cannot be serialised */
-        qpack_encode_exception(l, cfg, pk, -1, "type not supported");
-        /* never returns */
+         * and LUA_TLIGHTUSERDATA) cannot be serialised, except for a
+         * qpack.bitset or through an extension type */
+        if (!qpack_append_ext(l, pk))
+            qpack_encode_exception(l, cfg, pk, -1, "type not supported");
     }
     if (ret) {
         luaL_error(l, "encode data type:%d failed err:%d", dtype, ret);
     }
 }
 
+/* Serialise the Lua value on the top of the stack like qpack_append_data(),
+ * with back-references to tables which are seen again when
+ * encode_shared_tables is on. The value is only made a QP_HOOK_SHARED when it
+ * has back-references, so it is the same as without the option otherwise. */
+static void qpack_append_value(lua_State *l, qpack_config_t *cfg,
+                               int current_depth, qp_packer_t *pk)
+{
+    qpack_config_t shared;
+    size_t pos = pk->len;
+
+    if (!cfg->encode_shared_tables || lua_type(l, -1) != LUA_TTABLE) {
+        qpack_append_data(l, cfg, current_depth, pk);
+        return;
+    }
+
+    shared = *cfg;
+    lua_newtable(l);
+    shared.shared_index = lua_gettop(l);
+    shared.shared_slots = NULL;
+    shared.shared_count = 0;
+    shared.shared_refs = 0;
+    lua_pushnil(l);
+    qpack_shared_grow(l, &shared);
+    lua_pushvalue(l, -3);
+    qpack_append_data(l, &shared, current_depth, pk);
+    lua_pop(l, 3);
+
+    if (shared.shared_refs && qp_add_shared(pk, pos))
+        luaL_error(l, "encode shared tables failed");
+}
+
+#define QPACK_BUFFER_MT "qpack.buffer"
+
+/* Scratch packer owned by a userdata, so it is also freed when an error is
+ * raised while encoding */
+typedef struct {
+    qp_packer_t *pk;
+} qpack_buffer_t;
+
+/* Free the packer of the scratch buffer at idx now, instead of when the
+ * userdata is collected */
+static void qpack_buffer_free(lua_State *l, int idx)
+{
+    qpack_buffer_t *b = luaL_checkudata(l, idx, QPACK_BUFFER_MT);
+
+    if (b->pk != NULL) {
+        qp_packer_free(b->pk);
+        b->pk = NULL;
+    }
+}
+
+static int qpack_buffer_gc(lua_State *l)
+{
+    qpack_buffer_free(l, 1);
+    return 0;
+}
+
+/* Push a new scratch buffer userdata and return its packer */
+static qp_packer_t *qpack_buffer_new(lua_State *l, size_t alloc_size)
+{
+    qpack_buffer_t *b = (qpack_buffer_t *)lua_newuserdata(l, sizeof(*b));
+
+    b->pk = NULL;
+    luaL_setmetatable(l, QPACK_BUFFER_MT);
+    b->pk = qp_packer_new(alloc_size);
+    if (b->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK");
+
+    return b->pk;
+}
+
+static void qpack_buffer_register(lua_State *l)
+{
+    if (luaL_newmetatable(l, QPACK_BUFFER_MT)) {
+        lua_pushcfunction(l, qpack_buffer_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
 static int qpack_encode(lua_State *l)
 {
     qpack_config_t *cfg = qpack_fetch_config(l);
@@ -388,18 +958,241 @@ static int qpack_encode(lua_State *l)
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
-    /* Use private buffer */
-    pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    /* Use a private buffer, freed by its userdata when an error is raised */
+    pk = qpack_buffer_new(l, QP_SUGGESTED_SIZE);
+    lua_pushvalue(l, 1);
 
-    qpack_append_data(l, cfg, 0, pk);
+    qpack_append_value(l, cfg, 0, pk);
 
     lua_pushlstring(l, (const char*)pk->buffer, pk->len);
+    qpack_buffer_free(l, 2);
 
     return 1;
 }
 
 /* ===== DECODING ===== */
 
+static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
+        qp_unpacker_t *up, qp_obj_t *obj);
+
+/* Number the table on the top of the Lua stack, which was just created for a
+ * container, for back-references within a QP_HOOK_SHARED */
+static void qpack_share_table_decoded(lua_State *l, qpack_parse_t *pk)
+{
+    if (pk == NULL || pk->shared_index == 0)
+        return;
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, pk->shared_index, ++pk->shared_count);
+}
+
+/* Push the value of a QP_HOOK_SHARED; its containers are numbered in order
+ * as they are created, so a QP_HOOK_REF can push the same table again */
+static void qpack_process_shared(lua_State *l, qpack_parse_t *pk,
+                                 qp_obj_t *obj)
+{
+    qpack_parse_t shared = { NULL, NULL, NULL, 0, 0 };
+    qp_unpacker_t up;
+    qp_obj_t val;
+
+    if (pk != NULL)
+        shared = *pk;
+    lua_newtable(l);
+    shared.shared_index = lua_gettop(l);
+    shared.shared_count = 0;
+
+    qp_unpacker_init(&up, obj->via.raw, obj->len);
+    if (qp_next(&up, &val) == QP_END)
+        luaL_error(l, "QPACK invalid shared value");
+    qpack_process_obj(l, &shared, &up, &val);
+    if (qp_next(&up, &val) != QP_END)
+        luaL_error(l, "QPACK invalid shared value");
+    lua_remove(l, -2);
+}
+
+/* Push the table which a QP_HOOK_REF refers to */
+static void qpack_process_ref(lua_State *l, qpack_parse_t *pk,
+                              qp_obj_t *obj)
+{
+    if (pk == NULL || pk->shared_index == 0 ||
+        obj->via.int64 >= pk->shared_count)
+        luaL_error(l, "QPACK invalid back-reference");
+    lua_rawgeti(l, pk->shared_index, obj->via.int64 + 1);
+}
+
+/* Push a QP_HOOK_BOOLS array as a table or, with decode_bitsets, as a
+ * qpack.bitset */
+static void qpack_process_bools(lua_State *l, qpack_parse_t *pk,
+                                qp_obj_t *obj)
+{
+    unsigned char *bits;
+    qpack_bitset_t *bs;
+    size_t n, i;
+
+    if (qp_bools_get(obj, &n, &bits) || n > INT_MAX)
+        luaL_error(l, "QPACK invalid bool array");
+
+    if (pk != NULL && pk->cfg != NULL && pk->cfg->decode_bitsets) {
+        bs = lua_newuserdata(l, sizeof(*bs) + (n + 7) / 8);
+        bs->n = n;
+        memcpy(bs->bits, bits, (n + 7) / 8);
+        if (n & 7)
+            bs->bits[n / 8] &= (1u << (n & 7)) - 1;
+        luaL_setmetatable(l, QPACK_BITSET_MT);
+        return;
+    }
+
+    lua_createtable(l, (int)n, 0);
+    for (i = 0; i < n; i++) {
+        lua_pushboolean(l, bits[i >> 3] >> (i & 7) & 1);
+        lua_rawseti(l, -2, i + 1);
+    }
+}
+
+/* Push a QP_HOOK_DICT array; the strings are pushed once and each value is
+ * a copy from the stack */
+static void qpack_process_dict(lua_State *l, qp_obj_t *obj)
+{
+    qp_dict_t dict;
+    qp_obj_t str;
+    size_t i, index;
+    int top;
+
+    if (qp_dict_init(&dict, obj) || dict.n > INT_MAX || dict.k > INT_MAX)
+        luaL_error(l, "QPACK invalid string dictionary");
+    if (!lua_checkstack(l, (int)dict.k + 1))
+        luaL_error(l, "QPACK string dictionary too large");
+
+    lua_createtable(l, (int)dict.n, 0);
+    top = lua_gettop(l);
+    for (i = 0; i < dict.k; i++) {
+        qp_next(&dict.strings, &str);
+        lua_pushlstring(l, (const char*)str.via.raw, str.len);
+    }
+    for (i = 1; i <= dict.n; i++) {
+        index = qp_dict_next(&dict);
+        if (index >= dict.k)
+            luaL_error(l, "QPACK invalid string dictionary");
+        lua_pushvalue(l, top + 1 + (int)index);
+        lua_rawseti(l, top, i);
+    }
+    lua_settop(l, top);
+}
+
+/* Push a QP_HOOK_RUNS array; each value is kept on the stack while its
+ * repeats are filled in */
+static void qpack_process_runs(lua_State *l, qpack_parse_t *pk,
+                               qp_obj_t *obj)
+{
+    qp_unpacker_t up;
+    qp_obj_t val;
+    lua_Integer n, i = 0, k;
+    size_t size;
+
+    /* the runs are checked to add up to n before the table is sized */
+    if (qp_runs_get(obj, &size, &up) || size > INT_MAX)
+        luaL_error(l, "QPACK invalid array with runs");
+    n = (lua_Integer)size;
+
+    lua_createtable(l, (int)n, 0);
+    qpack_share_table_decoded(l, pk);
+    while (qp_next(&up, &val) != QP_END) {
+        if (val.tp == QP_HOOK && val.hook == QP_HOOK_REPEAT) {
+            if (i == 0 || val.via.int64 > n - i)
+                luaL_error(l, "QPACK invalid array with runs");
+            for (k = val.via.int64; k; k--) {
+                lua_pushvalue(l, -1);
+                lua_rawseti(l, -3, ++i);
+            }
+            continue;
+        }
+        if (i == n)
+            luaL_error(l, "QPACK invalid array with runs");
+        if (i)
+            lua_pop(l, 1);
+        qpack_process_obj(l, pk, &up, &val);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, -3, ++i);
+    }
+    if (i)
+        lua_pop(l, 1);
+    if (i != n)
+        luaL_error(l, "QPACK invalid array with runs");
+}
+
+/* Push an extension value, decoded by its C codec or Lua decoder */
+static void qpack_process_ext(lua_State *l, qp_obj_t *obj)
+{
+    const unsigned char *data;
+    const qp_ext_t *ext;
+    size_t n, size;
+    uint8_t id;
+    void *value;
+
+    if (qp_ext_get(obj, &id, &data, &n))
+        luaL_error(l, "QPACK invalid extension value");
+
+    ext = qp_ext_find(id);
+    if (ext != NULL && ext->name != NULL) {
+        size = ext->decode(data, n, NULL);
+        if (size == (size_t)-1)
+            luaL_error(l, "QPACK invalid extension %d value", id);
+        value = lua_newuserdata(l, size);
+        if (ext->decode(data, n, value) == (size_t)-1)
+            luaL_error(l, "QPACK invalid extension %d value", id);
+        luaL_setmetatable(l, ext->name);
+        return;
+    }
+
+    if (lua_getfield(l, LUA_REGISTRYINDEX, QPACK_EXT_REG) != LUA_TTABLE ||
+        lua_rawgeti(l, -1, id) != LUA_TTABLE ||
+        lua_rawgeti(l, -1, 2) != LUA_TFUNCTION)
+        luaL_error(l, "QPACK unknown extension %d", id);
+    lua_pushlstring(l, (const char*)data, n);
+    lua_call(l, 1, 1);
+    lua_replace(l, -3);
+    lua_pop(l, 1);
+}
+
+/* Push the value of a sized hook (see qp_hook_t) */
+static void qpack_process_hook(lua_State *l, qpack_parse_t *pk,
+                               qp_obj_t *obj)
+{
+    qp_decimals_t dec;
+    size_t i;
+
+    switch (obj->hook) {
+    case QP_HOOK_DECIMAL_ARRAY:
+        if (qp_decimals_init(&dec, obj) || dec.n > INT_MAX)
+            luaL_error(l, "QPACK invalid decimal array");
+        lua_createtable(l, (int)dec.n, 0);
+        for (i = 1; i <= dec.n; i++) {
+            lua_pushnumber(l, qp_decimals_next(&dec));
+            lua_rawseti(l, -2, i);
+        }
+        break;
+    case QP_HOOK_RUNS:
+        qpack_process_runs(l, pk, obj);
+        break;
+    case QP_HOOK_BOOLS:
+        qpack_process_bools(l, pk, obj);
+        break;
+    case QP_HOOK_DICT:
+        qpack_process_dict(l, obj);
+        break;
+    case QP_HOOK_SHARED:
+        qpack_process_shared(l, pk, obj);
+        break;
+    case QP_HOOK_REF:
+        qpack_process_ref(l, pk, obj);
+        break;
+    case QP_HOOK_EXT:
+        qpack_process_ext(l, obj);
+        break;
+    default:
+        luaL_error(l, "QPACK unsupported hook type:%d", obj->hook);
+    }
+}
+
 static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
         qp_unpacker_t *up, qp_obj_t *obj)
 {
@@ -432,6 +1225,9 @@ static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
     case QP_NULL:
         lua_pushlightuserdata(l, NULL);
         break;
+    case QP_HOOK:
+        qpack_process_hook(l, pk, obj);
+        break;
     case QP_ARRAY0:
     case QP_ARRAY1:
     case QP_ARRAY2:
@@ -442,6 +1238,7 @@ static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
         size_t total = obj->tp - QP_ARRAY0;
         int i;
         lua_newtable(l);
+        qpack_share_table_decoded(l, pk);
         for (i = 1; i <= total; i++)
         {
             qp_next(up, obj);
@@ -462,6 +1259,7 @@ static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
         size_t i = obj->tp - QP_MAP0;
 
         lua_newtable(l);
+        qpack_share_table_decoded(l, pk);
 
         while (i--)
         {
@@ -482,7 +1280,11 @@ static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
     }
     case QP_ARRAY_OPEN:
     {
-        lua_newtable(l);
+        /* a sized array has its number of items (checked with its size) */
+        int narr = obj->hook && obj->via.int64 <= INT_MAX ?
+                (int)obj->via.int64 : 0;
+        lua_createtable(l, narr, 0);
+        qpack_share_table_decoded(l, pk);
         size_t i = 1;
 
         while(qp_next(up, obj) && obj->tp != QP_ARRAY_CLOSE)
@@ -497,79 +1299,2780 @@ static int qpack_process_obj(lua_State *l, qpack_parse_t *pk,
     }
     case QP_MAP_OPEN:
     {
+        int nrec = obj->hook && obj->via.int64 <= INT_MAX ?
+                (int)obj->via.int64 : 0;
+        lua_createtable(l, 0, nrec);
+        qpack_share_table_decoded(l, pk);
+
+        while(qp_next(up, obj) && obj->tp != QP_MAP_CLOSE)
+        {
+            ret = qpack_process_obj(l, pk, up, obj);
+            if (ret)
+                break;
+
+            qp_next(up, obj);
+
+            ret = qpack_process_obj(l, pk, up, obj);
+            if (ret)
+                break;
+
+            /* Set key = value */
+            lua_rawset(l, -3);
+        }
+        break;
+    }
+    default:
+    {
+        ret = -1;
+        luaL_error(l, "QPACK unknown obj->tp:%d", obj->tp);
+    }
+    }
+    return ret;
+}
+
+static int qpack_decode(lua_State *l)
+{
+    qpack_parse_t qpack;
+    size_t qpack_len;
+    qp_unpacker_t up;
+    qp_obj_t obj;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    qpack.cfg = qpack_fetch_config(l);
+    qpack.shared_index = 0;
+
+    qpack.data = luaL_checklstring(l, 1, &qpack_len);
+
+    qp_unpacker_init(&up, (unsigned char*)qpack.data, qpack_len);
+
+    qp_next(&up, &obj);
+    if (obj.tp == QP_END) {
+        luaL_error(l, "QPACK cannot parse empty string");
+    } else {
+        qpack_process_obj(l, &qpack, &up, &obj);
+    }
+
+    return 1;
+}
+
+/* ===== BITSETS ===== */
+
+/* A qpack.bitset holds decoded booleans without a table (decode_bitsets).
+ * Indexes are 1 based like a table:
+ *
+ *   #b, b[i]           number of values and value i (nil out of range)
+ *   b:count([i, j])    number of true values in i..j, the whole set default
+ *   b:next([i])        index of the first true value from i on, or nil
+ *   b:totable()        the values as a table of booleans
+ *
+ * A bitset encodes as packed booleans again. */
+
+static qpack_bitset_t *qpack_check_bitset(lua_State *l)
+{
+    return luaL_checkudata(l, 1, QPACK_BITSET_MT);
+}
+
+static int qpack_bitset_popcount(uint64_t w)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(w);
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (w * 0x0101010101010101ULL) >> 56;
+#endif
+}
+
+/* Range i..j from the arguments at idx and idx + 1, as from..to (0 based,
+ * to exclusive); returns 0 for an empty range */
+static int qpack_bitset_range(lua_State *l, qpack_bitset_t *bs, int idx,
+                              size_t *from, size_t *to)
+{
+    lua_Integer i = luaL_optinteger(l, idx, 1);
+    lua_Integer j = luaL_optinteger(l, idx + 1, (lua_Integer)bs->n);
+
+    if (i < 1)
+        i = 1;
+    if (j > (lua_Integer)bs->n)
+        j = bs->n;
+    if (i > j)
+        return 0;
+    *from = i - 1;
+    *to = j;
+    return 1;
+}
+
+static int qpack_bitset_count(lua_State *l)
+{
+    qpack_bitset_t *bs = qpack_check_bitset(l);
+    size_t from, to, count = 0;
+    uint64_t w;
+
+    if (!qpack_bitset_range(l, bs, 2, &from, &to)) {
+        lua_pushinteger(l, 0);
+        return 1;
+    }
+
+    for (; from < to && (from & 63); from++)
+        count += bs->bits[from >> 3] >> (from & 7) & 1;
+    for (; from + 64 <= to; from += 64) {
+        memcpy(&w, bs->bits + (from >> 3), sizeof(w));
+        count += qpack_bitset_popcount(w);
+    }
+    for (; from < to; from++)
+        count += bs->bits[from >> 3] >> (from & 7) & 1;
+
+    lua_pushinteger(l, count);
+    return 1;
+}
+
+static int qpack_bitset_next(lua_State *l)
+{
+    qpack_bitset_t *bs = qpack_check_bitset(l);
+    size_t from, to;
+
+    if (qpack_bitset_range(l, bs, 2, &from, &to)) {
+        for (; from < to; from++) {
+            unsigned char byte = bs->bits[from >> 3] >> (from & 7);
+            if (byte == 0) {
+                from |= 7;  /* nothing left in this byte */
+                continue;
+            }
+            while (!(byte & 1)) {
+                byte >>= 1;
+                from++;
+            }
+            if (from >= to)
+                break;
+            lua_pushinteger(l, from + 1);
+            return 1;
+        }
+    }
+
+    lua_pushnil(l);
+    return 1;
+}
+
+static int qpack_bitset_totable(lua_State *l)
+{
+    qpack_bitset_t *bs = qpack_check_bitset(l);
+    size_t i;
+
+    lua_createtable(l, bs->n > INT_MAX ? INT_MAX : (int)bs->n, 0);
+    for (i = 0; i < bs->n; i++) {
+        lua_pushboolean(l, bs->bits[i >> 3] >> (i & 7) & 1);
+        lua_rawseti(l, -2, i + 1);
+    }
+    return 1;
+}
+
+static int qpack_bitset_len(lua_State *l)
+{
+    qpack_bitset_t *bs = qpack_check_bitset(l);
+
+    lua_pushinteger(l, bs->n);
+    return 1;
+}
+
+/* b[i] for an integer, otherwise a method */
+static int qpack_bitset_index(lua_State *l)
+{
+    qpack_bitset_t *bs = qpack_check_bitset(l);
+    lua_Integer i;
+    int isint;
+
+    i = lua_tointegerx(l, 2, &isint);
+    if (!isint) {
+        lua_pushvalue(l, 2);
+        lua_rawget(l, lua_upvalueindex(1));
+        return 1;
+    }
+    if (i < 1 || i > (lua_Integer)bs->n)
+        lua_pushnil(l);
+    else
+        lua_pushboolean(l, bs->bits[(i - 1) >> 3] >> ((i - 1) & 7) & 1);
+    return 1;
+}
+
+static void qpack_bitset_register(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "count", qpack_bitset_count },
+        { "next", qpack_bitset_next },
+        { "totable", qpack_bitset_totable },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, QPACK_BITSET_MT)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, reg, 0);
+        lua_pushcclosure(l, qpack_bitset_index, 1);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, qpack_bitset_len);
+        lua_setfield(l, -2, "__len");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== EXTENSIONS ===== */
+
+/* qpack.register_ext(id, encode, decode [, metatable]) registers Lua
+ * functions for extension type id (0 to QP_EXT_MAX), unless a C codec has
+ * the id. encode(value) returns the payload as a string and decode(payload)
+ * returns the value. With a metatable, values with that metatable are
+ * encoded with encode(). Without one, encode() is offered the values which
+ * cannot be encoded otherwise, in order of id, and returns nil to pass.
+ * qpack.register_ext(id) removes the type. Extension types are shared by
+ * all qpack instances of the Lua state. */
+static int qpack_register_ext(lua_State *l)
+{
+    lua_Integer id = luaL_checkinteger(l, 1);
+    int i, n = 0;
+
+    luaL_argcheck(l, id >= 0 && id <= QP_EXT_MAX, 1, "out of range");
+    luaL_argcheck(l, qp_ext_find((uint8_t)id) == NULL, 1,
+                  "taken by a C codec");
+    if (!lua_isnoneornil(l, 2))
+        luaL_checktype(l, 2, LUA_TFUNCTION);
+    if (!lua_isnoneornil(l, 3))
+        luaL_checktype(l, 3, LUA_TFUNCTION);
+    if (!lua_isnoneornil(l, 4))
+        luaL_checktype(l, 4, LUA_TTABLE);
+    lua_settop(l, 4);
+
+    if (lua_getfield(l, LUA_REGISTRYINDEX, QPACK_EXT_REG) != LUA_TTABLE) {
+        lua_pop(l, 1);
+        lua_newtable(l);
+        lua_pushvalue(l, -1);
+        lua_setfield(l, LUA_REGISTRYINDEX, QPACK_EXT_REG);
+    }
+
+    /* remove the type first; t[id] = { encode, decode, metatable } and
+     * t[metatable] = id */
+    if (lua_rawgeti(l, 5, id) == LUA_TTABLE &&
+        lua_rawgeti(l, -1, 3) == LUA_TTABLE) {
+        lua_pushnil(l);
+        lua_rawset(l, 5);
+    }
+    lua_settop(l, 5);
+    lua_pushnil(l);
+    lua_rawseti(l, 5, id);
+
+    if (!lua_isnil(l, 2) || !lua_isnil(l, 3)) {
+        if (!lua_isnil(l, 2) && !lua_isnil(l, 4)) {
+            lua_pushvalue(l, 4);
+            if (lua_rawget(l, 5) != LUA_TNIL)
+                luaL_argerror(l, 4, "has an extension type already");
+            lua_pop(l, 1);
+            lua_pushvalue(l, 4);
+            lua_pushinteger(l, id);
+            lua_rawset(l, 5);
+        }
+        lua_createtable(l, 3, 0);
+        for (i = 1; i <= 3; i++) {
+            lua_pushvalue(l, i + 1);
+            lua_rawseti(l, -2, i);
+        }
+        lua_rawseti(l, 5, id);
+    }
+
+    /* ids without a metatable, in order */
+    lua_newtable(l);
+    for (i = 0; i <= QP_EXT_MAX; i++) {
+        if (lua_rawgeti(l, 5, i) == LUA_TTABLE &&
+            lua_rawgeti(l, -1, 1) == LUA_TFUNCTION &&
+            lua_rawgeti(l, -2, 3) == LUA_TNIL) {
+            lua_pushinteger(l, i);
+            lua_rawseti(l, 6, ++n);
+        }
+        lua_settop(l, 6);
+    }
+    lua_setfield(l, 5, "any");
+    return 0;
+}
+
+/* ===== WRITER ===== */
+
+#define QPACK_WRITER_MT "qpack.writer"
+
+/* Writer nesting levels */
+#define QPACK_WRITER_ARRAY  0
+#define QPACK_WRITER_KEY    1   /* map, expecting a key */
+#define QPACK_WRITER_VALUE  2   /* map, expecting a value */
+
+typedef struct {
+    qp_packer_t *pk;
+    qpack_config_t cfg;
+    int sink;               /* registry reference to the sink function */
+    size_t written;         /* bytes passed to the sink */
+    int done;               /* a complete top level value is written */
+    int depth;
+    int stack_size;
+    unsigned char *stack;   /* QPACK_WRITER_* for each open container */
+} qpack_writer_t;
+
+static qpack_writer_t *qpack_check_writer(lua_State *l)
+{
+    qpack_writer_t *w = luaL_checkudata(l, 1, QPACK_WRITER_MT);
+    if (w->pk == NULL)
+        luaL_error(l, "QPACK writer is closed");
+    return w;
+}
+
+/* Pass the buffered bytes to the sink function, if any */
+static void qpack_writer_flush(lua_State *l, qpack_writer_t *w)
+{
+    if (w->sink == LUA_NOREF || w->pk->len == 0)
+        return;
+
+    lua_rawgeti(l, LUA_REGISTRYINDEX, w->sink);
+    lua_pushlstring(l, (const char*)w->pk->buffer, w->pk->len);
+    w->written += w->pk->len;
+    w->pk->len = 0;
+    lua_call(l, 1, 0);
+}
+
+/* Validate the position of the next item. Only strings and numbers are
+ * accepted where a map key is expected. */
+static void qpack_writer_begin(lua_State *l, qpack_writer_t *w, int is_key)
+{
+    if (w->done)
+        luaL_error(l, "QPACK writer already holds a complete value");
+
+    if (w->depth == 0)
+        return;
+
+    switch (w->stack[w->depth - 1]) {
+    case QPACK_WRITER_KEY:
+        if (!is_key)
+            luaL_error(l, "QPACK writer expects a map key");
+        w->stack[w->depth - 1] = QPACK_WRITER_VALUE;
+        break;
+    case QPACK_WRITER_VALUE:
+        w->stack[w->depth - 1] = QPACK_WRITER_KEY;
+        break;
+    }
+}
+
+/* Finish an item and flush when enough bytes are buffered */
+static int qpack_writer_end(lua_State *l, qpack_writer_t *w, int ret)
+{
+    if (ret)
+        luaL_error(l, "Memory allocation error in QPACK writer");
+
+    if (w->depth == 0)
+        w->done = 1;
+
+    if (w->pk->len >= QP_SUGGESTED_SIZE)
+        qpack_writer_flush(l, w);
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+static int qpack_writer_open(lua_State *l, qp_types_t tp)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    if (w->depth >= w->cfg.encode_max_depth)
+        luaL_error(l, "Cannot serialise, excessive nesting (%d)",
+                   w->depth + 1);
+
+    if (w->depth == w->stack_size) {
+        int size = w->stack_size ? w->stack_size * 2 : 16;
+        unsigned char *stack = realloc(w->stack, size);
+        if (stack == NULL)
+            luaL_error(l, "Memory allocation error in QPACK writer");
+        w->stack = stack;
+        w->stack_size = size;
+    }
+
+    qpack_writer_begin(l, w, 0);
+    w->stack[w->depth++] = (tp == QP_MAP_OPEN)
+            ? QPACK_WRITER_KEY
+            : QPACK_WRITER_ARRAY;
+
+    /* the container is not complete yet */
+    if (qp_add_type(w->pk, tp))
+        luaL_error(l, "Memory allocation error in QPACK writer");
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+static int qpack_writer_array_open(lua_State *l)
+{
+    return qpack_writer_open(l, QP_ARRAY_OPEN);
+}
+
+static int qpack_writer_map_open(lua_State *l)
+{
+    return qpack_writer_open(l, QP_MAP_OPEN);
+}
+
+static int qpack_writer_close(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    unsigned char level;
+
+    if (w->depth == 0)
+        luaL_error(l, "QPACK writer has no open array or map");
+
+    level = w->stack[w->depth - 1];
+    if (level == QPACK_WRITER_VALUE)
+        luaL_error(l, "QPACK writer expects a map value");
+    w->depth--;
+
+    return qpack_writer_end(l, w, qp_add_type(w->pk,
+            level == QPACK_WRITER_ARRAY ? QP_ARRAY_CLOSE : QP_MAP_CLOSE));
+}
+
+static int qpack_writer_key(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    if (w->depth == 0 || w->stack[w->depth - 1] != QPACK_WRITER_KEY)
+        luaL_error(l, "QPACK writer does not expect a map key");
+
+    switch (lua_type(l, 2)) {
+    case LUA_TSTRING:
+        qpack_writer_begin(l, w, 1);
+        return qpack_writer_end(l, w, qpack_append_string(l, w->pk, 2));
+    case LUA_TNUMBER:
+        qpack_writer_begin(l, w, 1);
+        return qpack_writer_end(l, w,
+                qpack_append_number(l, &w->cfg, w->pk, 2));
+    default:
+        return luaL_argerror(l, 2, "map key must be a number or string");
+    }
+}
+
+static int qpack_writer_int(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    lua_Integer num = luaL_checkinteger(l, 2);
+
+    qpack_writer_begin(l, w, 1);
+    return qpack_writer_end(l, w, qp_add_int64(w->pk, num));
+}
+
+static int qpack_writer_double(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    lua_Number num = luaL_checknumber(l, 2);
+
+    qpack_writer_begin(l, w, 1);
+    return qpack_writer_end(l, w, qpack_append_double(&w->cfg, w->pk, num));
+}
+
+/* Append a number, or an array of numbers, as decimals with the given
+ * scale; they decode as numbers rounded to scale decimal digits */
+static int qpack_writer_decimal(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    int scale = luaL_checkinteger(l, 3);
+    double *values;
+    size_t n;
+    int ret;
+
+    luaL_argcheck(l, scale >= 0 && scale <= QP_DECIMAL_MAX_SCALE, 3,
+                  "invalid decimal scale");
+    if (lua_type(l, 2) != LUA_TTABLE) {
+        lua_Number num = luaL_checknumber(l, 2);
+        qpack_writer_begin(l, w, 1);
+        return qpack_writer_end(l, w, qp_add_decimal(w->pk, num, scale));
+    }
+
+    n = lua_rawlen(l, 2);
+    values = qpack_decimal_values(l, 2, n);
+    luaL_argcheck(l, values != NULL, 2, "expected an array of numbers");
+    qpack_writer_begin(l, w, 0);
+    ret = qp_add_decimal_array(w->pk, values, n, scale);
+    lua_pop(l, 1);
+    return qpack_writer_end(l, w, ret);
+}
+
+static int qpack_writer_str(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    luaL_checktype(l, 2, LUA_TSTRING);
+    qpack_writer_begin(l, w, 1);
+    return qpack_writer_end(l, w, qpack_append_string(l, w->pk, 2));
+}
+
+static int qpack_writer_bool(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    luaL_checkany(l, 2);
+    qpack_writer_begin(l, w, 0);
+    return qpack_writer_end(l, w, lua_toboolean(l, 2)
+            ? qp_add_true(w->pk)
+            : qp_add_false(w->pk));
+}
+
+static int qpack_writer_null(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    qpack_writer_begin(l, w, 0);
+    return qpack_writer_end(l, w, qp_add_null(w->pk));
+}
+
+/* Append a single value which is already qpack encoded */
+static int qpack_writer_raw(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    qp_unpacker_t up;
+    qp_types_t tp;
+    const char *data;
+    size_t len;
+
+    data = luaL_checklstring(l, 2, &len);
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+    tp = qp_skip_next(&up);
+    luaL_argcheck(l, tp != QP_END && tp != QP_ERR && !qp_is_close(tp) &&
+                  up.pt == up.end, 2, "expected a single qpack value");
+
+    qpack_writer_begin(l, w, tp == QP_RAW || tp == QP_INT64 ||
+                       tp == QP_DOUBLE);
+    if (qp_packer_reserve(w->pk, len))
+        luaL_error(l, "Memory allocation error in QPACK writer");
+    memcpy(w->pk->buffer + w->pk->len, data, len);
+    w->pk->len += len;
+    return qpack_writer_end(l, w, 0);
+}
+
+/* Protected part of qpack_writer_value(): writer and value at 1 and 2 */
+static int qpack_writer_append(lua_State *l)
+{
+    qpack_writer_t *w = (qpack_writer_t *)lua_touserdata(l, 1);
+
+    qpack_append_value(l, &w->cfg, w->depth, w->pk);
+    return 0;
+}
+
+/* Append any Lua value, encoded like qpack.encode() does. When encoding
+ * fails, what was written of the value is dropped, so the writer can go on
+ * as if the call was not made. */
+static int qpack_writer_value(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+    size_t len = w->pk->len;
+    unsigned char state = w->depth ? w->stack[w->depth - 1] : 0;
+    int dtype;
+
+    luaL_checkany(l, 2);
+    lua_settop(l, 2);
+    dtype = lua_type(l, 2);
+    qpack_writer_begin(l, w, dtype == LUA_TSTRING || dtype == LUA_TNUMBER);
+
+    lua_pushcfunction(l, qpack_writer_append);
+    lua_pushvalue(l, 1);
+    lua_pushvalue(l, 2);
+    if (lua_pcall(l, 2, 0, 0) != LUA_OK) {
+        w->pk->len = len;
+        if (w->depth)
+            w->stack[w->depth - 1] = state;
+        return lua_error(l);
+    }
+    return qpack_writer_end(l, w, 0);
+}
+
+/* Complete the message. Without a sink the encoded string is returned,
+ * otherwise the remaining bytes are passed to the sink and the total number
+ * of bytes is returned. The writer can be used again afterwards. */
+static int qpack_writer_finish(lua_State *l)
+{
+    qpack_writer_t *w = qpack_check_writer(l);
+
+    if (w->depth)
+        luaL_error(l, "QPACK writer has %d unclosed array(s) or map(s)",
+                   w->depth);
+    if (!w->done)
+        luaL_error(l, "QPACK writer holds no value");
+
+    if (w->sink == LUA_NOREF) {
+        lua_pushlstring(l, (const char*)w->pk->buffer, w->pk->len);
+    } else {
+        qpack_writer_flush(l, w);
+        lua_pushinteger(l, w->written);
+    }
+
+    /* keep the buffer for the next message */
+    w->pk->len = 0;
+    w->written = 0;
+    w->done = 0;
+
+    return 1;
+}
+
+static int qpack_writer_gc(lua_State *l)
+{
+    qpack_writer_t *w = luaL_checkudata(l, 1, QPACK_WRITER_MT);
+
+    if (w->pk != NULL) {
+        qp_packer_free(w->pk);
+        w->pk = NULL;
+    }
+    free(w->stack);
+    w->stack = NULL;
+    luaL_unref(l, LUA_REGISTRYINDEX, w->sink);
+    w->sink = LUA_NOREF;
+
+    return 0;
+}
+
+/* qpack.writer([sink]) creates a writer which builds a message without
+ * intermediate tables. When a sink function is given, it is called with
+ * chunks of encoded data instead of keeping the full message in memory. */
+static int qpack_writer_new(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qpack_writer_t *w;
+
+    luaL_argcheck(l, lua_gettop(l) <= 1, 2, "found too many arguments");
+    if (!lua_isnoneornil(l, 1))
+        luaL_checktype(l, 1, LUA_TFUNCTION);
+
+    w = (qpack_writer_t *)lua_newuserdata(l, sizeof(*w));
+    w->pk = NULL;
+    w->cfg = *cfg;
+    w->sink = LUA_NOREF;
+    w->written = 0;
+    w->done = 0;
+    w->depth = 0;
+    w->stack_size = 0;
+    w->stack = NULL;
+    luaL_setmetatable(l, QPACK_WRITER_MT);
+
+    w->pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (w->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK writer");
+
+    if (lua_isfunction(l, 1)) {
+        lua_pushvalue(l, 1);
+        w->sink = luaL_ref(l, LUA_REGISTRYINDEX);
+    }
+
+    return 1;
+}
+
+static void qpack_writer_register(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "array_open", qpack_writer_array_open },
+        { "map_open", qpack_writer_map_open },
+        { "close", qpack_writer_close },
+        { "key", qpack_writer_key },
+        { "int", qpack_writer_int },
+        { "double", qpack_writer_double },
+        { "decimal", qpack_writer_decimal },
+        { "str", qpack_writer_str },
+        { "bool", qpack_writer_bool },
+        { "null", qpack_writer_null },
+        { "raw", qpack_writer_raw },
+        { "value", qpack_writer_value },
+        { "finish", qpack_writer_finish },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, QPACK_WRITER_MT)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, reg, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, qpack_writer_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== JSON ===== */
+
+/* Read an optional boolean field from the options table at 'optindex' */
+static int qpack_opt_boolean(lua_State *l, int optindex, const char *name,
+                             int def)
+{
+    int value = def;
+
+    if (lua_isnil(l, optindex))
+        return value;
+
+    if (lua_getfield(l, optindex, name) != LUA_TNIL) {
+        luaL_argcheck(l, lua_isboolean(l, -1), optindex,
+                      "option must be a boolean");
+        value = lua_toboolean(l, -1);
+    }
+    lua_pop(l, 1);
+
+    return value;
+}
+
+/* Convert qpack data straight to a JSON string without creating Lua tables.
+ * Options (optional table):
+ *  - escape_slash:    write '/' as "\/" (default true, like cjson)
+ *  - invalid_numbers: write NaN and Infinity instead of failing */
+static int qpack_to_json(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_unpacker_t up;
+    qp_packer_t *buf;
+    const char *data;
+    size_t len;
+    int flags = 0, ret;
+
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    data = luaL_checklstring(l, 1, &len);
+    if (!lua_isnoneornil(l, 2))
+        luaL_checktype(l, 2, LUA_TTABLE);
+    lua_settop(l, 2);
+
+    if (qpack_opt_boolean(l, 2, "escape_slash", 1))
+        flags |= QP_JSON_ESCAPE_SLASH;
+    if (qpack_opt_boolean(l, 2, "invalid_numbers", 0))
+        flags |= QP_JSON_INVALID_NUMBERS;
+
+    if (len == 0)
+        luaL_error(l, "QPACK cannot parse empty string");
+
+    buf = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (buf == NULL)
+        luaL_error(l, "Memory allocation error in QPACK to_json");
+
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+    ret = qp_to_json(&up, buf, flags, cfg->decode_max_depth);
+    if (ret) {
+        qp_packer_free(buf);
+        luaL_error(l, "QPACK to_json failed: %s", qp_json_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)buf->buffer, buf->len);
+    qp_packer_free(buf);
+
+    return 1;
+}
+
+/* Parse a JSON string straight to qpack data without creating Lua tables.
+ * Numbers without fraction or exponent are packed as integers when they fit,
+ * all other numbers as doubles. */
+static int qpack_from_json(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_packer_t *pk;
+    const char *json;
+    size_t len, pos;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    json = luaL_checklstring(l, 1, &len);
+
+    pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK from_json");
+
+    ret = qp_from_json(json, len, pk, cfg->decode_max_depth, &pos);
+    if (ret) {
+        qp_packer_free(pk);
+        luaL_error(l, "QPACK from_json failed: %s at character %d",
+                   qp_json_strerror(ret), (int)pos + 1);
+    }
+
+    lua_pushlstring(l, (const char*)pk->buffer, pk->len);
+    qp_packer_free(pk);
+
+    return 1;
+}
+
+/* ===== MESSAGEPACK ===== */
+
+/* Convert qpack data to MessagePack without creating Lua tables */
+static int qpack_to_msgpack(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_unpacker_t up;
+    qp_packer_t *buf;
+    const char *data;
+    size_t len;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    data = luaL_checklstring(l, 1, &len);
+
+    if (len == 0)
+        luaL_error(l, "QPACK cannot parse empty string");
+
+    buf = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (buf == NULL)
+        luaL_error(l, "Memory allocation error in QPACK to_msgpack");
+
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+    ret = qp_to_msgpack(&up, buf, cfg->decode_max_depth);
+    if (ret) {
+        qp_packer_free(buf);
+        luaL_error(l, "QPACK to_msgpack failed: %s",
+                   qp_msgpack_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)buf->buffer, buf->len);
+    qp_packer_free(buf);
+
+    return 1;
+}
+
+/* Convert MessagePack data to qpack without creating Lua tables */
+static int qpack_from_msgpack(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_packer_t *pk;
+    const char *data;
+    size_t len;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    data = luaL_checklstring(l, 1, &len);
+
+    pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK from_msgpack");
+
+    ret = qp_from_msgpack((const unsigned char*)data, len, pk,
+                          cfg->decode_max_depth);
+    if (ret) {
+        qp_packer_free(pk);
+        luaL_error(l, "QPACK from_msgpack failed: %s",
+                   qp_msgpack_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)pk->buffer, pk->len);
+    qp_packer_free(pk);
+
+    return 1;
+}
+
+/* ===== YIELDABLE ===== */
+
+/* encode_yieldable() and decode_yieldable() walk the data with an explicit
+ * stack instead of recursion, so they can yield from a coroutine when the
+ * budget of a slice is used up and continue where they stopped when the
+ * coroutine is resumed.
+ *
+ * Lua stack layout while running:
+ *   1      value to encode / qpack string to decode
+ *   2      budget (elements for encode, bytes for decode)
+ *   3      qpack_task_t userdata
+ *   4, 5   encode with encode_shared_tables: the numbered tables and their
+ *          slots (see qpack_append_value())
+ *   ...    one table per open container, each followed by the current key
+ *          of a map
+ */
+
+#define QPACK_TASK_MT "qpack.task"
+
+#define DEFAULT_ENCODE_BUDGET 1000      /* elements per slice */
+#define DEFAULT_DECODE_BUDGET 65536     /* bytes per slice */
+
+/* Container frames */
+#define QPACK_TASK_ARRAY    0
+#define QPACK_TASK_MAP      1
+#define QPACK_TASK_RUNS     2   /* encode: array with encode_run_length */
+
+typedef struct {
+    int kind;
+    int idx;            /* Lua stack index of the table */
+    lua_Integer i;      /* last array index set or read, or map pairs */
+    lua_Integer n;      /* encode: array length; decode: items left or -1
+                           for an open container */
+    size_t pos;         /* encode: header of a sized container */
+    qp_runs_t runs;     /* encode: QPACK_TASK_RUNS */
+} qpack_frame_t;
+
+typedef struct {
+    qp_packer_t *pk;    /* encode output */
+    qp_unpacker_t up;   /* decode input, points into argument 1 */
+    qpack_config_t cfg;
+    lua_Integer budget;
+    int top;            /* Lua stack top at the last yield */
+    int depth;
+    int frames_size;
+    qpack_frame_t *frames;
+} qpack_task_t;
+
+static int qpack_task_gc(lua_State *l)
+{
+    qpack_task_t *t = luaL_checkudata(l, 1, QPACK_TASK_MT);
+
+    if (t->pk != NULL) {
+        qp_packer_free(t->pk);
+        t->pk = NULL;
+    }
+    free(t->frames);
+    t->frames = NULL;
+
+    return 0;
+}
+
+/* Create the task userdata at stack index 3. Argument 2 is the optional
+ * budget per slice. */
+static qpack_task_t *qpack_task_new(lua_State *l, lua_Integer budget)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qpack_task_t *t;
+
+    if (!lua_isnil(l, 2)) {
+        budget = luaL_checkinteger(l, 2);
+        luaL_argcheck(l, budget > 0, 2, "expected a positive budget");
+    }
+
+    t = (qpack_task_t *)lua_newuserdata(l, sizeof(*t));
+    t->pk = NULL;
+    t->cfg = *cfg;
+    t->budget = budget;
+    t->top = 0;
+    t->depth = 0;
+    t->frames_size = 0;
+    t->frames = NULL;
+    luaL_setmetatable(l, QPACK_TASK_MT);
+
+    return t;
+}
+
+/* Add a frame for the table on the top of the Lua stack */
+static qpack_frame_t *qpack_task_push(lua_State *l, qpack_task_t *t,
+                                      int kind, lua_Integer n)
+{
+    qpack_frame_t *f;
+
+    if (t->depth == t->frames_size) {
+        int size = t->frames_size ? t->frames_size * 2 : 16;
+        f = realloc(t->frames, size * sizeof(*f));
+        if (f == NULL)
+            luaL_error(l, "Memory allocation error in QPACK task");
+        t->frames = f;
+        t->frames_size = size;
+    }
+
+    f = &t->frames[t->depth++];
+    f->kind = kind;
+    f->idx = lua_gettop(l);
+    f->i = 0;
+    f->n = n;
+
+    return f;
+}
+
+/* Encode the value on the top of the Lua stack. Scalars, and tables which
+ * are written at once, are popped; other tables are opened and stay on the
+ * stack as a new frame. Like qpack_append_data() and qpack_append_array(),
+ * with the container itself left to qpack_task_encode(). */
+static void qpack_task_encode_value(lua_State *l, qpack_task_t *t)
+{
+    qpack_config_t *cfg = &t->cfg;
+    qpack_frame_t *f;
+    int len, ret;
+    size_t pos = 0;
+
+    if (lua_type(l, -1) != LUA_TTABLE) {
+        qpack_append_data(l, cfg, t->depth, t->pk);
+        lua_pop(l, 1);
+        return;
+    }
+
+    if (lua_getmetatable(l, -1)) {
+        lua_pop(l, 1);
+        if (qpack_append_ext(l, t->pk)) {
+            lua_pop(l, 1);
+            return;
+        }
+    }
+    if (cfg->shared_index) {
+        qpack_shared_slot_t *slot =
+                qpack_shared_find(cfg, lua_topointer(l, -1));
+        if (slot->table != NULL) {
+            ret = qp_add_ref(t->pk, slot->number);
+            cfg->shared_refs++;
+            if (ret)
+                luaL_error(l, "Memory allocation error in QPACK encode");
+            lua_pop(l, 1);
+            return;
+        }
+        cfg->shared_free = slot;
+    }
+
+    qpack_check_encode_depth(l, cfg, t->depth + 1, t->pk);
+    len = qpack_table_length(l, cfg, t->pk);
+    if (len >= 0) {
+        ret = qpack_append_packed(l, cfg, t->pk, len);
+        if (ret > 0) {
+            lua_pop(l, 1);
+            return;
+        }
+        if (ret == 0) {
+            qpack_share_table(l, cfg);
+            /* a short array has too little to gain from runs */
+            if (cfg->encode_run_length && len > 5) {
+                f = qpack_task_push(l, t, QPACK_TASK_RUNS, len);
+                ret = qp_runs_open(t->pk, &f->runs, len);
+            } else {
+                ret = cfg->encode_sized_containers ?
+                        qp_add_open_sized(t->pk, QP_ARRAY_OPEN, &pos) :
+                        qp_add_type(t->pk, QP_ARRAY_OPEN);
+                qpack_task_push(l, t, QPACK_TASK_ARRAY, len)->pos = pos;
+            }
+        }
+    } else {
+        qpack_share_table(l, cfg);
+        ret = cfg->encode_sized_containers ?
+                qp_add_open_sized(t->pk, QP_MAP_OPEN, &pos) :
+                qp_add_type(t->pk, QP_MAP_OPEN);
+        qpack_task_push(l, t, QPACK_TASK_MAP, 0)->pos = pos;
+    }
+    if (ret)
+        luaL_error(l, "Memory allocation error in QPACK encode");
+
+    lua_pushnil(l);     /* current map key */
+}
+
+/* Call after each value of the container in the top frame */
+static void qpack_task_encoded(lua_State *l, qpack_task_t *t)
+{
+    qpack_frame_t *f;
+
+    if (t->depth == 0)
+        return;
+    f = &t->frames[t->depth - 1];
+    if (f->kind == QPACK_TASK_RUNS && qp_runs_next(t->pk, &f->runs))
+        luaL_error(l, "Memory allocation error in QPACK encode");
+}
+
+/* Encode at most budget elements, a negative budget has no limit.
+ * Returns 1 when the value is complete */
+static int qpack_task_encode(lua_State *l, qpack_task_t *t,
+                             lua_Integer budget)
+{
+    qpack_frame_t *f;
+    int ret = 0, depth;
+
+    while (t->depth) {
+        if (budget >= 0 && budget-- == 0)
+            return 0;
+
+        f = &t->frames[t->depth - 1];
+        if (f->kind != QPACK_TASK_MAP) {
+            if (f->i < f->n) {
+                lua_geti(l, f->idx, ++f->i);
+                depth = t->depth;
+                qpack_task_encode_value(l, t);
+                if (t->depth == depth)
+                    qpack_task_encoded(l, t);
+                continue;
+            }
+            if (f->kind == QPACK_TASK_RUNS)
+                ret = qp_runs_close(t->pk, &f->runs);
+            else
+                ret = t->cfg.encode_sized_containers ?
+                        qp_add_close(t->pk, f->pos, (size_t)f->n) :
+                        qp_add_type(t->pk, QP_ARRAY_CLOSE);
+        } else {
+            lua_pushvalue(l, f->idx + 1);
+            if (lua_next(l, f->idx) != 0) {
+                /* table, key, next key, value */
+                lua_copy(l, -2, f->idx + 1);
+                if (lua_type(l, -2) == LUA_TNUMBER) {
+                    ret = qpack_append_number(l, &t->cfg, t->pk, -2);
+                } else if (lua_type(l, -2) == LUA_TSTRING) {
+                    ret = qpack_append_string(l, t->pk, -2);
+                } else {
+                    qpack_encode_exception(l, &t->cfg, t->pk, -2,
+                                          "table key must be a number or string");
+                    /* never returns */
+                }
+                if (ret)
+                    luaL_error(l, "Memory allocation error in QPACK encode");
+                lua_remove(l, -2);
+                f->i++;
+                qpack_task_encode_value(l, t);
+                continue;
+            }
+            ret = t->cfg.encode_sized_containers ?
+                    qp_add_close(t->pk, f->pos, (size_t)f->i) :
+                    qp_add_type(t->pk, QP_MAP_CLOSE);
+        }
+        if (ret)
+            luaL_error(l, "Memory allocation error in QPACK encode");
+
+        lua_settop(l, f->idx - 1);
+        t->depth--;
+        qpack_task_encoded(l, t);
+    }
+
+    return 1;
+}
+
+static int qpack_encode_yieldable_k(lua_State *l, int status,
+                                    lua_KContext ctx)
+{
+    qpack_task_t *t = (qpack_task_t *)lua_touserdata(l, 3);
+
+    /* Drop the values passed to resume() */
+    if (status == LUA_YIELD)
+        lua_settop(l, t->top);
+
+    if (!qpack_task_encode(l, t, lua_isyieldable(l) ? t->budget : -1)) {
+        t->top = lua_gettop(l);
+        return lua_yieldk(l, 0, 0, qpack_encode_yieldable_k);
+    }
+
+    if (t->cfg.shared_refs && qp_add_shared(t->pk, 0))
+        luaL_error(l, "encode shared tables failed");
+
+    lua_pushlstring(l, (const char*)t->pk->buffer, t->pk->len);
+    qp_packer_free(t->pk);
+    t->pk = NULL;
+
+    return 1;
+}
+
+/* qpack.encode_yieldable(value[, budget]) works like encode() but yields
+ * the running coroutine after each budget elements. Outside a coroutine it
+ * runs to completion. The encode options apply like they do for encode(),
+ * but a packed, dictionary or extension value is written in one step. */
+static int qpack_encode_yieldable(lua_State *l)
+{
+    qpack_task_t *t;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1, 1, "expected 1 or 2 arguments");
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    lua_settop(l, 2);
+
+    t = qpack_task_new(l, DEFAULT_ENCODE_BUDGET);
+    t->pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (t->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK encode");
+
+    if (t->cfg.encode_shared_tables && lua_type(l, 1) == LUA_TTABLE) {
+        lua_newtable(l);
+        t->cfg.shared_index = lua_gettop(l);
+        t->cfg.shared_slots = NULL;
+        t->cfg.shared_count = 0;
+        t->cfg.shared_refs = 0;
+        lua_pushnil(l);
+        qpack_shared_grow(l, &t->cfg);
+    }
+
+    lua_pushvalue(l, 1);
+    qpack_task_encode_value(l, t);
+
+    return qpack_encode_yieldable_k(l, LUA_OK, 0);
+}
+
+/* Store the value on the top of the Lua stack in the current container.
+ * Returns 1 when it is the complete top level value */
+static int qpack_task_set(lua_State *l, qpack_task_t *t)
+{
+    qpack_frame_t *f;
+
+    if (t->depth == 0)
+        return 1;
+
+    f = &t->frames[t->depth - 1];
+    if (f->kind == QPACK_TASK_ARRAY) {
+        lua_rawseti(l, f->idx, ++f->i);     /* arr[i] = value */
+    } else if (lua_gettop(l) == f->idx + 1) {
+        return 0;                           /* key, wait for the value */
+    } else {
+        lua_rawset(l, f->idx);              /* map[key] = value */
+    }
+    if (f->n > 0)
+        f->n--;
+
+    return 0;
+}
+
+/* Decode until at least budget bytes are read, a negative budget has no
+ * limit. Returns 1 when the value is complete */
+static int qpack_task_decode(lua_State *l, qpack_task_t *t,
+                             lua_Integer budget)
+{
+    const unsigned char *start = t->up.pt;
+    qpack_parse_t parse = { NULL, NULL, &t->cfg };
+    qpack_frame_t *f = NULL;
+    qp_obj_t obj;
+    qp_types_t tp;
+
+    for (;;) {
+        if (t->depth) {
+            f = &t->frames[t->depth - 1];
+            if (f->n == 0) {
+                /* counted container is complete */
+                t->depth--;
+                if (qpack_task_set(l, t))
+                    return 1;
+                continue;
+            }
+        }
+
+        if (budget >= 0 && t->up.pt - start >= budget)
+            return 0;
+
+        tp = qp_next(&t->up, &obj);
+
+        /* Open containers end with a close mark or the end of data */
+        if (t->depth && f->n < 0 && (tp == QP_END ||
+                tp == (f->kind == QPACK_TASK_ARRAY ?
+                       QP_ARRAY_CLOSE : QP_MAP_CLOSE))) {
+            if (lua_gettop(l) != f->idx)
+                luaL_error(l, "QPACK error obj->tp:%d", tp);
+            t->depth--;
+            if (qpack_task_set(l, t))
+                return 1;
+            continue;
+        }
+
+        switch (tp) {
+        case QP_ARRAY0:
+        case QP_ARRAY1:
+        case QP_ARRAY2:
+        case QP_ARRAY3:
+        case QP_ARRAY4:
+        case QP_ARRAY5:
+        case QP_ARRAY_OPEN:
+        case QP_MAP0:
+        case QP_MAP1:
+        case QP_MAP2:
+        case QP_MAP3:
+        case QP_MAP4:
+        case QP_MAP5:
+        case QP_MAP_OPEN:
+            if (t->depth >= t->cfg.decode_max_depth || !lua_checkstack(l, 4))
+                luaL_error(l, "Cannot deserialise, excessive nesting (%d)",
+                           t->depth + 1);
+            if (obj.hook && obj.via.int64 <= INT_MAX)
+                /* a sized container has its number of items */
+                lua_createtable(l, tp == QP_ARRAY_OPEN ? (int)obj.via.int64 : 0,
+                                tp == QP_MAP_OPEN ? (int)obj.via.int64 : 0);
+            else
+                lua_newtable(l);
+            if (tp == QP_ARRAY_OPEN)
+                qpack_task_push(l, t, QPACK_TASK_ARRAY, -1);
+            else if (tp == QP_MAP_OPEN)
+                qpack_task_push(l, t, QPACK_TASK_MAP, -1);
+            else if (tp <= QP_ARRAY5)
+                qpack_task_push(l, t, QPACK_TASK_ARRAY, tp - QP_ARRAY0);
+            else
+                qpack_task_push(l, t, QPACK_TASK_MAP, tp - QP_MAP0);
+            continue;
+        default:
+            qpack_process_obj(l, &parse, &t->up, &obj);
+            break;
+        }
+
+        if (qpack_task_set(l, t))
+            return 1;
+    }
+}
+
+static int qpack_decode_yieldable_k(lua_State *l, int status,
+                                    lua_KContext ctx)
+{
+    qpack_task_t *t = (qpack_task_t *)lua_touserdata(l, 3);
+
+    /* Drop the values passed to resume() */
+    if (status == LUA_YIELD)
+        lua_settop(l, t->top);
+
+    if (!qpack_task_decode(l, t, lua_isyieldable(l) ? t->budget : -1)) {
+        t->top = lua_gettop(l);
+        return lua_yieldk(l, 0, 0, qpack_decode_yieldable_k);
+    }
+
+    return 1;
+}
+
+/* qpack.decode_yieldable(str[, budget]) works like decode() but yields
+ * the running coroutine after each budget bytes. Outside a coroutine it
+ * runs to completion. */
+static int qpack_decode_yieldable(lua_State *l)
+{
+    qpack_task_t *t;
+    const char *data;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1, 1, "expected 1 or 2 arguments");
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    lua_settop(l, 2);
+
+    data = luaL_checklstring(l, 1, &len);
+    if (len == 0)
+        luaL_error(l, "QPACK cannot parse empty string");
+
+    t = qpack_task_new(l, DEFAULT_DECODE_BUDGET);
+    qp_unpacker_init(&t->up, (unsigned char*)data, len);
+
+    return qpack_decode_yieldable_k(l, LUA_OK, 0);
+}
+
+static void qpack_task_register(lua_State *l)
+{
+    if (luaL_newmetatable(l, QPACK_TASK_MT)) {
+        lua_pushcfunction(l, qpack_task_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== FILE READER ===== */
+
+#define QPACK_READER_MT "qpack.reader"
+
+typedef struct {
+    qp_freader_t *reader;
+} qpack_reader_t;
+
+static qpack_reader_t *qpack_check_reader(lua_State *l)
+{
+    qpack_reader_t *r = luaL_checkudata(l, 1, QPACK_READER_MT);
+    if (r->reader == NULL)
+        luaL_error(l, "QPACK reader is closed");
+    return r;
+}
+
+/* reader:next() returns the next value, or nil at the end of the file or of
+ * the array entered with reader:elements() */
+static int qpack_reader_next(lua_State *l)
+{
+    qpack_reader_t *r = qpack_check_reader(l);
+    qp_unpacker_t up;
+    qp_obj_t obj;
+    int ret;
+
+    ret = qp_freader_next(r->reader, &up);
+    if (ret == QP_FREADER_END) {
+        lua_pushnil(l);
+        return 1;
+    }
+    if (ret)
+        luaL_error(l, "QPACK reader failed: %s", qp_freader_strerror(ret));
+
+    qp_next(&up, &obj);
+    qpack_process_obj(l, NULL, &up, &obj);
+
+    return 1;
+}
+
+/* for value in reader:values() do ... end */
+static int qpack_reader_values(lua_State *l)
+{
+    qpack_check_reader(l);
+    lua_pushcfunction(l, qpack_reader_next);
+    lua_pushvalue(l, 1);
+    return 2;
+}
+
+/* for value in reader:elements() do ... end iterates over the elements of
+ * the open array at the current position */
+static int qpack_reader_elements(lua_State *l)
+{
+    qpack_reader_t *r = qpack_check_reader(l);
+    int ret;
+
+    ret = qp_freader_enter(r->reader);
+    if (ret)
+        luaL_error(l, "QPACK reader failed: %s", qp_freader_strerror(ret));
+
+    lua_pushcfunction(l, qpack_reader_next);
+    lua_pushvalue(l, 1);
+    return 2;
+}
+
+static int qpack_reader_close(lua_State *l)
+{
+    qpack_reader_t *r = luaL_checkudata(l, 1, QPACK_READER_MT);
+
+    if (r->reader != NULL) {
+        qp_freader_free(r->reader);
+        r->reader = NULL;
+    }
+
+    return 0;
+}
+
+/* qpack.open(path[, window]) opens a file for reading values one at a time
+ * with a buffer of window bytes. Returns nil and a message when the file
+ * cannot be opened. */
+static int qpack_reader_open(lua_State *l)
+{
+    const char *path = luaL_checkstring(l, 1);
+    lua_Integer window = luaL_optinteger(l, 2, QP_FREADER_WINDOW);
+    qpack_reader_t *r;
+
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    luaL_argcheck(l, window > 0, 2, "expected a positive window size");
+
+    r = (qpack_reader_t *)lua_newuserdata(l, sizeof(*r));
+    r->reader = NULL;
+    luaL_setmetatable(l, QPACK_READER_MT);
+
+    r->reader = qp_freader_new(path, window);
+    if (r->reader == NULL)
+        return luaL_fileresult(l, 0, path);
+
+    return 1;
+}
+
+static void qpack_reader_register(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "next", qpack_reader_next },
+        { "values", qpack_reader_values },
+        { "elements", qpack_reader_elements },
+        { "close", qpack_reader_close },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, QPACK_READER_MT)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, reg, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, qpack_reader_close);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== APPENDER ===== */
+
+#define QPACK_APPENDER_MT "qpack.appender"
+
+typedef struct {
+    qp_fpacker_t *fp;
+    qp_packer_t *pk;        /* encoded elements, reused for each add() */
+    qpack_config_t cfg;
+} qpack_appender_t;
+
+static qpack_appender_t *qpack_check_appender(lua_State *l)
+{
+    qpack_appender_t *a = luaL_checkudata(l, 1, QPACK_APPENDER_MT);
+    if (a->fp == NULL)
+        luaL_error(l, "QPACK appender is closed");
+    return a;
+}
+
+/* appender:add(value, ...) adds each value as an element of the array */
+static int qpack_appender_add(lua_State *l)
+{
+    qpack_appender_t *a = qpack_check_appender(l);
+    int i, n = lua_gettop(l);
+
+    a->pk->len = 0;
+    for (i = 2; i <= n; i++) {
+        lua_pushvalue(l, i);
+        qpack_append_value(l, &a->cfg, 0, a->pk);
+        lua_pop(l, 1);
+    }
+
+    if (a->pk->len &&
+        fwrite(a->pk->buffer, a->pk->len, 1, a->fp) != 1)
+        luaL_error(l, "QPACK append failed: %s", strerror(errno));
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+static int qpack_appender_flush(lua_State *l)
+{
+    qpack_appender_t *a = qpack_check_appender(l);
+
+    if (qp_flush(a->fp))
+        luaL_error(l, "QPACK append failed: %s", strerror(errno));
+
+    lua_settop(l, 1);
+    return 1;
+}
+
+static int qpack_appender_close(lua_State *l)
+{
+    qpack_appender_t *a = luaL_checkudata(l, 1, QPACK_APPENDER_MT);
+    int ret = 0;
+
+    if (a->fp != NULL) {
+        ret = qp_close(a->fp);
+        a->fp = NULL;
+    }
+    if (a->pk != NULL) {
+        qp_packer_free(a->pk);
+        a->pk = NULL;
+    }
+    if (ret)
+        luaL_error(l, "QPACK append failed: %s", strerror(errno));
+
+    return 0;
+}
+
+static int qpack_appender_gc(lua_State *l)
+{
+    qpack_appender_t *a = luaL_checkudata(l, 1, QPACK_APPENDER_MT);
+
+    if (a->fp != NULL) {
+        qp_close(a->fp);
+        a->fp = NULL;
+    }
+    if (a->pk != NULL) {
+        qp_packer_free(a->pk);
+        a->pk = NULL;
+    }
+
+    return 0;
+}
+
+/* qpack.append(path) opens or creates a file holding a top level open array
+ * and returns an appender which adds elements at the end of the file. The
+ * array is never closed, so the file can be opened again later to continue.
+ * Returns nil and a message when the file cannot be opened. */
+static int qpack_appender_open(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    const char *path = luaL_checkstring(l, 1);
+    qpack_appender_t *a;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 2, "found too many arguments");
+
+    a = (qpack_appender_t *)lua_newuserdata(l, sizeof(*a));
+    a->fp = NULL;
+    a->pk = NULL;
+    a->cfg = *cfg;
+    luaL_setmetatable(l, QPACK_APPENDER_MT);
+
+    a->pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (a->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK appender");
+
+    a->fp = qp_fappend_open(path);
+    if (a->fp == NULL)
+        return luaL_fileresult(l, 0, path);
+
+    return 1;
+}
+
+static void qpack_appender_register(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "add", qpack_appender_add },
+        { "flush", qpack_appender_flush },
+        { "close", qpack_appender_close },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, QPACK_APPENDER_MT)) {
+        lua_newtable(l);
+        luaL_setfuncs(l, reg, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, qpack_appender_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== SPLICING ===== */
+
+static int qpack_split_chunk(void *arg, const unsigned char *chunk, size_t n)
+{
+    lua_State *l = (lua_State *)arg;
+
+    lua_pushlstring(l, (const char*)chunk, n);
+    lua_rawseti(l, -2, lua_rawlen(l, -2) + 1);
+    return 0;
+}
+
+/* qpack.split(str, max_bytes) splits an encoded map or array into a list of
+ * maps or arrays with at most max_bytes bytes each, by copying the encoded
+ * elements */
+static int qpack_split(lua_State *l)
+{
+    qp_unpacker_t up;
+    qp_packer_t *chunk;
+    const char *data;
+    size_t len;
+    lua_Integer max_bytes;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    data = luaL_checklstring(l, 1, &len);
+    max_bytes = luaL_checkinteger(l, 2);
+    luaL_argcheck(l, max_bytes > 0, 2, "expected a positive size");
+
+    chunk = qp_packer_new(max_bytes < QP_SUGGESTED_SIZE ?
+                          (size_t)max_bytes : QP_SUGGESTED_SIZE);
+    if (chunk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK split");
+
+    lua_newtable(l);
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+    ret = qp_split(&up, max_bytes, chunk, qpack_split_chunk, l);
+    qp_packer_free(chunk);
+    if (ret)
+        luaL_error(l, "QPACK split failed: %s", qp_splice_strerror(ret));
+
+    return 1;
+}
+
+/* Fill an unpacker for each string argument from index 'first' to the top
+ * of the stack, or for each string in the list at index 'first' */
+static qp_unpacker_t *qpack_unpackers(lua_State *l, int first, int is_list,
+                                      size_t *n)
+{
+    qp_unpacker_t *unpackers;
+    const char *data;
+    size_t i, len;
+
+    *n = is_list ? lua_rawlen(l, first) : (size_t)(lua_gettop(l) - first + 1);
+    unpackers = (qp_unpacker_t *)lua_newuserdata(l,
+            (*n ? *n : 1) * sizeof(qp_unpacker_t));
+
+    for (i = 0; i < *n; i++) {
+        if (is_list) {
+            lua_rawgeti(l, first, i + 1);
+            if (lua_type(l, -1) != LUA_TSTRING)
+                luaL_error(l, "bad argument #%d (item %d is not a string)",
+                           first, (int)i + 1);
+            /* the string is kept alive by the list */
+            data = lua_tolstring(l, -1, &len);
+            lua_pop(l, 1);
+        } else {
+            data = luaL_checklstring(l, first + i, &len);
+        }
+        qp_unpacker_init(&unpackers[i], (unsigned char*)data, len);
+    }
+
+    return unpackers;
+}
+
+/* qpack.concat_arrays(str, ...) returns one array with the elements of all
+ * encoded arrays */
+static int qpack_concat_arrays(lua_State *l)
+{
+    qp_unpacker_t *unpackers;
+    qp_packer_t *pk;
+    size_t n;
+    int ret;
+
+    unpackers = qpack_unpackers(l, 1, 0, &n);
+
+    pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK concat_arrays");
+
+    ret = qp_concat(unpackers, n, pk);
+    if (ret) {
+        qp_packer_free(pk);
+        luaL_error(l, "QPACK concat_arrays failed: %s",
+                   qp_splice_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)pk->buffer, pk->len);
+    qp_packer_free(pk);
+
+    return 1;
+}
+
+/* qpack.merge_maps({str, ...}[, conflict]) returns one map with the pairs
+ * of all encoded maps. Duplicate keys are handled as set by conflict:
+ * "none" (copy all pairs), "first", "last" or "error" */
+static int qpack_merge_maps(lua_State *l)
+{
+    static const char *options[] = { "none", "first", "last", "error", NULL };
+    qp_unpacker_t *unpackers;
+    qp_packer_t *pk;
+    size_t n;
+    int ret, mode;
+
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    luaL_checktype(l, 1, LUA_TTABLE);
+    mode = luaL_checkoption(l, 2, "none", options);
+
+    unpackers = qpack_unpackers(l, 1, 1, &n);
+
+    pk = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK merge_maps");
+
+    ret = qp_merge(unpackers, n, (qp_merge_t)mode, pk);
+    if (ret) {
+        qp_packer_free(pk);
+        luaL_error(l, "QPACK merge_maps failed: %s",
+                   qp_splice_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)pk->buffer, pk->len);
+    qp_packer_free(pk);
+
+    return 1;
+}
+
+/* Convert the path at stack index idx, a single key or a list of map keys
+ * and array indexes (from 1), to qp_path_t steps. The keys are encoded in
+ * pk; call qpack_path_resolve() when nothing more is added to pk. */
+static qp_path_t *qpack_check_path(lua_State *l, int idx, qpack_config_t *cfg,
+                                   qp_packer_t *pk, size_t *n)
+{
+    int is_list = lua_type(l, idx) == LUA_TTABLE;
+    qp_path_t *path;
+    size_t i, len;
+
+    *n = is_list ? lua_rawlen(l, idx) : 1;
+    path = (qp_path_t *)lua_newuserdata(l, (*n ? *n : 1) * sizeof(qp_path_t));
+
+    for (i = 0; i < *n; i++) {
+        if (is_list)
+            lua_rawgeti(l, idx, i + 1);
+        else
+            lua_pushvalue(l, idx);
+
+        len = pk->len;
+        if (lua_type(l, -1) == LUA_TSTRING) {
+            if (qpack_append_string(l, pk, -1))
+                luaL_error(l, "Memory allocation error in QPACK");
+            path[i].index = -1;
+        } else if (lua_type(l, -1) == LUA_TNUMBER) {
+            if (qpack_append_number(l, cfg, pk, -1))
+                luaL_error(l, "Memory allocation error in QPACK");
+            path[i].index = lua_isinteger(l, -1) && lua_tointeger(l, -1) > 0 ?
+                            lua_tointeger(l, -1) - 1 : -1;
+        } else {
+            luaL_argerror(l, idx, "path must be a key or a list of keys");
+        }
+        path[i].key = NULL;
+        path[i].key_n = pk->len - len;
+        lua_pop(l, 1);
+    }
+
+    return path;
+}
+
+/* Point the path keys into the packer, once its buffer does not move */
+static void qpack_path_resolve(qp_path_t *path, size_t n, qp_packer_t *pk)
+{
+    const unsigned char *key = pk->buffer;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        path[i].key = key;
+        key += path[i].key_n;
+    }
+}
+
+/* qpack.patch(str, path, value) returns str with the value at path replaced
+ * by value, without decoding str. The path is a map key or a list of map
+ * keys and array indexes, {} is the root value. */
+static int qpack_patch(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_packer_t *scratch, *out;
+    qp_path_t *path;
+    const char *data;
+    size_t len, n, value_pos;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 3, 3, "expected 3 arguments");
+    data = luaL_checklstring(l, 1, &len);
+
+    scratch = qpack_buffer_new(l, QP_SUGGESTED_SIZE);
+    path = qpack_check_path(l, 2, cfg, scratch, &n);
+
+    value_pos = scratch->len;
+    lua_pushvalue(l, 3);
+    qpack_append_data(l, cfg, 0, scratch);
+    lua_pop(l, 1);
+    qpack_path_resolve(path, n, scratch);
+
+    /* strings are immutable, patch a copy */
+    out = qp_packer_new(len + scratch->len - value_pos + 1);
+    if (out == NULL)
+        luaL_error(l, "Memory allocation error in QPACK patch");
+    memcpy(out->buffer, data, len);
+    out->len = len;
+
+    ret = qp_patch(out, path, n, scratch->buffer + value_pos,
+                   scratch->len - value_pos);
+    if (ret) {
+        qp_packer_free(out);
+        luaL_error(l, "QPACK patch failed: %s", qp_splice_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)out->buffer, out->len);
+    qp_packer_free(out);
+
+    return 1;
+}
+
+/* qpack.diff(old, new) returns an encoded patch with the changes between two
+ * encoded values. Use qpack.apply(old, patch) to create new from old. */
+static int qpack_diff(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qp_unpacker_t a, b;
+    qp_packer_t *patch;
+    const char *data_a, *data_b;
+    size_t len_a, len_b;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    data_a = luaL_checklstring(l, 1, &len_a);
+    data_b = luaL_checklstring(l, 2, &len_b);
+
+    patch = qp_packer_new(QP_SUGGESTED_SIZE);
+    if (patch == NULL)
+        luaL_error(l, "Memory allocation error in QPACK diff");
+
+    qp_unpacker_init(&a, (unsigned char*)data_a, len_a);
+    qp_unpacker_init(&b, (unsigned char*)data_b, len_b);
+    ret = qp_diff(&a, &b, patch, cfg->decode_max_depth);
+    if (ret) {
+        qp_packer_free(patch);
+        luaL_error(l, "QPACK diff failed: %s", qp_splice_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)patch->buffer, patch->len);
+    qp_packer_free(patch);
+
+    return 1;
+}
+
+/* qpack.apply(old, patch) applies a patch created with qpack.diff() */
+static int qpack_apply(lua_State *l)
+{
+    qp_unpacker_t up;
+    qp_packer_t *out;
+    const char *data, *patch;
+    size_t len, patch_len;
+    int ret;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    data = luaL_checklstring(l, 1, &len);
+    patch = luaL_checklstring(l, 2, &patch_len);
+
+    /* strings are immutable, apply to a copy */
+    out = qp_packer_new(len + patch_len + 1);
+    if (out == NULL)
+        luaL_error(l, "Memory allocation error in QPACK apply");
+    memcpy(out->buffer, data, len);
+    out->len = len;
+
+    qp_unpacker_init(&up, (unsigned char*)patch, patch_len);
+    ret = qp_apply(out, &up);
+    if (ret) {
+        qp_packer_free(out);
+        luaL_error(l, "QPACK apply failed: %s", qp_splice_strerror(ret));
+    }
+
+    lua_pushlstring(l, (const char*)out->buffer, out->len);
+    qp_packer_free(out);
+
+    return 1;
+}
+
+/* ===== TEMPLATES ===== */
+
+/* A template is compiled from a sample value into a list of instructions
+ * which rebuild the value. Scalars in the sample are slots: a message only
+ * holds the template id and the slot values, as the array [id, v1, ...]. */
+
+#define QPACK_TEMPLATE_MT "qpack.template"
+
+/* Template instructions */
+#define QPACK_TPL_ARRAY     0   /* push a table with arg array items */
+#define QPACK_TPL_MAP       1   /* push a table with arg map items */
+#define QPACK_TPL_KEY       2   /* push key arg from the key list */
+#define QPACK_TPL_SLOT      3   /* push the next value */
+#define QPACK_TPL_SET       4   /* table[key] = value */
+#define QPACK_TPL_SETI      5   /* table[arg] = value */
+
+typedef struct {
+    int op;
+    int arg;
+} qpack_tpl_op_t;
+
+typedef struct {
+    lua_Integer id;
+    uint32_t hash;          /* FNV-1a of the shape, the default id */
+    int nslots;
+    int nkeys;
+    int max_depth;
+    int nops;
+    int size;
+    qpack_tpl_op_t *ops;
+    qp_packer_t *pk;        /* reused by encode() */
+    qpack_config_t cfg;
+} qpack_template_t;
+
+/* Map key of a sample, for sorting keys in a fixed order */
+typedef struct {
+    int idx;                /* index in the list of keys */
+    int is_str;
+    lua_Number num;
+    const char *str;
+    size_t len;
+} qpack_tpl_key_t;
+
+static qpack_template_t *qpack_check_template(lua_State *l)
+{
+    return (qpack_template_t *)luaL_checkudata(l, 1, QPACK_TEMPLATE_MT);
+}
+
+static void qpack_template_hash(qpack_template_t *t, const void *data,
+                                size_t n)
+{
+    const unsigned char *pt = (const unsigned char *)data;
+
+    while (n--) {
+        t->hash ^= *pt++;
+        t->hash *= 16777619U;
+    }
+}
+
+static void qpack_template_add(lua_State *l, qpack_template_t *t, int op,
+                               int arg)
+{
+    if (t->nops == t->size) {
+        int size = t->size ? t->size * 2 : 32;
+        qpack_tpl_op_t *ops = realloc(t->ops, size * sizeof(*ops));
+        if (ops == NULL)
+            luaL_error(l, "Memory allocation error in QPACK template");
+        t->ops = ops;
+        t->size = size;
+    }
+
+    t->ops[t->nops].op = op;
+    t->ops[t->nops].arg = arg;
+    t->nops++;
+    qpack_template_hash(t, &op, sizeof(op));
+    qpack_template_hash(t, &arg, sizeof(arg));
+}
+
+/* Numbers sort before strings */
+static int qpack_template_cmp(const void *a, const void *b)
+{
+    const qpack_tpl_key_t *ka = a, *kb = b;
+    int rc;
+
+    if (ka->is_str != kb->is_str)
+        return ka->is_str - kb->is_str;
+    if (!ka->is_str)
+        return (ka->num > kb->num) - (ka->num < kb->num);
+
+    rc = memcmp(ka->str, kb->str, ka->len < kb->len ? ka->len : kb->len);
+    return rc ? rc : (ka->len > kb->len) - (ka->len < kb->len);
+}
+
+/* Compile the sample value on the top of the Lua stack.
+ * Stack: ..., keys (index keys), path (index path), slots (index slots) */
+static void qpack_template_compile(lua_State *l, qpack_template_t *t,
+                                   int depth, int keys, int path, int slots)
+{
+    qpack_tpl_key_t *sorted;
+    int i, n, len;
+
+    if (depth > t->max_depth)
+        t->max_depth = depth;
+
+    if (lua_type(l, -1) != LUA_TTABLE) {
+        qpack_template_add(l, t, QPACK_TPL_SLOT, 0);
+
+        /* slots[n] = copy of the path */
+        lua_createtable(l, depth, 0);
+        for (i = 1; i <= depth; i++) {
+            lua_rawgeti(l, path, i);
+            lua_rawseti(l, -2, i);
+        }
+        lua_rawseti(l, slots, ++t->nslots);
+        return;
+    }
+
+    qpack_check_encode_depth(l, &t->cfg, depth + 1, NULL);
+    len = qpack_table_length(l, &t->cfg, NULL);
+    if (len >= 0) {
+        qpack_template_add(l, t, QPACK_TPL_ARRAY, len);
+        for (i = 1; i <= len; i++) {
+            lua_pushinteger(l, i);
+            lua_rawseti(l, path, depth + 1);
+            lua_geti(l, -1, i);
+            qpack_template_compile(l, t, depth + 1, keys, path, slots);
+            lua_pop(l, 1);
+            qpack_template_add(l, t, QPACK_TPL_SETI, i);
+        }
+        return;
+    }
+
+    /* map keys in a fixed order, so equal shapes give equal templates */
+    lua_newtable(l);
+    n = 0;
+    lua_pushnil(l);
+    while (lua_next(l, -3) != 0) {
+        lua_pop(l, 1);
+        if (lua_type(l, -1) != LUA_TNUMBER && lua_type(l, -1) != LUA_TSTRING)
+            qpack_encode_exception(l, &t->cfg, NULL, -1,
+                                   "table key must be a number or string");
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, -3, ++n);
+    }
+
+    sorted = (qpack_tpl_key_t *)lua_newuserdata(l,
+            (n ? n : 1) * sizeof(qpack_tpl_key_t));
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(l, -2, i + 1);
+        sorted[i].idx = i + 1;
+        sorted[i].is_str = lua_type(l, -1) == LUA_TSTRING;
+        if (sorted[i].is_str)
+            sorted[i].str = lua_tolstring(l, -1, &sorted[i].len);
+        else
+            sorted[i].num = lua_tonumber(l, -1);
+        lua_pop(l, 1);
+    }
+    qsort(sorted, n, sizeof(qpack_tpl_key_t), qpack_template_cmp);
+
+    /* table, key list, sorted */
+    qpack_template_add(l, t, QPACK_TPL_MAP, n);
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(l, -2, sorted[i].idx);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, keys, ++t->nkeys);
+        qpack_template_add(l, t, QPACK_TPL_KEY, t->nkeys);
+        if (sorted[i].is_str)
+            qpack_template_hash(t, sorted[i].str, sorted[i].len);
+        else
+            qpack_template_hash(t, &sorted[i].num, sizeof(lua_Number));
+
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, path, depth + 1);
+        lua_rawget(l, -4);
+        qpack_template_compile(l, t, depth + 1, keys, path, slots);
+        lua_pop(l, 1);
+        qpack_template_add(l, t, QPACK_TPL_SET, 0);
+    }
+    lua_pop(l, 2);
+}
+
+/* tpl:encode(values) returns a message with the values for the slots in
+ * the order of tpl:slots(). A nil value is written as null. */
+static int qpack_template_encode(lua_State *l)
+{
+    qpack_template_t *t = qpack_check_template(l);
+    size_t pos;
+    int i;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 1 argument");
+    luaL_checktype(l, 2, LUA_TTABLE);
+
+    t->pk->len = 0;
+    if (qp_add_open(t->pk, QP_ARRAY_OPEN, &pos) ||
+        qp_add_int64(t->pk, t->id))
+        luaL_error(l, "Memory allocation error in QPACK template");
+
+    for (i = 1; i <= t->nslots; i++) {
+        lua_rawgeti(l, 2, i);
+        qpack_append_data(l, &t->cfg, 0, t->pk);
+        lua_pop(l, 1);
+    }
+
+    if (qp_add_close(t->pk, pos, t->nslots + 1))
+        luaL_error(l, "Memory allocation error in QPACK template");
+
+    lua_pushlstring(l, (const char*)t->pk->buffer, t->pk->len);
+    return 1;
+}
+
+/* tpl:decode(str) rebuilds the value from a message of this template */
+static int qpack_template_decode(lua_State *l)
+{
+    qpack_template_t *t = qpack_check_template(l);
+    qpack_parse_t parse = { NULL, NULL, &t->cfg };
+    qp_unpacker_t up;
+    qp_obj_t obj;
+    qp_types_t tp;
+    const char *data;
+    size_t len;
+    int i, keys;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 1 argument");
+    data = luaL_checklstring(l, 2, &len);
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+
+    tp = qp_next(&up, &obj);
+    if (tp == QP_ARRAY_OPEN ?
+            obj.hook && obj.via.int64 != t->nslots + 1 :
+            tp < QP_ARRAY0 || tp > QP_ARRAY5 ||
+            tp - QP_ARRAY0 != t->nslots + 1)
+        luaL_error(l, "QPACK template message expected");
+    if (qp_next(&up, &obj) != QP_INT64 || obj.via.int64 != t->id)
+        luaL_error(l, "QPACK template id mismatch");
+
+    if (!lua_checkstack(l, 2 * t->max_depth + 4))
+        luaL_error(l, "Cannot deserialise, excessive nesting (%d)",
+                   t->max_depth);
+    lua_getuservalue(l, 1);
+    keys = lua_gettop(l);
+
+    for (i = 0; i < t->nops; i++) {
+        switch (t->ops[i].op) {
+        case QPACK_TPL_ARRAY:
+            lua_createtable(l, t->ops[i].arg, 0);
+            break;
+        case QPACK_TPL_MAP:
+            lua_createtable(l, 0, t->ops[i].arg);
+            break;
+        case QPACK_TPL_KEY:
+            lua_rawgeti(l, keys, t->ops[i].arg);
+            break;
+        case QPACK_TPL_SLOT:
+            if (qp_next(&up, &obj) == QP_END || obj.tp == QP_ARRAY_CLOSE)
+                luaL_error(l, "QPACK too few values for template");
+            qpack_process_obj(l, &parse, &up, &obj);
+            break;
+        case QPACK_TPL_SET:
+            lua_rawset(l, -3);
+            break;
+        case QPACK_TPL_SETI:
+            lua_rawseti(l, -2, t->ops[i].arg);
+            break;
+        }
+    }
+
+    /* an open array may also end at the end of the message */
+    if (tp == QP_ARRAY_OPEN) {
+        tp = qp_next(&up, &obj);
+        if (tp != QP_ARRAY_CLOSE && tp != QP_END)
+            luaL_error(l, "QPACK template message has too many values");
+    }
+    if (up.pt < up.end)
+        luaL_error(l, "QPACK template message has trailing data");
+
+    return 1;
+}
+
+static int qpack_template_id(lua_State *l)
+{
+    lua_pushinteger(l, qpack_check_template(l)->id);
+    return 1;
+}
+
+/* tpl:slots() returns the path of each slot, a list of keys and indexes */
+static int qpack_template_slots(lua_State *l)
+{
+    qpack_check_template(l);
+    lua_getuservalue(l, 1);
+    lua_getfield(l, -1, "slots");
+    return 1;
+}
+
+static int qpack_template_gc(lua_State *l)
+{
+    qpack_template_t *t = qpack_check_template(l);
+
+    free(t->ops);
+    t->ops = NULL;
+    if (t->pk != NULL) {
+        qp_packer_free(t->pk);
+        t->pk = NULL;
+    }
+
+    return 0;
+}
+
+/* qpack.template(sample[, id]) compiles the shape of sample. Without id,
+ * the id is a hash of the shape, so two processes which compile the same
+ * shape get the same template. */
+static int qpack_template_new(lua_State *l)
+{
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qpack_template_t *t;
+
+    luaL_argcheck(l, lua_gettop(l) >= 1, 1, "expected 1 or 2 arguments");
+    luaL_argcheck(l, lua_gettop(l) <= 2, 3, "found too many arguments");
+    lua_settop(l, 2);
+
+    t = (qpack_template_t *)lua_newuserdata(l, sizeof(*t));
+    t->hash = 2166136261U;
+    t->nslots = 0;
+    t->nkeys = 0;
+    t->max_depth = 0;
+    t->nops = 0;
+    t->size = 0;
+    t->ops = NULL;
+    t->pk = NULL;
+    t->cfg = *cfg;
+    luaL_setmetatable(l, QPACK_TEMPLATE_MT);
+
+    t->pk = qp_packer_new(256);
+    if (t->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK template");
+
+    /* keys and slots are kept as user value of the template */
+    lua_newtable(l);
+    lua_newtable(l);
+    lua_pushvalue(l, -1);
+    lua_setfield(l, -3, "slots");
+    lua_newtable(l);
+
+    /* 1: sample, 2: id, 3: template, 4: keys, 5: slots, 6: path */
+    lua_pushvalue(l, 1);
+    qpack_template_compile(l, t, 0, 4, 6, 5);
+    lua_settop(l, 4);
+    lua_setuservalue(l, 3);
+
+    t->id = lua_isnil(l, 2) ? (lua_Integer)(t->hash & 0x7fffffff) :
+                              luaL_checkinteger(l, 2);
+
+    return 1;
+}
+
+static void qpack_template_register(lua_State *l)
+{
+    luaL_Reg reg[] = {
+        { "encode", qpack_template_encode },
+        { "decode", qpack_template_decode },
+        { "id", qpack_template_id },
+        { "slots", qpack_template_slots },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, QPACK_TEMPLATE_MT)) {
         lua_newtable(l);
+        luaL_setfuncs(l, reg, 0);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, qpack_template_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
 
-        while(qp_next(up, obj) && obj->tp != QP_MAP_CLOSE)
-        {
-            ret = qpack_process_obj(l, pk, up, obj);
-            if (ret)
-                break;
+/* ===== COMPILED SCHEMAS ===== */
 
-            qp_next(up, obj);
+/* qpack.compile(schema) turns a schema into a plan: a list of nodes where a
+ * record lists its fields in a fixed order, so values are read with
+ * lua_getfield() on known keys and written with typed writers, without
+ * finding the type and shape of every table.
+ *
+ * Schema types: "any", "int", "number", "string", "boolean", a record
+ * { {name, type}, ... } or an array { "array", type }.
+ *
+ * A "decimal(N)" number is written as an integer of value * 10^N and decodes
+ * as the value rounded to N decimal digits; an array of decimals is written
+ * as a delta and bit packed series. */
 
-            ret = qpack_process_obj(l, pk, up, obj);
+#define QPACK_PLAN_MT "qpack.plan"
+
+#define QPACK_PLAN_ANY      0
+#define QPACK_PLAN_INT      1
+#define QPACK_PLAN_NUMBER   2
+#define QPACK_PLAN_STRING   3
+#define QPACK_PLAN_BOOLEAN  4
+#define QPACK_PLAN_RECORD   5
+#define QPACK_PLAN_ARRAY    6
+#define QPACK_PLAN_DECIMAL  7
+
+#define QPACK_PLAN_BATCH    16  /* array elements kept on the stack */
+
+static const char *qpack_plan_types[] = {
+    "any", "int", "number", "string", "boolean", "record", "array",
+    "decimal", NULL
+};
+
+typedef struct {
+    int type;
+    int key;            /* record field: index of the name in the key list */
+    const char *name;   /* record field: name, kept alive by the key list */
+    size_t name_len;
+    size_t key_pos;     /* record field: encoded name in the key buffer */
+    size_t key_len;
+    int first;          /* record: first field node; array: element node */
+    int count;          /* record: number of fields */
+    int scale;          /* decimal: digits after the decimal point */
+} qpack_plan_node_t;
+
+typedef struct {
+    int nnodes;
+    int size;
+    int nkeys;
+    int stack;          /* Lua stack slots used by encode and decode */
+    qpack_plan_node_t *nodes;
+    qp_packer_t *keybuf;    /* encoded field names */
+    qp_packer_t *pk;        /* output buffer, reused by each encode */
+    qpack_config_t cfg;
+} qpack_plan_t;
+
+static int qpack_plan_gc(lua_State *l)
+{
+    qpack_plan_t *p = luaL_checkudata(l, 1, QPACK_PLAN_MT);
+
+    free(p->nodes);
+    p->nodes = NULL;
+    if (p->keybuf != NULL) {
+        qp_packer_free(p->keybuf);
+        p->keybuf = NULL;
+    }
+    if (p->pk != NULL) {
+        qp_packer_free(p->pk);
+        p->pk = NULL;
+    }
+
+    return 0;
+}
+
+/* Reserve n nodes and return the index of the first */
+static int qpack_plan_reserve(lua_State *l, qpack_plan_t *p, int n)
+{
+    int first = p->nnodes;
+
+    if (p->nnodes + n > p->size) {
+        int size = p->size ? p->size : 16;
+        qpack_plan_node_t *nodes;
+        while (size < p->nnodes + n)
+            size *= 2;
+        nodes = realloc(p->nodes, size * sizeof(*nodes));
+        if (nodes == NULL)
+            luaL_error(l, "Memory allocation error in QPACK compile");
+        p->nodes = nodes;
+        p->size = size;
+    }
+
+    memset(p->nodes + first, 0, n * sizeof(*p->nodes));
+    p->nnodes += n;
+    return first;
+}
+
+/* Compile the schema type on the top of the Lua stack into node ni.
+ * Field names are added to the key list at stack index keys. The value of
+ * the node is found with stack slots in use. */
+static void qpack_plan_compile(lua_State *l, qpack_plan_t *p, int ni,
+                               int keys, int depth, int stack)
+{
+    int i, n, first;
+
+    if (depth > p->cfg.encode_max_depth || !lua_checkstack(l, 4))
+        luaL_error(l, "Cannot compile schema, excessive nesting (%d)", depth);
+    if (stack > p->stack)
+        p->stack = stack;
+
+    if (lua_type(l, -1) == LUA_TSTRING) {
+        const char *name = lua_tostring(l, -1);
+        char *end;
+        for (i = 0; i < QPACK_PLAN_RECORD; i++) {
+            if (strcmp(name, qpack_plan_types[i]) == 0) {
+                p->nodes[ni].type = i;
+                return;
+            }
+        }
+        if (strncmp(name, "decimal(", 8) == 0 && name[8] >= '0' &&
+            name[8] <= '9') {
+            long scale = strtol(name + 8, &end, 10);
+            if (strcmp(end, ")") == 0 && scale <= QP_DECIMAL_MAX_SCALE) {
+                p->nodes[ni].type = QPACK_PLAN_DECIMAL;
+                p->nodes[ni].scale = scale;
+                return;
+            }
+        }
+        luaL_error(l, "Invalid QPACK schema type '%s'", name);
+    }
+    if (lua_type(l, -1) != LUA_TTABLE)
+        luaL_error(l, "QPACK schema type must be a string or table");
+
+    lua_rawgeti(l, -1, 1);
+    if (lua_type(l, -1) == LUA_TSTRING &&
+        strcmp(lua_tostring(l, -1), "array") == 0) {
+        lua_pop(l, 1);
+        p->nodes[ni].type = QPACK_PLAN_ARRAY;
+        first = qpack_plan_reserve(l, p, 1);
+        p->nodes[ni].first = first;
+        lua_rawgeti(l, -1, 2);
+        qpack_plan_compile(l, p, first, keys, depth + 1,
+                           stack + QPACK_PLAN_BATCH);
+        lua_pop(l, 1);
+        return;
+    }
+    lua_pop(l, 1);
+
+    /* record: { {name, type}, ... } */
+    n = lua_rawlen(l, -1);
+    first = qpack_plan_reserve(l, p, n);
+    p->nodes[ni].type = QPACK_PLAN_RECORD;
+    p->nodes[ni].first = first;
+    p->nodes[ni].count = n;
+
+    for (i = 0; i < n; i++) {
+        qpack_plan_node_t *node;
+
+        lua_rawgeti(l, -1, i + 1);
+        if (lua_type(l, -1) != LUA_TTABLE)
+            luaL_error(l, "QPACK schema field %d must be {name, type}", i + 1);
+        lua_rawgeti(l, -1, 1);
+        if (lua_type(l, -1) != LUA_TSTRING)
+            luaL_error(l, "QPACK schema field %d needs a name", i + 1);
+
+        node = &p->nodes[first + i];
+        node->name = lua_tolstring(l, -1, &node->name_len);
+        node->key = ++p->nkeys;
+        node->key_pos = p->keybuf->len;
+        if (qp_add_raw(p->keybuf, (const unsigned char*)node->name,
+                       node->name_len))
+            luaL_error(l, "Memory allocation error in QPACK compile");
+        node->key_len = p->keybuf->len - node->key_pos;
+        lua_rawseti(l, keys, node->key);
+
+        lua_rawgeti(l, -1, 2);
+        qpack_plan_compile(l, p, first + i, keys, depth + 1,
+                           stack + (n > 3 ? n : 3));
+        lua_pop(l, 2);
+    }
+}
+
+static void qpack_plan_type_error(lua_State *l, int type)
+{
+    luaL_error(l, "Cannot serialise %s: %s expected",
+               lua_typename(l, lua_type(l, -1)), qpack_plan_types[type]);
+}
+
+/* Encode the value on the top of the Lua stack, of Lua type ltype, as
+ * node ni */
+static void qpack_plan_encode_node(lua_State *l, qpack_plan_t *p, int ni,
+                                   int ltype, qp_packer_t *pk, int depth)
+{
+    qpack_plan_node_t *node = &p->nodes[ni];
+    size_t pos, count = 0;
+    int i, ret = 0, n, isint;
+    lua_Integer num;
+
+    if (ltype == LUA_TNIL && node->type != QPACK_PLAN_ANY) {
+        ret = qp_add_null(pk);
+        goto done;
+    }
+
+    switch (node->type) {
+    case QPACK_PLAN_ANY:
+        qpack_append_data(l, &p->cfg, depth, pk);
+        return;
+    case QPACK_PLAN_INT:
+        num = lua_tointegerx(l, -1, &isint);
+        if (!isint || ltype != LUA_TNUMBER)
+            qpack_plan_type_error(l, node->type);
+        ret = qp_add_int64(pk, num);
+        break;
+    case QPACK_PLAN_NUMBER:
+        if (ltype != LUA_TNUMBER)
+            qpack_plan_type_error(l, node->type);
+        ret = qpack_append_number(l, &p->cfg, pk, -1);
+        break;
+    case QPACK_PLAN_DECIMAL:
+        if (ltype != LUA_TNUMBER)
+            qpack_plan_type_error(l, node->type);
+        ret = qp_add_decimal(pk, lua_tonumber(l, -1), node->scale);
+        break;
+    case QPACK_PLAN_STRING:
+        if (ltype != LUA_TSTRING)
+            qpack_plan_type_error(l, node->type);
+        ret = qpack_append_string(l, pk, -1);
+        break;
+    case QPACK_PLAN_BOOLEAN:
+        if (ltype != LUA_TBOOLEAN)
+            qpack_plan_type_error(l, node->type);
+        ret = lua_toboolean(l, -1) ? qp_add_true(pk) : qp_add_false(pk);
+        break;
+    case QPACK_PLAN_RECORD:
+        if (ltype != LUA_TTABLE)
+            qpack_plan_type_error(l, node->type);
+        ret = qpack_add_open(&p->cfg, pk, QP_MAP_OPEN, &pos);
+        if (ret)
+            break;
+        /* the field values are popped together after the last field */
+        n = lua_gettop(l);
+        for (i = 0; i < node->count && !ret; i++) {
+            qpack_plan_node_t *field = &p->nodes[node->first + i];
+            ltype = lua_getfield(l, n, field->name);
+            if (ltype == LUA_TNIL)
+                continue;   /* absent fields are left out, like encode() */
+            ret = qp_packer_reserve(pk, field->key_len);
             if (ret)
                 break;
-
-            /* Set key = value */
-            lua_rawset(l, -3);
+            memcpy(pk->buffer + pk->len, p->keybuf->buffer + field->key_pos,
+                   field->key_len);
+            pk->len += field->key_len;
+            qpack_plan_encode_node(l, p, node->first + i, ltype, pk,
+                                   depth + 1);
+            count++;
+        }
+        lua_settop(l, n);
+        ret = ret || qp_add_close(pk, pos, count);
+        break;
+    case QPACK_PLAN_ARRAY:
+        if (ltype != LUA_TTABLE)
+            qpack_plan_type_error(l, node->type);
+        count = lua_rawlen(l, -1);
+        if (p->nodes[node->first].type == QPACK_PLAN_BOOLEAN &&
+            p->cfg.encode_packed_bools &&
+            (ret = qpack_append_bools(l, pk, count)) != 0) {
+            ret = ret < 0;
+            break;
+        }
+        if (p->nodes[node->first].type == QPACK_PLAN_STRING &&
+            p->cfg.encode_dict_strings && count > 5 &&
+            (ret = qpack_append_dict(l, pk, count)) != 0) {
+            ret = ret < 0;
+            break;
+        }
+        if (p->nodes[node->first].type == QPACK_PLAN_DECIMAL) {
+            double *values = qpack_decimal_values(l, -1, count);
+            if (values != NULL) {
+                ret = qp_add_decimal_array(pk, values, count,
+                                           p->nodes[node->first].scale);
+                lua_pop(l, 1);
+                break;
+            }
+            /* with a nil or other value, the elements are written one by
+             * one, so the error or null is the same as for other types */
+        }
+        if (p->cfg.encode_run_length && count > 5) {
+            qp_runs_t runs;
+            n = lua_gettop(l);
+            ret = qp_runs_open(pk, &runs, count);
+            for (i = 1; i <= (int)count && !ret; i++) {
+                ltype = lua_rawgeti(l, n, i);
+                qpack_plan_encode_node(l, p, node->first, ltype, pk,
+                                       depth + 1);
+                lua_settop(l, n);
+                ret = qp_runs_next(pk, &runs);
+            }
+            ret = ret || qp_runs_close(pk, &runs);
+            break;
+        }
+        ret = qpack_add_open(&p->cfg, pk, QP_ARRAY_OPEN, &pos);
+        if (ret)
+            break;
+        /* elements are popped in batches of QPACK_PLAN_BATCH */
+        n = lua_gettop(l);
+        for (i = 1; i <= (int)count; i++) {
+            ltype = lua_rawgeti(l, n, i);
+            qpack_plan_encode_node(l, p, node->first, ltype, pk, depth + 1);
+            if (i % QPACK_PLAN_BATCH == 0)
+                lua_settop(l, n);
         }
+        lua_settop(l, n);
+        ret = qp_add_close(pk, pos, count);
         break;
     }
+
+done:
+    if (ret)
+        luaL_error(l, "Memory allocation error in QPACK encode");
+}
+
+static void qpack_plan_decode_node(lua_State *l, qpack_plan_t *p, int ni,
+                                   int keys, qp_unpacker_t *up, qp_obj_t *obj);
+
+/* Decode the object obj (already read from up) as node ni. A scalar is
+ * pushed as is, whatever the node, so that is done here without a call for
+ * each field or array element. */
+static inline void qpack_plan_decode_value(lua_State *l, qpack_plan_t *p,
+                                           int ni, int keys,
+                                           qp_unpacker_t *up, qp_obj_t *obj)
+{
+    switch (obj->tp) {
+    case QP_INT64:
+        lua_pushinteger(l, obj->via.int64);
+        return;
+    case QP_DOUBLE:
+        lua_pushnumber(l, obj->via.real);
+        return;
+    case QP_RAW:
+        lua_pushlstring(l, (const char*)obj->via.raw, obj->len);
+        return;
+    case QP_TRUE:
+    case QP_FALSE:
+        lua_pushboolean(l, obj->tp == QP_TRUE);
+        return;
     default:
-    {
-        ret = -1;
-        luaL_error(l, "QPACK unknown obj->tp:%d", obj->tp);
+        qpack_plan_decode_node(l, p, ni, keys, up, obj);
     }
+}
+
+/* Decode the object obj (already read from up) as node ni */
+static void qpack_plan_decode_node(lua_State *l, qpack_plan_t *p, int ni,
+                                   int keys, qp_unpacker_t *up, qp_obj_t *obj)
+{
+    qpack_plan_node_t *node = &p->nodes[ni];
+    qpack_parse_t parse = { NULL, NULL, &p->cfg };
+    int i, next = 0, is_open = 0;
+    size_t count = 0;
+
+    if (node->type == QPACK_PLAN_RECORD) {
+        if (obj->tp >= QP_MAP0 && obj->tp <= QP_MAP5)
+            count = obj->tp - QP_MAP0;
+        else if (obj->tp == QP_MAP_OPEN)
+            is_open = 1;
+        else
+            goto generic;
+
+        lua_createtable(l, 0, node->count);
+        while (is_open || count--) {
+            qpack_plan_node_t *field = NULL;
+
+            if (qp_next(up, obj) == QP_MAP_CLOSE || (is_open && !obj->tp))
+                break;
+
+            /* fields are usually found in schema order */
+            if (obj->tp == QP_RAW) {
+                for (i = 0; i < node->count; i++) {
+                    qpack_plan_node_t *f = &p->nodes[node->first + next];
+                    if (f->name_len == obj->len &&
+                        memcmp(f->name, obj->via.raw, obj->len) == 0) {
+                        field = f;
+                        break;
+                    }
+                    next = (next + 1) % node->count;
+                }
+            }
+
+            if (field != NULL) {
+                lua_rawgeti(l, keys, field->key);
+                qp_next(up, obj);
+                qpack_plan_decode_value(l, p, node->first + next, keys, up,
+                                        obj);
+                next = (next + 1) % node->count;
+            } else {
+                qpack_process_obj(l, &parse, up, obj);
+                qp_next(up, obj);
+                qpack_process_obj(l, &parse, up, obj);
+            }
+            lua_rawset(l, -3);
+        }
+        return;
     }
-    return ret;
+
+    if (node->type == QPACK_PLAN_ARRAY) {
+        if (obj->tp >= QP_ARRAY0 && obj->tp <= QP_ARRAY5)
+            count = obj->tp - QP_ARRAY0;
+        else if (obj->tp == QP_ARRAY_OPEN)
+            is_open = 1;
+        else
+            goto generic;
+
+        /* a sized array has its number of items */
+        lua_createtable(l, is_open && obj->hook && obj->via.int64 <= INT_MAX ?
+                        (int)obj->via.int64 : (int)count, 0);
+        for (i = 1; is_open || count--; i++) {
+            if (qp_next(up, obj) == QP_ARRAY_CLOSE || (is_open && !obj->tp))
+                break;
+            qpack_plan_decode_value(l, p, node->first, keys, up, obj);
+            lua_rawseti(l, -2, i);
+        }
+        return;
+    }
+
+generic:
+    qpack_process_obj(l, &parse, up, obj);
 }
 
-static int qpack_decode(lua_State *l)
+static int qpack_plan_encode(lua_State *l)
 {
-    qpack_parse_t qpack;
-    size_t qpack_len;
-    qp_unpacker_t up;
-    qp_obj_t obj;
+    qpack_plan_t *p = lua_touserdata(l, lua_upvalueindex(1));
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    if (!lua_checkstack(l, p->stack + 4))
+        luaL_error(l, "Cannot serialise, excessive nesting");
 
-    qpack.cfg = qpack_fetch_config(l);
+    p->pk->len = 0;
+    qpack_plan_encode_node(l, p, 0, lua_type(l, 1), p->pk, 0);
 
-    qpack.data = luaL_checklstring(l, 1, &qpack_len);
+    lua_pushlstring(l, (const char*)p->pk->buffer, p->pk->len);
+    return 1;
+}
 
-    qp_unpacker_init(&up, (unsigned char*)qpack.data, qpack_len);
+static int qpack_plan_decode(lua_State *l)
+{
+    qpack_plan_t *p = lua_touserdata(l, lua_upvalueindex(1));
+    qp_unpacker_t up;
+    qp_obj_t obj;
+    const char *data;
+    size_t len;
 
-    qp_next(&up, &obj);
-    if (obj.tp == QP_END) {
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    data = luaL_checklstring(l, 1, &len);
+    if (len == 0)
         luaL_error(l, "QPACK cannot parse empty string");
-    } else {
-        qpack_process_obj(l, &qpack, &up, &obj);
-    }
+    if (!lua_checkstack(l, p->stack + 4))
+        luaL_error(l, "Cannot deserialise, excessive nesting");
+
+    lua_getuservalue(l, lua_upvalueindex(1));
+    qp_unpacker_init(&up, (unsigned char*)data, len);
+    qp_next(&up, &obj);
+    qpack_plan_decode_node(l, p, 0, 2, &up, &obj);
 
     return 1;
 }
 
-/* ===== INITIALISATION ===== */
-
-/* Call target function in protected mode with all supplied args.
- * Assumes target function only returns a single non-nil value.
- * Convert and return thrown errors as: nil, "error message" */
-static int qpack_protect_conversion(lua_State *l)
+/* qpack.compile(schema) returns encode and decode functions for values
+ * of the schema. The encoding is the same as encode() gives for such a
+ * value, with the record fields in schema order. Decoding gains on records,
+ * from presized tables and reused field names; an array of scalars decodes
+ * about as fast as with decode(). */
+static int qpack_plan_new(lua_State *l)
 {
-    int err;
+    qpack_config_t *cfg = qpack_fetch_config(l);
+    qpack_plan_t *p;
 
-    /* Deliberately throw an error for invalid arguments */
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
-    /* pcall() the function stored as upvalue(1) */
-    lua_pushvalue(l, lua_upvalueindex(1));
-    lua_insert(l, 1);
-    err = lua_pcall(l, 1, 1, 0);
-    if (!err)
+    p = (qpack_plan_t *)lua_newuserdata(l, sizeof(*p));
+    p->nnodes = 0;
+    p->size = 0;
+    p->nkeys = 0;
+    p->stack = 0;
+    p->nodes = NULL;
+    p->keybuf = NULL;
+    p->pk = NULL;
+    p->cfg = *cfg;
+    luaL_setmetatable(l, QPACK_PLAN_MT);
+
+    p->keybuf = qp_packer_new(256);
+    p->pk = qp_packer_new(256);
+    if (p->keybuf == NULL || p->pk == NULL)
+        luaL_error(l, "Memory allocation error in QPACK compile");
+
+    /* 1: schema, 2: plan, 3: field names */
+    lua_newtable(l);
+    lua_pushvalue(l, 1);
+    qpack_plan_reserve(l, p, 1);
+    qpack_plan_compile(l, p, 0, 3, 0, 0);
+    lua_pop(l, 1);
+    lua_setuservalue(l, 2);
+
+    lua_pushvalue(l, 2);
+    lua_pushcclosure(l, qpack_plan_encode, 1);
+    lua_pushvalue(l, 2);
+    lua_pushcclosure(l, qpack_plan_decode, 1);
+
+    return 2;
+}
+
+static void qpack_plan_register(lua_State *l)
+{
+    if (luaL_newmetatable(l, QPACK_PLAN_MT)) {
+        lua_pushcfunction(l, qpack_plan_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+}
+
+/* ===== INITIALISATION ===== */
+
+/* Finish a protected call, also after the target function yielded.
+ * Convert and return thrown errors as: nil, "error message" */
+static int qpack_protect_finish(lua_State *l, int status, lua_KContext ctx)
+{
+    if (status == LUA_OK || status == LUA_YIELD)
         return 1;
 
-    if (err == LUA_ERRRUN) {
+    if (status == LUA_ERRRUN) {
         lua_pushnil(l);
         lua_insert(l, -2);
         return 2;
@@ -580,19 +4083,76 @@ static int qpack_protect_conversion(lua_State *l)
     return luaL_error(l, "Memory allocation error in QPACK protected call");
 }
 
+/* Call target function in protected mode with all supplied args.
+ * Assumes target function only returns a single non-nil value. */
+static int qpack_protect_conversion(lua_State *l)
+{
+    int nargs = lua_gettop(l);
+
+    /* Deliberately throw an error for invalid arguments. The maximum number
+     * of arguments is stored as upvalue(2) */
+    if (lua_tointeger(l, lua_upvalueindex(2)) == 1)
+        luaL_argcheck(l, nargs == 1, 1, "expected 1 argument");
+    else
+        luaL_argcheck(l, nargs >= 1 &&
+                      nargs <= lua_tointeger(l, lua_upvalueindex(2)),
+                      1, "unexpected number of arguments");
+
+    /* pcall() the function stored as upvalue(1). The continuation allows
+     * the yieldable functions to yield. */
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_insert(l, 1);
+    return qpack_protect_finish(l,
+            lua_pcallk(l, nargs, 1, 0, 0, qpack_protect_finish), 0);
+}
+
 /* Return qpack module table */
 static int lua_qpack_new(lua_State *l)
 {
     luaL_Reg reg[] = {
         { "encode", qpack_encode },
         { "decode", qpack_decode },
+        { "to_json", qpack_to_json },
+        { "from_json", qpack_from_json },
+        { "to_msgpack", qpack_to_msgpack },
+        { "from_msgpack", qpack_from_msgpack },
+        { "writer", qpack_writer_new },
+        { "encode_yieldable", qpack_encode_yieldable },
+        { "decode_yieldable", qpack_decode_yieldable },
+        { "open", qpack_reader_open },
+        { "append", qpack_appender_open },
+        { "split", qpack_split },
+        { "concat_arrays", qpack_concat_arrays },
+        { "merge_maps", qpack_merge_maps },
+        { "patch", qpack_patch },
+        { "diff", qpack_diff },
+        { "apply", qpack_apply },
+        { "template", qpack_template_new },
+        { "compile", qpack_plan_new },
+        { "register_ext", qpack_register_ext },
         { "encode_max_depth", qpack_cfg_encode_max_depth },
         { "decode_max_depth", qpack_cfg_decode_max_depth },
         { "encode_empty_table_as_array", qpack_cfg_encode_empty_tables_as_array },
+        { "encode_compact_doubles", qpack_cfg_encode_compact_doubles },
+        { "encode_run_length", qpack_cfg_encode_run_length },
+        { "encode_packed_bools", qpack_cfg_encode_packed_bools },
+        { "encode_dict_strings", qpack_cfg_encode_dict_strings },
+        { "decode_bitsets", qpack_cfg_decode_bitsets },
+        { "encode_shared_tables", qpack_cfg_encode_shared_tables },
+        { "encode_sized_containers", qpack_cfg_encode_sized_containers },
         { "new", lua_qpack_new },
         { NULL, NULL }
     };
 
+    qpack_writer_register(l);
+    qpack_task_register(l);
+    qpack_reader_register(l);
+    qpack_appender_register(l);
+    qpack_buffer_register(l);
+    qpack_template_register(l);
+    qpack_plan_register(l);
+    qpack_bitset_register(l);
+
     /* qpack module table */
     lua_newtable(l);
 
@@ -616,7 +4176,24 @@ static int lua_qpack_new(lua_State *l)
 /* Return qpack.safe module table */
 static int lua_qpack_safe_new(lua_State *l)
 {
-    const char *func[] = { "decode", "encode", NULL };
+    /* function name and maximum number of arguments */
+    const struct { const char *name; int nargs; } func[] = {
+        { "decode", 1 },
+        { "encode", 1 },
+        { "to_json", 2 },
+        { "from_json", 1 },
+        { "to_msgpack", 1 },
+        { "from_msgpack", 1 },
+        { "encode_yieldable", 2 },
+        { "decode_yieldable", 2 },
+        { "split", 2 },
+        { "concat_arrays", INT_MAX },
+        { "merge_maps", 2 },
+        { "patch", 3 },
+        { "diff", 2 },
+        { "apply", 2 },
+        { NULL, 0 }
+    };
     int i;
 
     lua_qpack_new(l);
@@ -625,10 +4202,11 @@ static int lua_qpack_safe_new(lua_State *l)
     lua_pushcfunction(l, lua_qpack_safe_new);
     lua_setfield(l, -2, "new");
 
-    for (i = 0; func[i]; i++) {
-        lua_getfield(l, -1, func[i]);
-        lua_pushcclosure(l, qpack_protect_conversion, 1);
-        lua_setfield(l, -2, func[i]);
+    for (i = 0; func[i].name; i++) {
+        lua_getfield(l, -1, func[i].name);
+        lua_pushinteger(l, func[i].nargs);
+        lua_pushcclosure(l, qpack_protect_conversion, 2);
+        lua_setfield(l, -2, func[i].name);
     }
 
     return 1;
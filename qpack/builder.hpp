@@ -0,0 +1,422 @@
+/*
+ * builder.hpp - Build qpack data in C++ with an inline small buffer.
+ *
+ * A qpack::builder<N> writes into an N byte buffer which is part of the
+ * builder itself, so a small message does not allocate memory. Only when
+ * the data grows beyond N bytes is it moved to the heap.
+ *
+ *      qpack::builder<64> b;
+ *      b.map({{"status", 200}, {"msg", "ok"}, {"ids", b2}});
+ *      send(b.data(), b.size());
+ *
+ * Containers can be written at once with map({...}) and array(...), which
+ * know their size and use a QP_MAPn / QP_ARRAYn header when possible, or
+ * step by step with open_map() / open_array() and close_map() /
+ * close_array(). In debug builds (without NDEBUG) a close must match the
+ * open container, a map must have a value for each key, and all containers
+ * must be closed before the data is used.
+ *
+ * Moving a builder which is on the heap takes over the buffer; an inline
+ * buffer is copied, which is at most N bytes.
+ */
+#ifndef QPACK_BUILDER_HPP_
+#define QPACK_BUILDER_HPP_
+
+#include <qpack/qpack.hpp>
+#include <cassert>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace qpack
+{
+
+class basic_builder;
+
+/* A value for map({...}) and array({...}) */
+class item
+{
+public:
+    item(std::nullptr_t) noexcept : kind_(null_k) {}
+    item(bool v) noexcept : kind_(bool_k) { via_.b = v; }
+    item(double v) noexcept : kind_(double_k) { via_.real = v; }
+    item(float v) noexcept : kind_(double_k) { via_.real = v; }
+    item(const char * v) noexcept : item(std::string_view(v)) {}
+    item(const std::string & v) noexcept : item(std::string_view(v)) {}
+    item(std::string_view v) noexcept : kind_(raw_k)
+    {
+        via_.raw.pt = v.data();
+        via_.raw.len = v.size();
+    }
+
+    template <typename T,
+              typename = std::enable_if_t<std::is_integral_v<T>>>
+    item(T v) noexcept : kind_(int_k)
+    {
+        via_.int64 = int64_t(v);
+    }
+
+    /* The data written by another builder, as a single value */
+    inline item(const basic_builder & b) noexcept;
+
+private:
+    friend class basic_builder;
+
+    enum kind_t { null_k, bool_k, int_k, double_k, raw_k, qpack_k };
+
+    kind_t kind_;
+    union
+    {
+        bool b;
+        int64_t int64;
+        double real;
+        struct { const char * pt; size_t len; } raw;
+    } via_;
+};
+
+/* Builder without the inline buffer; use builder<N> */
+class basic_builder
+{
+public:
+    basic_builder(const basic_builder &) = delete;
+    basic_builder & operator=(const basic_builder &) = delete;
+
+    const unsigned char * data() const noexcept
+    {
+        finished();
+        return data_;
+    }
+    size_t size() const noexcept { return len_; }
+    std::string_view view() const noexcept
+    {
+        finished();
+        return std::string_view(reinterpret_cast<const char *>(data_), len_);
+    }
+
+    /* True when the data no longer fits the inline buffer */
+    bool on_heap() const noexcept { return data_ != inline_; }
+
+    /* Start again with an empty buffer, keeping memory which is in use */
+    void clear() noexcept
+    {
+        len_ = 0;
+        open_.clear();
+    }
+
+    basic_builder & add(std::nullptr_t) { return put(QP_NULL); }
+    basic_builder & add(bool v) { return put(v ? QP_TRUE : QP_FALSE); }
+    basic_builder & add(float v) { return add(double(v)); }
+    basic_builder & add(const char * v) { return add(std::string_view(v)); }
+    basic_builder & add(const std::string & v)
+    {
+        return add(std::string_view(v));
+    }
+
+    template <typename T,
+              typename = std::enable_if_t<std::is_integral_v<T>>>
+    basic_builder & add(T v)
+    {
+        if constexpr (std::is_unsigned_v<T> && sizeof(T) >= sizeof(int64_t))
+        {
+            if (v > uint64_t(std::numeric_limits<int64_t>::max()))
+                throw error("qpack: integer out of range");
+        }
+        return add_int(int64_t(v));
+    }
+
+    basic_builder & add_int(int64_t v)
+    {
+        counted();
+        reserve(9);
+        if (v >= 0 && v < 64)
+            data_[len_++] = uint8_t(v);
+        else if (v >= -60 && v < 0)
+            data_[len_++] = uint8_t(63 - v);
+        else if (v == int8_t(v))
+            store(QP_INT8, int8_t(v));
+        else if (v == int16_t(v))
+            store(QP_INT16, int16_t(v));
+        else if (v == int32_t(v))
+            store(QP_INT32, int32_t(v));
+        else
+            store(QP_INT64, v);
+        return *this;
+    }
+
+    basic_builder & add(double v)
+    {
+        counted();
+        reserve(9);
+        if (v == 0.0)
+            data_[len_++] = QP_DOUBLE_0;
+        else if (v == 1.0)
+            data_[len_++] = QP_DOUBLE_1;
+        else if (v == -1.0)
+            data_[len_++] = QP_DOUBLE_N1;
+        else
+            store(QP_DOUBLE, v);
+        return *this;
+    }
+
+    basic_builder & add(std::string_view v)
+    {
+        size_t n = v.size();
+        counted();
+        reserve(9 + n);
+        if (n < 100)
+            data_[len_++] = uint8_t(128 + n);
+        else if (n <= UINT8_MAX)
+            store(QP_RAW8, uint8_t(n));
+        else if (n <= UINT16_MAX)
+            store(QP_RAW16, uint16_t(n));
+        else if (n <= UINT32_MAX)
+            store(QP_RAW32, uint32_t(n));
+        else
+            store(QP_RAW64, uint64_t(n));
+        std::memcpy(data_ + len_, v.data(), n);
+        len_ += n;
+        return *this;
+    }
+
+    basic_builder & add(const item & v)
+    {
+        switch (v.kind_)
+        {
+        case item::null_k:      return add(nullptr);
+        case item::bool_k:      return add(v.via_.b);
+        case item::int_k:       return add_int(v.via_.int64);
+        case item::double_k:    return add(v.via_.real);
+        case item::raw_k:
+            return add(std::string_view(v.via_.raw.pt, v.via_.raw.len));
+        case item::qpack_k:
+            return add_qpack(v.via_.raw.pt, v.via_.raw.len);
+        }
+        return *this;
+    }
+
+    /* Append data which is already qpack encoded, as a single value */
+    basic_builder & add_qpack(const void * pt, size_t n)
+    {
+        counted();
+        reserve(n);
+        std::memcpy(data_ + len_, pt, n);
+        len_ += n;
+        return *this;
+    }
+
+    basic_builder & open_array() { return open(QP_ARRAY_OPEN); }
+    basic_builder & open_map() { return open(QP_MAP_OPEN); }
+    basic_builder & close_array() { return close(QP_ARRAY_CLOSE); }
+    basic_builder & close_map() { return close(QP_MAP_CLOSE); }
+
+    template <typename... Args>
+    basic_builder & array(Args &&... args)
+    {
+        size_t n = sizeof...(Args);
+        open(n <= 5 ? qp_types_t(QP_ARRAY0 + n) : QP_ARRAY_OPEN);
+        (add(std::forward<Args>(args)), ...);
+        return close(n <= 5 ? QP_END : QP_ARRAY_CLOSE);
+    }
+
+    basic_builder & array(std::initializer_list<item> items)
+    {
+        size_t n = items.size();
+        open(n <= 5 ? qp_types_t(QP_ARRAY0 + n) : QP_ARRAY_OPEN);
+        for (auto & v : items)
+            add(v);
+        return close(n <= 5 ? QP_END : QP_ARRAY_CLOSE);
+    }
+
+    basic_builder & map(
+            std::initializer_list<std::pair<std::string_view, item>> items)
+    {
+        size_t n = items.size();
+        open(n <= 5 ? qp_types_t(QP_MAP0 + n) : QP_MAP_OPEN);
+        for (auto & kv : items)
+        {
+            add(kv.first);
+            add(kv.second);
+        }
+        return close(n <= 5 ? QP_END : QP_MAP_CLOSE);
+    }
+
+protected:
+    basic_builder(unsigned char * buf, size_t n) noexcept :
+        data_(buf), inline_(buf), len_(0), cap_(n), inline_cap_(n)
+    {}
+
+    ~basic_builder()
+    {
+        if (on_heap())
+            std::free(data_);
+    }
+
+    /* Take the data of other, which uses an inline buffer of the same size */
+    void take(basic_builder & other) noexcept
+    {
+        if (other.on_heap())
+        {
+            data_ = other.data_;
+            cap_ = other.cap_;
+            other.data_ = other.inline_;
+            other.cap_ = other.inline_cap_;
+        }
+        else
+        {
+            std::memcpy(data_, other.data_, other.len_);
+        }
+        len_ = other.len_;
+        other.len_ = 0;
+        open_ = std::move(other.open_);
+        other.open_.clear();
+    }
+
+    void release() noexcept
+    {
+        if (on_heap())
+            std::free(data_);
+        data_ = inline_;
+        cap_ = inline_cap_;
+    }
+
+private:
+    void reserve(size_t n)
+    {
+        if (len_ + n <= cap_)
+            return;
+
+        size_t cap = cap_ * 2;
+        while (cap < len_ + n)
+            cap *= 2;
+
+        unsigned char * pt;
+        if (on_heap())
+        {
+            pt = static_cast<unsigned char *>(std::realloc(data_, cap));
+        }
+        else
+        {
+            pt = static_cast<unsigned char *>(std::malloc(cap));
+            if (pt != nullptr)
+                std::memcpy(pt, data_, len_);
+        }
+        if (pt == nullptr)
+            throw error("qpack: memory allocation error");
+        data_ = pt;
+        cap_ = cap;
+    }
+
+    template <typename T>
+    void store(uint8_t tp, T v) noexcept
+    {
+        data_[len_++] = tp;
+        std::memcpy(data_ + len_, &v, sizeof(T));
+        len_ += sizeof(T);
+    }
+
+    basic_builder & put(qp_types_t tp)
+    {
+        counted();
+        reserve(1);
+        data_[len_++] = uint8_t(tp);
+        return *this;
+    }
+
+    /* Write a container header; tp can be a fixed size or open type */
+    basic_builder & open(qp_types_t tp)
+    {
+        put(tp);
+#ifndef NDEBUG
+        open_.push_back({uint8_t(tp), 0});
+#endif
+        return *this;
+    }
+
+    /* End the last container; a fixed size container has close QP_END */
+    basic_builder & close(qp_types_t close)
+    {
+#ifndef NDEBUG
+        assert (!open_.empty() && "close without open container");
+        level lv = open_.back();
+        bool is_map = qp_is_map(qp_types_t(lv.tp));
+        assert ((close == QP_END) == (lv.tp < QP_ARRAY_OPEN) &&
+                (close == QP_END ||
+                 (close == QP_MAP_CLOSE) == is_map) &&
+                "close does not match the open container");
+        assert ((!is_map || !(lv.n & 1)) && "map key without value");
+        open_.pop_back();
+#endif
+        if (close != QP_END)
+        {
+            reserve(1);
+            data_[len_++] = uint8_t(close);
+        }
+        return *this;
+    }
+
+    /* Count a value in the open container (debug builds only) */
+    void counted() noexcept
+    {
+#ifndef NDEBUG
+        if (!open_.empty())
+            open_.back().n++;
+#endif
+    }
+
+    void finished() const noexcept
+    {
+#ifndef NDEBUG
+        assert (open_.empty() && "data used with an open container");
+#endif
+    }
+
+    unsigned char * data_;
+    unsigned char * inline_;
+    size_t len_;
+    size_t cap_;
+    size_t inline_cap_;
+
+    /* Open containers, only tracked in debug builds; the member is always
+     * there so the layout does not depend on NDEBUG */
+    struct level { uint8_t tp; size_t n; };
+    std::vector<level> open_;
+};
+
+template <size_t N = 256>
+class builder : public basic_builder
+{
+    static_assert(N >= 16, "qpack: builder needs at least 16 bytes");
+
+public:
+    builder() noexcept : basic_builder(buf_, N) {}
+
+    builder(builder && other) noexcept : basic_builder(buf_, N)
+    {
+        take(other);
+    }
+
+    builder & operator=(builder && other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            take(other);
+        }
+        return *this;
+    }
+
+private:
+    unsigned char buf_[N];
+};
+
+inline item::item(const basic_builder & b) noexcept : kind_(qpack_k)
+{
+    via_.raw.pt = reinterpret_cast<const char *>(b.data());
+    via_.raw.len = b.size();
+}
+
+}  /* namespace qpack */
+
+#endif  /* QPACK_BUILDER_HPP_ */
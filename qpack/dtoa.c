@@ -0,0 +1,379 @@
+/*
+ * dtoa.c - Shortest round-trip double to string conversion.
+ *
+ * This is an implementation of the Grisu2 algorithm as described by Florian
+ * Loitsch in "Printing Floating-Point Numbers Quickly and Accurately with
+ * Integers". The output always reads back as the exact same double and is
+ * the shortest possible representation for nearly all values.
+ */
+#include <qpack/dtoa.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DP_SIGNIFICAND_MASK UINT64_C(0x000FFFFFFFFFFFFF)
+#define DP_EXPONENT_MASK    UINT64_C(0x7FF0000000000000)
+#define DP_HIDDEN_BIT       UINT64_C(0x0010000000000000)
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT     (-DP_EXPONENT_BIAS)
+
+typedef struct
+{
+    uint64_t f;
+    int e;
+} diyfp_t;
+
+/* normalized powers of ten 10^-348, 10^-340, ... 10^340 */
+static const uint64_t dtoa__cached_f[] = {
+    UINT64_C(0xfa8fd5a0081c0288), UINT64_C(0xbaaee17fa23ebf76), UINT64_C(0x8b16fb203055ac76),
+    UINT64_C(0xcf42894a5dce35ea), UINT64_C(0x9a6bb0aa55653b2d), UINT64_C(0xe61acf033d1a45df),
+    UINT64_C(0xab70fe17c79ac6ca), UINT64_C(0xff77b1fcbebcdc4f), UINT64_C(0xbe5691ef416bd60c),
+    UINT64_C(0x8dd01fad907ffc3c), UINT64_C(0xd3515c2831559a83), UINT64_C(0x9d71ac8fada6c9b5),
+    UINT64_C(0xea9c227723ee8bcb), UINT64_C(0xaecc49914078536d), UINT64_C(0x823c12795db6ce57),
+    UINT64_C(0xc21094364dfb5637), UINT64_C(0x9096ea6f3848984f), UINT64_C(0xd77485cb25823ac7),
+    UINT64_C(0xa086cfcd97bf97f4), UINT64_C(0xef340a98172aace5), UINT64_C(0xb23867fb2a35b28e),
+    UINT64_C(0x84c8d4dfd2c63f3b), UINT64_C(0xc5dd44271ad3cdba), UINT64_C(0x936b9fcebb25c996),
+    UINT64_C(0xdbac6c247d62a584), UINT64_C(0xa3ab66580d5fdaf6), UINT64_C(0xf3e2f893dec3f126),
+    UINT64_C(0xb5b5ada8aaff80b8), UINT64_C(0x87625f056c7c4a8b), UINT64_C(0xc9bcff6034c13053),
+    UINT64_C(0x964e858c91ba2655), UINT64_C(0xdff9772470297ebd), UINT64_C(0xa6dfbd9fb8e5b88f),
+    UINT64_C(0xf8a95fcf88747d94), UINT64_C(0xb94470938fa89bcf), UINT64_C(0x8a08f0f8bf0f156b),
+    UINT64_C(0xcdb02555653131b6), UINT64_C(0x993fe2c6d07b7fac), UINT64_C(0xe45c10c42a2b3b06),
+    UINT64_C(0xaa242499697392d3), UINT64_C(0xfd87b5f28300ca0e), UINT64_C(0xbce5086492111aeb),
+    UINT64_C(0x8cbccc096f5088cc), UINT64_C(0xd1b71758e219652c), UINT64_C(0x9c40000000000000),
+    UINT64_C(0xe8d4a51000000000), UINT64_C(0xad78ebc5ac620000), UINT64_C(0x813f3978f8940984),
+    UINT64_C(0xc097ce7bc90715b3), UINT64_C(0x8f7e32ce7bea5c70), UINT64_C(0xd5d238a4abe98068),
+    UINT64_C(0x9f4f2726179a2245), UINT64_C(0xed63a231d4c4fb27), UINT64_C(0xb0de65388cc8ada8),
+    UINT64_C(0x83c7088e1aab65db), UINT64_C(0xc45d1df942711d9a), UINT64_C(0x924d692ca61be758),
+    UINT64_C(0xda01ee641a708dea), UINT64_C(0xa26da3999aef774a), UINT64_C(0xf209787bb47d6b85),
+    UINT64_C(0xb454e4a179dd1877), UINT64_C(0x865b86925b9bc5c2), UINT64_C(0xc83553c5c8965d3d),
+    UINT64_C(0x952ab45cfa97a0b3), UINT64_C(0xde469fbd99a05fe3), UINT64_C(0xa59bc234db398c25),
+    UINT64_C(0xf6c69a72a3989f5c), UINT64_C(0xb7dcbf5354e9bece), UINT64_C(0x88fcf317f22241e2),
+    UINT64_C(0xcc20ce9bd35c78a5), UINT64_C(0x98165af37b2153df), UINT64_C(0xe2a0b5dc971f303a),
+    UINT64_C(0xa8d9d1535ce3b396), UINT64_C(0xfb9b7cd9a4a7443c), UINT64_C(0xbb764c4ca7a44410),
+    UINT64_C(0x8bab8eefb6409c1a), UINT64_C(0xd01fef10a657842c), UINT64_C(0x9b10a4e5e9913129),
+    UINT64_C(0xe7109bfba19c0c9d), UINT64_C(0xac2820d9623bf429), UINT64_C(0x80444b5e7aa7cf85),
+    UINT64_C(0xbf21e44003acdd2d), UINT64_C(0x8e679c2f5e44ff8f), UINT64_C(0xd433179d9c8cb841),
+    UINT64_C(0x9e19db92b4e31ba9), UINT64_C(0xeb96bf6ebadf77d9), UINT64_C(0xaf87023b9bf0ee6b)
+};
+
+static const int16_t dtoa__cached_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066
+};
+
+static const uint64_t dtoa__pow10[] = {
+    UINT64_C(1), UINT64_C(10), UINT64_C(100), UINT64_C(1000),
+    UINT64_C(10000), UINT64_C(100000), UINT64_C(1000000),
+    UINT64_C(10000000), UINT64_C(100000000), UINT64_C(1000000000),
+    UINT64_C(10000000000), UINT64_C(100000000000),
+    UINT64_C(1000000000000), UINT64_C(10000000000000),
+    UINT64_C(100000000000000), UINT64_C(1000000000000000),
+    UINT64_C(10000000000000000), UINT64_C(100000000000000000),
+    UINT64_C(1000000000000000000), UINT64_C(10000000000000000000),
+};
+
+static inline diyfp_t dtoa__diyfp(uint64_t f, int e)
+{
+    diyfp_t fp = {f, e};
+    return fp;
+}
+
+static inline diyfp_t dtoa__mul(diyfp_t x, diyfp_t y)
+{
+    const uint64_t m32 = UINT64_C(0xFFFFFFFF);
+    uint64_t a = x.f >> 32, b = x.f & m32;
+    uint64_t c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    tmp += UINT64_C(1) << 31;   /* round */
+    return dtoa__diyfp(
+            ac + (ad >> 32) + (bc >> 32) + (tmp >> 32),
+            x.e + y.e + 64);
+}
+
+static inline diyfp_t dtoa__normalize(diyfp_t x)
+{
+    int s = __builtin_clzll(x.f);
+    return dtoa__diyfp(x.f << s, x.e - s);
+}
+
+static inline void dtoa__boundaries(
+        diyfp_t v,
+        diyfp_t * minus,
+        diyfp_t * plus)
+{
+    diyfp_t pl = dtoa__diyfp((v.f << 1) + 1, v.e - 1);
+    diyfp_t mi;
+
+    while (!(pl.f & (DP_HIDDEN_BIT << 1)))
+    {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= 64 - DP_SIGNIFICAND_SIZE - 2;
+    pl.e -= 64 - DP_SIGNIFICAND_SIZE - 2;
+
+    mi = (v.f == DP_HIDDEN_BIT)
+            ? dtoa__diyfp((v.f << 2) - 1, v.e - 2)
+            : dtoa__diyfp((v.f << 1) - 1, v.e - 1);
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *plus = pl;
+    *minus = mi;
+}
+
+static inline diyfp_t dtoa__cached_power(int e, int * K)
+{
+    /* (-61 - e) * log10(2) + 347, always positive */
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int) dk;
+    unsigned int idx;
+
+    if (dk - k > 0.0)
+    {
+        k++;
+    }
+    idx = (unsigned int) ((k >> 3) + 1);
+    *K = -(-348 + (int) (idx << 3));
+    return dtoa__diyfp(dtoa__cached_f[idx], dtoa__cached_e[idx]);
+}
+
+static inline int dtoa__count_digits(uint32_t n)
+{
+    if (n < 10) return 1;
+    if (n < 100) return 2;
+    if (n < 1000) return 3;
+    if (n < 10000) return 4;
+    if (n < 100000) return 5;
+    if (n < 1000000) return 6;
+    if (n < 10000000) return 7;
+    if (n < 100000000) return 8;
+    if (n < 1000000000) return 9;
+    return 10;
+}
+
+static inline void dtoa__round(
+        char * buffer,
+        int len,
+        uint64_t delta,
+        uint64_t rest,
+        uint64_t ten_kappa,
+        uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static inline void dtoa__digit_gen(
+        diyfp_t W,
+        diyfp_t Mp,
+        uint64_t delta,
+        char * buffer,
+        int * len,
+        int * K)
+{
+    const diyfp_t one = dtoa__diyfp(UINT64_C(1) << -Mp.e, Mp.e);
+    const uint64_t wp_w = Mp.f - W.f;
+    uint32_t p1 = (uint32_t) (Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = dtoa__count_digits(p1);
+
+    *len = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t div = (uint32_t) dtoa__pow10[kappa - 1];
+        uint32_t d = p1 / div;
+        uint64_t tmp;
+
+        p1 %= div;
+        if (d || *len)
+        {
+            buffer[(*len)++] = (char) ('0' + d);
+        }
+        kappa--;
+        tmp = ((uint64_t) p1 << -one.e) + p2;
+        if (tmp <= delta)
+        {
+            *K += kappa;
+            dtoa__round(
+                    buffer, *len, delta, tmp,
+                    dtoa__pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        char d;
+        p2 *= 10;
+        delta *= 10;
+        d = (char) (p2 >> -one.e);
+        if (d || *len)
+        {
+            buffer[(*len)++] = (char) ('0' + d);
+        }
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *K += kappa;
+            dtoa__round(
+                    buffer, *len, delta, p2, one.f,
+                    wp_w * (-kappa < 20 ? dtoa__pow10[-kappa] : 0));
+            return;
+        }
+    }
+}
+
+static inline void dtoa__grisu2(double value, char * buffer, int * len, int * K)
+{
+    diyfp_t v, w_m, w_p, c_mk, W, Wp, Wm;
+    uint64_t u;
+    int biased_e;
+
+    memcpy(&u, &value, sizeof(double));
+    biased_e = (int) ((u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    v = (biased_e)
+            ? dtoa__diyfp(
+                    (u & DP_SIGNIFICAND_MASK) + DP_HIDDEN_BIT,
+                    biased_e - DP_EXPONENT_BIAS)
+            : dtoa__diyfp(u & DP_SIGNIFICAND_MASK, DP_MIN_EXPONENT + 1);
+
+    dtoa__boundaries(v, &w_m, &w_p);
+
+    c_mk = dtoa__cached_power(w_p.e, K);
+    W = dtoa__mul(dtoa__normalize(v), c_mk);
+    Wp = dtoa__mul(w_p, c_mk);
+    Wm = dtoa__mul(w_m, c_mk);
+    Wm.f++;
+    Wp.f--;
+    dtoa__digit_gen(W, Wp, Wp.f - Wm.f, buffer, len, K);
+}
+
+static inline char * dtoa__exponent(int K, char * buffer)
+{
+    if (K < 0)
+    {
+        *buffer++ = '-';
+        K = -K;
+    }
+    if (K >= 100)
+    {
+        *buffer++ = (char) ('0' + K / 100);
+        K %= 100;
+        *buffer++ = (char) ('0' + K / 10);
+        *buffer++ = (char) ('0' + K % 10);
+    }
+    else if (K >= 10)
+    {
+        *buffer++ = (char) ('0' + K / 10);
+        *buffer++ = (char) ('0' + K % 10);
+    }
+    else
+    {
+        *buffer++ = (char) ('0' + K);
+    }
+    return buffer;
+}
+
+static inline char * dtoa__prettify(char * buffer, int length, int k)
+{
+    const int kk = length + k;  /* 10^(kk-1) <= v < 10^kk */
+    int i;
+
+    if (0 <= k && kk <= 21)
+    {
+        /* 1234e7 -> 12340000000.0 */
+        for (i = length; i < kk; i++)
+        {
+            buffer[i] = '0';
+        }
+        buffer[kk] = '.';
+        buffer[kk + 1] = '0';
+        return &buffer[kk + 2];
+    }
+
+    if (0 < kk && kk <= 21)
+    {
+        /* 1234e-2 -> 12.34 */
+        memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+        buffer[kk] = '.';
+        return &buffer[length + 1];
+    }
+
+    if (-6 < kk && kk <= 0)
+    {
+        /* 1234e-6 -> 0.001234 */
+        const int offset = 2 - kk;
+        memmove(&buffer[offset], &buffer[0], length);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        for (i = 2; i < offset; i++)
+        {
+            buffer[i] = '0';
+        }
+        return &buffer[length + offset];
+    }
+
+    if (length == 1)
+    {
+        /* 1e30 */
+        buffer[1] = 'e';
+        return dtoa__exponent(kk - 1, &buffer[2]);
+    }
+
+    /* 1234e30 -> 1.234e33 */
+    memmove(&buffer[2], &buffer[1], length - 1);
+    buffer[1] = '.';
+    buffer[length + 1] = 'e';
+    return dtoa__exponent(kk - 1, &buffer[length + 2]);
+}
+
+/*
+ * Write the shortest string which reads back as 'value' to 'buffer'. The
+ * buffer must have room for at least QP_DTOA_BUFSZ characters. The result is
+ * not terminated. Integral values keep a trailing ".0" so they still read
+ * back as a floating point value.
+ *
+ * NaN and infinity are not handled and must be checked by the caller.
+ *
+ * Returns the number of characters written.
+ */
+size_t qp_dtoa(double value, char * buffer)
+{
+    char * pt = buffer;
+    int len, K;
+
+    if (value == 0.0)
+    {
+        if (signbit(value))
+        {
+            *pt++ = '-';
+        }
+        memcpy(pt, "0.0", 3);
+        return (pt - buffer) + 3;
+    }
+
+    if (value < 0.0)
+    {
+        *pt++ = '-';
+        value = -value;
+    }
+
+    dtoa__grisu2(value, pt, &len, &K);
+    return dtoa__prettify(pt, len, K) - buffer;
+}
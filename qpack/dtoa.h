@@ -0,0 +1,15 @@
+/*
+ * dtoa.h - Shortest round-trip double to string conversion.
+ */
+#ifndef QP_DTOA_H_
+#define QP_DTOA_H_
+
+#include <stddef.h>
+#include <math.h>
+
+/* enough room for "-1.2345678901234567e-308" */
+#define QP_DTOA_BUFSZ 32
+
+size_t qp_dtoa(double value, char * buffer);
+
+#endif  /* QP_DTOA_H_ */
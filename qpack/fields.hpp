@@ -0,0 +1,449 @@
+/*
+ * fields.hpp - Compile-time struct serialization for qpack.
+ *
+ * After a struct is described with QPACK_FIELDS() (at namespace scope, in
+ * the namespace of the struct), it can be encoded and decoded with static
+ * dispatch on the member types:
+ *
+ *      struct point { double x, y; std::string label; };
+ *      QPACK_FIELDS(point, x, y, label)
+ *
+ *      qpack::encode(packer, p);               writes {"x": .., "y": .., ..}
+ *      point p = qpack::decode<point>(data, len);
+ *
+ * Structs and std::array with up to 5 elements get a QP_MAPn / QP_ARRAYn
+ * header with a constant size. Keys are written from the field names with
+ * constant sizes. When decoding, keys are found with a perfect hash which
+ * is generated at compile time; unknown keys are skipped and missing keys
+ * leave the member unchanged.
+ *
+ * Supported member types are bool, integer and floating point types,
+ * std::string, std::string_view (decoded as a view into the data),
+ * std::optional, std::vector, std::array and structs with QPACK_FIELDS().
+ */
+#ifndef QPACK_FIELDS_HPP_
+#define QPACK_FIELDS_HPP_
+
+#include <qpack/qpack.hpp>
+#include <array>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace qpack
+{
+namespace detail
+{
+
+template <typename T, typename M>
+struct field
+{
+    std::string_view name;
+    M T::* ptr;
+};
+
+template <typename T, typename M>
+constexpr field<T, M> make_field(std::string_view name, M T::* ptr)
+{
+    return {name, ptr};
+}
+
+template <typename T, typename = void>
+struct has_fields : std::false_type {};
+
+template <typename T>
+struct has_fields<T, std::void_t<
+        decltype(qpack_fields(static_cast<const T *>(nullptr)))>> :
+    std::true_type {};
+
+template <typename T> struct is_vector : std::false_type {};
+template <typename T, typename A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+template <typename T> struct is_array : std::false_type {};
+template <typename T, size_t N>
+struct is_array<std::array<T, N>> : std::true_type {};
+
+template <typename T> struct is_optional : std::false_type {};
+template <typename T>
+struct is_optional<std::optional<T>> : std::true_type {};
+
+[[noreturn]] inline void alloc_error()
+{
+    throw error("qpack: memory allocation error");
+}
+
+inline void check(int rc)
+{
+    if (rc)
+        alloc_error();
+}
+
+constexpr uint32_t hash(std::string_view s, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (char c : s)
+    {
+        h ^= uint8_t(c);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+template <size_t N>
+constexpr bool unique(const std::array<std::string_view, N> & names)
+{
+    for (size_t i = 0; i < N; i++)
+        for (size_t j = i + 1; j < N; j++)
+            if (names[i] == names[j])
+                return false;
+    return true;
+}
+
+/* First seed for which all names hash to a different slot */
+template <size_t N>
+constexpr uint32_t find_seed(
+        const std::array<std::string_view, N> & names,
+        uint32_t mask)
+{
+    for (uint32_t seed = 0; seed < 100000; seed++)
+    {
+        bool used[64] = {};
+        bool ok = true;
+        for (size_t i = 0; i < N && ok; i++)
+        {
+            uint32_t slot = hash(names[i], seed) & mask;
+            ok = !used[slot];
+            used[slot] = true;
+        }
+        if (ok)
+            return seed;
+    }
+    return ~0u;
+}
+
+/* Field descriptions and key lookup table for a struct */
+template <typename T>
+struct table
+{
+    static constexpr auto fields =
+            qpack_fields(static_cast<const T *>(nullptr));
+    static constexpr size_t size = std::tuple_size_v<decltype(fields)>;
+
+    static_assert(size <= 32, "qpack: too many fields");
+
+    template <size_t... I>
+    static constexpr std::array<std::string_view, size> names_of(
+            std::index_sequence<I...>)
+    {
+        return {{std::get<I>(fields).name...}};
+    }
+
+    static constexpr std::array<std::string_view, size> names =
+            names_of(std::make_index_sequence<size>{});
+
+    static_assert(unique(names), "qpack: duplicate field names");
+
+    /* at least twice the number of fields, a power of 2 */
+    static constexpr uint32_t mask = size <= 2 ? 3 : size <= 4 ? 7 :
+            size <= 8 ? 15 : size <= 16 ? 31 : 63;
+    static constexpr uint32_t seed = find_seed(names, mask);
+
+    static_assert(seed != ~0u, "qpack: no perfect hash for field names");
+
+    static constexpr std::array<int8_t, mask + 1> make_slots()
+    {
+        std::array<int8_t, mask + 1> slots = {};
+        for (auto & s : slots)
+            s = -1;
+        for (size_t i = 0; i < size; i++)
+            slots[hash(names[i], seed) & mask] = int8_t(i);
+        return slots;
+    }
+
+    static constexpr std::array<int8_t, mask + 1> slots = make_slots();
+};
+
+template <typename V>
+inline void put(qp_packer_t * pk, const V & v);
+
+template <typename T, size_t I>
+inline void put_field(qp_packer_t * pk, const T & obj)
+{
+    constexpr auto f = std::get<I>(table<T>::fields);
+    static_assert(f.name.size() < 100, "qpack: field name too long");
+
+    /* fixed raw header and name of constant size */
+    check(qp_packer_reserve(pk, f.name.size() + 1));
+    pk->buffer[pk->len++] = uint8_t(128 + f.name.size());
+    std::memcpy(pk->buffer + pk->len, f.name.data(), f.name.size());
+    pk->len += f.name.size();
+
+    put(pk, obj.*(f.ptr));
+}
+
+template <typename T, size_t... I>
+inline void put_struct(
+        qp_packer_t * pk,
+        const T & obj,
+        std::index_sequence<I...>)
+{
+    constexpr size_t n = sizeof...(I);
+    size_t pos = 0;
+
+    if constexpr (n <= 5)
+        check(qp_add_type(pk, qp_types_t(QP_MAP0 + n)));
+    else
+        check(qp_add_open(pk, QP_MAP_OPEN, &pos));
+
+    (put_field<T, I>(pk, obj), ...);
+
+    if constexpr (n > 5)
+        check(qp_add_close(pk, pos, n));
+}
+
+template <typename V>
+inline void put(qp_packer_t * pk, const V & v)
+{
+    if constexpr (std::is_same_v<V, bool>)
+    {
+        check(v ? qp_add_true(pk) : qp_add_false(pk));
+    }
+    else if constexpr (std::is_integral_v<V>)
+    {
+        if constexpr (std::is_unsigned_v<V> && sizeof(V) >= sizeof(int64_t))
+        {
+            if (v > uint64_t(std::numeric_limits<int64_t>::max()))
+                throw error("qpack: integer out of range");
+        }
+        check(qp_add_int64(pk, int64_t(v)));
+    }
+    else if constexpr (std::is_floating_point_v<V>)
+    {
+        check(qp_add_double(pk, double(v)));
+    }
+    else if constexpr (std::is_convertible_v<const V &, std::string_view>)
+    {
+        std::string_view s = v;
+        check(qp_add_raw(
+                pk,
+                reinterpret_cast<const unsigned char *>(s.data()),
+                s.size()));
+    }
+    else if constexpr (is_optional<V>::value)
+    {
+        if (v)
+            put(pk, *v);
+        else
+            check(qp_add_null(pk));
+    }
+    else if constexpr (is_array<V>::value)
+    {
+        constexpr size_t n = std::tuple_size_v<V>;
+        size_t pos = 0;
+        if constexpr (n <= 5)
+            check(qp_add_type(pk, qp_types_t(QP_ARRAY0 + n)));
+        else
+            check(qp_add_open(pk, QP_ARRAY_OPEN, &pos));
+        for (auto & e : v)
+            put(pk, e);
+        if constexpr (n > 5)
+            check(qp_add_close(pk, pos, n));
+    }
+    else if constexpr (is_vector<V>::value)
+    {
+        size_t pos;
+        check(qp_add_open(pk, QP_ARRAY_OPEN, &pos));
+        /* const auto &, as std::vector<bool> iterates over proxies */
+        for (const auto & e : v)
+            put(pk, e);
+        check(qp_add_close(pk, pos, v.size()));
+    }
+    else if constexpr (has_fields<V>::value)
+    {
+        put_struct(pk, v, std::make_index_sequence<table<V>::size>{});
+    }
+    else
+    {
+        static_assert(std::is_same_v<V, void>,
+                      "qpack: no encoding for this type, use QPACK_FIELDS()");
+    }
+}
+
+template <typename V>
+inline void get(const value & v, V & out);
+
+template <typename T, size_t... I>
+inline void get_field(
+        int idx,
+        const value & v,
+        T & obj,
+        std::index_sequence<I...>)
+{
+    (void) ((idx == int(I) &&
+             (get(v, obj.*(std::get<I>(table<T>::fields).ptr)), true)) ||
+            ...);
+}
+
+template <typename T>
+inline void get_struct(const value & v, T & obj)
+{
+    using tb = table<T>;
+
+    for (member & m : v.map())
+    {
+        if (!m.key.is_raw())
+            continue;
+
+        std::string_view name = m.key.as<std::string_view>();
+        int idx = tb::slots[hash(name, tb::seed) & tb::mask];
+        if (idx >= 0 && tb::names[idx] == name)
+            get_field(idx, m.val, obj, std::make_index_sequence<tb::size>{});
+    }
+}
+
+template <typename V>
+inline void get(const value & v, V & out)
+{
+    if constexpr (std::is_same_v<V, std::string>)
+    {
+        out.assign(v.as<std::string_view>());
+    }
+    else if constexpr (std::is_arithmetic_v<V> ||
+                       std::is_same_v<V, std::string_view>)
+    {
+        out = v.as<V>();
+    }
+    else if constexpr (is_optional<V>::value)
+    {
+        if (v.is_null())
+            out.reset();
+        else
+            get(v, out.emplace());
+    }
+    else if constexpr (is_array<V>::value)
+    {
+        size_t i = 0;
+        for (auto & e : v.array())
+        {
+            if (i == out.size())
+                throw error("qpack: array size mismatch");
+            get(e, out[i++]);
+        }
+        if (i != out.size())
+            throw error("qpack: array size mismatch");
+    }
+    else if constexpr (is_vector<V>::value)
+    {
+        out.clear();
+        if (v.fixed_size() > 0)
+            out.reserve(v.fixed_size());
+        for (auto & e : v.array())
+        {
+            /* decode into a value first, std::vector<bool> has no bool & */
+            typename V::value_type item{};
+            get(e, item);
+            out.push_back(std::move(item));
+        }
+    }
+    else if constexpr (has_fields<V>::value)
+    {
+        get_struct(v, out);
+    }
+    else
+    {
+        static_assert(std::is_same_v<V, void>,
+                      "qpack: no decoding for this type, use QPACK_FIELDS()");
+    }
+}
+
+}  /* namespace detail */
+
+/* Append a value to a packer */
+template <typename T>
+inline void encode(qp_packer_t * pk, const T & v)
+{
+    detail::put(pk, v);
+}
+
+/* Decode a value into out */
+template <typename T>
+inline void decode(const value & v, T & out)
+{
+    detail::get(v, out);
+}
+
+/* Decode the first value in the data */
+template <typename T>
+inline T decode(const void * data, size_t len)
+{
+    reader r(data, len);
+    T out{};
+    detail::get(r.next(), out);
+    return out;
+}
+
+}  /* namespace qpack */
+
+/*
+ * Describe the fields of struct T which are serialized, in order. Use at
+ * namespace scope in the namespace of T.
+ */
+#define QPACK_FIELDS(T, ...)                                                \
+    constexpr auto qpack_fields(const T *)                                  \
+    {                                                                       \
+        return std::make_tuple(QPACK__EACH(QPACK__FIELD, T, __VA_ARGS__));  \
+    }
+
+#define QPACK__FIELD(T, f) ::qpack::detail::make_field(#f, &T::f)
+
+#define QPACK__NARGS(...) QPACK__NARGS_(__VA_ARGS__,                      \
+        32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,     \
+        16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1)
+#define QPACK__NARGS_(                                                      \
+        _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15,   \
+        _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28,    \
+        _29, _30, _31, _32, N, ...) N
+
+#define QPACK__CAT(a, b) QPACK__CAT_(a, b)
+#define QPACK__CAT_(a, b) a##b
+
+#define QPACK__EACH(M, T, ...)                                              \
+    QPACK__CAT(QPACK__EACH_, QPACK__NARGS(__VA_ARGS__))(M, T, __VA_ARGS__)
+
+#define QPACK__EACH_1(M, T, a) M(T, a)
+#define QPACK__EACH_2(M, T, a, ...) M(T, a), QPACK__EACH_1(M, T, __VA_ARGS__)
+#define QPACK__EACH_3(M, T, a, ...) M(T, a), QPACK__EACH_2(M, T, __VA_ARGS__)
+#define QPACK__EACH_4(M, T, a, ...) M(T, a), QPACK__EACH_3(M, T, __VA_ARGS__)
+#define QPACK__EACH_5(M, T, a, ...) M(T, a), QPACK__EACH_4(M, T, __VA_ARGS__)
+#define QPACK__EACH_6(M, T, a, ...) M(T, a), QPACK__EACH_5(M, T, __VA_ARGS__)
+#define QPACK__EACH_7(M, T, a, ...) M(T, a), QPACK__EACH_6(M, T, __VA_ARGS__)
+#define QPACK__EACH_8(M, T, a, ...) M(T, a), QPACK__EACH_7(M, T, __VA_ARGS__)
+#define QPACK__EACH_9(M, T, a, ...) M(T, a), QPACK__EACH_8(M, T, __VA_ARGS__)
+#define QPACK__EACH_10(M, T, a, ...) M(T, a), QPACK__EACH_9(M, T, __VA_ARGS__)
+#define QPACK__EACH_11(M, T, a, ...) M(T, a), QPACK__EACH_10(M, T, __VA_ARGS__)
+#define QPACK__EACH_12(M, T, a, ...) M(T, a), QPACK__EACH_11(M, T, __VA_ARGS__)
+#define QPACK__EACH_13(M, T, a, ...) M(T, a), QPACK__EACH_12(M, T, __VA_ARGS__)
+#define QPACK__EACH_14(M, T, a, ...) M(T, a), QPACK__EACH_13(M, T, __VA_ARGS__)
+#define QPACK__EACH_15(M, T, a, ...) M(T, a), QPACK__EACH_14(M, T, __VA_ARGS__)
+#define QPACK__EACH_16(M, T, a, ...) M(T, a), QPACK__EACH_15(M, T, __VA_ARGS__)
+#define QPACK__EACH_17(M, T, a, ...) M(T, a), QPACK__EACH_16(M, T, __VA_ARGS__)
+#define QPACK__EACH_18(M, T, a, ...) M(T, a), QPACK__EACH_17(M, T, __VA_ARGS__)
+#define QPACK__EACH_19(M, T, a, ...) M(T, a), QPACK__EACH_18(M, T, __VA_ARGS__)
+#define QPACK__EACH_20(M, T, a, ...) M(T, a), QPACK__EACH_19(M, T, __VA_ARGS__)
+#define QPACK__EACH_21(M, T, a, ...) M(T, a), QPACK__EACH_20(M, T, __VA_ARGS__)
+#define QPACK__EACH_22(M, T, a, ...) M(T, a), QPACK__EACH_21(M, T, __VA_ARGS__)
+#define QPACK__EACH_23(M, T, a, ...) M(T, a), QPACK__EACH_22(M, T, __VA_ARGS__)
+#define QPACK__EACH_24(M, T, a, ...) M(T, a), QPACK__EACH_23(M, T, __VA_ARGS__)
+#define QPACK__EACH_25(M, T, a, ...) M(T, a), QPACK__EACH_24(M, T, __VA_ARGS__)
+#define QPACK__EACH_26(M, T, a, ...) M(T, a), QPACK__EACH_25(M, T, __VA_ARGS__)
+#define QPACK__EACH_27(M, T, a, ...) M(T, a), QPACK__EACH_26(M, T, __VA_ARGS__)
+#define QPACK__EACH_28(M, T, a, ...) M(T, a), QPACK__EACH_27(M, T, __VA_ARGS__)
+#define QPACK__EACH_29(M, T, a, ...) M(T, a), QPACK__EACH_28(M, T, __VA_ARGS__)
+#define QPACK__EACH_30(M, T, a, ...) M(T, a), QPACK__EACH_29(M, T, __VA_ARGS__)
+#define QPACK__EACH_31(M, T, a, ...) M(T, a), QPACK__EACH_30(M, T, __VA_ARGS__)
+#define QPACK__EACH_32(M, T, a, ...) M(T, a), QPACK__EACH_31(M, T, __VA_ARGS__)
+
+#endif  /* QPACK_FIELDS_HPP_ */
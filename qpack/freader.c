@@ -0,0 +1,319 @@
+/*
+ * freader.c - Read qpack values from a file with a fixed size window.
+ *
+ * The file is read with large read() calls into a window. When a value
+ * crosses the end of the window, the unread bytes are moved to the front and
+ * the window is refilled. Only a value larger than the window makes the
+ * buffer grow, and the buffer shrinks back once that value is consumed, so
+ * the memory used does not depend on the size of the file.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <qpack/freader.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Move the unpacker past one value. Returns 1 if the value is complete, 0 if
+ * it continues after the end of the data or QP_FREADER_ERR_DEPTH.
+ */
+static int freader__skip(qp_unpacker_t * unpacker, int depth)
+{
+    qp_types_t tp;
+    int count, rc;
+
+    if (depth > QP_FREADER_MAX_DEPTH)
+    {
+        return QP_FREADER_ERR_DEPTH;
+    }
+
+    tp = qp_next(unpacker, NULL);
+    switch (tp)
+    {
+    case QP_END:
+    case QP_ERR:
+        return 0;
+    case QP_ARRAY0:
+    case QP_ARRAY1:
+    case QP_ARRAY2:
+    case QP_ARRAY3:
+    case QP_ARRAY4:
+    case QP_ARRAY5:
+        count = tp - QP_ARRAY0;
+        break;
+    case QP_MAP0:
+    case QP_MAP1:
+    case QP_MAP2:
+    case QP_MAP3:
+    case QP_MAP4:
+    case QP_MAP5:
+        count = (tp - QP_MAP0) * 2;
+        break;
+    case QP_ARRAY_OPEN:
+    case QP_MAP_OPEN:
+    {
+        uint8_t close = tp == QP_ARRAY_OPEN ? QP_ARRAY_CLOSE : QP_MAP_CLOSE;
+        for (;;)
+        {
+            if (unpacker->pt >= unpacker->end)
+            {
+                return 0;
+            }
+            if (*unpacker->pt == close)
+            {
+                unpacker->pt++;
+                return 1;
+            }
+            rc = freader__skip(unpacker, depth + 1);
+            if (rc != 1)
+            {
+                return rc;
+            }
+        }
+    }
+    default:
+        return 1;
+    }
+
+    while (count--)
+    {
+        rc = freader__skip(unpacker, depth + 1);
+        if (rc != 1)
+        {
+            return rc;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Read from the file until the buffer is full or the end of the file is
+ * reached. Before reading, unread bytes are moved to the front of the buffer
+ * and a buffer which was grown for a large value is reduced to the window
+ * size when possible. If no space is left, the buffer size is doubled.
+ *
+ * Returns 0 if successful or a negative QP_FREADER_ERR_* value.
+ */
+static int freader__fill(qp_freader_t * reader)
+{
+    size_t n = reader->end - reader->start;
+    ssize_t rc;
+
+    if (reader->start)
+    {
+        memmove(reader->buffer, reader->buffer + reader->start, n);
+        reader->start = 0;
+        reader->end = n;
+    }
+
+    if (reader->size > reader->window && n < reader->window)
+    {
+        unsigned char * tmp = realloc(reader->buffer, reader->window);
+        if (tmp != NULL)
+        {
+            reader->buffer = tmp;
+            reader->size = reader->window;
+        }
+    }
+    else if (n == reader->size)
+    {
+        unsigned char * tmp = realloc(reader->buffer, reader->size * 2);
+        if (tmp == NULL)
+        {
+            return QP_FREADER_ERR_ALLOC;
+        }
+        reader->buffer = tmp;
+        reader->size *= 2;
+    }
+
+    while (reader->end < reader->size)
+    {
+        rc = read(
+                reader->fd,
+                reader->buffer + reader->end,
+                reader->size - reader->end);
+        if (rc == 0)
+        {
+            reader->eof = 1;
+            break;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return QP_FREADER_ERR_READ;
+        }
+        reader->end += rc;
+    }
+    return 0;
+}
+
+/*
+ * Returns a reader for file 'fn' or NULL in case of an error, in which case
+ * errno is set. A 'window' of 0 uses QP_FREADER_WINDOW.
+ */
+qp_freader_t * qp_freader_new(const char * fn, size_t window)
+{
+    qp_freader_t * reader = malloc(sizeof(qp_freader_t));
+    if (reader == NULL)
+    {
+        return NULL;
+    }
+
+    reader->window = reader->size = window ? window : QP_FREADER_WINDOW;
+    reader->buffer = malloc(reader->size);
+    if (reader->buffer == NULL)
+    {
+        free(reader);
+        return NULL;
+    }
+
+    reader->fd = open(fn, O_RDONLY);
+    if (reader->fd < 0)
+    {
+        free(reader->buffer);
+        free(reader);
+        return NULL;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* the file is read once from start to end, allow a large readahead */
+    (void) posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    reader->eof = 0;
+    reader->in_array = 0;
+    reader->start = 0;
+    reader->end = 0;
+    return reader;
+}
+
+/*
+ * Destroy a reader and close the file. (parsing NULL is not allowed)
+ */
+void qp_freader_free(qp_freader_t * reader)
+{
+    close(reader->fd);
+    free(reader->buffer);
+    free(reader);
+}
+
+/*
+ * Set 'unpacker' to the next complete value. The unpacker points into the
+ * reader buffer and stays valid until the next call to the reader.
+ *
+ * After qp_freader_enter() the values are the elements of the open array and
+ * QP_FREADER_END is returned at its close or at the end of the file. A value
+ * which is incomplete at the end of the file is returned as is; the unpacker
+ * will then report QP_END (implicit close) or QP_ERR (truncated data).
+ *
+ * Returns QP_FREADER_OK, QP_FREADER_END or a negative QP_FREADER_ERR_* value.
+ */
+int qp_freader_next(qp_freader_t * reader, qp_unpacker_t * unpacker)
+{
+    unsigned char * pt;
+    int rc;
+
+    for (;;)
+    {
+        pt = reader->buffer + reader->start;
+        qp_unpacker_init(unpacker, pt, reader->end - reader->start);
+
+        if (reader->start == reader->end)
+        {
+            if (reader->eof)
+            {
+                reader->in_array = 0;
+                return QP_FREADER_END;
+            }
+        }
+        else if (reader->in_array && *pt == QP_ARRAY_CLOSE)
+        {
+            reader->start++;
+            reader->in_array = 0;
+            return QP_FREADER_END;
+        }
+        else
+        {
+            rc = freader__skip(unpacker, 0);
+            if (rc < 0)
+            {
+                return rc;
+            }
+            if (rc || reader->eof)
+            {
+                if (!rc)
+                {
+                    unpacker->pt = reader->buffer + reader->end;
+                }
+                unpacker->end = unpacker->pt;
+                unpacker->pt = pt;
+                reader->start = unpacker->end - reader->buffer;
+                return QP_FREADER_OK;
+            }
+        }
+
+        rc = freader__fill(reader);
+        if (rc)
+        {
+            return rc;
+        }
+    }
+}
+
+/*
+ * Enter the open array at the current position so qp_freader_next() returns
+ * its elements one by one.
+ *
+ * Returns 0 if successful or a negative QP_FREADER_ERR_* value.
+ */
+int qp_freader_enter(qp_freader_t * reader)
+{
+    int rc;
+
+    while (reader->start == reader->end && !reader->eof)
+    {
+        rc = freader__fill(reader);
+        if (rc)
+        {
+            return rc;
+        }
+    }
+
+    if (reader->in_array ||
+        reader->start == reader->end ||
+        reader->buffer[reader->start] != QP_ARRAY_OPEN)
+    {
+        return QP_FREADER_ERR_ARRAY;
+    }
+
+    reader->start++;
+    reader->in_array = 1;
+    return 0;
+}
+
+const char * qp_freader_strerror(int err)
+{
+    switch ((qp_freader_err_t) err)
+    {
+    case QP_FREADER_OK:
+        return "no error";
+    case QP_FREADER_END:
+        return "end of data";
+    case QP_FREADER_ERR_ALLOC:
+        return "memory allocation error";
+    case QP_FREADER_ERR_READ:
+        return "error reading from file";
+    case QP_FREADER_ERR_DEPTH:
+        return "excessive nesting";
+    case QP_FREADER_ERR_ARRAY:
+        return "no open array at this position";
+    }
+    return "unknown error";
+}
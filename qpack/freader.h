@@ -0,0 +1,40 @@
+/*
+ * freader.h - Read qpack values from a file with a fixed size window.
+ */
+#ifndef QP_FREADER_H_
+#define QP_FREADER_H_
+
+#include <qpack/qpack.h>
+
+#define QP_FREADER_WINDOW 1048576   /* default window size (1 MiB)        */
+#define QP_FREADER_MAX_DEPTH 1000   /* nesting limit when checking values */
+
+typedef enum
+{
+    QP_FREADER_OK,                  /* a value is available             */
+    QP_FREADER_END          =1,     /* end of file or of the open array */
+    QP_FREADER_ERR_ALLOC    =-1,    /* memory allocation error          */
+    QP_FREADER_ERR_READ     =-2,    /* error reading from the file      */
+    QP_FREADER_ERR_DEPTH    =-3,    /* maximum nesting depth reached    */
+    QP_FREADER_ERR_ARRAY    =-4,    /* no open array at this position   */
+} qp_freader_err_t;
+
+typedef struct qp_freader_s
+{
+    int fd;
+    int eof;
+    int in_array;           /* iterating over a top level open array    */
+    size_t window;          /* initial (and normal) buffer size         */
+    size_t size;            /* current buffer size                      */
+    size_t start;           /* first unread byte in buffer              */
+    size_t end;             /* end of the data in buffer                */
+    unsigned char * buffer;
+} qp_freader_t;
+
+qp_freader_t * qp_freader_new(const char * fn, size_t window);
+void qp_freader_free(qp_freader_t * reader);
+int qp_freader_next(qp_freader_t * reader, qp_unpacker_t * unpacker);
+int qp_freader_enter(qp_freader_t * reader);
+const char * qp_freader_strerror(int err);
+
+#endif  /* QP_FREADER_H_ */
@@ -0,0 +1,1369 @@
+/*
+ * json.c - Convert between qpack data and JSON without intermediate objects.
+ */
+#include <qpack/json.h>
+#include <qpack/dtoa.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define JSON_RESERVE(N__)                                               \
+if (buffer->len + (N__) > buffer->buffer_size &&                        \
+    qp_packer_reserve(buffer, (N__)))                                   \
+{                                                                       \
+    return QP_JSON_ERR_ALLOC;                                           \
+}
+
+#define JSON_WRITE(S__, N__)                                            \
+{                                                                       \
+    JSON_RESERVE(N__)                                                   \
+    memcpy(buffer->buffer + buffer->len, (S__), (N__));                 \
+    buffer->len += (N__);                                               \
+}
+
+#define JSON_PUTC(C__)                                                  \
+{                                                                       \
+    JSON_RESERVE(1)                                                     \
+    buffer->buffer[buffer->len++] = (C__);                              \
+}
+
+/* escape sequences, NULL when the character can be copied as is */
+static const char * json__esc[256] = {
+    "\\u0000", "\\u0001", "\\u0002", "\\u0003", "\\u0004", "\\u0005",
+    "\\u0006", "\\u0007", "\\b", "\\t", "\\n", "\\u000b", "\\f", "\\r",
+    "\\u000e", "\\u000f", "\\u0010", "\\u0011", "\\u0012", "\\u0013",
+    "\\u0014", "\\u0015", "\\u0016", "\\u0017", "\\u0018", "\\u0019",
+    "\\u001a", "\\u001b", "\\u001c", "\\u001d", "\\u001e", "\\u001f", NULL,
+    NULL, "\\\"", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, "\\/", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, "\\\\",
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, "\\u007f",
+    /* 128..255 are copied as is */
+};
+
+static const char json__digits[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Output of the containers within a QP_HOOK_SHARED, by number */
+typedef struct
+{
+    size_t n;
+    size_t size;
+    size_t * spans;     /* start and end of each, the end is 0 while open  */
+} json__shared_t;
+
+typedef struct
+{
+    qp_unpacker_t * unpacker;
+    qp_packer_t * buffer;
+    int flags;
+    int depth;
+    json__shared_t * shared;
+} json__t;
+
+static int json__value(json__t * json, qp_obj_t * qp_obj);
+
+/*
+ * Write an integer. (at most 20 characters are written)
+ */
+static inline size_t json__itoa(int64_t integer, char * pt)
+{
+    char tmp[20];
+    char * end = tmp + sizeof(tmp);
+    char * p = end;
+    uint64_t u = (integer < 0)
+            ? ~((uint64_t) integer) + 1
+            : (uint64_t) integer;
+    size_t n;
+
+    while (u >= 100)
+    {
+        unsigned int i = (unsigned int) (u % 100) * 2;
+        u /= 100;
+        *--p = json__digits[i + 1];
+        *--p = json__digits[i];
+    }
+    if (u < 10)
+    {
+        *--p = (char) ('0' + u);
+    }
+    else
+    {
+        unsigned int i = (unsigned int) u * 2;
+        *--p = json__digits[i + 1];
+        *--p = json__digits[i];
+    }
+    if (integer < 0)
+    {
+        *--p = '-';
+    }
+    n = end - p;
+    memcpy(pt, p, n);
+    return n;
+}
+
+static int json__int(json__t * json, int64_t integer, int quote)
+{
+    qp_packer_t * buffer = json->buffer;
+    char * pt;
+
+    JSON_RESERVE(22)
+    pt = (char *) buffer->buffer + buffer->len;
+    if (quote)
+    {
+        *pt++ = '"';
+    }
+    pt += json__itoa(integer, pt);
+    if (quote)
+    {
+        *pt++ = '"';
+    }
+    buffer->len = (unsigned char *) pt - buffer->buffer;
+    return 0;
+}
+
+static int json__double(json__t * json, double real, int quote)
+{
+    qp_packer_t * buffer = json->buffer;
+    char * pt;
+
+    if (isnan(real) || isinf(real))
+    {
+        if (!(json->flags & QP_JSON_INVALID_NUMBERS))
+        {
+            return QP_JSON_ERR_NUMBER;
+        }
+        if (isnan(real))
+        {
+            JSON_WRITE(quote ? "\"NaN\"" : "NaN", quote ? 5 : 3)
+        }
+        else if (real > 0)
+        {
+            JSON_WRITE(
+                    quote ? "\"Infinity\"" : "Infinity",
+                    quote ? 10 : 8)
+        }
+        else
+        {
+            JSON_WRITE(
+                    quote ? "\"-Infinity\"" : "-Infinity",
+                    quote ? 11 : 9)
+        }
+        return 0;
+    }
+
+    JSON_RESERVE(QP_DTOA_BUFSZ + 2)
+    pt = (char *) buffer->buffer + buffer->len;
+    if (quote)
+    {
+        *pt++ = '"';
+    }
+    pt += qp_dtoa(real, pt);
+    if (quote)
+    {
+        *pt++ = '"';
+    }
+    buffer->len = (unsigned char *) pt - buffer->buffer;
+    return 0;
+}
+
+/*
+ * Write a quoted and escaped string. Bytes which do not require an escape
+ * sequence are copied in runs.
+ */
+static int json__string(json__t * json, const unsigned char * raw, size_t len)
+{
+    qp_packer_t * buffer = json->buffer;
+    int escape_slash = json->flags & QP_JSON_ESCAPE_SLASH;
+    size_t i, start = 0;
+
+    JSON_RESERVE(len + 2)
+    buffer->buffer[buffer->len++] = '"';
+
+    for (i = 0; i < len; i++)
+    {
+        const char * esc = json__esc[raw[i]];
+        size_t n;
+
+        if (esc == NULL || (raw[i] == '/' && !escape_slash))
+        {
+            continue;
+        }
+
+        n = strlen(esc);
+        JSON_RESERVE((i - start) + n + (len - i) + 1)
+        memcpy(buffer->buffer + buffer->len, raw + start, i - start);
+        buffer->len += i - start;
+        memcpy(buffer->buffer + buffer->len, esc, n);
+        buffer->len += n;
+        start = i + 1;
+    }
+
+    JSON_RESERVE((len - start) + 1)
+    memcpy(buffer->buffer + buffer->len, raw + start, len - start);
+    buffer->len += len - start;
+    buffer->buffer[buffer->len++] = '"';
+    return 0;
+}
+
+static int json__key(json__t * json, qp_obj_t * qp_obj)
+{
+    switch (qp_obj->tp)
+    {
+    case QP_RAW:
+        return json__string(json, qp_obj->via.raw, qp_obj->len);
+    case QP_INT64:
+        return json__int(json, qp_obj->via.int64, 1);
+    case QP_DOUBLE:
+        return json__double(json, qp_obj->via.real, 1);
+    case QP_END:
+    case QP_ERR:
+        return QP_JSON_ERR_DATA;
+    default:
+        return QP_JSON_ERR_KEY;
+    }
+}
+
+/*
+ * Write array items until 'count' items are written or, for an open array
+ * (count < 0), until the array is closed or the data ends.
+ */
+static int json__array(json__t * json, qp_obj_t * qp_obj, int count)
+{
+    qp_packer_t * buffer = json->buffer;
+    int rc, n;
+
+    JSON_PUTC('[')
+    for (n = 0; count < 0 || n < count; n++)
+    {
+        qp_types_t tp = qp_next(json->unpacker, qp_obj);
+        if (count < 0 && (tp == QP_ARRAY_CLOSE || tp == QP_END))
+        {
+            break;
+        }
+        if (n)
+        {
+            JSON_PUTC(',')
+        }
+        if ((rc = json__value(json, qp_obj)))
+        {
+            return rc;
+        }
+    }
+    JSON_PUTC(']')
+    return 0;
+}
+
+static int json__map(json__t * json, qp_obj_t * qp_obj, int count)
+{
+    qp_packer_t * buffer = json->buffer;
+    int rc, n;
+
+    JSON_PUTC('{')
+    for (n = 0; count < 0 || n < count; n++)
+    {
+        qp_types_t tp = qp_next(json->unpacker, qp_obj);
+        if (count < 0 && (tp == QP_MAP_CLOSE || tp == QP_END))
+        {
+            break;
+        }
+        if (n)
+        {
+            JSON_PUTC(',')
+        }
+        if ((rc = json__key(json, qp_obj)))
+        {
+            return rc;
+        }
+        JSON_PUTC(':')
+        qp_next(json->unpacker, qp_obj);
+        if ((rc = json__value(json, qp_obj)))
+        {
+            return rc;
+        }
+    }
+    JSON_PUTC('}')
+    return 0;
+}
+
+/*
+ * Write the values of an array with runs from json->unpacker; a repeat
+ * copies the text of the value before it.
+ */
+static int json__runs(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = json->buffer;
+    size_t start = 0, len = 0, count;
+    int rc, n = 0;
+
+    JSON_PUTC('[')
+    while (qp_next(json->unpacker, qp_obj) != QP_END)
+    {
+        if (qp_obj->tp == QP_HOOK && qp_obj->hook == QP_HOOK_REPEAT)
+        {
+            for (count = (size_t) qp_obj->via.int64; count; count--)
+            {
+                JSON_PUTC(',')
+                JSON_WRITE(buffer->buffer + start, len)
+            }
+            continue;
+        }
+        if (n++)
+        {
+            JSON_PUTC(',')
+        }
+        start = buffer->len;
+        if ((rc = json__value(json, qp_obj)))
+        {
+            return rc;
+        }
+        len = buffer->len - start;
+    }
+    JSON_PUTC(']')
+    return 0;
+}
+
+/* Write the values of a string dictionary, given its k strings */
+static int json__dict_values(
+        json__t * json,
+        qp_dict_t * dict,
+        const qp_obj_t * strings)
+{
+    qp_packer_t * buffer = json->buffer;
+    size_t i, index;
+    int rc;
+
+    JSON_PUTC('[')
+    for (i = 0; i < dict->n; i++)
+    {
+        index = qp_dict_next(dict);
+        if (index >= dict->k)
+        {
+            return QP_JSON_ERR_DATA;
+        }
+        if (i)
+        {
+            JSON_PUTC(',')
+        }
+        rc = json__string(json, strings[index].via.raw, strings[index].len);
+        if (rc)
+        {
+            return rc;
+        }
+    }
+    JSON_PUTC(']')
+    return 0;
+}
+
+/* Write a string dictionary as the array of its strings */
+static int json__dict(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_obj_t * strings;
+    qp_dict_t dict;
+    size_t i;
+    int rc;
+
+    if (qp_dict_init(&dict, qp_obj))
+    {
+        return QP_JSON_ERR_DATA;
+    }
+    strings = malloc((dict.k ? dict.k : 1) * sizeof(qp_obj_t));
+    if (strings == NULL)
+    {
+        return QP_JSON_ERR_ALLOC;
+    }
+    for (i = 0; i < dict.k; i++)
+    {
+        qp_next(&dict.strings, &strings[i]);
+    }
+    rc = json__dict_values(json, &dict, strings);
+    free(strings);
+    return rc;
+}
+
+/*
+ * Number a container which starts now, when within a QP_HOOK_SHARED. Call
+ * json__numbered() when it is written.
+ */
+static int json__number(json__t * json, size_t * number)
+{
+    json__shared_t * shared = json->shared;
+    size_t * spans;
+
+    if (shared == NULL)
+    {
+        return 0;
+    }
+    if (shared->n == shared->size)
+    {
+        shared->size = shared->size ? shared->size * 2 : 8;
+        spans = realloc(shared->spans, shared->size * 2 * sizeof(size_t));
+        if (spans == NULL)
+        {
+            return QP_JSON_ERR_ALLOC;
+        }
+        shared->spans = spans;
+    }
+    *number = shared->n++;
+    shared->spans[*number * 2] = json->buffer->len;
+    shared->spans[*number * 2 + 1] = 0;
+    return 0;
+}
+
+static inline void json__numbered(json__t * json, size_t number)
+{
+    if (json->shared != NULL)
+    {
+        json->shared->spans[number * 2 + 1] = json->buffer->len;
+    }
+}
+
+/*
+ * Write the value of a QP_HOOK_SHARED. Its containers are numbered as they
+ * open, so a back-reference can copy the text of the one it refers to.
+ */
+static int json__shared(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_unpacker_t * unpacker = json->unpacker;
+    json__shared_t * outer = json->shared;
+    json__shared_t shared = {0, 0, NULL};
+    qp_unpacker_t value;
+    int rc;
+
+    qp_unpacker_init(&value, qp_obj->via.raw, qp_obj->len);
+    json->unpacker = &value;
+    json->shared = &shared;
+    rc = qp_next(&value, qp_obj) == QP_END
+            ? QP_JSON_ERR_DATA
+            : json__value(json, qp_obj);
+    if (rc == 0 && qp_next(&value, NULL) != QP_END)
+    {
+        rc = QP_JSON_ERR_DATA;
+    }
+    json->unpacker = unpacker;
+    json->shared = outer;
+    free(shared.spans);
+    return rc;
+}
+
+/* Write a copy of the container a QP_HOOK_REF refers to */
+static int json__ref(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = json->buffer;
+    json__shared_t * shared = json->shared;
+    size_t number = (size_t) qp_obj->via.int64, start, end;
+
+    if (shared == NULL || number >= shared->n)
+    {
+        return QP_JSON_ERR_DATA;
+    }
+    start = shared->spans[number * 2];
+    end = shared->spans[number * 2 + 1];
+    if (end == 0)
+    {
+        return QP_JSON_ERR_CYCLE;
+    }
+    JSON_WRITE(buffer->buffer + start, end - start)
+    return 0;
+}
+
+/* Write a sized hook as the plain value it stands for */
+static int json__hook(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = json->buffer;
+    qp_unpacker_t * unpacker = json->unpacker;
+    qp_unpacker_t values;
+    qp_decimals_t decimals;
+    unsigned char * bits;
+    size_t n, i, number = 0;
+    int rc;
+
+    switch (qp_obj->hook)
+    {
+    case QP_HOOK_EXT:
+        return QP_JSON_ERR_EXT;
+    case QP_HOOK_SHARED:
+        return json__shared(json, qp_obj);
+    case QP_HOOK_REF:
+        return json__ref(json, qp_obj);
+    case QP_HOOK_DICT:
+        return json__dict(json, qp_obj);
+    case QP_HOOK_BOOLS:
+        if (qp_bools_get(qp_obj, &n, &bits))
+        {
+            return QP_JSON_ERR_DATA;
+        }
+        JSON_PUTC('[')
+        for (i = 0; i < n; i++)
+        {
+            if (i)
+            {
+                JSON_PUTC(',')
+            }
+            if (bits[i / 8] & (1 << (i % 8)))
+            {
+                JSON_WRITE("true", 4)
+            }
+            else
+            {
+                JSON_WRITE("false", 5)
+            }
+        }
+        JSON_PUTC(']')
+        return 0;
+    case QP_HOOK_RUNS:
+        if (qp_runs_get(qp_obj, &n, &values))
+        {
+            return QP_JSON_ERR_DATA;
+        }
+        if ((rc = json__number(json, &number)))
+        {
+            return rc;
+        }
+        json->unpacker = &values;
+        rc = json__runs(json, qp_obj);
+        json->unpacker = unpacker;
+        json__numbered(json, number);
+        return rc;
+    case QP_HOOK_DECIMAL_ARRAY:
+        if (qp_decimals_init(&decimals, qp_obj))
+        {
+            return QP_JSON_ERR_DATA;
+        }
+        JSON_PUTC('[')
+        for (n = 0; n < decimals.n; n++)
+        {
+            if (n)
+            {
+                JSON_PUTC(',')
+            }
+            rc = json__double(json, qp_decimals_next(&decimals), 0);
+            if (rc)
+            {
+                return rc;
+            }
+        }
+        JSON_PUTC(']')
+        return 0;
+    default:
+        return QP_JSON_ERR_DATA;
+    }
+}
+
+static int json__value(json__t * json, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = json->buffer;
+    size_t number = 0;
+    int rc;
+
+    switch (qp_obj->tp)
+    {
+    case QP_RAW:
+        return json__string(json, qp_obj->via.raw, qp_obj->len);
+    case QP_INT64:
+        return json__int(json, qp_obj->via.int64, 0);
+    case QP_DOUBLE:
+        return json__double(json, qp_obj->via.real, 0);
+    case QP_TRUE:
+        JSON_WRITE("true", 4)
+        return 0;
+    case QP_FALSE:
+        JSON_WRITE("false", 5)
+        return 0;
+    case QP_NULL:
+        JSON_WRITE("null", 4)
+        return 0;
+    case QP_ARRAY0:
+    case QP_ARRAY1:
+    case QP_ARRAY2:
+    case QP_ARRAY3:
+    case QP_ARRAY4:
+    case QP_ARRAY5:
+    case QP_ARRAY_OPEN:
+    case QP_MAP0:
+    case QP_MAP1:
+    case QP_MAP2:
+    case QP_MAP3:
+    case QP_MAP4:
+    case QP_MAP5:
+    case QP_MAP_OPEN:
+        if (!json->depth--)
+        {
+            return QP_JSON_ERR_DEPTH;
+        }
+        if ((rc = json__number(json, &number)))
+        {
+            return rc;
+        }
+        switch ((qp_types_t) qp_obj->tp)
+        {
+        case QP_ARRAY_OPEN:
+            rc = json__array(json, qp_obj, -1);
+            break;
+        case QP_MAP_OPEN:
+            rc = json__map(json, qp_obj, -1);
+            break;
+        default:
+            rc = qp_is_array(qp_obj->tp)
+                    ? json__array(json, qp_obj, qp_obj->tp - QP_ARRAY0)
+                    : json__map(json, qp_obj, qp_obj->tp - QP_MAP0);
+        }
+        json__numbered(json, number);
+        json->depth++;
+        return rc;
+    case QP_HOOK:
+        if (!json->depth--)
+        {
+            return QP_JSON_ERR_DEPTH;
+        }
+        rc = json__hook(json, qp_obj);
+        json->depth++;
+        return rc;
+    default:
+        return QP_JSON_ERR_DATA;
+    }
+}
+
+/*
+ * Write the next object from the unpacker as JSON to the end of 'buffer'.
+ * The buffer is only used as a growing byte buffer and will not contain valid
+ * qpack data. Nested arrays and maps are allowed up to 'max_depth' levels.
+ * A decimal array is written as an array of numbers, a bool array as an array
+ * of true and false, a string dictionary as the array of its strings and an
+ * array with runs with each run expanded. A back-reference in shared data is
+ * written as a copy of the container it refers to, so shared data is written
+ * as a tree; a reference to a container which contains it fails with
+ * QP_JSON_ERR_CYCLE. Extension values have no JSON form and fail with
+ * QP_JSON_ERR_EXT.
+ *
+ * Returns 0 if successful or a negative qp_json_err_t value in case of an
+ * error. (the content of the buffer is undefined in case of an error)
+ */
+int qp_to_json(
+        qp_unpacker_t * unpacker,
+        qp_packer_t * buffer,
+        int flags,
+        int max_depth)
+{
+    qp_obj_t qp_obj;
+    json__t json = {unpacker, buffer, flags, max_depth, NULL};
+
+    qp_next(unpacker, &qp_obj);
+    return json__value(&json, &qp_obj);
+}
+
+/*
+ * Return a pointer to the first '"', '\\' or control character at or after
+ * 'pt', or 'end' when none is found. Complete blocks are checked using SIMD
+ * compares when available; only the tail is handled byte by byte.
+ */
+static inline const unsigned char * json__scan_string(
+        const unsigned char * pt,
+        const unsigned char * end)
+{
+#if defined(__AVX2__)
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i bslash32 = _mm256_set1_epi8('\\');
+    const __m256i ctrl32 = _mm256_set1_epi8(0x1f);
+    while (end - pt >= 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *) pt);
+        __m256i m = _mm256_or_si256(
+                _mm256_or_si256(
+                        _mm256_cmpeq_epi8(x, quote32),
+                        _mm256_cmpeq_epi8(x, bslash32)),
+                _mm256_cmpeq_epi8(_mm256_max_epu8(x, ctrl32), ctrl32));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+        if (mask)
+        {
+            return pt + __builtin_ctz(mask);
+        }
+        pt += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i bslash = _mm_set1_epi8('\\');
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    while (end - pt >= 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) pt);
+        __m128i m = _mm_or_si128(
+                _mm_or_si128(
+                        _mm_cmpeq_epi8(x, quote),
+                        _mm_cmpeq_epi8(x, bslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(x, ctrl), ctrl));
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(m);
+        if (mask)
+        {
+            return pt + __builtin_ctz(mask);
+        }
+        pt += 16;
+    }
+#endif
+    while (pt < end && *pt != '"' && *pt != '\\' && *pt >= 0x20)
+    {
+        pt++;
+    }
+    return pt;
+}
+
+/*
+ * Return a pointer to the first non white space character at or after 'pt',
+ * or 'end'. Most tokens are followed by no or a single white space character
+ * so these are checked first; indentation runs are skipped using SIMD.
+ */
+static inline const unsigned char * json__skip_ws(
+        const unsigned char * pt,
+        const unsigned char * end)
+{
+    if (pt < end && *pt > ' ')
+    {
+        return pt;
+    }
+#if defined(__SSE2__)
+    while (end - pt >= 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *) pt);
+        __m128i m = _mm_or_si128(
+                _mm_or_si128(
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('\n'))),
+                _mm_or_si128(
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')),
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))));
+        unsigned int mask = ~((unsigned int) _mm_movemask_epi8(m)) & 0xffff;
+        if (mask)
+        {
+            return pt + __builtin_ctz(mask);
+        }
+        pt += 16;
+    }
+#endif
+    while (pt < end &&
+           (*pt == ' ' || *pt == '\n' || *pt == '\r' || *pt == '\t'))
+    {
+        pt++;
+    }
+    return pt;
+}
+
+typedef struct
+{
+    const unsigned char * pt;
+    const unsigned char * end;
+    qp_packer_t * packer;
+    int depth;
+    unsigned char * scratch;    /* unescaped strings are written here */
+    size_t scratch_sz;
+    size_t scratch_len;
+} json__parser_t;
+
+static int json__parse(json__parser_t * parser);
+
+static int json__scratch_add(
+        json__parser_t * parser,
+        const unsigned char * data,
+        size_t n)
+{
+    if (parser->scratch_len + n > parser->scratch_sz)
+    {
+        size_t sz = parser->scratch_sz ? parser->scratch_sz : 256;
+        unsigned char * tmp;
+        while (sz < parser->scratch_len + n)
+        {
+            sz *= 2;
+        }
+        tmp = realloc(parser->scratch, sz);
+        if (tmp == NULL)
+        {
+            return QP_JSON_ERR_ALLOC;
+        }
+        parser->scratch = tmp;
+        parser->scratch_sz = sz;
+    }
+    memcpy(parser->scratch + parser->scratch_len, data, n);
+    parser->scratch_len += n;
+    return 0;
+}
+
+static inline int json__hex4(const unsigned char * pt, uint32_t * cp)
+{
+    int i;
+    *cp = 0;
+    for (i = 0; i < 4; i++)
+    {
+        unsigned char c = pt[i];
+        *cp <<= 4;
+        if (c >= '0' && c <= '9')
+        {
+            *cp |= c - '0';
+        }
+        else if (c >= 'a' && c <= 'f')
+        {
+            *cp |= c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F')
+        {
+            *cp |= c - 'A' + 10;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Decode a \uXXXX escape (and a following low surrogate if required) to
+ * UTF-8. On entry 'pt' points at the 'u'.
+ */
+static int json__parse_unicode(json__parser_t * parser)
+{
+    const unsigned char * pt = parser->pt;
+    unsigned char utf8[4];
+    uint32_t cp, lo;
+    size_t n;
+
+    if (parser->end - pt < 5 || json__hex4(pt + 1, &cp))
+    {
+        return QP_JSON_ERR_SYNTAX;
+    }
+    pt += 5;
+
+    if (cp >= 0xDC00 && cp <= 0xDFFF)
+    {
+        return QP_JSON_ERR_SYNTAX;
+    }
+    if (cp >= 0xD800 && cp <= 0xDBFF)
+    {
+        if (parser->end - pt < 6 || pt[0] != '\\' || pt[1] != 'u' ||
+            json__hex4(pt + 2, &lo) || lo < 0xDC00 || lo > 0xDFFF)
+        {
+            return QP_JSON_ERR_SYNTAX;
+        }
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+        pt += 6;
+    }
+
+    if (cp < 0x80)
+    {
+        utf8[0] = (unsigned char) cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        utf8[0] = (unsigned char) (0xC0 | (cp >> 6));
+        utf8[1] = (unsigned char) (0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        utf8[0] = (unsigned char) (0xE0 | (cp >> 12));
+        utf8[1] = (unsigned char) (0x80 | ((cp >> 6) & 0x3F));
+        utf8[2] = (unsigned char) (0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        utf8[0] = (unsigned char) (0xF0 | (cp >> 18));
+        utf8[1] = (unsigned char) (0x80 | ((cp >> 12) & 0x3F));
+        utf8[2] = (unsigned char) (0x80 | ((cp >> 6) & 0x3F));
+        utf8[3] = (unsigned char) (0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    parser->pt = pt;
+    return json__scratch_add(parser, utf8, n);
+}
+
+/*
+ * Parse a string. Strings without escape sequences are added straight from
+ * the input, others are first unescaped to the scratch buffer.
+ */
+static int json__parse_string(json__parser_t * parser)
+{
+    const unsigned char * start = ++parser->pt;
+    const unsigned char * pt = json__scan_string(start, parser->end);
+    int rc;
+
+    if (pt < parser->end && *pt == '"')
+    {
+        parser->pt = pt + 1;
+        return qp_add_raw(parser->packer, start, pt - start)
+                ? QP_JSON_ERR_ALLOC : 0;
+    }
+
+    parser->scratch_len = 0;
+    for (;;)
+    {
+        unsigned char c;
+
+        if (pt >= parser->end || *pt < 0x20)
+        {
+            parser->pt = pt;
+            return QP_JSON_ERR_SYNTAX;
+        }
+        if ((rc = json__scratch_add(parser, start, pt - start)))
+        {
+            return rc;
+        }
+        if (*pt == '"')
+        {
+            break;
+        }
+
+        /* backslash */
+        if (++pt >= parser->end)
+        {
+            parser->pt = pt;
+            return QP_JSON_ERR_SYNTAX;
+        }
+        switch (*pt)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            c = *pt;
+            break;
+        case 'b':
+            c = '\b';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 't':
+            c = '\t';
+            break;
+        case 'u':
+            parser->pt = pt;
+            if ((rc = json__parse_unicode(parser)))
+            {
+                return rc;
+            }
+            start = parser->pt;
+            pt = json__scan_string(start, parser->end);
+            continue;
+        default:
+            parser->pt = pt;
+            return QP_JSON_ERR_SYNTAX;
+        }
+        if ((rc = json__scratch_add(parser, &c, 1)))
+        {
+            return rc;
+        }
+        start = pt + 1;
+        pt = json__scan_string(start, parser->end);
+    }
+
+    parser->pt = pt + 1;
+    return qp_add_raw(parser->packer, parser->scratch, parser->scratch_len)
+            ? QP_JSON_ERR_ALLOC : 0;
+}
+
+static const double json__exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/*
+ * Parse a number. Numbers without fraction or exponent which fit in a signed
+ * 64 bit integer are added as integer, all others as double. (this is how
+ * Lua converts such a string to a number)
+ */
+static int json__parse_number(json__parser_t * parser)
+{
+    const unsigned char * start = parser->pt;
+    const unsigned char * pt = start;
+    const unsigned char * end = parser->end;
+    uint64_t mant = 0;
+    int neg = 0, is_int = 1, digits = 0, exp10 = 0, exact = 1;
+    double real;
+
+    if (*pt == '-')
+    {
+        neg = 1;
+        pt++;
+    }
+    if (pt >= end || *pt < '0' || *pt > '9')
+    {
+        parser->pt = pt;
+        return QP_JSON_ERR_SYNTAX;
+    }
+    if (*pt == '0')
+    {
+        pt++;
+    }
+    else
+    {
+        for (; pt < end && *pt >= '0' && *pt <= '9'; pt++)
+        {
+            if (digits++ < 19)
+            {
+                mant = mant * 10 + (*pt - '0');
+            }
+            else
+            {
+                exact = 0;
+            }
+        }
+    }
+
+    if (pt < end && *pt == '.')
+    {
+        is_int = 0;
+        if (++pt >= end || *pt < '0' || *pt > '9')
+        {
+            parser->pt = pt;
+            return QP_JSON_ERR_SYNTAX;
+        }
+        for (; pt < end && *pt >= '0' && *pt <= '9'; pt++)
+        {
+            if (mant == 0 && *pt == '0')
+            {
+                exp10--;
+            }
+            else if (digits++ < 19)
+            {
+                mant = mant * 10 + (*pt - '0');
+                exp10--;
+            }
+            else
+            {
+                exact = 0;
+            }
+        }
+    }
+
+    if (pt < end && (*pt == 'e' || *pt == 'E'))
+    {
+        int eneg = 0, e = 0;
+        is_int = 0;
+        if (++pt < end && (*pt == '-' || *pt == '+'))
+        {
+            eneg = *pt++ == '-';
+        }
+        if (pt >= end || *pt < '0' || *pt > '9')
+        {
+            parser->pt = pt;
+            return QP_JSON_ERR_SYNTAX;
+        }
+        for (; pt < end && *pt >= '0' && *pt <= '9'; pt++)
+        {
+            if (e < 10000)
+            {
+                e = e * 10 + (*pt - '0');
+            }
+        }
+        exp10 += eneg ? -e : e;
+    }
+
+    parser->pt = pt;
+
+    if (is_int && exact && digits <= 19 &&
+        mant <= (uint64_t) INT64_MAX + (uint64_t) neg)
+    {
+        int64_t integer = neg ? (int64_t) (~mant + 1) : (int64_t) mant;
+        return qp_add_int64(parser->packer, integer) ? QP_JSON_ERR_ALLOC : 0;
+    }
+
+    if (exact && digits <= 15 && exp10 >= -22 && exp10 <= 22)
+    {
+        /* both the mantissa and the power of ten are exact doubles */
+        real = (double) mant;
+        real = (exp10 < 0)
+                ? real / json__exact_pow10[-exp10]
+                : real * json__exact_pow10[exp10];
+    }
+    else
+    {
+        char buf[64];
+        char * num = buf;
+        size_t n = pt - start;
+
+        if (n >= sizeof(buf))
+        {
+            num = malloc(n + 1);
+            if (num == NULL)
+            {
+                return QP_JSON_ERR_ALLOC;
+            }
+        }
+        memcpy(num, start, n);
+        num[n] = '\0';
+        real = strtod(num, NULL);
+        if (num != buf)
+        {
+            free(num);
+        }
+        neg = 0;
+    }
+
+    return qp_add_double(parser->packer, neg ? -real : real)
+            ? QP_JSON_ERR_ALLOC : 0;
+}
+
+static int json__parse_literal(
+        json__parser_t * parser,
+        const char * literal,
+        size_t n,
+        qp_types_t tp)
+{
+    qp_packer_t * packer = parser->packer;
+
+    if ((size_t) (parser->end - parser->pt) < n ||
+        memcmp(parser->pt, literal, n))
+    {
+        return QP_JSON_ERR_SYNTAX;
+    }
+    parser->pt += n;
+    if (qp_packer_reserve(packer, 1))
+    {
+        return QP_JSON_ERR_ALLOC;
+    }
+    packer->buffer[packer->len++] = tp;
+    return 0;
+}
+
+static int json__parse_array(json__parser_t * parser)
+{
+    size_t pos, count = 0;
+    int rc;
+
+    if (!parser->depth--)
+    {
+        return QP_JSON_ERR_DEPTH;
+    }
+    parser->pt++;
+    if (qp_add_open(parser->packer, QP_ARRAY_OPEN, &pos))
+    {
+        return QP_JSON_ERR_ALLOC;
+    }
+
+    parser->pt = json__skip_ws(parser->pt, parser->end);
+    if (parser->pt < parser->end && *parser->pt == ']')
+    {
+        parser->pt++;
+        parser->depth++;
+        return qp_add_close(parser->packer, pos, 0) ? QP_JSON_ERR_ALLOC : 0;
+    }
+
+    for (;;)
+    {
+        if ((rc = json__parse(parser)))
+        {
+            return rc;
+        }
+        count++;
+        parser->pt = json__skip_ws(parser->pt, parser->end);
+        if (parser->pt >= parser->end)
+        {
+            return QP_JSON_ERR_SYNTAX;
+        }
+        if (*parser->pt == ',')
+        {
+            parser->pt++;
+            continue;
+        }
+        if (*parser->pt == ']')
+        {
+            parser->pt++;
+            break;
+        }
+        return QP_JSON_ERR_SYNTAX;
+    }
+
+    parser->depth++;
+    return qp_add_close(parser->packer, pos, count) ? QP_JSON_ERR_ALLOC : 0;
+}
+
+static int json__parse_object(json__parser_t * parser)
+{
+    size_t pos, count = 0;
+    int rc;
+
+    if (!parser->depth--)
+    {
+        return QP_JSON_ERR_DEPTH;
+    }
+    parser->pt++;
+    if (qp_add_open(parser->packer, QP_MAP_OPEN, &pos))
+    {
+        return QP_JSON_ERR_ALLOC;
+    }
+
+    parser->pt = json__skip_ws(parser->pt, parser->end);
+    if (parser->pt < parser->end && *parser->pt == '}')
+    {
+        parser->pt++;
+        parser->depth++;
+        return qp_add_close(parser->packer, pos, 0) ? QP_JSON_ERR_ALLOC : 0;
+    }
+
+    for (;;)
+    {
+        if (parser->pt >= parser->end || *parser->pt != '"')
+        {
+            return QP_JSON_ERR_SYNTAX;
+        }
+        if ((rc = json__parse_string(parser)))
+        {
+            return rc;
+        }
+        parser->pt = json__skip_ws(parser->pt, parser->end);
+        if (parser->pt >= parser->end || *parser->pt != ':')
+        {
+            return QP_JSON_ERR_SYNTAX;
+        }
+        parser->pt++;
+        if ((rc = json__parse(parser)))
+        {
+            return rc;
+        }
+        count++;
+        parser->pt = json__skip_ws(parser->pt, parser->end);
+        if (parser->pt >= parser->end)
+        {
+            return QP_JSON_ERR_SYNTAX;
+        }
+        if (*parser->pt == ',')
+        {
+            parser->pt = json__skip_ws(parser->pt + 1, parser->end);
+            continue;
+        }
+        if (*parser->pt == '}')
+        {
+            parser->pt++;
+            break;
+        }
+        return QP_JSON_ERR_SYNTAX;
+    }
+
+    parser->depth++;
+    return qp_add_close(parser->packer, pos, count) ? QP_JSON_ERR_ALLOC : 0;
+}
+
+static int json__parse(json__parser_t * parser)
+{
+    parser->pt = json__skip_ws(parser->pt, parser->end);
+    if (parser->pt >= parser->end)
+    {
+        return QP_JSON_ERR_SYNTAX;
+    }
+
+    switch (*parser->pt)
+    {
+    case '{':
+        return json__parse_object(parser);
+    case '[':
+        return json__parse_array(parser);
+    case '"':
+        return json__parse_string(parser);
+    case 't':
+        return json__parse_literal(parser, "true", 4, QP_TRUE);
+    case 'f':
+        return json__parse_literal(parser, "false", 5, QP_FALSE);
+    case 'n':
+        return json__parse_literal(parser, "null", 4, QP_NULL);
+    case '-':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+        return json__parse_number(parser);
+    default:
+        return QP_JSON_ERR_SYNTAX;
+    }
+}
+
+/*
+ * Parse a JSON document and add it as a single object to 'packer'. Arrays
+ * and objects with at most 5 items get a fixed size header. Nested arrays and
+ * objects are allowed up to 'max_depth' levels.
+ *
+ * Returns 0 if successful or a negative qp_json_err_t value in case of an
+ * error. In case of an error, 'pos' (if not NULL) is set to the offset in the
+ * input where the error was detected.
+ */
+int qp_from_json(
+        const char * json,
+        size_t len,
+        qp_packer_t * packer,
+        int max_depth,
+        size_t * pos)
+{
+    json__parser_t parser = {
+            (const unsigned char *) json,
+            (const unsigned char *) json + len,
+            packer,
+            max_depth,
+            NULL,
+            0,
+            0};
+    int rc = json__parse(&parser);
+
+    if (rc == 0)
+    {
+        parser.pt = json__skip_ws(parser.pt, parser.end);
+        if (parser.pt != parser.end)
+        {
+            rc = QP_JSON_ERR_SYNTAX;
+        }
+    }
+    if (rc && pos != NULL)
+    {
+        *pos = (const char *) parser.pt - json;
+    }
+
+    free(parser.scratch);
+    return rc;
+}
+
+const char * qp_json_strerror(int err)
+{
+    switch ((qp_json_err_t) err)
+    {
+    case QP_JSON_OK:
+        return "no error";
+    case QP_JSON_ERR_ALLOC:
+        return "memory allocation error";
+    case QP_JSON_ERR_DATA:
+        return "invalid qpack data";
+    case QP_JSON_ERR_DEPTH:
+        return "excessive nesting";
+    case QP_JSON_ERR_NUMBER:
+        return "NaN and Infinity are not allowed";
+    case QP_JSON_ERR_KEY:
+        return "map key must be a number or string";
+    case QP_JSON_ERR_SYNTAX:
+        return "invalid JSON";
+    case QP_JSON_ERR_CYCLE:
+        return "cyclic data";
+    case QP_JSON_ERR_EXT:
+        return "extension values have no JSON form";
+    }
+    return "unknown error";
+}
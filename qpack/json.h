@@ -0,0 +1,43 @@
+/*
+ * json.h - Convert between qpack data and JSON without intermediate objects.
+ */
+#ifndef QP_JSON_H_
+#define QP_JSON_H_
+
+#include <qpack/qpack.h>
+
+typedef enum
+{
+    QP_JSON_ESCAPE_SLASH    =1<<0,  /* write '/' as "\/"                */
+    QP_JSON_INVALID_NUMBERS =1<<1,  /* write NaN, Infinity, -Infinity   */
+} qp_json_flags_t;
+
+typedef enum
+{
+    QP_JSON_OK,
+    QP_JSON_ERR_ALLOC       =-1,    /* memory allocation error          */
+    QP_JSON_ERR_DATA        =-2,    /* invalid or truncated qpack data  */
+    QP_JSON_ERR_DEPTH       =-3,    /* maximum nesting depth reached    */
+    QP_JSON_ERR_NUMBER      =-4,    /* NaN or Infinity not allowed      */
+    QP_JSON_ERR_KEY         =-5,    /* map key is not a string/number   */
+    QP_JSON_ERR_SYNTAX      =-6,    /* invalid JSON input               */
+    QP_JSON_ERR_CYCLE       =-7,    /* shared data contains itself      */
+    QP_JSON_ERR_EXT         =-8,    /* extension value (QP_HOOK_EXT)    */
+} qp_json_err_t;
+
+int qp_to_json(
+        qp_unpacker_t * unpacker,
+        qp_packer_t * buffer,
+        int flags,
+        int max_depth);
+
+int qp_from_json(
+        const char * json,
+        size_t len,
+        qp_packer_t * packer,
+        int max_depth,
+        size_t * pos);
+
+const char * qp_json_strerror(int err);
+
+#endif  /* QP_JSON_H_ */
@@ -0,0 +1,946 @@
+/*
+ * msgpack.c - Convert between qpack and MessagePack data.
+ *
+ * Both directions are a single pass over the input. MessagePack requires the
+ * number of items in front of an array or map, so an open qpack container
+ * gets a 32-bit header which is filled in at its close; when done, one pass
+ * over the output shrinks these headers to their smallest form.
+ */
+#include <qpack/msgpack.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MP_RESERVE(N__)                                                 \
+if (buffer->len + (N__) > buffer->buffer_size &&                        \
+    qp_packer_reserve(buffer, (N__)))                                   \
+{                                                                       \
+    return QP_MSGPACK_ERR_ALLOC;                                        \
+}
+
+/* write type byte T__ followed by N__ big endian bytes of integer V__ */
+#define MP_WRITE_BE(T__, V__, N__)                                      \
+{                                                                       \
+    int i__;                                                            \
+    buffer->buffer[buffer->len++] = (T__);                              \
+    for (i__ = (N__) - 1; i__ >= 0; i__--)                              \
+    {                                                                   \
+        buffer->buffer[buffer->len++] =                                 \
+                (unsigned char) ((uint64_t) (V__) >> (i__ * 8));        \
+    }                                                                   \
+}
+
+/* Output of the containers within a QP_HOOK_SHARED, by number */
+typedef struct
+{
+    size_t n;
+    size_t size;
+    size_t * spans;     /* start and end of each, the end is 0 while open  */
+} mp__shared_t;
+
+typedef struct
+{
+    qp_unpacker_t * unpacker;
+    qp_packer_t * buffer;
+    int depth;
+    mp__shared_t * shared;
+    size_t nopen;
+    size_t open_size;
+    size_t * opens;     /* positions of the 32-bit headers, in order        */
+} mp__writer_t;
+
+static int mp__value(mp__writer_t * mp, qp_obj_t * qp_obj);
+
+static int mp__int(qp_packer_t * buffer, int64_t integer)
+{
+    MP_RESERVE(9)
+    if (integer >= 0)
+    {
+        if (integer < 128)
+        {
+            buffer->buffer[buffer->len++] = (unsigned char) integer;
+        }
+        else if (integer <= UINT8_MAX)
+        {
+            MP_WRITE_BE(0xcc, integer, 1)
+        }
+        else if (integer <= UINT16_MAX)
+        {
+            MP_WRITE_BE(0xcd, integer, 2)
+        }
+        else if (integer <= UINT32_MAX)
+        {
+            MP_WRITE_BE(0xce, integer, 4)
+        }
+        else
+        {
+            MP_WRITE_BE(0xcf, integer, 8)
+        }
+    }
+    else if (integer >= -32)
+    {
+        buffer->buffer[buffer->len++] = (unsigned char) (integer & 0xff);
+    }
+    else if (integer >= INT8_MIN)
+    {
+        MP_WRITE_BE(0xd0, integer, 1)
+    }
+    else if (integer >= INT16_MIN)
+    {
+        MP_WRITE_BE(0xd1, integer, 2)
+    }
+    else if (integer >= INT32_MIN)
+    {
+        MP_WRITE_BE(0xd2, integer, 4)
+    }
+    else
+    {
+        MP_WRITE_BE(0xd3, integer, 8)
+    }
+    return 0;
+}
+
+static int mp__double(qp_packer_t * buffer, double real)
+{
+    uint64_t u;
+    memcpy(&u, &real, sizeof(double));
+    MP_RESERVE(9)
+    MP_WRITE_BE(0xcb, u, 8)
+    return 0;
+}
+
+static int mp__raw(qp_packer_t * buffer, const unsigned char * raw, size_t len)
+{
+    MP_RESERVE(len + 5)
+    if (len < 32)
+    {
+        buffer->buffer[buffer->len++] = 0xa0 | (unsigned char) len;
+    }
+    else if (len <= UINT8_MAX)
+    {
+        MP_WRITE_BE(0xd9, len, 1)
+    }
+    else if (len <= UINT16_MAX)
+    {
+        MP_WRITE_BE(0xda, len, 2)
+    }
+    else if (len <= UINT32_MAX)
+    {
+        MP_WRITE_BE(0xdb, len, 4)
+    }
+    else
+    {
+        return QP_MSGPACK_ERR_TYPE;
+    }
+    memcpy(buffer->buffer + buffer->len, raw, len);
+    buffer->len += len;
+    return 0;
+}
+
+/* Write extension type id with its payload as a MessagePack ext */
+static int mp__ext(
+        qp_packer_t * buffer,
+        uint8_t id,
+        const unsigned char * data,
+        size_t len)
+{
+    MP_RESERVE(len + 6)
+    switch (len)
+    {
+    case 1:
+        buffer->buffer[buffer->len++] = 0xd4;
+        break;
+    case 2:
+        buffer->buffer[buffer->len++] = 0xd5;
+        break;
+    case 4:
+        buffer->buffer[buffer->len++] = 0xd6;
+        break;
+    case 8:
+        buffer->buffer[buffer->len++] = 0xd7;
+        break;
+    case 16:
+        buffer->buffer[buffer->len++] = 0xd8;
+        break;
+    default:
+        if (len <= UINT8_MAX)
+        {
+            MP_WRITE_BE(0xc7, len, 1)
+        }
+        else if (len <= UINT16_MAX)
+        {
+            MP_WRITE_BE(0xc8, len, 2)
+        }
+        else if (len <= UINT32_MAX)
+        {
+            MP_WRITE_BE(0xc9, len, 4)
+        }
+        else
+        {
+            return QP_MSGPACK_ERR_TYPE;
+        }
+    }
+    buffer->buffer[buffer->len++] = id;
+    memcpy(buffer->buffer + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static int mp__header(qp_packer_t * buffer, int is_map, size_t count)
+{
+    MP_RESERVE(5)
+    if (count < 16)
+    {
+        buffer->buffer[buffer->len++] =
+                (is_map ? 0x80 : 0x90) | (unsigned char) count;
+    }
+    else if (count <= UINT16_MAX)
+    {
+        MP_WRITE_BE(is_map ? 0xde : 0xdc, count, 2)
+    }
+    else if (count <= UINT32_MAX)
+    {
+        MP_WRITE_BE(is_map ? 0xdf : 0xdd, count, 4)
+    }
+    else
+    {
+        return QP_MSGPACK_ERR_TYPE;
+    }
+    return 0;
+}
+
+static int mp__container(
+        mp__writer_t * mp,
+        qp_obj_t * qp_obj,
+        int is_map,
+        size_t count,
+        int is_open)
+{
+    size_t n, total = is_map ? count * 2 : count;
+    int rc;
+
+    if ((rc = mp__header(mp->buffer, is_map, count)))
+    {
+        return rc;
+    }
+    for (n = 0; n < total; n++)
+    {
+        qp_next(mp->unpacker, qp_obj);
+        if ((rc = mp__value(mp, qp_obj)))
+        {
+            return rc;
+        }
+    }
+    if (is_open)
+    {
+        /* consume the close type, if any (end of data is a valid close) */
+        qp_next(mp->unpacker, NULL);
+    }
+    return 0;
+}
+
+/*
+ * Write an open array or map with a 32-bit header and fill in the number of
+ * items when its close type (or the end of the data) is reached.
+ */
+static int mp__open(mp__writer_t * mp, qp_obj_t * qp_obj, int is_map)
+{
+    qp_packer_t * buffer = mp->buffer;
+    qp_types_t close = is_map ? QP_MAP_CLOSE : QP_ARRAY_CLOSE;
+    size_t pos = buffer->len, end, n = 0, * opens;
+    int rc;
+
+    if (mp->nopen == mp->open_size)
+    {
+        mp->open_size = mp->open_size ? mp->open_size * 2 : 16;
+        opens = realloc(mp->opens, mp->open_size * sizeof(size_t));
+        if (opens == NULL)
+        {
+            return QP_MSGPACK_ERR_ALLOC;
+        }
+        mp->opens = opens;
+    }
+    mp->opens[mp->nopen++] = pos;
+
+    MP_RESERVE(5)
+    MP_WRITE_BE(is_map ? 0xdf : 0xdd, 0, 4)
+    while (qp_next(mp->unpacker, qp_obj) != QP_END && qp_obj->tp != close)
+    {
+        if ((rc = mp__value(mp, qp_obj)))
+        {
+            return rc;
+        }
+        n++;
+    }
+    if (is_map)
+    {
+        if (n % 2)
+        {
+            return QP_MSGPACK_ERR_DATA;
+        }
+        n /= 2;
+    }
+    if (n > UINT32_MAX)
+    {
+        return QP_MSGPACK_ERR_TYPE;
+    }
+    end = buffer->len;
+    buffer->len = pos;
+    MP_WRITE_BE(is_map ? 0xdf : 0xdd, n, 4)
+    buffer->len = end;
+    return 0;
+}
+
+/*
+ * Shrink the 32-bit headers mp__open() wrote to the smallest form for their
+ * count, moving the bytes in between down in one pass.
+ */
+static void mp__shrink(mp__writer_t * mp)
+{
+    qp_packer_t * buffer = mp->buffer;
+    size_t i, count, len, src, dst, end = buffer->len;
+    unsigned char * pt;
+
+    if (mp->nopen == 0)
+    {
+        return;
+    }
+    src = dst = mp->opens[0];
+    for (i = 0; i < mp->nopen; i++)
+    {
+        len = mp->opens[i] - src;
+        memmove(buffer->buffer + dst, buffer->buffer + src, len);
+        dst += len;
+        pt = buffer->buffer + mp->opens[i];
+        count = (size_t) pt[1] << 24 | (size_t) pt[2] << 16 |
+                (size_t) pt[3] << 8 | (size_t) pt[4];
+
+        /* at most 5 bytes at dst, which is not after the header read */
+        buffer->len = dst;
+        (void) mp__header(buffer, pt[0] == 0xdf, count);
+        dst = buffer->len;
+        src = mp->opens[i] + 5;
+    }
+    memmove(buffer->buffer + dst, buffer->buffer + src, end - src);
+    buffer->len = dst + end - src;
+}
+
+/*
+ * Write the n values of an array with runs from mp->unpacker; a repeat
+ * copies the bytes of the value before it.
+ */
+static int mp__runs(mp__writer_t * mp, qp_obj_t * qp_obj, size_t n)
+{
+    qp_packer_t * buffer = mp->buffer;
+    size_t start = 0, len = 0, count;
+    int rc;
+
+    if ((rc = mp__header(buffer, 0, n)))
+    {
+        return rc;
+    }
+    while (qp_next(mp->unpacker, qp_obj) != QP_END)
+    {
+        if (qp_obj->tp == QP_HOOK && qp_obj->hook == QP_HOOK_REPEAT)
+        {
+            for (count = (size_t) qp_obj->via.int64; count; count--)
+            {
+                MP_RESERVE(len)
+                memcpy(buffer->buffer + buffer->len,
+                       buffer->buffer + start, len);
+                buffer->len += len;
+            }
+            continue;
+        }
+        start = buffer->len;
+        if ((rc = mp__value(mp, qp_obj)))
+        {
+            return rc;
+        }
+        len = buffer->len - start;
+    }
+    return 0;
+}
+
+/* Write a string dictionary as the array of its strings */
+static int mp__dict(qp_packer_t * buffer, qp_obj_t * qp_obj)
+{
+    qp_obj_t * strings;
+    qp_dict_t dict;
+    size_t i, index;
+    int rc;
+
+    if (qp_dict_init(&dict, qp_obj))
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    if ((rc = mp__header(buffer, 0, dict.n)))
+    {
+        return rc;
+    }
+    strings = malloc((dict.k ? dict.k : 1) * sizeof(qp_obj_t));
+    if (strings == NULL)
+    {
+        return QP_MSGPACK_ERR_ALLOC;
+    }
+    for (i = 0; i < dict.k; i++)
+    {
+        qp_next(&dict.strings, &strings[i]);
+    }
+    for (i = 0; i < dict.n && rc == 0; i++)
+    {
+        index = qp_dict_next(&dict);
+        rc = index < dict.k
+                ? mp__raw(buffer, strings[index].via.raw, strings[index].len)
+                : QP_MSGPACK_ERR_DATA;
+    }
+    free(strings);
+    return rc;
+}
+
+/*
+ * Number a container which starts now, when within a QP_HOOK_SHARED. Call
+ * mp__numbered() when it is written.
+ */
+static int mp__number(mp__writer_t * mp, size_t * number)
+{
+    mp__shared_t * shared = mp->shared;
+    size_t * spans;
+
+    if (shared == NULL)
+    {
+        return 0;
+    }
+    if (shared->n == shared->size)
+    {
+        shared->size = shared->size ? shared->size * 2 : 8;
+        spans = realloc(shared->spans, shared->size * 2 * sizeof(size_t));
+        if (spans == NULL)
+        {
+            return QP_MSGPACK_ERR_ALLOC;
+        }
+        shared->spans = spans;
+    }
+    *number = shared->n++;
+    shared->spans[*number * 2] = mp->buffer->len;
+    shared->spans[*number * 2 + 1] = 0;
+    return 0;
+}
+
+static inline void mp__numbered(mp__writer_t * mp, size_t number)
+{
+    if (mp->shared != NULL)
+    {
+        mp->shared->spans[number * 2 + 1] = mp->buffer->len;
+    }
+}
+
+/*
+ * Write the value of a QP_HOOK_SHARED. Its containers are numbered as they
+ * open, so a back-reference can copy the bytes of the one it refers to.
+ */
+static int mp__shared(mp__writer_t * mp, qp_obj_t * qp_obj)
+{
+    qp_unpacker_t * unpacker = mp->unpacker;
+    mp__shared_t * outer = mp->shared;
+    mp__shared_t shared = {0, 0, NULL};
+    qp_unpacker_t value;
+    int rc;
+
+    qp_unpacker_init(&value, qp_obj->via.raw, qp_obj->len);
+    mp->unpacker = &value;
+    mp->shared = &shared;
+    rc = qp_next(&value, qp_obj) == QP_END
+            ? QP_MSGPACK_ERR_DATA
+            : mp__value(mp, qp_obj);
+    if (rc == 0 && qp_next(&value, NULL) != QP_END)
+    {
+        rc = QP_MSGPACK_ERR_DATA;
+    }
+    mp->unpacker = unpacker;
+    mp->shared = outer;
+    free(shared.spans);
+    return rc;
+}
+
+/* Write a copy of the container a QP_HOOK_REF refers to */
+static int mp__ref(mp__writer_t * mp, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = mp->buffer;
+    mp__shared_t * shared = mp->shared;
+    size_t number = (size_t) qp_obj->via.int64, start, end;
+
+    if (shared == NULL || number >= shared->n)
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    start = shared->spans[number * 2];
+    end = shared->spans[number * 2 + 1];
+    if (end == 0)
+    {
+        return QP_MSGPACK_ERR_CYCLE;
+    }
+    MP_RESERVE(end - start)
+    memcpy(buffer->buffer + buffer->len, buffer->buffer + start, end - start);
+    buffer->len += end - start;
+    return 0;
+}
+
+/* Write a sized hook as the plain value it stands for */
+static int mp__hook(mp__writer_t * mp, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = mp->buffer;
+    qp_unpacker_t * unpacker = mp->unpacker;
+    qp_unpacker_t values;
+    qp_decimals_t decimals;
+    const unsigned char * data;
+    unsigned char * bits;
+    size_t n, i, number = 0;
+    uint8_t id;
+    int rc;
+
+    switch (qp_obj->hook)
+    {
+    case QP_HOOK_EXT:
+        if (qp_ext_get(qp_obj, &id, &data, &n))
+        {
+            return QP_MSGPACK_ERR_DATA;
+        }
+        return mp__ext(buffer, id, data, n);
+    case QP_HOOK_SHARED:
+        return mp__shared(mp, qp_obj);
+    case QP_HOOK_REF:
+        return mp__ref(mp, qp_obj);
+    case QP_HOOK_DICT:
+        return mp__dict(buffer, qp_obj);
+    case QP_HOOK_BOOLS:
+        if (qp_bools_get(qp_obj, &n, &bits))
+        {
+            return QP_MSGPACK_ERR_DATA;
+        }
+        if ((rc = mp__header(buffer, 0, n)))
+        {
+            return rc;
+        }
+        MP_RESERVE(n)
+        for (i = 0; i < n; i++)
+        {
+            buffer->buffer[buffer->len++] =
+                    bits[i / 8] & (1 << (i % 8)) ? 0xc3 : 0xc2;
+        }
+        return 0;
+    case QP_HOOK_RUNS:
+        if (qp_runs_get(qp_obj, &n, &values))
+        {
+            return QP_MSGPACK_ERR_DATA;
+        }
+        if ((rc = mp__number(mp, &number)))
+        {
+            return rc;
+        }
+        mp->unpacker = &values;
+        rc = mp__runs(mp, qp_obj, n);
+        mp->unpacker = unpacker;
+        mp__numbered(mp, number);
+        return rc;
+    case QP_HOOK_DECIMAL_ARRAY:
+        if (qp_decimals_init(&decimals, qp_obj))
+        {
+            return QP_MSGPACK_ERR_DATA;
+        }
+        if ((rc = mp__header(buffer, 0, decimals.n)))
+        {
+            return rc;
+        }
+        for (n = 0; n < decimals.n; n++)
+        {
+            if ((rc = mp__double(buffer, qp_decimals_next(&decimals))))
+            {
+                return rc;
+            }
+        }
+        return 0;
+    default:
+        return QP_MSGPACK_ERR_DATA;
+    }
+}
+
+static int mp__value(mp__writer_t * mp, qp_obj_t * qp_obj)
+{
+    qp_packer_t * buffer = mp->buffer;
+    size_t number = 0;
+    int rc, is_map;
+
+    switch (qp_obj->tp)
+    {
+    case QP_RAW:
+        return mp__raw(buffer, qp_obj->via.raw, qp_obj->len);
+    case QP_INT64:
+        return mp__int(buffer, qp_obj->via.int64);
+    case QP_DOUBLE:
+        return mp__double(buffer, qp_obj->via.real);
+    case QP_TRUE:
+    case QP_FALSE:
+    case QP_NULL:
+        MP_RESERVE(1)
+        buffer->buffer[buffer->len++] =
+                qp_obj->tp == QP_TRUE ? 0xc3 :
+                qp_obj->tp == QP_FALSE ? 0xc2 : 0xc0;
+        return 0;
+    case QP_ARRAY0:
+    case QP_ARRAY1:
+    case QP_ARRAY2:
+    case QP_ARRAY3:
+    case QP_ARRAY4:
+    case QP_ARRAY5:
+    case QP_ARRAY_OPEN:
+    case QP_MAP0:
+    case QP_MAP1:
+    case QP_MAP2:
+    case QP_MAP3:
+    case QP_MAP4:
+    case QP_MAP5:
+    case QP_MAP_OPEN:
+        if (!mp->depth--)
+        {
+            return QP_MSGPACK_ERR_DEPTH;
+        }
+        if ((rc = mp__number(mp, &number)))
+        {
+            return rc;
+        }
+        is_map = qp_is_map(qp_obj->tp);
+        if ((qp_obj->tp == QP_ARRAY_OPEN || qp_obj->tp == QP_MAP_OPEN) &&
+            qp_obj->hook)
+        {
+            /* a sized container has the count in its header */
+            rc = mp__container(
+                    mp, qp_obj, is_map, (size_t) qp_obj->via.int64, 1);
+        }
+        else if (qp_obj->tp == QP_ARRAY_OPEN || qp_obj->tp == QP_MAP_OPEN)
+        {
+            rc = mp__open(mp, qp_obj, is_map);
+        }
+        else
+        {
+            rc = mp__container(
+                    mp, qp_obj, is_map,
+                    qp_obj->tp - (is_map ? QP_MAP0 : QP_ARRAY0), 0);
+        }
+        mp__numbered(mp, number);
+        mp->depth++;
+        return rc;
+    case QP_HOOK:
+        if (!mp->depth--)
+        {
+            return QP_MSGPACK_ERR_DEPTH;
+        }
+        rc = mp__hook(mp, qp_obj);
+        mp->depth++;
+        return rc;
+    default:
+        return QP_MSGPACK_ERR_DATA;
+    }
+}
+
+/*
+ * Write the next object from the unpacker as MessagePack to the end of
+ * 'buffer'. Raw data is written as MessagePack str, a decimal array as an
+ * array of float 64, a bool array as an array of true and false, a string
+ * dictionary as the array of its strings and an array with runs with each
+ * run expanded. A back-reference in shared data is written as a copy of the
+ * container it refers to; a reference to a container which contains it fails
+ * with QP_MSGPACK_ERR_CYCLE. An extension value is written as a MessagePack
+ * ext with the same type. Nested arrays and maps are allowed up to
+ * 'max_depth' levels.
+ *
+ * Returns 0 if successful or a negative qp_msgpack_err_t value in case of an
+ * error. (the content of the buffer is undefined in case of an error)
+ */
+int qp_to_msgpack(
+        qp_unpacker_t * unpacker,
+        qp_packer_t * buffer,
+        int max_depth)
+{
+    qp_obj_t qp_obj;
+    mp__writer_t mp = {unpacker, buffer, max_depth, NULL, 0, 0, NULL};
+    int rc;
+
+    qp_next(unpacker, &qp_obj);
+    if ((rc = mp__value(&mp, &qp_obj)) == 0)
+    {
+        mp__shrink(&mp);
+    }
+    free(mp.opens);
+    return rc;
+}
+
+typedef struct
+{
+    const unsigned char * pt;
+    const unsigned char * end;
+    qp_packer_t * packer;
+    int depth;
+} mp__reader_t;
+
+static int mp__read(mp__reader_t * mp);
+
+/* read an N__ byte big endian unsigned integer into V__ */
+#define MP_READ_BE(V__, N__)                                            \
+{                                                                       \
+    int i__;                                                            \
+    if (mp->end - mp->pt < (N__))                                       \
+    {                                                                   \
+        return QP_MSGPACK_ERR_DATA;                                     \
+    }                                                                   \
+    (V__) = 0;                                                          \
+    for (i__ = 0; i__ < (N__); i__++)                                   \
+    {                                                                   \
+        (V__) = ((V__) << 8) | *mp->pt++;                               \
+    }                                                                   \
+}
+
+static int mp__read_raw(mp__reader_t * mp, size_t len)
+{
+    if ((size_t) (mp->end - mp->pt) < len)
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    if (qp_add_raw(mp->packer, mp->pt, len))
+    {
+        return QP_MSGPACK_ERR_ALLOC;
+    }
+    mp->pt += len;
+    return 0;
+}
+
+/* Read the type and payload of an ext with len bytes of data */
+static int mp__read_ext(mp__reader_t * mp, size_t len)
+{
+    int8_t id;
+
+    if ((size_t) (mp->end - mp->pt) < len + 1)
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    id = (int8_t) *mp->pt++;
+    if (id < 0)
+    {
+        /* types below 0 are reserved for MessagePack itself */
+        return QP_MSGPACK_ERR_TYPE;
+    }
+    if (qp_add_ext(mp->packer, (uint8_t) id, mp->pt, len))
+    {
+        return QP_MSGPACK_ERR_ALLOC;
+    }
+    mp->pt += len;
+    return 0;
+}
+
+static int mp__read_container(mp__reader_t * mp, int is_map, uint64_t count)
+{
+    uint64_t n, total = is_map ? count * 2 : count;
+    int rc;
+
+    if (!mp->depth--)
+    {
+        return QP_MSGPACK_ERR_DEPTH;
+    }
+    /* every item is at least one byte */
+    if (total > (uint64_t) (mp->end - mp->pt))
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    if (qp_add_type(mp->packer, (count <= 5)
+            ? (is_map ? QP_MAP0 : QP_ARRAY0) + count
+            : (is_map ? QP_MAP_OPEN : QP_ARRAY_OPEN)))
+    {
+        return QP_MSGPACK_ERR_ALLOC;
+    }
+    for (n = 0; n < total; n++)
+    {
+        if ((rc = mp__read(mp)))
+        {
+            return rc;
+        }
+    }
+    if (count > 5 && qp_add_type(
+            mp->packer,
+            is_map ? QP_MAP_CLOSE : QP_ARRAY_CLOSE))
+    {
+        return QP_MSGPACK_ERR_ALLOC;
+    }
+    mp->depth++;
+    return 0;
+}
+
+static int mp__read(mp__reader_t * mp)
+{
+    uint64_t u;
+    unsigned char tp;
+
+    if (mp->pt >= mp->end)
+    {
+        return QP_MSGPACK_ERR_DATA;
+    }
+    tp = *mp->pt++;
+
+    if (tp <= 0x7f)
+    {
+        return qp_add_int64(mp->packer, tp) ? QP_MSGPACK_ERR_ALLOC : 0;
+    }
+    if (tp >= 0xe0)
+    {
+        return qp_add_int64(mp->packer, (int8_t) tp)
+                ? QP_MSGPACK_ERR_ALLOC : 0;
+    }
+    if (tp <= 0x8f)
+    {
+        return mp__read_container(mp, 1, tp & 0x0f);
+    }
+    if (tp <= 0x9f)
+    {
+        return mp__read_container(mp, 0, tp & 0x0f);
+    }
+    if (tp <= 0xbf)
+    {
+        return mp__read_raw(mp, tp & 0x1f);
+    }
+
+    switch (tp)
+    {
+    case 0xc0:
+        return qp_add_null(mp->packer) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xc2:
+        return qp_add_false(mp->packer) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xc3:
+        return qp_add_true(mp->packer) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xc4:  /* bin 8 */
+    case 0xd9:  /* str 8 */
+        MP_READ_BE(u, 1)
+        return mp__read_raw(mp, u);
+    case 0xc5:  /* bin 16 */
+    case 0xda:  /* str 16 */
+        MP_READ_BE(u, 2)
+        return mp__read_raw(mp, u);
+    case 0xc6:  /* bin 32 */
+    case 0xdb:  /* str 32 */
+        MP_READ_BE(u, 4)
+        return mp__read_raw(mp, u);
+    case 0xca:  /* float 32 */
+    {
+        uint32_t u32;
+        float f;
+        MP_READ_BE(u, 4)
+        u32 = (uint32_t) u;
+        memcpy(&f, &u32, sizeof(float));
+        return qp_add_double(mp->packer, f) ? QP_MSGPACK_ERR_ALLOC : 0;
+    }
+    case 0xcb:  /* float 64 */
+    {
+        double d;
+        MP_READ_BE(u, 8)
+        memcpy(&d, &u, sizeof(double));
+        return qp_add_double(mp->packer, d) ? QP_MSGPACK_ERR_ALLOC : 0;
+    }
+    case 0xcc:  /* uint 8 */
+        MP_READ_BE(u, 1)
+        return qp_add_int64(mp->packer, u) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xcd:  /* uint 16 */
+        MP_READ_BE(u, 2)
+        return qp_add_int64(mp->packer, u) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xce:  /* uint 32 */
+        MP_READ_BE(u, 4)
+        return qp_add_int64(mp->packer, u) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xcf:  /* uint 64 */
+        MP_READ_BE(u, 8)
+        if (u > INT64_MAX)
+        {
+            return QP_MSGPACK_ERR_TYPE;
+        }
+        return qp_add_int64(mp->packer, u) ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xd0:  /* int 8 */
+        MP_READ_BE(u, 1)
+        return qp_add_int64(mp->packer, (int8_t) u)
+                ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xd1:  /* int 16 */
+        MP_READ_BE(u, 2)
+        return qp_add_int64(mp->packer, (int16_t) u)
+                ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xd2:  /* int 32 */
+        MP_READ_BE(u, 4)
+        return qp_add_int64(mp->packer, (int32_t) u)
+                ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xd3:  /* int 64 */
+        MP_READ_BE(u, 8)
+        return qp_add_int64(mp->packer, (int64_t) u)
+                ? QP_MSGPACK_ERR_ALLOC : 0;
+    case 0xdc:  /* array 16 */
+        MP_READ_BE(u, 2)
+        return mp__read_container(mp, 0, u);
+    case 0xdd:  /* array 32 */
+        MP_READ_BE(u, 4)
+        return mp__read_container(mp, 0, u);
+    case 0xde:  /* map 16 */
+        MP_READ_BE(u, 2)
+        return mp__read_container(mp, 1, u);
+    case 0xdf:  /* map 32 */
+        MP_READ_BE(u, 4)
+        return mp__read_container(mp, 1, u);
+    case 0xc7:  /* ext 8 */
+        MP_READ_BE(u, 1)
+        return mp__read_ext(mp, u);
+    case 0xc8:  /* ext 16 */
+        MP_READ_BE(u, 2)
+        return mp__read_ext(mp, u);
+    case 0xc9:  /* ext 32 */
+        MP_READ_BE(u, 4)
+        return mp__read_ext(mp, u);
+    case 0xd4:  /* fixext 1 */
+    case 0xd5:  /* fixext 2 */
+    case 0xd6:  /* fixext 4 */
+    case 0xd7:  /* fixext 8 */
+    case 0xd8:  /* fixext 16 */
+        return mp__read_ext(mp, (size_t) 1 << (tp - 0xd4));
+    default:    /* 0xc1 is never used */
+        return QP_MSGPACK_ERR_DATA;
+    }
+}
+
+/*
+ * Read one MessagePack object and add it to 'packer'. Both str and bin are
+ * added as raw data and an ext of type 0 to 127 as an extension value; the
+ * types below 0 are not supported. Arrays and maps with at most 5 items get a fixed size
+ * header. Nested arrays and maps are allowed up to 'max_depth' levels.
+ *
+ * Returns 0 if successful or a negative qp_msgpack_err_t value in case of an
+ * error.
+ */
+int qp_from_msgpack(
+        const unsigned char * data,
+        size_t len,
+        qp_packer_t * packer,
+        int max_depth)
+{
+    mp__reader_t mp = {data, data + len, packer, max_depth};
+    return mp__read(&mp);
+}
+
+const char * qp_msgpack_strerror(int err)
+{
+    switch ((qp_msgpack_err_t) err)
+    {
+    case QP_MSGPACK_OK:
+        return "no error";
+    case QP_MSGPACK_ERR_ALLOC:
+        return "memory allocation error";
+    case QP_MSGPACK_ERR_DATA:
+        return "invalid or truncated data";
+    case QP_MSGPACK_ERR_DEPTH:
+        return "excessive nesting";
+    case QP_MSGPACK_ERR_TYPE:
+        return "type or size not supported";
+    case QP_MSGPACK_ERR_CYCLE:
+        return "cyclic data";
+    }
+    return "unknown error";
+}
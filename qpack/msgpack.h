@@ -0,0 +1,32 @@
+/*
+ * msgpack.h - Convert between qpack and MessagePack data.
+ */
+#ifndef QP_MSGPACK_H_
+#define QP_MSGPACK_H_
+
+#include <qpack/qpack.h>
+
+typedef enum
+{
+    QP_MSGPACK_OK,
+    QP_MSGPACK_ERR_ALLOC    =-1,    /* memory allocation error          */
+    QP_MSGPACK_ERR_DATA     =-2,    /* invalid or truncated input       */
+    QP_MSGPACK_ERR_DEPTH    =-3,    /* maximum nesting depth reached    */
+    QP_MSGPACK_ERR_TYPE     =-4,    /* type has no equivalent           */
+    QP_MSGPACK_ERR_CYCLE    =-5,    /* shared data contains itself      */
+} qp_msgpack_err_t;
+
+int qp_to_msgpack(
+        qp_unpacker_t * unpacker,
+        qp_packer_t * buffer,
+        int max_depth);
+
+int qp_from_msgpack(
+        const unsigned char * data,
+        size_t len,
+        qp_packer_t * packer,
+        int max_depth);
+
+const char * qp_msgpack_strerror(int err);
+
+#endif  /* QP_MSGPACK_H_ */
@@ -12,6 +12,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <float.h>
 // #include <logger/logger.h>
 #include <assert.h>
 // #include <siri/err.h>
@@ -34,6 +36,9 @@ if (!siri_err) siri_err = SIGSEGV;
 
 #define QPACK_MAX_FMT_SIZE 1024
 
+/* QP_HOOK, the hook type, the size and the number of items as QP_INT32 */
+#define QP_SIZED_HEAD (2 + 2 * (1 + sizeof(int32_t)))
+
 #define QP_RESIZE(LEN)                                                  \
 if (packer->len + LEN > packer->buffer_size)                            \
 {                                                                       \
@@ -120,14 +125,14 @@ if (packer->len + LEN > packer->buffer_size)                            \
     return QP_INT64;                                        \
 }
 
-#define QP_UNPACK_CHECK_SZ(size)            \
-if (unpacker->pt + size > unpacker->end)    \
-{                                           \
-    if  (qp_obj != NULL)                    \
-    {                                       \
-        qp_obj->tp = QP_ERR;                \
-    }                                       \
-    return QP_ERR;                          \
+#define QP_UNPACK_CHECK_SZ(size)                                \
+if ((size_t) (unpacker->end - unpacker->pt) < (size_t) (size))  \
+{                                                               \
+    if  (qp_obj != NULL)                                        \
+    {                                                           \
+        qp_obj->tp = QP_ERR;                                    \
+    }                                                           \
+    return QP_ERR;                                              \
 }
 
 static qp_types_t QP_print_unpacker(
@@ -257,6 +262,17 @@ void qp_packer_free(qp_packer_t * packer)
     free(packer);
 }
 
+/*
+ * Make sure the packer has room for at least n more bytes.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_packer_reserve(qp_packer_t * packer, size_t n)
+{
+    QP_RESIZE(n)
+    return 0;
+}
+
 /*
  * Extend packer with another packer (source).
  *
@@ -313,8 +329,24 @@ void qp_print(unsigned char * pt, size_t len)
  */
 qp_types_t qp_skip_next(qp_unpacker_t * unpacker)
 {
-    qp_types_t tp = qp_next(unpacker, NULL);
+    qp_types_t tp;
     int count;
+
+    if (unpacker->pt + 1 < unpacker->end &&
+        *unpacker->pt == QP_HOOK &&
+        (unpacker->pt[1] == QP_HOOK_ARRAY || unpacker->pt[1] == QP_HOOK_MAP))
+    {
+        /* a sized container is skipped at once */
+        qp_obj_t qp_obj;
+        tp = qp_next(unpacker, &qp_obj);
+        if (tp != QP_ERR)
+        {
+            unpacker->pt += qp_obj.len;
+        }
+        return tp;
+    }
+
+    tp = qp_next(unpacker, NULL);
     switch (tp)
     {
 
@@ -486,246 +518,1658 @@ int qp_add_double(qp_packer_t * packer, double real)
 }
 
 
-
-
-
-
-
+/* Number of bytes qp_add_int64() writes for an integer */
+static size_t qp__int_size(int64_t integer)
+{
+    return (integer >= -60 && integer < 64) ? 1 :
+           (integer == (int8_t) integer) ? 2 :
+           (integer == (int16_t) integer) ? 3 :
+           (integer == (int32_t) integer) ? 5 : 9;
+}
 
 /*
+ * Add a double in the smallest form which unpacks to the same value: an
+ * integral double as an integer, or a float32 when the double has no more
+ * precision than that (5 bytes, see qp_hook_t).
+ *
+ * An integer unpacks as QP_INT64, unless 'keep_float' is set; then it is
+ * flagged with QP_HOOK_DOUBLE_INT and unpacks as QP_DOUBLE, like the float32
+ * does anyway.
+ *
  * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
  */
-int qp_add_int64(qp_packer_t * packer, int64_t integer)
+int qp_add_double_compact(qp_packer_t * packer, double real, int keep_float)
 {
-    int8_t i8;
-    if ((i8 = (int8_t) integer) == integer)
+    size_t int_size = 9, size = 9;
+    int64_t integer = 0;
+    uint32_t bits = 0;
+    float f;
+
+    if (real == 0.0 || real == 1.0 || real == -1.0)
     {
-        QP_RESIZE(2)
-        if (i8 >= 0 && i8 < 64)
-        {
-            packer->buffer[packer->len++] = i8;
-        }
-        else if (i8 >= -60 && i8 < 0)
-        {
-            packer->buffer[packer->len++] = 63 - i8;
-        }
-        else
+        return qp_add_double(packer, real);
+    }
+
+    if (real >= -9223372036854775808.0 && real < 9223372036854775808.0 &&
+        real == (double) (integer = (int64_t) real))
+    {
+        int_size = qp__int_size(integer) + (keep_float ? 2 : 0);
+    }
+
+    if (real >= -FLT_MAX && real <= FLT_MAX &&
+        (double) (f = (float) real) == real)
+    {
+        memcpy(&bits, &f, sizeof(float));
+        if ((bits >> 24) >= QP_HOOK_FLOAT32)
         {
-            packer->buffer[packer->len++] = QP_INT8;
-            packer->buffer[packer->len++] = i8;
+            size = 5;
         }
-        return 0;
     }
 
-    int16_t i16;
-    if ((i16 = (int16_t) integer) == integer)
+    /* on a tie, a plain integer is kept and a flagged one is not */
+    if (int_size < size || (int_size == size && !keep_float && size < 9))
     {
-        QP_RESIZE(3)
-        packer->buffer[packer->len++] = QP_INT16;
-        memcpy(packer->buffer + packer->len, &i16, sizeof(int16_t));
-        packer->len += sizeof(int16_t);
-        return 0;
+        if (keep_float)
+        {
+            QP_RESIZE(2)
+            packer->buffer[packer->len++] = QP_HOOK;
+            packer->buffer[packer->len++] = QP_HOOK_DOUBLE_INT;
+        }
+        return qp_add_int64(packer, integer);
     }
 
-    int32_t i32;
-    if ((i32 = (int32_t) integer) == integer)
+    if (size == 5)
     {
         QP_RESIZE(5)
-        packer->buffer[packer->len++] = QP_INT32;
-        memcpy(packer->buffer + packer->len, &i32, sizeof(int32_t));
-        packer->len += sizeof(int32_t);
+        packer->buffer[packer->len++] = QP_HOOK;
+        packer->buffer[packer->len++] = bits >> 24;
+        packer->buffer[packer->len++] = bits >> 16;
+        packer->buffer[packer->len++] = bits >> 8;
+        packer->buffer[packer->len++] = bits;
         return 0;
     }
 
-
-    QP_RESIZE(9)
-    packer->buffer[packer->len++] = QP_INT64;
-    memcpy(packer->buffer + packer->len, &integer, sizeof(int64_t));
-    packer->len += sizeof(int64_t);
-    return 0;
+    return qp_add_double(packer, real);
 }
 
-/*
- * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
- */
-int qp_add_true(qp_packer_t * packer) QP_PLAIN_OBJ(QP_TRUE)
-
-/*
- * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
- */
-int qp_add_false(qp_packer_t * packer) QP_PLAIN_OBJ(QP_FALSE)
-
-/*
- * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
- */
-int qp_add_null(qp_packer_t * packer) QP_PLAIN_OBJ(QP_NULL)
+/* Powers of ten for the decimal scales; these are exact doubles */
+static const double qp__pow10[QP_DECIMAL_MAX_SCALE + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+    1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+};
 
 /*
- * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ * Scale a double to the nearest integer of value * 10^scale. Returns 0 if
+ * successful or -1 when the result is not exact as a double (beyond 2^53) or
+ * the value is not finite.
  */
-int qp_add_type(qp_packer_t * packer, qp_types_t tp)
+static int qp__decimal_scale(double real, int scale, int64_t * integer)
 {
-    assert(tp >= QP_ARRAY0 && tp <= QP_MAP_CLOSE);
-    QP_RESIZE(1)
-    packer->buffer[packer->len++] = tp;
+    double scaled = real * qp__pow10[scale], frac;
+    int64_t i;
+
+    if (!(scaled > -9007199254740992.0 && scaled < 9007199254740992.0))
+    {
+        return -1;
+    }
+    i = (int64_t) scaled;
+    frac = scaled - (double) i;
+    *integer = frac >= 0.5 ? i + 1 : frac <= -0.5 ? i - 1 : i;
     return 0;
 }
 
 /*
- * Returns 0 if successful and EOF in case an error occurred.
+ * Add a double as a decimal: the integer value * 10^scale, rounded to the
+ * nearest. It unpacks as the double nearest to that integer / 10^scale, so
+ * a value like 29.1100001 with scale 2 takes 5 bytes and unpacks as 29.11.
+ *
+ * A value which cannot be scaled within 2^53 is added as a double.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred
+ * or -1 when the scale is not between 0 and QP_DECIMAL_MAX_SCALE.
  */
-int qp_fadd_type(qp_fpacker_t * fpacker, qp_types_t tp)
+int qp_add_decimal(qp_packer_t * packer, double real, int scale)
 {
-    assert(tp >= QP_ARRAY0 && tp <= QP_MAP_CLOSE);
-    return (fputc(tp, fpacker) == (int) tp) ? 0 : EOF;
+    int64_t integer;
+
+    if (scale < 0 || scale > QP_DECIMAL_MAX_SCALE)
+    {
+        return -1;
+    }
+
+    if (qp__decimal_scale(real, scale, &integer))
+    {
+        return qp_add_double(packer, real);
+    }
+
+    QP_RESIZE(3)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_DECIMAL;
+    packer->buffer[packer->len++] = scale;
+    return qp_add_int64(packer, integer);
 }
 
 /*
- * Returns 0 if successful and EOF in case an error occurred.
+ * Add an array of decimals as a QP_HOOK_DECIMAL_ARRAY. The payload is:
+ *
+ *  scale (byte), n (integer)
+ *  and for n > 0: first value (integer)
+ *  and for n > 1: base (integer), width (byte), packed deltas
+ *
+ * Each next value is the previous one plus base plus a 'width' bits unsigned
+ * delta; the deltas are packed little endian, starting with the lowest bits.
+ * A series which changes in small steps needs only a few bits per value. The
+ * width is at least 1, so n is bounded by the payload size.
+ *
+ * When a value cannot be scaled (see qp_add_decimal()) the values are added
+ * as an array of doubles.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred
+ * or -1 when the scale is not between 0 and QP_DECIMAL_MAX_SCALE.
  */
-int qp_fadd_raw(qp_fpacker_t * fpacker, const unsigned char * raw, size_t len)
+int qp_add_decimal_array(
+        qp_packer_t * packer,
+        const double * values,
+        size_t n,
+        int scale)
 {
-    if (len < 100)
+    int64_t prev = 0, integer = 0, delta, lo = 0, hi = 0;
+    uint64_t bits = 0;
+    unsigned int nbits = 0, width = 0;
+    size_t i, size, nbytes = 0;
+
+    if (scale < 0 || scale > QP_DECIMAL_MAX_SCALE)
     {
-        if (fputc(128 + len, fpacker) == EOF)
-        {
-            return EOF;
-        }
+        return -1;
     }
-    else if (len <= UINT8_MAX)
+
+    for (i = 0; i < n; i++)
     {
-        if (    fputc(QP_RAW8, fpacker) == EOF ||
-                fputc(len, fpacker) == EOF)
+        if (qp__decimal_scale(values[i], scale, &integer))
         {
-            return EOF;
+            break;
         }
-    }
-    else if (len <= UINT16_MAX)
-    {
-        if (    fputc(QP_RAW16, fpacker) == EOF ||
-                fwrite(&len, sizeof(uint16_t), 1, fpacker) != 1)
+        delta = integer - prev;
+        if (i == 1)
         {
-            return EOF;
+            lo = hi = delta;
+        }
+        else if (i > 1)
+        {
+            lo = delta < lo ? delta : lo;
+            hi = delta > hi ? delta : hi;
         }
+        prev = integer;
     }
-    else if (len <= UINT32_MAX)
+
+    if (i < n)
     {
-        if (    fputc(QP_RAW32, fpacker) == EOF ||
-                fwrite(&len, sizeof(uint32_t), 1, fpacker) != 1)
+        if (qp_add_type(packer, n <= 5 ? QP_ARRAY0 + n : QP_ARRAY_OPEN))
         {
-            return EOF;
+            return -1;
         }
+        for (i = 0; i < n; i++)
+        {
+            if (qp_add_double(packer, values[i]))
+            {
+                return -1;
+            }
+        }
+        return n <= 5 ? 0 : qp_add_type(packer, QP_ARRAY_CLOSE);
     }
-    else
+
+    /* deltas are below 2^54, so the width is at most 55 bits */
+    while (width < 64 && ((uint64_t) (hi - lo) >> width))
     {
-        if (    fputc(QP_RAW64, fpacker) == EOF ||
-                fwrite(&len, sizeof(uint64_t), 1, fpacker) != 1)
+        width++;
+    }
+    if (width == 0)
+    {
+        width = 1;
+    }
+
+    size = 1 + qp__int_size((int64_t) n);
+    if (n)
+    {
+        qp__decimal_scale(values[0], scale, &prev);
+        size += qp__int_size(prev);
+    }
+    if (n > 1)
+    {
+        nbytes = ((n - 1) * width + 7) / 8;
+        size += qp__int_size(lo) + 1 + nbytes;
+    }
+
+    QP_RESIZE(2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_DECIMAL_ARRAY;
+    if (qp_add_int64(packer, (int64_t) size))
+    {
+        return -1;
+    }
+
+    QP_RESIZE(size)
+    packer->buffer[packer->len++] = scale;
+    qp_add_int64(packer, (int64_t) n);
+    if (n == 0)
+    {
+        return 0;
+    }
+    qp_add_int64(packer, prev);
+    if (n == 1)
+    {
+        return 0;
+    }
+    qp_add_int64(packer, lo);
+    packer->buffer[packer->len++] = width;
+
+    for (i = 1; i < n; i++)
+    {
+        qp__decimal_scale(values[i], scale, &integer);
+        bits |= (uint64_t) (integer - prev - lo) << nbits;
+        nbits += width;
+        prev = integer;
+        while (nbits >= 8)
         {
-            return EOF;
+            packer->buffer[packer->len++] = (unsigned char) bits;
+            bits >>= 8;
+            nbits -= 8;
         }
     }
-    return (!len || (fwrite(raw, len, 1, fpacker) == 1)) ? 0 : EOF;
+    if (nbits)
+    {
+        packer->buffer[packer->len++] = (unsigned char) bits;
+    }
+    return 0;
 }
 
-/*
- * Returns 0 if successful and EOF in case an error occurred.
- */
-int qp_fadd_string(qp_fpacker_t * fpacker, const char * str)
+/* Write the header of a QP_HOOK_BOOLS array with n bits */
+static int qp__add_bools_head(qp_packer_t * packer, size_t n)
 {
-    return qp_fadd_raw(fpacker, (unsigned char *) str, strlen(str));
+    size_t nbytes = (n + 7) / 8;
+
+    QP_RESIZE(2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_BOOLS;
+    if (qp_add_int64(packer, (int64_t) (qp__int_size((int64_t) n) + nbytes)) ||
+        qp_add_int64(packer, (int64_t) n))
+    {
+        return -1;
+    }
+    QP_RESIZE(nbytes)
+    return 0;
 }
 
 /*
- * Returns 0 if successful and EOF in case an error occurred.
+ * Add n booleans as a QP_HOOK_BOOLS array; each byte in values is false when
+ * 0 and true otherwise. The payload is:
+ *
+ *  n (integer), followed by the bits
+ *
+ * where value i is bit i % 8 of byte i / 8. Unused bits in the last byte are
+ * 0.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
  */
-int qp_fadd_int64(qp_fpacker_t * fpacker, int64_t integer)
+int qp_add_bools(qp_packer_t * packer, const unsigned char * values, size_t n)
 {
-    int8_t i8;
-    if ((i8 = (int8_t) integer) == integer)
+    unsigned char * pt, byte;
+    size_t i;
+
+    if (qp__add_bools_head(packer, n))
     {
-        if (i8 >= 0 && i8 < 64)
-        {
-            return (fputc(i8, fpacker) != EOF) ? 0 : EOF;
-        }
-        if (i8 >= -60 && i8 < 0)
-        {
-            return (fputc(63 - i8, fpacker) != EOF) ? 0 : EOF;
-        }
-        return (fputc(QP_INT8, fpacker) != EOF && fputc(i8, fpacker) != EOF)
-                ? 0 : EOF;
+        return -1;
     }
-    int16_t i16;
-    if ((i16 = (int16_t) integer) == integer)
+
+    pt = packer->buffer + packer->len;
+    for (i = 0; i + 8 <= n; i += 8, values += 8)
     {
-        return (fputc(QP_INT16, fpacker) != EOF &&
-                fwrite(&i16, sizeof(int16_t), 1, fpacker) == 1) ? 0 : EOF;
+        *pt++ = (values[0] != 0) |
+                (values[1] != 0) << 1 |
+                (values[2] != 0) << 2 |
+                (values[3] != 0) << 3 |
+                (values[4] != 0) << 4 |
+                (values[5] != 0) << 5 |
+                (values[6] != 0) << 6 |
+                (values[7] != 0) << 7;
     }
-
-    int32_t i32;
-    if ((i32 = (int32_t) integer) == integer)
+    if (i < n)
     {
-        return (fputc(QP_INT32, fpacker) != EOF &&
-                fwrite(&i32, sizeof(int32_t), 1, fpacker) == 1) ? 0 : EOF;
+        for (byte = 0; i < n; i++, values++)
+        {
+            byte |= (*values != 0) << (i & 7);
+        }
+        *pt++ = byte;
     }
 
-    return (fputc(QP_INT64, fpacker) != EOF &&
-            fwrite(&integer, sizeof(int64_t), 1, fpacker) == 1) ? 0 : EOF;
+    packer->len = pt - packer->buffer;
+    return 0;
 }
 
 /*
- * Returns 0 if successful and EOF in case an error occurred.
+ * Like qp_add_bools() but with the n bits already packed in bits.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
  */
-int qp_fadd_double(qp_fpacker_t * fpacker, double real)
+int qp_add_bits(qp_packer_t * packer, const unsigned char * bits, size_t n)
 {
-    if (real == 0.0)
-    {
-        return (fputc(QP_DOUBLE_0, fpacker) != EOF) ? 0 : EOF;
-    }
-    else if (real == 1.0)
-    {
-        return (fputc(QP_DOUBLE_1, fpacker) != EOF) ? 0 : EOF;
-    }
-    else if (real == -1.0)
+    size_t nbytes = (n + 7) / 8;
+
+    if (qp__add_bools_head(packer, n))
     {
-        return (fputc(QP_DOUBLE_N1, fpacker) != EOF) ? 0 : EOF;
+        return -1;
     }
-    else
+    memcpy(packer->buffer + packer->len, bits, nbytes);
+    packer->len += nbytes;
+    if (n & 7)
     {
-        return (fputc(QP_DOUBLE, fpacker) != EOF &&
-                fwrite(&real, sizeof(double), 1, fpacker) == 1) ? 0 : EOF;
+        packer->buffer[packer->len - 1] &= (1u << (n & 7)) - 1;
     }
     return 0;
 }
 
 /*
- * Jump to the next object. If 'qp_obj' is not NULL, the object will be stored
- * in qp_obj so you can use it later.
+ * Add an array of n strings as a QP_HOOK_DICT: the k distinct strings once,
+ * and for each value the index of its string. The payload is:
  *
- * Returns one of the following: (these are the ONLY possible return values)
+ *  n (integer), k (integer), the k strings (raw),
+ *  width (byte), n indexes of 'width' bits
  *
- *  QP_END, QP_RAW, QP_INT64, QP_DOUBLE
- *  QP_TRUE, QP_FALSE, QP_NULL, QP_ARRAY0..5, QP_MAP0..5,
- *  QP_ARRAY_OPEN, QP_ARRAY_CLOSE, QP_MAP_OPEN, QP_MAP_CLOSE
+ * where width is the number of bits for k - 1 and the indexes are packed
+ * like the deltas of a QP_HOOK_DECIMAL_ARRAY. Each index must be below k.
+ * The width is at least 1 when n > k, so n is bounded by the payload size.
  *
- * Its fine to reuse the same object without calling free in between.
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
  */
-qp_types_t qp_next(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
+int qp_add_dict(
+        qp_packer_t * packer,
+        const char * const * strs,
+        const size_t * lens,
+        size_t k,
+        const uint32_t * indexes,
+        size_t n)
 {
-    uint8_t tp;
+    size_t i, size, nbytes;
+    unsigned int width = 0, nbits = 0;
+    uint64_t bits = 0;
 
-    if (unpacker->pt >= unpacker->end)
+    while (k > 1 && ((uint64_t) (k - 1) >> width))
     {
-        if (qp_obj != NULL)
-        {
-            qp_obj->tp = QP_END;
-        }
-        return QP_END;
+        width++;
     }
+    if (width == 0 && n > k)
+    {
+        width = 1;
+    }
+    nbytes = (n * width + 7) / 8;
 
-    tp = *unpacker->pt;
-    unpacker->pt++;
-
-    switch(tp)
+    size = qp__int_size((int64_t) n) + qp__int_size((int64_t) k) + 1 + nbytes;
+    for (i = 0; i < k; i++)
+    {
+        size += lens[i] + (lens[i] < 100 ? 1 :
+                           lens[i] <= UINT8_MAX ? 2 :
+                           lens[i] <= UINT16_MAX ? 3 :
+                           lens[i] <= UINT32_MAX ? 5 : 9);
+    }
+
+    QP_RESIZE(2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_DICT;
+    if (qp_add_int64(packer, (int64_t) size) ||
+        qp_add_int64(packer, (int64_t) n) ||
+        qp_add_int64(packer, (int64_t) k))
+    {
+        return -1;
+    }
+    for (i = 0; i < k; i++)
+    {
+        if (qp_add_raw(packer, (const unsigned char *) strs[i], lens[i]))
+        {
+            return -1;
+        }
+    }
+
+    QP_RESIZE(1 + nbytes)
+    packer->buffer[packer->len++] = width;
+    for (i = 0; width && i < n; i++)
+    {
+        bits |= (uint64_t) indexes[i] << nbits;
+        nbits += width;
+        while (nbits >= 8)
+        {
+            packer->buffer[packer->len++] = (unsigned char) bits;
+            bits >>= 8;
+            nbits -= 8;
+        }
+    }
+    if (nbits)
+    {
+        packer->buffer[packer->len++] = (unsigned char) bits;
+    }
+    return 0;
+}
+
+/*
+ * Add a value of extension type id (0 to QP_EXT_MAX) with n bytes of data as
+ * its payload. The value is a QP_HOOK_EXT:
+ *
+ *  QP_HOOK, QP_HOOK_EXT, length (integer), id (byte), data
+ *
+ * so a reader which does not know the type skips it like any sized hook.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_ext(
+        qp_packer_t * packer,
+        uint8_t id,
+        const unsigned char * data,
+        size_t n)
+{
+    if (id > QP_EXT_MAX)
+    {
+        return -1;
+    }
+    QP_RESIZE(2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_EXT;
+    if (qp_add_int64(packer, (int64_t) n + 1))
+    {
+        return -1;
+    }
+    QP_RESIZE(1 + n)
+    packer->buffer[packer->len++] = id;
+    memcpy(packer->buffer + packer->len, data, n);
+    packer->len += n;
+    return 0;
+}
+
+/*
+ * Turn the bytes which were added from position pos into the data of an
+ * extension value, like qp_add_ext() writes. This lets a codec write its
+ * payload straight into the packer; the payload is moved once to make room
+ * for the header.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_ext_close(qp_packer_t * packer, uint8_t id, size_t pos)
+{
+    size_t n = packer->len - pos;
+    size_t head = 2 + qp__int_size((int64_t) n + 1) + 1;
+
+    if (id > QP_EXT_MAX)
+    {
+        return -1;
+    }
+    QP_RESIZE(head)
+    memmove(packer->buffer + pos + head, packer->buffer + pos, n);
+    packer->len = pos;
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_EXT;
+    qp_add_int64(packer, (int64_t) n + 1);
+    packer->buffer[packer->len++] = id;
+    packer->len += n;
+    return 0;
+}
+
+/*
+ * Add a back-reference to an earlier container within a QP_HOOK_SHARED
+ * value. Containers are numbered from 0 in the order in which they open,
+ * counting the QP_HOOK_SHARED value itself when it is a container and each
+ * QP_HOOK_RUNS array, but not other sized hooks. A reference to a container
+ * which is still open makes a cycle.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_ref(qp_packer_t * packer, size_t ordinal)
+{
+    QP_RESIZE(2)
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_REF;
+    return qp_add_int64(packer, (int64_t) ordinal);
+}
+
+/*
+ * Turn the value which was added from position pos into the payload of a
+ * QP_HOOK_SHARED, so a reader knows to number its containers before it
+ * meets a QP_HOOK_REF. This moves the value, so it is meant to be called
+ * once, when the value turned out to have back-references.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_shared(qp_packer_t * packer, size_t pos)
+{
+    size_t len = packer->len - pos;
+    size_t head = 2 + qp__int_size((int64_t) len);
+
+    QP_RESIZE(head)
+    memmove(packer->buffer + pos + head, packer->buffer + pos, len);
+    packer->len = pos;
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_SHARED;
+    qp_add_int64(packer, (int64_t) len);
+    packer->len += len;
+    return 0;
+}
+
+/*
+ * Start an array of n values with runs of repeated values. Add each value as
+ * usual and call qp_runs_next() after it; a value with the same bytes as the
+ * one before is taken back and counted instead. qp_runs_close() ends the
+ * array. The result is a QP_HOOK_RUNS with as payload:
+ *
+ *  n (integer), followed by the values
+ *
+ * where QP_HOOK, QP_HOOK_REPEAT and a count stand for the value before it,
+ * count more times. Containers are never repeated this way, so a reader can
+ * use the same (immutable) value for each of them.
+ *
+ * When no run is long enough to save space, qp_runs_close() turns it into a
+ * plain array.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_runs_open(qp_packer_t * packer, qp_runs_t * runs, size_t n)
+{
+    int32_t size = 0;
+
+    runs->n = n;
+    runs->pos = packer->len;
+    runs->count = 0;
+    runs->repeats = 0;
+
+    /* the payload length is set by qp_runs_close() */
+    QP_RESIZE(2 + 1 + sizeof(int32_t))
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] = QP_HOOK_RUNS;
+    packer->buffer[packer->len++] = QP_INT32;
+    memcpy(packer->buffer + packer->len, &size, sizeof(int32_t));
+    packer->len += sizeof(int32_t);
+    if (qp_add_int64(packer, (int64_t) n))
+    {
+        return -1;
+    }
+
+    runs->prev = runs->start = packer->len;
+    return 0;
+}
+
+/*
+ * Write the repeats of the previous value in front of the value at
+ * runs->start; a short run is cheaper as copies of the value.
+ */
+static int qp__runs_flush(qp_packer_t * packer, qp_runs_t * runs)
+{
+    size_t vlen = runs->start - runs->prev;
+    size_t mark = 2 + qp__int_size((int64_t) runs->count);
+    size_t n = runs->count * vlen <= mark ? runs->count * vlen : mark;
+    size_t len = packer->len, i;
+    unsigned char * pt;
+
+    QP_RESIZE(n)
+    pt = packer->buffer + runs->start;
+    memmove(pt + n, pt, len - runs->start);
+
+    if (n == mark)
+    {
+        packer->len = runs->start;
+        packer->buffer[packer->len++] = QP_HOOK;
+        packer->buffer[packer->len++] = QP_HOOK_REPEAT;
+        (void) qp_add_int64(packer, (int64_t) runs->count);  /* fits */
+        runs->repeats++;
+    }
+    else
+    {
+        for (i = 0; i < runs->count; i++)
+        {
+            memcpy(pt + i * vlen, packer->buffer + runs->prev, vlen);
+        }
+    }
+
+    packer->len = len + n;
+    runs->start += n;
+    runs->count = 0;
+    return 0;
+}
+
+/*
+ * Call after each value of a qp_runs_open() array.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_runs_next(qp_packer_t * packer, qp_runs_t * runs)
+{
+    size_t vlen = packer->len - runs->start;
+    unsigned char * pt = packer->buffer + runs->start;
+    uint8_t tp = *pt;
+
+    if (runs->start > runs->prev &&
+        vlen == runs->start - runs->prev &&
+        !(tp >= QP_ARRAY0 && tp <= QP_MAP5) &&
+        tp != QP_ARRAY_OPEN && tp != QP_MAP_OPEN &&
+        !(tp == QP_HOOK && pt[1] >= QP_HOOK_SIZED && pt[1] < QP_HOOK_FLOAT32) &&
+        memcmp(pt, packer->buffer + runs->prev, vlen) == 0)
+    {
+        packer->len = runs->start;
+        runs->count++;
+        return 0;
+    }
+
+    if (runs->count && qp__runs_flush(packer, runs))
+    {
+        return -1;
+    }
+    runs->prev = runs->start;
+    runs->start = packer->len;
+    return 0;
+}
+
+/*
+ * End a qp_runs_open() array.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_runs_close(qp_packer_t * packer, qp_runs_t * runs)
+{
+    size_t head = 2 + 1 + sizeof(int32_t) + qp__int_size((int64_t) runs->n);
+    size_t size;
+    int32_t size32;
+
+    if (runs->count && qp__runs_flush(packer, runs))
+    {
+        return -1;
+    }
+
+    if (runs->repeats == 0)
+    {
+        /* the values are the same as for a plain array */
+        unsigned char * pt = packer->buffer + runs->pos;
+        size = packer->len - runs->pos - head;
+        memmove(pt + 1, pt + head, size);
+        packer->len = runs->pos + 1 + size;
+        if (runs->n <= 5)
+        {
+            *pt = QP_ARRAY0 + runs->n;
+            return 0;
+        }
+        *pt = QP_ARRAY_OPEN;
+        return qp_add_type(packer, QP_ARRAY_CLOSE);
+    }
+
+    size = packer->len - runs->pos - 2 - 1 - sizeof(int32_t);
+    if (size > INT32_MAX)
+    {
+        int64_t size64 = (int64_t) size;
+        size_t extra = sizeof(int64_t) - sizeof(int32_t);
+        unsigned char * pt;
+        QP_RESIZE(extra)
+        pt = packer->buffer + runs->pos + 2 + 1;
+        memmove(pt + sizeof(int64_t), pt + sizeof(int32_t), size);
+        pt[-1] = QP_INT64;
+        memcpy(pt, &size64, sizeof(int64_t));
+        packer->len += extra;
+        return 0;
+    }
+
+    size32 = (int32_t) size;
+    memcpy(packer->buffer + runs->pos + 2 + 1, &size32, sizeof(int32_t));
+    return 0;
+}
+
+/*
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_int64(qp_packer_t * packer, int64_t integer)
+{
+    int8_t i8;
+    if ((i8 = (int8_t) integer) == integer)
+    {
+        QP_RESIZE(2)
+        if (i8 >= 0 && i8 < 64)
+        {
+            packer->buffer[packer->len++] = i8;
+        }
+        else if (i8 >= -60 && i8 < 0)
+        {
+            packer->buffer[packer->len++] = 63 - i8;
+        }
+        else
+        {
+            packer->buffer[packer->len++] = QP_INT8;
+            packer->buffer[packer->len++] = i8;
+        }
+        return 0;
+    }
+
+    int16_t i16;
+    if ((i16 = (int16_t) integer) == integer)
+    {
+        QP_RESIZE(3)
+        packer->buffer[packer->len++] = QP_INT16;
+        memcpy(packer->buffer + packer->len, &i16, sizeof(int16_t));
+        packer->len += sizeof(int16_t);
+        return 0;
+    }
+
+    int32_t i32;
+    if ((i32 = (int32_t) integer) == integer)
+    {
+        QP_RESIZE(5)
+        packer->buffer[packer->len++] = QP_INT32;
+        memcpy(packer->buffer + packer->len, &i32, sizeof(int32_t));
+        packer->len += sizeof(int32_t);
+        return 0;
+    }
+
+
+    QP_RESIZE(9)
+    packer->buffer[packer->len++] = QP_INT64;
+    memcpy(packer->buffer + packer->len, &integer, sizeof(int64_t));
+    packer->len += sizeof(int64_t);
+    return 0;
+}
+
+/*
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_true(qp_packer_t * packer) QP_PLAIN_OBJ(QP_TRUE)
+
+/*
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_false(qp_packer_t * packer) QP_PLAIN_OBJ(QP_FALSE)
+
+/*
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_null(qp_packer_t * packer) QP_PLAIN_OBJ(QP_NULL)
+
+/*
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_type(qp_packer_t * packer, qp_types_t tp)
+{
+    assert(tp >= QP_ARRAY0 && tp <= QP_MAP_CLOSE);
+    QP_RESIZE(1)
+    packer->buffer[packer->len++] = tp;
+    return 0;
+}
+
+/*
+ * Open an array or map (QP_ARRAY_OPEN or QP_MAP_OPEN) for which the number of
+ * items is not known yet. The position of the header is stored in 'pos' and
+ * must be used with qp_add_close() to finish the container.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_open(qp_packer_t * packer, qp_types_t tp, size_t * pos)
+{
+    assert (tp == QP_ARRAY_OPEN || tp == QP_MAP_OPEN);
+    QP_RESIZE(1)
+    *pos = packer->len;
+    packer->buffer[packer->len++] = tp;
+    return 0;
+}
+
+/*
+ * Like qp_add_open() but the container is written as:
+ *
+ *  QP_HOOK, QP_HOOK_ARRAY or QP_HOOK_MAP, size (integer),
+ *  count (integer), the items, QP_ARRAY_CLOSE or QP_MAP_CLOSE
+ *
+ * where the size is the number of bytes after it and count the number of
+ * array items or map key/value pairs. Both are set by qp_add_close(), so a
+ * reader can skip the container at once and knows the number of items before
+ * reading them. Containers with less than QP_SIZED_MIN bytes of items are
+ * written as plain containers instead.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_open_sized(qp_packer_t * packer, qp_types_t tp, size_t * pos)
+{
+    int32_t zero = 0;
+
+    assert (tp == QP_ARRAY_OPEN || tp == QP_MAP_OPEN);
+    QP_RESIZE(QP_SIZED_HEAD)
+    *pos = packer->len;
+    packer->buffer[packer->len++] = QP_HOOK;
+    packer->buffer[packer->len++] =
+            tp == QP_ARRAY_OPEN ? QP_HOOK_ARRAY : QP_HOOK_MAP;
+    packer->buffer[packer->len++] = QP_INT32;
+    memcpy(packer->buffer + packer->len, &zero, sizeof(int32_t));
+    packer->len += sizeof(int32_t);
+    packer->buffer[packer->len++] = QP_INT32;
+    memcpy(packer->buffer + packer->len, &zero, sizeof(int32_t));
+    packer->len += sizeof(int32_t);
+    return 0;
+}
+
+/*
+ * Finish a container started with qp_add_open_sized().
+ */
+static int qp__close_sized(qp_packer_t * packer, size_t pos, size_t count)
+{
+    int is_array = packer->buffer[pos + 1] == QP_HOOK_ARRAY;
+    size_t n = packer->len - pos - QP_SIZED_HEAD;
+    size_t extra = 2 * (sizeof(int64_t) - sizeof(int32_t));
+    size_t size;
+    unsigned char * pt;
+    int32_t i32;
+
+    if (n < QP_SIZED_MIN)
+    {
+        pt = packer->buffer + pos;
+        memmove(pt + 1, pt + QP_SIZED_HEAD, n);
+        packer->len = pos + 1 + n;
+        *pt = is_array ? QP_ARRAY_OPEN : QP_MAP_OPEN;
+        return qp_add_close(packer, pos, count);
+    }
+
+    QP_RESIZE(1 + extra)
+    packer->buffer[packer->len++] = is_array ? QP_ARRAY_CLOSE : QP_MAP_CLOSE;
+    pt = packer->buffer + pos;
+    size = packer->len - pos - 2 - 1 - sizeof(int32_t);
+
+    if (size > INT32_MAX)
+    {
+        /* both the size and the count become a QP_INT64 */
+        int64_t i64 = (int64_t) (size + extra / 2);
+        memmove(pt + QP_SIZED_HEAD + extra, pt + QP_SIZED_HEAD, n + 1);
+        packer->len += extra;
+        pt[2] = QP_INT64;
+        memcpy(pt + 3, &i64, sizeof(int64_t));
+        pt[3 + sizeof(int64_t)] = QP_INT64;
+        i64 = (int64_t) count;
+        memcpy(pt + 4 + sizeof(int64_t), &i64, sizeof(int64_t));
+        return 0;
+    }
+
+    /* the count is never larger than the size */
+    i32 = (int32_t) size;
+    memcpy(pt + 3, &i32, sizeof(int32_t));
+    i32 = (int32_t) count;
+    memcpy(pt + 4 + sizeof(int32_t), &i32, sizeof(int32_t));
+    return 0;
+}
+
+/*
+ * Finish a container started with qp_add_open() or qp_add_open_sized(). The
+ * 'count' is the number of array items or map key/value pairs. Small
+ * containers get a fixed size header (QP_ARRAY0..5 or QP_MAP0..5) instead of
+ * a close type.
+ *
+ * Returns 0 if successful; -1 and a SIGNAL is raised in case an error occurred.
+ */
+int qp_add_close(qp_packer_t * packer, size_t pos, size_t count)
+{
+    int is_array;
+    if (packer->buffer[pos] == QP_HOOK)
+    {
+        return qp__close_sized(packer, pos, count);
+    }
+    is_array = packer->buffer[pos] == QP_ARRAY_OPEN;
+    assert (is_array || packer->buffer[pos] == QP_MAP_OPEN);
+    if (count <= 5)
+    {
+        packer->buffer[pos] = (is_array ? QP_ARRAY0 : QP_MAP0) + count;
+        return 0;
+    }
+    QP_RESIZE(1)
+    packer->buffer[packer->len++] = is_array ? QP_ARRAY_CLOSE : QP_MAP_CLOSE;
+    return 0;
+}
+
+/*
+ * Returns 0 if successful and EOF in case an error occurred.
+ */
+int qp_fadd_type(qp_fpacker_t * fpacker, qp_types_t tp)
+{
+    assert(tp >= QP_ARRAY0 && tp <= QP_MAP_CLOSE);
+    return (fputc(tp, fpacker) == (int) tp) ? 0 : EOF;
+}
+
+/*
+ * Returns 0 if successful and EOF in case an error occurred.
+ */
+int qp_fadd_raw(qp_fpacker_t * fpacker, const unsigned char * raw, size_t len)
+{
+    if (len < 100)
+    {
+        if (fputc(128 + len, fpacker) == EOF)
+        {
+            return EOF;
+        }
+    }
+    else if (len <= UINT8_MAX)
+    {
+        if (    fputc(QP_RAW8, fpacker) == EOF ||
+                fputc(len, fpacker) == EOF)
+        {
+            return EOF;
+        }
+    }
+    else if (len <= UINT16_MAX)
+    {
+        if (    fputc(QP_RAW16, fpacker) == EOF ||
+                fwrite(&len, sizeof(uint16_t), 1, fpacker) != 1)
+        {
+            return EOF;
+        }
+    }
+    else if (len <= UINT32_MAX)
+    {
+        if (    fputc(QP_RAW32, fpacker) == EOF ||
+                fwrite(&len, sizeof(uint32_t), 1, fpacker) != 1)
+        {
+            return EOF;
+        }
+    }
+    else
+    {
+        if (    fputc(QP_RAW64, fpacker) == EOF ||
+                fwrite(&len, sizeof(uint64_t), 1, fpacker) != 1)
+        {
+            return EOF;
+        }
+    }
+    return (!len || (fwrite(raw, len, 1, fpacker) == 1)) ? 0 : EOF;
+}
+
+/*
+ * Returns 0 if successful and EOF in case an error occurred.
+ */
+int qp_fadd_string(qp_fpacker_t * fpacker, const char * str)
+{
+    return qp_fadd_raw(fpacker, (unsigned char *) str, strlen(str));
+}
+
+/*
+ * Returns 0 if successful and EOF in case an error occurred.
+ */
+int qp_fadd_int64(qp_fpacker_t * fpacker, int64_t integer)
+{
+    int8_t i8;
+    if ((i8 = (int8_t) integer) == integer)
+    {
+        if (i8 >= 0 && i8 < 64)
+        {
+            return (fputc(i8, fpacker) != EOF) ? 0 : EOF;
+        }
+        if (i8 >= -60 && i8 < 0)
+        {
+            return (fputc(63 - i8, fpacker) != EOF) ? 0 : EOF;
+        }
+        return (fputc(QP_INT8, fpacker) != EOF && fputc(i8, fpacker) != EOF)
+                ? 0 : EOF;
+    }
+    int16_t i16;
+    if ((i16 = (int16_t) integer) == integer)
+    {
+        return (fputc(QP_INT16, fpacker) != EOF &&
+                fwrite(&i16, sizeof(int16_t), 1, fpacker) == 1) ? 0 : EOF;
+    }
+
+    int32_t i32;
+    if ((i32 = (int32_t) integer) == integer)
+    {
+        return (fputc(QP_INT32, fpacker) != EOF &&
+                fwrite(&i32, sizeof(int32_t), 1, fpacker) == 1) ? 0 : EOF;
+    }
+
+    return (fputc(QP_INT64, fpacker) != EOF &&
+            fwrite(&integer, sizeof(int64_t), 1, fpacker) == 1) ? 0 : EOF;
+}
+
+/*
+ * Returns 0 if successful and EOF in case an error occurred.
+ */
+int qp_fadd_double(qp_fpacker_t * fpacker, double real)
+{
+    if (real == 0.0)
+    {
+        return (fputc(QP_DOUBLE_0, fpacker) != EOF) ? 0 : EOF;
+    }
+    else if (real == 1.0)
+    {
+        return (fputc(QP_DOUBLE_1, fpacker) != EOF) ? 0 : EOF;
+    }
+    else if (real == -1.0)
+    {
+        return (fputc(QP_DOUBLE_N1, fpacker) != EOF) ? 0 : EOF;
+    }
+    else
+    {
+        return (fputc(QP_DOUBLE, fpacker) != EOF &&
+                fwrite(&real, sizeof(double), 1, fpacker) == 1) ? 0 : EOF;
+    }
+    return 0;
+}
+
+/*
+ * Open file 'fn' for adding elements to a top level open array. A new or empty
+ * file gets a QP_ARRAY_OPEN; an existing file must start with QP_ARRAY_OPEN.
+ * Everything written with the qp_fadd_ functions is added to the end of the
+ * file and is an element of the array. The array is never closed since
+ * readers take the end of the file as the close of the array, which means
+ * the file can be closed with qp_close() and opened again later to add more
+ * elements without rewriting existing data.
+ *
+ * Returns NULL in case an error occurred, with errno set (EINVAL when the file
+ * is not an open array). Nothing is logged.
+ */
+qp_fpacker_t * qp_fappend_open(const char * fn)
+{
+    qp_fpacker_t * fpacker;
+    int c, err;
+
+    fpacker = fopen(fn, "a+");
+    if (fpacker == NULL)
+    {
+        return NULL;
+    }
+
+    /* elements are usually small, write them in large blocks */
+    setvbuf(fpacker, NULL, _IOFBF, QP_SUGGESTED_SIZE);
+
+    rewind(fpacker);
+    c = fgetc(fpacker);
+    if (c == EOF && ferror(fpacker))
+    {
+        goto error;
+    }
+    if (c != EOF && c != QP_ARRAY_OPEN)
+    {
+        errno = EINVAL;
+        goto error;
+    }
+
+    /* a stream must be positioned before switching from reading to writing */
+    if (fseeko(fpacker, 0, SEEK_END) ||
+        (c == EOF && fputc(QP_ARRAY_OPEN, fpacker) == EOF))
+    {
+        goto error;
+    }
+
+    return fpacker;
+
+error:
+    /* keep the errno of the failure, not of closing the file */
+    err = errno;
+    fclose(fpacker);
+    errno = err;
+    return NULL;
+}
+
+/*
+ * Read the integer in the header of a hook type. Unlike qp_next(), this does
+ * not follow a hook, so a chain of hooks cannot recurse.
+ *
+ * Returns 0 if successful or -1 when the next object is not an integer.
+ */
+static int qp__next_int(qp_unpacker_t * unpacker, int64_t * integer)
+{
+    uint8_t tp;
+    size_t sz;
+    int16_t i16;
+    int32_t i32;
+
+    if (unpacker->pt >= unpacker->end)
+    {
+        return -1;
+    }
+    tp = *unpacker->pt++;
+    if (tp < QP_HOOK)
+    {
+        *integer = tp < 64 ? (int64_t) tp : (int64_t) 63 - tp;
+        return 0;
+    }
+    if (tp < QP_INT8 || tp > QP_INT64)
+    {
+        return -1;
+    }
+    sz = (size_t) 1 << (tp - QP_INT8);
+    if (sz > (size_t) (unpacker->end - unpacker->pt))
+    {
+        return -1;
+    }
+    switch ((qp_types_t) tp)
+    {
+    case QP_INT8:
+        *integer = (int8_t) *unpacker->pt;
+        break;
+    case QP_INT16:
+        memcpy(&i16, unpacker->pt, sizeof(int16_t));
+        *integer = i16;
+        break;
+    case QP_INT32:
+        memcpy(&i32, unpacker->pt, sizeof(int32_t));
+        *integer = i32;
+        break;
+    default:
+        memcpy(integer, unpacker->pt, sizeof(int64_t));
+        break;
+    }
+    unpacker->pt += sz;
+    return 0;
+}
+
+/*
+ * Unpack the header of a QP_HOOK_ARRAY or QP_HOOK_MAP container. The unpacker
+ * is left at the first item and qp_obj gets the number of items in via.int64
+ * and the number of bytes up to the end of the container in len.
+ */
+static qp_types_t qp__next_sized(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
+{
+    int64_t size, count;
+    uint8_t hook = *unpacker->pt++;
+    qp_types_t tp = hook == QP_HOOK_ARRAY ? QP_ARRAY_OPEN : QP_MAP_OPEN;
+    const unsigned char * end;
+
+    if (qp__next_int(unpacker, &size) ||
+        size < 2 ||
+        size > unpacker->end - unpacker->pt)
+    {
+        goto error;
+    }
+    end = unpacker->pt + size;
+    if (qp__next_int(unpacker, &count) ||
+        count < 0 ||
+        count > end - unpacker->pt ||
+        end[-1] != (tp == QP_ARRAY_OPEN ? QP_ARRAY_CLOSE : QP_MAP_CLOSE))
+    {
+        goto error;
+    }
+    if (qp_obj != NULL)
+    {
+        qp_obj->tp = tp;
+        qp_obj->hook = hook;
+        qp_obj->via.int64 = count;
+        qp_obj->len = end - unpacker->pt;
+    }
+    return tp;
+
+error:
+    if (qp_obj != NULL)
+    {
+        qp_obj->tp = QP_ERR;
+    }
+    return QP_ERR;
+}
+
+/*
+ * Unpack a hook type; the unpacker is at the byte after QP_HOOK. A sized hook
+ * type returns QP_HOOK with the payload in qp_obj, other unknown hook types
+ * return QP_HOOK with only the QP_HOOK byte consumed.
+ */
+static qp_types_t qp__next_hook(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
+{
+    int64_t integer;
+    uint8_t scale, hook;
+
+    switch ((qp_hook_t) *unpacker->pt)
+    {
+    case QP_HOOK_DOUBLE_INT:
+        unpacker->pt++;
+        if (qp__next_int(unpacker, &integer))
+        {
+            if (qp_obj != NULL)
+            {
+                qp_obj->tp = QP_ERR;
+            }
+            return QP_ERR;
+        }
+        if (qp_obj != NULL)
+        {
+            qp_obj->tp = QP_DOUBLE;
+            qp_obj->via.real = (double) integer;
+        }
+        return QP_DOUBLE;
+    case QP_HOOK_DECIMAL:
+        QP_UNPACK_CHECK_SZ(2)
+        scale = unpacker->pt[1];
+        unpacker->pt += 2;
+        if (scale > QP_DECIMAL_MAX_SCALE ||
+            qp__next_int(unpacker, &integer))
+        {
+            if (qp_obj != NULL)
+            {
+                qp_obj->tp = QP_ERR;
+            }
+            return QP_ERR;
+        }
+        if (qp_obj != NULL)
+        {
+            qp_obj->tp = QP_DOUBLE;
+            qp_obj->via.real = (double) integer / qp__pow10[scale];
+        }
+        return QP_DOUBLE;
+    case QP_HOOK_ARRAY:
+    case QP_HOOK_MAP:
+        return qp__next_sized(unpacker, qp_obj);
+    case QP_HOOK_REPEAT:
+    case QP_HOOK_REF:
+        hook = *unpacker->pt++;
+        if (qp__next_int(unpacker, &integer) ||
+            integer < (hook == QP_HOOK_REPEAT))
+        {
+            if (qp_obj != NULL)
+            {
+                qp_obj->tp = QP_ERR;
+            }
+            return QP_ERR;
+        }
+        if (qp_obj != NULL)
+        {
+            qp_obj->tp = QP_HOOK;
+            qp_obj->hook = hook;
+            qp_obj->via.int64 = integer;
+        }
+        return QP_HOOK;
+    default:
+        if (qp_obj != NULL)
+        {
+            qp_obj->tp = QP_HOOK;
+            qp_obj->hook = *unpacker->pt;
+        }
+        if (*unpacker->pt < QP_HOOK_SIZED)
+        {
+            return QP_HOOK;
+        }
+        unpacker->pt++;
+        if (qp__next_int(unpacker, &integer) ||
+            integer < 0 ||
+            integer > unpacker->end - unpacker->pt)
+        {
+            if (qp_obj != NULL)
+            {
+                qp_obj->tp = QP_ERR;
+            }
+            return QP_ERR;
+        }
+        if (qp_obj != NULL)
+        {
+            qp_obj->via.raw = unpacker->pt;
+            qp_obj->len = (size_t) integer;
+        }
+        unpacker->pt += integer;
+        return QP_HOOK;
+    }
+}
+
+/*
+ * Get the extension id and the data of a QP_HOOK_EXT object.
+ *
+ * Returns 0 if successful or -1 when the object is not a valid extension
+ * value.
+ */
+int qp_ext_get(
+        qp_obj_t * qp_obj,
+        uint8_t * id,
+        const unsigned char ** data,
+        size_t * n)
+{
+    if (qp_obj->tp != QP_HOOK || qp_obj->hook != QP_HOOK_EXT ||
+        qp_obj->len < 1 || qp_obj->via.raw[0] > QP_EXT_MAX)
+    {
+        return -1;
+    }
+    *id = qp_obj->via.raw[0];
+    *data = qp_obj->via.raw + 1;
+    *n = qp_obj->len - 1;
+    return 0;
+}
+
+/* registered codecs by extension id */
+static const qp_ext_t * qp__exts[QP_EXT_MAX + 1];
+
+/*
+ * Register the codec for extension type id, or remove it when ext is NULL.
+ * The codec is not copied and must stay valid while it is registered. The
+ * registry is global and not locked, so register codecs at startup, before
+ * packing or unpacking in other threads.
+ *
+ * Returns 0 if successful or -1 when the id is out of range or taken.
+ */
+int qp_register_ext(uint8_t id, const qp_ext_t * ext)
+{
+    if (id > QP_EXT_MAX || (ext != NULL && qp__exts[id] != NULL))
+    {
+        return -1;
+    }
+    qp__exts[id] = ext;
+    return 0;
+}
+
+/*
+ * Returns the codec for extension type id, or NULL when none is registered.
+ */
+const qp_ext_t * qp_ext_find(uint8_t id)
+{
+    return id > QP_EXT_MAX ? NULL : qp__exts[id];
+}
+
+/*
+ * Returns the codec with the given type name and sets its id, or returns
+ * NULL when there is none.
+ */
+const qp_ext_t * qp_ext_find_name(const char * name, uint8_t * id)
+{
+    uint8_t i;
+
+    for (i = 0; i <= QP_EXT_MAX; i++)
+    {
+        if (qp__exts[i] != NULL && qp__exts[i]->name != NULL &&
+            strcmp(qp__exts[i]->name, name) == 0)
+        {
+            *id = i;
+            return qp__exts[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Get the number of values of a QP_HOOK_RUNS object (see qp_runs_open()) and
+ * an unpacker for them; after a value, qp_next() on 'values' may return a
+ * QP_HOOK_REPEAT with the number of repeats. The repeats are checked to add
+ * up to n with the values, so n is known to be backed by the payload before
+ * anything is read.
+ *
+ * Returns 0 if successful or -1 when the object is not a valid array with runs.
+ */
+int qp_runs_get(qp_obj_t * qp_obj, size_t * n, qp_unpacker_t * values)
+{
+    qp_unpacker_t unpacker;
+    qp_obj_t obj;
+    size_t i = 0;
+
+    if (qp_obj->tp != QP_HOOK || qp_obj->hook != QP_HOOK_RUNS)
+    {
+        return -1;
+    }
+
+    qp_unpacker_init(&unpacker, qp_obj->via.raw, qp_obj->len);
+    if (qp_next(&unpacker, &obj) != QP_INT64 || obj.via.int64 < 0)
+    {
+        return -1;
+    }
+    *n = (size_t) obj.via.int64;
+    *values = unpacker;
+
+    while (unpacker.pt < unpacker.end)
+    {
+        if (unpacker.pt + 1 < unpacker.end &&
+            *unpacker.pt == QP_HOOK &&
+            unpacker.pt[1] == QP_HOOK_REPEAT)
+        {
+            if (qp_next(&unpacker, &obj) != QP_HOOK ||
+                i == 0 ||
+                (uint64_t) obj.via.int64 > *n - i)
+            {
+                return -1;
+            }
+            i += (size_t) obj.via.int64;
+            continue;
+        }
+        if (i == *n || qp_skip_next(&unpacker) == QP_ERR)
+        {
+            return -1;
+        }
+        i++;
+    }
+    return i == *n ? 0 : -1;
+}
+
+/*
+ * Get the number of booleans and the packed bits of a QP_HOOK_BOOLS object
+ * (see qp_add_bools()). Unused bits in the last byte are not checked.
+ *
+ * Returns 0 if successful or -1 when the object is not a valid bool array.
+ */
+int qp_bools_get(qp_obj_t * qp_obj, size_t * n, unsigned char ** bits)
+{
+    qp_unpacker_t unpacker;
+    qp_obj_t obj;
+
+    if (qp_obj->tp != QP_HOOK || qp_obj->hook != QP_HOOK_BOOLS)
+    {
+        return -1;
+    }
+
+    qp_unpacker_init(&unpacker, qp_obj->via.raw, qp_obj->len);
+    if (qp_next(&unpacker, &obj) != QP_INT64 ||
+        obj.via.int64 < 0 ||
+        (uint64_t) obj.via.int64 / 8 > (size_t) (unpacker.end - unpacker.pt) ||
+        ((size_t) obj.via.int64 + 7) / 8 != (size_t) (unpacker.end - unpacker.pt))
+    {
+        return -1;
+    }
+
+    *n = (size_t) obj.via.int64;
+    *bits = unpacker.pt;
+    return 0;
+}
+
+/*
+ * Start reading a QP_HOOK_DICT object (see qp_add_dict()); after this,
+ * dict->n and dict->k are set and the k strings can be read from
+ * dict->strings with qp_next(). Each call to qp_dict_next() returns the
+ * dictionary index of the next of the n values.
+ *
+ * Returns 0 if successful or -1 when the object is not a valid dictionary.
+ */
+int qp_dict_init(qp_dict_t * dict, qp_obj_t * qp_obj)
+{
+    qp_unpacker_t unpacker;
+    qp_obj_t obj;
+    unsigned char * strings;
+    size_t i, size;
+
+    if (qp_obj->tp != QP_HOOK || qp_obj->hook != QP_HOOK_DICT)
+    {
+        return -1;
+    }
+
+    qp_unpacker_init(&unpacker, qp_obj->via.raw, qp_obj->len);
+    if (qp_next(&unpacker, &obj) != QP_INT64 || obj.via.int64 < 0)
+    {
+        return -1;
+    }
+    dict->n = (size_t) obj.via.int64;
+    if (qp_next(&unpacker, &obj) != QP_INT64 ||
+        obj.via.int64 < 0 ||
+        obj.via.int64 > unpacker.end - unpacker.pt)
+    {
+        return -1;
+    }
+    dict->k = (size_t) obj.via.int64;
+
+    strings = unpacker.pt;
+    for (i = 0; i < dict->k; i++)
+    {
+        if (qp_next(&unpacker, NULL) != QP_RAW)
+        {
+            return -1;
+        }
+    }
+    qp_unpacker_init(&dict->strings, strings, unpacker.pt - strings);
+
+    if (unpacker.pt >= unpacker.end || *unpacker.pt > 32)
+    {
+        return -1;
+    }
+    dict->width = *unpacker.pt++;
+    size = unpacker.end - unpacker.pt;
+    if ((dict->n && dict->k == 0) ||
+        (dict->width == 0 && dict->n > dict->k) ||
+        (dict->width && dict->n / 8 > size) ||
+        (dict->n * dict->width + 7) / 8 != size)
+    {
+        return -1;
+    }
+
+    dict->pt = unpacker.pt;
+    dict->bits = 0;
+    dict->nbits = 0;
+    return 0;
+}
+
+/*
+ * Returns the index of the next value of a dictionary. This must not be
+ * called more than dict->n times and the index is not checked to be below
+ * dict->k.
+ */
+size_t qp_dict_next(qp_dict_t * dict)
+{
+    size_t index;
+
+    while (dict->nbits < dict->width)
+    {
+        dict->bits |= (uint64_t) *dict->pt++ << dict->nbits;
+        dict->nbits += 8;
+    }
+    index = (size_t) (dict->bits & ((UINT64_C(1) << dict->width) - 1));
+    dict->bits >>= dict->width;
+    dict->nbits -= dict->width;
+    return index;
+}
+
+/*
+ * Start reading a QP_HOOK_DECIMAL_ARRAY object (see qp_add_decimal_array());
+ * after this, decimals->n and decimals->scale are set and each call to
+ * qp_decimals_next() returns the next of the n values.
+ *
+ * Returns 0 if successful or -1 when the object is not a valid decimal array.
+ */
+int qp_decimals_init(qp_decimals_t * decimals, qp_obj_t * qp_obj)
+{
+    qp_unpacker_t unpacker;
+    qp_obj_t obj;
+    int64_t first = 0;
+    size_t size;
+
+    if (qp_obj->tp != QP_HOOK ||
+        qp_obj->hook != QP_HOOK_DECIMAL_ARRAY ||
+        qp_obj->len == 0 ||
+        qp_obj->via.raw[0] > QP_DECIMAL_MAX_SCALE)
+    {
+        return -1;
+    }
+
+    qp_unpacker_init(&unpacker, qp_obj->via.raw + 1, qp_obj->len - 1);
+    decimals->scale = qp_obj->via.raw[0];
+    decimals->div = qp__pow10[decimals->scale];
+    decimals->value = 0;
+    decimals->base = 0;
+    decimals->bits = 0;
+    decimals->nbits = 0;
+    decimals->width = 0;
+
+    if (qp_next(&unpacker, &obj) != QP_INT64 || obj.via.int64 < 0)
+    {
+        return -1;
+    }
+    decimals->n = (size_t) obj.via.int64;
+
+    if (decimals->n)
+    {
+        if (qp_next(&unpacker, &obj) != QP_INT64)
+        {
+            return -1;
+        }
+        first = obj.via.int64;
+    }
+
+    if (decimals->n > 1)
+    {
+        if (qp_next(&unpacker, &obj) != QP_INT64 ||
+            unpacker.pt >= unpacker.end ||
+            *unpacker.pt == 0 ||
+            *unpacker.pt > 56)
+        {
+            return -1;
+        }
+        decimals->base = obj.via.int64;
+        decimals->width = *unpacker.pt++;
+    }
+
+    size = unpacker.end - unpacker.pt;
+    if (decimals->width &&
+        (decimals->n - 1 > size * 8 ||
+         ((decimals->n - 1) * decimals->width + 7) / 8 != size))
+    {
+        return -1;
+    }
+    if (!decimals->width && size)
+    {
+        return -1;
+    }
+
+    /* the first call reads no bits and adds base to this, which gives first */
+    decimals->pt = unpacker.pt;
+    decimals->nbits = decimals->width;
+    decimals->value = (int64_t) ((uint64_t) first - (uint64_t) decimals->base);
+    return 0;
+}
+
+/*
+ * Returns the next value of a decimal array. This must not be called more
+ * than decimals->n times.
+ */
+double qp_decimals_next(qp_decimals_t * decimals)
+{
+    uint64_t delta;
+
+    while (decimals->nbits < decimals->width)
+    {
+        decimals->bits |= (uint64_t) *decimals->pt++ << decimals->nbits;
+        decimals->nbits += 8;
+    }
+    delta = decimals->bits & ((UINT64_C(1) << decimals->width) - 1);
+    decimals->bits >>= decimals->width;
+    decimals->nbits -= decimals->width;
+    decimals->value = (int64_t) ((uint64_t) decimals->value +
+                                 (uint64_t) decimals->base + delta);
+    return (double) decimals->value / decimals->div;
+}
+
+/*
+ * Jump to the next object. If 'qp_obj' is not NULL, the object will be stored
+ * in qp_obj so you can use it later.
+ *
+ * Returns one of the following: (these are the ONLY possible return values)
+ *
+ *  QP_END, QP_ERR, QP_HOOK, QP_RAW, QP_INT64, QP_DOUBLE
+ *  QP_TRUE, QP_FALSE, QP_NULL, QP_ARRAY0..5, QP_MAP0..5,
+ *  QP_ARRAY_OPEN, QP_ARRAY_CLOSE, QP_MAP_OPEN, QP_MAP_CLOSE
+ *
+ * A QP_HOOK has its hook type in qp_obj->hook and, for a sized hook type,
+ * the payload in qp_obj->via.raw and qp_obj->len. For QP_HOOK_REPEAT the
+ * count and for QP_HOOK_REF the container number is in qp_obj->via.int64.
+ *
+ * A sized container (QP_HOOK_ARRAY or QP_HOOK_MAP) returns QP_ARRAY_OPEN or
+ * QP_MAP_OPEN with the hook type in qp_obj->hook, the number of items in
+ * qp_obj->via.int64 and the number of bytes up to and including the close
+ * type in qp_obj->len. For other containers qp_obj->hook is 0.
+ *
+ * Its fine to reuse the same object without calling free in between.
+ */
+qp_types_t qp_next(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
+{
+    uint8_t tp;
+
+    if (unpacker->pt >= unpacker->end)
+    {
+        if (qp_obj != NULL)
+        {
+            qp_obj->tp = QP_END;
+        }
+        return QP_END;
+    }
+
+    tp = *unpacker->pt;
+    unpacker->pt++;
+
+    switch(tp)
     {
     case 0:
     case 1:
@@ -866,12 +2310,26 @@ qp_types_t qp_next(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
         return QP_INT64;
 
     case 124:
-        /* Object hooks are not supported yet */
-        if (qp_obj != NULL)
+        QP_UNPACK_CHECK_SZ(1)
+        if (*unpacker->pt >= QP_HOOK_FLOAT32)
         {
-            qp_obj->tp = QP_HOOK;
+            QP_UNPACK_CHECK_SZ(4)
+            uint32_t bits =
+                    (uint32_t) unpacker->pt[0] << 24 |
+                    (uint32_t) unpacker->pt[1] << 16 |
+                    (uint32_t) unpacker->pt[2] << 8 |
+                    (uint32_t) unpacker->pt[3];
+            float f;
+            memcpy(&f, &bits, sizeof(float));
+            if (qp_obj != NULL)
+            {
+                qp_obj->tp = QP_DOUBLE;
+                qp_obj->via.real = (double) f;
+            }
+            unpacker->pt += 4;
+            return QP_DOUBLE;
         }
-        return QP_HOOK;
+        return qp__next_hook(unpacker, qp_obj);
 
     case 125:
     case 126:
@@ -1048,6 +2506,7 @@ qp_types_t qp_next(qp_unpacker_t * unpacker, qp_obj_t * qp_obj)
         if (qp_obj != NULL)
         {
             qp_obj->tp = tp;
+            qp_obj->hook = 0;
         }
         return tp;
     }
@@ -1073,7 +2532,18 @@ qp_types_t qp_current(qp_unpacker_t * unpacker)
     switch ((uint8_t) *unpacker->pt)
     {
     case 124:
-        return QP_HOOK;
+        if (unpacker->pt + 1 < unpacker->end &&
+            (unpacker->pt[1] == QP_HOOK_ARRAY ||
+             unpacker->pt[1] == QP_HOOK_MAP))
+        {
+            return unpacker->pt[1] == QP_HOOK_ARRAY ?
+                    QP_ARRAY_OPEN : QP_MAP_OPEN;
+        }
+        return (unpacker->pt + 1 < unpacker->end &&
+                (unpacker->pt[1] >= QP_HOOK_FLOAT32 ||
+                 unpacker->pt[1] == QP_HOOK_DOUBLE_INT ||
+                 unpacker->pt[1] == QP_HOOK_DECIMAL)) ?
+                QP_DOUBLE : QP_HOOK;
     case 125:
     case 126:
     case 127:
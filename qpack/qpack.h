@@ -9,6 +9,10 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 #define QP_SUGGESTED_SIZE 65536
 
 typedef enum
@@ -66,11 +70,53 @@ typedef enum
     QP_MAP_CLOSE,       /* close map                            */
 } qp_types_t;
 
+/*
+ * The byte after QP_HOOK tells what follows. A byte from QP_HOOK_FLOAT32 up
+ * is the first byte of a big endian float32 (sign and high exponent bits),
+ * which makes a 5 byte double; lower bytes are hook types. Floats which would
+ * start with a lower byte (below 2^-95) are written as 9 byte doubles.
+ *
+ * Hook types from QP_HOOK_SIZED up are followed by the payload length as an
+ * integer and the payload, so a reader can skip them without knowing them.
+ * The payload of QP_HOOK_ARRAY and QP_HOOK_MAP is the number of items and the
+ * items of an open container, including its close type.
+ */
+typedef enum
+{
+    QP_HOOK_DOUBLE_INT=1,   /* integral double, followed by an integer  */
+    QP_HOOK_DECIMAL,        /* scale byte, followed by an integer       */
+    QP_HOOK_REPEAT,         /* in QP_HOOK_RUNS: previous value n times  */
+    QP_HOOK_REF,            /* in QP_HOOK_SHARED: container number n    */
+    QP_HOOK_SIZED=8,        /* first hook type with a payload length    */
+    QP_HOOK_DECIMAL_ARRAY=8,/* delta and bit packed decimals            */
+    QP_HOOK_RUNS,           /* array with runs of repeated values       */
+    QP_HOOK_BOOLS,          /* array of booleans, 8 per byte            */
+    QP_HOOK_DICT,           /* array of strings as dictionary indexes   */
+    QP_HOOK_SHARED,         /* value with QP_HOOK_REF back-references   */
+    QP_HOOK_EXT,            /* extension id byte and its payload        */
+    QP_HOOK_ARRAY,          /* array with its size and number of items  */
+    QP_HOOK_MAP,            /* map with its size and number of pairs    */
+    QP_HOOK_FLOAT32=16,     /* first byte of a float32                  */
+} qp_hook_t;
+
+/* Decimals are stored as value * 10^scale, with a scale up to this */
+#define QP_DECIMAL_MAX_SCALE 18
+
+/* Extension ids (QP_HOOK_EXT) go from 0 up to this */
+#define QP_EXT_MAX 127
+
+/* Sized containers with less item bytes are written as plain containers */
+#define QP_SIZED_MIN 64
+
 typedef union qp_via_u qp_via_t;
 typedef struct qp_obj_s qp_obj_t;
 typedef struct qp_unpacker_s qp_unpacker_t;
 typedef struct qp_packer_s qp_packer_t;
 typedef FILE qp_fpacker_t;
+typedef struct qp_decimals_s qp_decimals_t;
+typedef struct qp_runs_s qp_runs_t;
+typedef struct qp_dict_s qp_dict_t;
+typedef struct qp_ext_s qp_ext_t;
 
 union qp_via_u
 {
@@ -84,6 +130,8 @@ union qp_via_u
 struct qp_obj_s
 {
     uint8_t tp;
+    uint8_t hook;           /* the hook type when tp is QP_HOOK or  */
+                            /* a sized QP_ARRAY_OPEN, QP_MAP_OPEN   */
     size_t len;
     qp_via_t via;
 };
@@ -103,6 +151,55 @@ struct qp_packer_s
     unsigned char * buffer;
 };
 
+/* Writes a QP_HOOK_RUNS array, see qp_runs_open() */
+struct qp_runs_s
+{
+    size_t n;               /* number of values                     */
+    size_t pos;             /* start of the array                   */
+    size_t prev;            /* start of the previous value          */
+    size_t start;           /* start of the value being added       */
+    size_t count;           /* repeats of the previous value        */
+    size_t repeats;         /* number of QP_HOOK_REPEAT marks       */
+};
+
+/* Reads a QP_HOOK_DICT, see qp_dict_init() */
+struct qp_dict_s
+{
+    size_t n;               /* number of values                     */
+    size_t k;               /* number of strings in the dictionary  */
+    qp_unpacker_t strings;  /* the k strings                        */
+    /* private */
+    unsigned char * pt;
+    uint64_t bits;
+    unsigned int nbits;
+    unsigned int width;
+};
+
+/* Reads the values of a QP_HOOK_DECIMAL_ARRAY, see qp_decimals_init() */
+struct qp_decimals_s
+{
+    size_t n;               /* number of values                     */
+    int scale;
+    /* private */
+    unsigned char * pt;
+    uint64_t bits;
+    unsigned int nbits;
+    unsigned int width;
+    int64_t value;
+    int64_t base;
+    double div;
+};
+
+/* Codec for the values of an extension type, see qp_register_ext() */
+struct qp_ext_s
+{
+    const char * name;      /* type name, for Lua the metatable name */
+    /* append the payload for value, which has size bytes */
+    int (*encode)(qp_packer_t * packer, const void * value, size_t size);
+    /* return the size of the value for a payload, and with value not
+     * NULL fill it too; (size_t) -1 when the payload is invalid */
+    size_t (*decode)(const unsigned char * data, size_t n, void * value);
+};
 
 #define qp_open fopen     /* returns NULL in case of an error           */
 #define qp_close fclose   /* 0 if successful, EOF in case of an error   */
@@ -111,6 +208,7 @@ struct qp_packer_s
 /* packer: create, destroy and extend functions */
 qp_packer_t * qp_packer_new(size_t alloc_size);
 void qp_packer_free(qp_packer_t * packer);
+int qp_packer_reserve(qp_packer_t * packer, size_t n);
 int qp_packer_extend(qp_packer_t * packer, qp_packer_t * source);
 int qp_packer_extend_fu(qp_packer_t * packer, qp_unpacker_t * unpacker);
 
@@ -124,6 +222,62 @@ qp_types_t qp_next(qp_unpacker_t * unpacker, qp_obj_t * qp_obj);
 qp_types_t qp_current(qp_unpacker_t * unpacker);
 qp_types_t qp_skip_next(qp_unpacker_t * unpacker);
 
+/* add an array of booleans, packed 8 per byte */
+int qp_add_bools(qp_packer_t * packer, const unsigned char * values, size_t n);
+int qp_add_bits(qp_packer_t * packer, const unsigned char * bits, size_t n);
+
+/* add an array of strings as a dictionary and an index for each value */
+int qp_add_dict(
+        qp_packer_t * packer,
+        const char * const * strs,
+        const size_t * lens,
+        size_t k,
+        const uint32_t * indexes,
+        size_t n);
+
+/* add an extension value, or make the bytes added from pos one */
+int qp_add_ext(
+        qp_packer_t * packer,
+        uint8_t id,
+        const unsigned char * data,
+        size_t n);
+int qp_ext_close(qp_packer_t * packer, uint8_t id, size_t pos);
+
+/* read the id and payload of a QP_HOOK_EXT object */
+int qp_ext_get(
+        qp_obj_t * qp_obj,
+        uint8_t * id,
+        const unsigned char ** data,
+        size_t * n);
+
+/* codecs for extension types, by id or type name */
+int qp_register_ext(uint8_t id, const qp_ext_t * ext);
+const qp_ext_t * qp_ext_find(uint8_t id);
+const qp_ext_t * qp_ext_find_name(const char * name, uint8_t * id);
+
+/* add a back-reference and mark the value from pos as having them */
+int qp_add_ref(qp_packer_t * packer, size_t ordinal);
+int qp_add_shared(qp_packer_t * packer, size_t pos);
+
+/* add an array with runs of repeated values */
+int qp_runs_open(qp_packer_t * packer, qp_runs_t * runs, size_t n);
+int qp_runs_next(qp_packer_t * packer, qp_runs_t * runs);
+int qp_runs_close(qp_packer_t * packer, qp_runs_t * runs);
+
+/* read the values of a QP_HOOK_RUNS object */
+int qp_runs_get(qp_obj_t * qp_obj, size_t * n, qp_unpacker_t * values);
+
+/* read the bits of a QP_HOOK_BOOLS object */
+int qp_bools_get(qp_obj_t * qp_obj, size_t * n, unsigned char ** bits);
+
+/* read a QP_HOOK_DICT object */
+int qp_dict_init(qp_dict_t * dict, qp_obj_t * qp_obj);
+size_t qp_dict_next(qp_dict_t * dict);
+
+/* read the values of a QP_HOOK_DECIMAL_ARRAY object */
+int qp_decimals_init(qp_decimals_t * decimals, qp_obj_t * qp_obj);
+double qp_decimals_next(qp_decimals_t * decimals);
+
 /* print function */
 void qp_print(unsigned char * pt, size_t len);
 
@@ -179,11 +333,21 @@ int qp_add_string_term_n(qp_packer_t * packer, const char * str, size_t n);
 
 int qp_add_raw_term(qp_packer_t * packer, const unsigned char * raw, size_t len);
 int qp_add_double(qp_packer_t * packer, double real);
+int qp_add_double_compact(qp_packer_t * packer, double real, int keep_float);
 int qp_add_int64(qp_packer_t * packer, int64_t integer);
+int qp_add_decimal(qp_packer_t * packer, double real, int scale);
+int qp_add_decimal_array(
+        qp_packer_t * packer,
+        const double * values,
+        size_t n,
+        int scale);
 int qp_add_true(qp_packer_t * packer);
 int qp_add_false(qp_packer_t * packer);
 int qp_add_null(qp_packer_t * packer);
 int qp_add_type(qp_packer_t * packer, qp_types_t tp);
+int qp_add_open(qp_packer_t * packer, qp_types_t tp, size_t * pos);
+int qp_add_open_sized(qp_packer_t * packer, qp_types_t tp, size_t * pos);
+int qp_add_close(qp_packer_t * packer, size_t pos, size_t count);
 int qp_add_fmt(qp_packer_t * packer, const char * fmt, ...);
 int qp_add_fmt_safe(qp_packer_t * packer, const char * fmt, ...);
 
@@ -194,10 +358,17 @@ int qp_fadd_string(qp_fpacker_t * fpacker, const char * str);
 int qp_fadd_int64(qp_fpacker_t * fpacker, int64_t integer);
 int qp_fadd_double(qp_fpacker_t * fpacker, double real);
 
+/* file-packer for appending elements to an open array */
+qp_fpacker_t * qp_fappend_open(const char * fn);
+
 /* creates a valid qpack buffer of length 3 holding an int16 type. */
 #define QP_PACK_INT16(BUF__, N__) \
 unsigned char BUF__[3];\
 BUF__[0] = QP_INT16; \
 memcpy(&BUF__[1], &N__, 2);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif  /* QPACK_H_ */
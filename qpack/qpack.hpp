@@ -0,0 +1,658 @@
+/*
+ * qpack.hpp - Header-only C++17 reader for qpack data.
+ *
+ * A qpack::reader walks a buffer (or a qp_unpacker_t) without copying:
+ * strings are returned as std::string_view into the buffer and containers
+ * are iterated with range-for:
+ *
+ *      qpack::reader r(data, len);
+ *      for (auto & [key, val] : r.next().map())
+ *      {
+ *          if (key.as<std::string_view>() == "points")
+ *              for (auto & p : val.array())
+ *                  sum += p.as<double>();
+ *      }
+ *
+ * Values which are not looked at are skipped when the iteration moves on.
+ * A container which was iterated until its end remembers where it ends, so
+ * moving past it afterwards does not read it again; other values have a
+ * known size, so skip() is O(1) except for containers which were not read.
+ *
+ * Errors (truncated data, a type which does not match as<T>()) throw
+ * qpack::error. All functions are inline and decode the data directly, so
+ * no call is made into qpack.c.
+ */
+#ifndef QPACK_HPP_
+#define QPACK_HPP_
+
+#include <qpack/qpack.h>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+/* Keeps a rarely taken path out of the inlined reader */
+#if defined(__GNUC__)
+#define QPACK_COLD __attribute__((cold, noinline))
+#elif defined(_MSC_VER)
+#define QPACK_COLD __declspec(noinline)
+#else
+#define QPACK_COLD
+#endif
+
+namespace qpack
+{
+
+class error : public std::runtime_error
+{
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class value;
+class array_range;
+class map_range;
+
+namespace detail
+{
+
+constexpr int max_depth = 1000;
+
+[[noreturn]] inline void truncated()
+{
+    throw error("qpack: truncated data");
+}
+
+template <typename T>
+inline T load(const unsigned char * pt)
+{
+    T v;
+    std::memcpy(&v, pt, sizeof(T));
+    return v;
+}
+
+/* Size of the payload which follows a RAW8..64 or INT8..64 header */
+inline size_t raw_size(
+        uint8_t tp,
+        const unsigned char *& pt,
+        const unsigned char * end)
+{
+    size_t n = size_t(1) << (tp - QP_RAW8);
+    size_t sz;
+    if (size_t(end - pt) < n)
+        truncated();
+    switch (tp)
+    {
+    case QP_RAW8:   sz = load<uint8_t>(pt); break;
+    case QP_RAW16:  sz = load<uint16_t>(pt); break;
+    case QP_RAW32:  sz = load<uint32_t>(pt); break;
+    default:        sz = size_t(load<uint64_t>(pt)); break;
+    }
+    pt += n;
+    if (size_t(end - pt) < sz)
+        truncated();
+    return sz;
+}
+
+/* Read the integer at pt, as used after QP_HOOK_DOUBLE_INT */
+inline int64_t integer(const unsigned char *& pt, const unsigned char * end)
+{
+    if (pt >= end)
+        truncated();
+    uint8_t tp = *pt++;
+    if (tp < 64)
+        return tp;
+    if (tp < QP_HOOK)
+        return int64_t(63) - tp;
+    if (tp < QP_INT8 || tp > QP_INT64)
+        throw error("qpack: integer expected");
+
+    size_t n = size_t(1) << (tp - QP_INT8);
+    int64_t v;
+    if (size_t(end - pt) < n)
+        truncated();
+    switch (tp)
+    {
+    case QP_INT8:   v = load<int8_t>(pt); break;
+    case QP_INT16:  v = load<int16_t>(pt); break;
+    case QP_INT32:  v = load<int32_t>(pt); break;
+    default:        v = load<int64_t>(pt); break;
+    }
+    pt += n;
+    return v;
+}
+
+/* Read the double which follows a QP_HOOK byte (see qp_hook_t) */
+inline double hook_double(const unsigned char *& pt, const unsigned char * end)
+{
+    if (pt >= end)
+        truncated();
+    if (*pt >= QP_HOOK_FLOAT32)
+    {
+        if (end - pt < 4)
+            truncated();
+        uint32_t bits = uint32_t(pt[0]) << 24 | uint32_t(pt[1]) << 16 |
+                        uint32_t(pt[2]) << 8 | uint32_t(pt[3]);
+        float f;
+        std::memcpy(&f, &bits, sizeof(float));
+        pt += 4;
+        return f;
+    }
+    if (*pt == QP_HOOK_DOUBLE_INT)
+        return double(integer(++pt, end));
+    if (*pt == QP_HOOK_DECIMAL)
+    {
+        static const double pow10[QP_DECIMAL_MAX_SCALE + 1] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+            1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18,
+        };
+        if (end - pt < 2)
+            truncated();
+        uint8_t scale = pt[1];
+        if (scale > QP_DECIMAL_MAX_SCALE)
+            throw error("qpack: invalid decimal scale");
+        pt += 2;
+        return double(integer(pt, end)) / pow10[scale];
+    }
+    throw error("qpack: unsupported hook");
+}
+
+/* Move pt past the value which starts at pt */
+inline const unsigned char * skip(
+        const unsigned char * pt,
+        const unsigned char * end,
+        int depth = 0)
+{
+    uint8_t tp;
+    int count;
+
+    if (pt >= end)
+        truncated();
+    if (depth > max_depth)
+        throw error("qpack: excessive nesting");
+
+    tp = *pt++;
+    if (tp < QP_HOOK || (tp >= QP_DOUBLE_N1 && tp <= QP_DOUBLE_1))
+        return pt;
+    if (tp >= 128 && tp < QP_RAW8)
+    {
+        if (size_t(end - pt) < size_t(tp - 128))
+            truncated();
+        return pt + (tp - 128);
+    }
+
+    switch (tp)
+    {
+    case QP_RAW8:
+    case QP_RAW16:
+    case QP_RAW32:
+    case QP_RAW64:
+        return pt + raw_size(tp, pt, end);
+    case QP_INT8:
+    case QP_INT16:
+    case QP_INT32:
+    case QP_INT64:
+    {
+        size_t n = size_t(1) << (tp - QP_INT8);
+        if (size_t(end - pt) < n)
+            truncated();
+        return pt + n;
+    }
+    case QP_DOUBLE:
+        if (size_t(end - pt) < sizeof(double))
+            truncated();
+        return pt + sizeof(double);
+    case QP_HOOK:
+        if (pt < end && *pt >= QP_HOOK_SIZED && *pt < QP_HOOK_FLOAT32)
+        {
+            int64_t n = integer(++pt, end);
+            if (n < 0 || n > end - pt)
+                truncated();
+            return pt + n;
+        }
+        hook_double(pt, end);
+        return pt;
+    case QP_ARRAY0: case QP_ARRAY1: case QP_ARRAY2:
+    case QP_ARRAY3: case QP_ARRAY4: case QP_ARRAY5:
+        count = tp - QP_ARRAY0;
+        break;
+    case QP_MAP0: case QP_MAP1: case QP_MAP2:
+    case QP_MAP3: case QP_MAP4: case QP_MAP5:
+        count = (tp - QP_MAP0) * 2;
+        break;
+    case QP_TRUE:
+    case QP_FALSE:
+    case QP_NULL:
+        return pt;
+    case QP_ARRAY_OPEN:
+    case QP_MAP_OPEN:
+    {
+        uint8_t close = tp == QP_ARRAY_OPEN ? QP_ARRAY_CLOSE : QP_MAP_CLOSE;
+        /* like qp_next(), the end of the data closes open containers */
+        while (pt < end && *pt != close)
+            pt = skip(pt, end, depth + 1);
+        return pt < end ? pt + 1 : pt;
+    }
+    default:
+        throw error("qpack: unexpected type");
+    }
+
+    while (count--)
+        pt = skip(pt, end, depth + 1);
+    return pt;
+}
+
+}  /* namespace detail */
+
+/*
+ * One value in the data. Scalars are decoded when the value is read;
+ * containers give access to their elements with array() and map().
+ */
+class value
+{
+public:
+    value() noexcept : tp_(QP_END) {}
+
+    /* Type as returned by qp_next() (QP_INT64, QP_DOUBLE, QP_RAW, ...) */
+    qp_types_t type() const noexcept { return qp_types_t(tp_); }
+
+    bool is_int() const noexcept { return tp_ == QP_INT64; }
+    bool is_double() const noexcept { return tp_ == QP_DOUBLE; }
+    bool is_number() const noexcept { return is_int() || is_double(); }
+    bool is_raw() const noexcept { return tp_ == QP_RAW; }
+    bool is_bool() const noexcept { return qp_is_bool(type()); }
+    bool is_null() const noexcept { return tp_ == QP_NULL; }
+    bool is_array() const noexcept { return qp_is_array(type()); }
+    bool is_map() const noexcept { return qp_is_map(type()); }
+    bool is_hook() const noexcept { return tp_ == QP_HOOK; }
+
+    /*
+     * Hook type and payload of a sized hook (see qp_hook_t). For a sized
+     * container the type is QP_HOOK_ARRAY or QP_HOOK_MAP, without payload.
+     */
+    uint8_t hook() const noexcept { return hook_; }
+    std::string_view payload() const noexcept
+    {
+        if (tp_ != QP_HOOK)
+            return std::string_view();
+        return std::string_view(
+                reinterpret_cast<const char *>(via_.raw), len_);
+    }
+
+    /*
+     * Returns the value as T: bool, an integer type, float or double, or
+     * std::string_view. Integers are range checked and an integer can be
+     * read as a floating point type; everything else must match exactly.
+     */
+    template <typename T>
+    T as() const
+    {
+        if constexpr (std::is_same_v<T, bool>)
+        {
+            if (tp_ == QP_TRUE || tp_ == QP_FALSE)
+                return tp_ == QP_TRUE;
+        }
+        else if constexpr (std::is_same_v<T, std::string_view>)
+        {
+            if (tp_ == QP_RAW)
+                return std::string_view(
+                        reinterpret_cast<const char *>(via_.raw), len_);
+        }
+        else if constexpr (std::is_integral_v<T>)
+        {
+            if (tp_ == QP_INT64)
+            {
+                if constexpr (!std::is_same_v<T, int64_t>)
+                {
+                    if (via_.int64 < int64_t(std::numeric_limits<T>::min())
+                        || (via_.int64 > 0 && uint64_t(via_.int64) >
+                            uint64_t(std::numeric_limits<T>::max())))
+                        throw error("qpack: integer out of range");
+                }
+                return T(via_.int64);
+            }
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+        {
+            if (tp_ == QP_DOUBLE)
+                return T(via_.real);
+            if (tp_ == QP_INT64)
+                return T(via_.int64);
+        }
+        else
+        {
+            static_assert(std::is_same_v<T, void>,
+                          "qpack: unsupported type for as<T>()");
+        }
+        throw error("qpack: type mismatch");
+    }
+
+    /* Number of elements (or pairs) for QP_ARRAY0..5 and QP_MAP0..5 */
+    int fixed_size() const noexcept
+    {
+        return tp_ >= QP_MAP0 && tp_ <= QP_MAP5 ? tp_ - QP_MAP0 :
+               tp_ >= QP_ARRAY0 && tp_ <= QP_ARRAY5 ? tp_ - QP_ARRAY0 : -1;
+    }
+
+    /* Number of elements (or pairs) of a sized container, or -1 */
+    int64_t sized_count() const noexcept
+    {
+        return tp_ != QP_HOOK && hook_ ? via_.int64 : -1;
+    }
+
+    inline array_range array() const;
+    inline map_range map() const;
+
+    /* Position right after this value */
+    const unsigned char * skip() const
+    {
+        if (after_ == nullptr)
+            after_ = detail::skip(pt_, end_);
+        return after_;
+    }
+
+    /* Read the value at pt; Returns the position after the header */
+    const unsigned char * read(
+            const unsigned char * pt,
+            const unsigned char * end)
+    {
+        uint8_t tp;
+
+        if (pt >= end)
+            detail::truncated();
+
+        end_ = end;
+        after_ = nullptr;
+        hook_ = 0;
+        tp = *pt;
+        pt_ = pt++;
+
+        if (tp < 64)
+        {
+            tp_ = QP_INT64;
+            via_.int64 = tp;
+        }
+        else if (tp < QP_HOOK)
+        {
+            tp_ = QP_INT64;
+            via_.int64 = int64_t(63) - tp;
+        }
+        else if (tp == QP_HOOK && pt < end &&
+                 *pt >= QP_HOOK_SIZED && *pt < QP_HOOK_FLOAT32)
+        {
+            return read_sized(pt, end);
+        }
+        else if (tp < 128)
+        {
+            tp_ = QP_DOUBLE;
+            via_.real = tp == QP_HOOK ?
+                    detail::hook_double(pt, end) :
+                    double(int(tp) - QP_DOUBLE_0);
+        }
+        else if (tp < QP_RAW8)
+        {
+            tp_ = QP_RAW;
+            len_ = tp - 128;
+            if (size_t(end - pt) < len_)
+                detail::truncated();
+            via_.raw = const_cast<unsigned char *>(pt);
+            pt += len_;
+        }
+        else if (tp <= QP_RAW64)
+        {
+            tp_ = QP_RAW;
+            len_ = detail::raw_size(tp, pt, end);
+            via_.raw = const_cast<unsigned char *>(pt);
+            pt += len_;
+        }
+        else if (tp <= QP_INT64)
+        {
+            size_t n = size_t(1) << (tp - QP_INT8);
+            if (size_t(end - pt) < n)
+                detail::truncated();
+            tp_ = QP_INT64;
+            switch (tp)
+            {
+            case QP_INT8:   via_.int64 = detail::load<int8_t>(pt); break;
+            case QP_INT16:  via_.int64 = detail::load<int16_t>(pt); break;
+            case QP_INT32:  via_.int64 = detail::load<int32_t>(pt); break;
+            default:        via_.int64 = detail::load<int64_t>(pt); break;
+            }
+            pt += n;
+        }
+        else if (tp == QP_DOUBLE)
+        {
+            if (size_t(end - pt) < sizeof(double))
+                detail::truncated();
+            tp_ = QP_DOUBLE;
+            via_.real = detail::load<double>(pt);
+            pt += sizeof(double);
+        }
+        else
+        {
+            tp_ = tp;
+            if (tp >= QP_ARRAY_CLOSE)
+                throw error("qpack: unexpected close");
+            if (qp_is_array(type()) || qp_is_map(type()))
+            {
+                body_ = pt;
+                return pt;
+            }
+        }
+
+        after_ = pt;
+        return pt;
+    }
+
+private:
+    friend class array_range;
+    friend class map_range;
+    template <typename> friend class iterator_base;
+
+    /* Read a sized hook, pt is at the hook type */
+    QPACK_COLD const unsigned char * read_sized(
+            const unsigned char * pt,
+            const unsigned char * end)
+    {
+        if (*pt == QP_HOOK_ARRAY || *pt == QP_HOOK_MAP)
+        {
+            /* a sized container, its end is known up front */
+            bool is_array = *pt++ == QP_HOOK_ARRAY;
+            int64_t n = detail::integer(pt, end);
+            if (n < 2 || n > end - pt)
+                detail::truncated();
+            after_ = pt + n;
+            via_.int64 = detail::integer(pt, after_);
+            if (via_.int64 < 0 || via_.int64 > after_ - pt ||
+                after_[-1] != (is_array ? QP_ARRAY_CLOSE : QP_MAP_CLOSE))
+                throw error("qpack: invalid sized container");
+            tp_ = is_array ? QP_ARRAY_OPEN : QP_MAP_OPEN;
+            hook_ = is_array ? QP_HOOK_ARRAY : QP_HOOK_MAP;
+            len_ = size_t(after_ - pt);
+            body_ = pt;
+            return pt;
+        }
+
+        tp_ = QP_HOOK;
+        hook_ = *pt++;
+        int64_t n = detail::integer(pt, end);
+        if (n < 0 || n > end - pt)
+            detail::truncated();
+        len_ = size_t(n);
+        via_.raw = const_cast<unsigned char *>(pt);
+        after_ = pt + len_;
+        return after_;
+    }
+
+    uint8_t tp_;
+    uint8_t hook_ = 0;
+    size_t len_ = 0;
+    qp_via_t via_ = {};
+    const unsigned char * pt_ = nullptr;    /* start of the value        */
+    const unsigned char * body_ = nullptr;  /* container: first element  */
+    const unsigned char * end_ = nullptr;   /* end of the data           */
+    mutable const unsigned char * after_ = nullptr;  /* end, if known    */
+};
+
+/* Key and value of a map element */
+struct member
+{
+    value key;
+    value val;
+};
+
+struct sentinel {};
+
+/*
+ * Iterator over the elements of a container. The owner learns where it
+ * ends when the iteration reaches the end.
+ */
+template <typename Elem>
+class iterator_base
+{
+public:
+    iterator_base(const value & owner) :
+        owner_(&owner),
+        pt_(owner.body_),
+        left_(owner.fixed_size())
+    {
+        load();
+    }
+
+    Elem & operator*() noexcept { return elem_; }
+    Elem * operator->() noexcept { return &elem_; }
+
+    iterator_base & operator++()
+    {
+        if constexpr (std::is_same_v<Elem, member>)
+            pt_ = elem_.val.skip();
+        else
+            pt_ = elem_.skip();
+        if (left_ > 0)
+            --left_;
+        load();
+        return *this;
+    }
+
+    bool operator==(sentinel) const noexcept { return done_; }
+    bool operator!=(sentinel) const noexcept { return !done_; }
+
+private:
+    void load()
+    {
+        const unsigned char * end = owner_->end_;
+        uint8_t close = owner_->is_array() ? QP_ARRAY_CLOSE : QP_MAP_CLOSE;
+
+        if (left_ == 0 || (left_ < 0 && (pt_ >= end || *pt_ == close)))
+        {
+            done_ = true;
+            owner_->after_ = left_ < 0 && pt_ < end ? pt_ + 1 : pt_;
+            return;
+        }
+
+        if constexpr (std::is_same_v<Elem, member>)
+        {
+            elem_.key.read(pt_, end);
+            elem_.val.read(elem_.key.skip(), end);
+        }
+        else
+            elem_.read(pt_, end);
+    }
+
+    const value * owner_;
+    const unsigned char * pt_;
+    int left_;          /* elements left for a fixed size container */
+    bool done_ = false;
+    Elem elem_;
+};
+
+class array_range
+{
+public:
+    explicit array_range(const value & v) : v_(v)
+    {
+        if (!v.is_array())
+            throw error("qpack: not an array");
+    }
+    iterator_base<value> begin() const { return iterator_base<value>(v_); }
+    sentinel end() const noexcept { return {}; }
+
+private:
+    const value & v_;
+};
+
+class map_range
+{
+public:
+    explicit map_range(const value & v) : v_(v)
+    {
+        if (!v.is_map())
+            throw error("qpack: not a map");
+    }
+    iterator_base<member> begin() const { return iterator_base<member>(v_); }
+    sentinel end() const noexcept { return {}; }
+
+private:
+    const value & v_;
+};
+
+inline array_range value::array() const { return array_range(*this); }
+inline map_range value::map() const { return map_range(*this); }
+
+/*
+ * Reads the values in a buffer one after the other. The value returned by
+ * next() stays valid until the next call.
+ */
+class reader
+{
+public:
+    reader(const void * data, size_t len) noexcept :
+        pt_(static_cast<const unsigned char *>(data)),
+        end_(pt_ + len)
+    {}
+
+    /* Read from the current position of an unpacker; see sync() */
+    explicit reader(const qp_unpacker_t & unpacker) noexcept :
+        pt_(unpacker.pt),
+        end_(unpacker.end)
+    {}
+
+    bool at_end() const noexcept
+    {
+        return (started_ ? cur_.skip() : pt_) >= end_;
+    }
+
+    value & next()
+    {
+        if (started_)
+            pt_ = cur_.skip();
+        started_ = true;
+        cur_.read(pt_, end_);
+        return cur_;
+    }
+
+    /* Skip the next value */
+    void skip()
+    {
+        next();
+    }
+
+    /* Move the unpacker past the values which are read */
+    void sync(qp_unpacker_t & unpacker) const
+    {
+        unpacker.pt = const_cast<unsigned char *>(
+                started_ ? cur_.skip() : pt_);
+    }
+
+private:
+    const unsigned char * pt_;
+    const unsigned char * end_;
+    bool started_ = false;
+    value cur_;
+};
+
+}  /* namespace qpack */
+
+#endif  /* QPACK_HPP_ */
@@ -0,0 +1,1651 @@
+/*
+ * splice.c - Operate on encoded maps and arrays by copying raw bytes.
+ *
+ * The elements of a container are located with qp_skip_next() and copied as
+ * byte ranges, so nothing is decoded or encoded again.
+ */
+#include <qpack/splice.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct
+{
+    int is_map;
+    int is_open;
+    size_t count;       /* elements left in a container with a fixed size */
+    const unsigned char * key_end;  /* end of the key of the last pair */
+} splice__iter_t;
+
+typedef struct
+{
+    const unsigned char * start;
+    size_t key_n;
+    size_t n;           /* 0 when the pair is dropped */
+} splice__pair_t;
+
+/*
+ * Read the header of the map or array at the unpacker position. A value
+ * with shared tables is refused, since its back-references count containers
+ * from the start of the value and would point elsewhere after a splice.
+ *
+ * Returns 0 if successful, QP_SPLICE_ERR_TYPE or QP_SPLICE_ERR_SHARED.
+ */
+static int splice__iter_init(splice__iter_t * it, qp_unpacker_t * unpacker)
+{
+    qp_types_t tp;
+
+    if (unpacker->end - unpacker->pt >= 2 &&
+        unpacker->pt[0] == QP_HOOK &&
+        unpacker->pt[1] == QP_HOOK_SHARED)
+    {
+        return QP_SPLICE_ERR_SHARED;
+    }
+
+    tp = qp_next(unpacker, NULL);
+    switch (tp)
+    {
+    case QP_ARRAY0:
+    case QP_ARRAY1:
+    case QP_ARRAY2:
+    case QP_ARRAY3:
+    case QP_ARRAY4:
+    case QP_ARRAY5:
+        it->is_map = 0;
+        it->is_open = 0;
+        it->count = tp - QP_ARRAY0;
+        return 0;
+    case QP_MAP0:
+    case QP_MAP1:
+    case QP_MAP2:
+    case QP_MAP3:
+    case QP_MAP4:
+    case QP_MAP5:
+        it->is_map = 1;
+        it->is_open = 0;
+        it->count = tp - QP_MAP0;
+        return 0;
+    case QP_ARRAY_OPEN:
+    case QP_MAP_OPEN:
+        it->is_map = tp == QP_MAP_OPEN;
+        it->is_open = 1;
+        it->count = 0;
+        return 0;
+    default:
+        return QP_SPLICE_ERR_TYPE;
+    }
+}
+
+static int splice__skip(qp_unpacker_t * unpacker)
+{
+    switch (qp_skip_next(unpacker))
+    {
+    case QP_END:
+    case QP_ERR:
+    case QP_ARRAY_CLOSE:
+    case QP_MAP_CLOSE:
+        return QP_SPLICE_ERR_DATA;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Move the unpacker past the next element, which is a key and value for a
+ * map. The element starts at 'start' and ends at the new unpacker position.
+ * An open container ends at its close mark or at the end of the data.
+ *
+ * Returns 1 if an element is found, 0 at the end of the container or
+ * QP_SPLICE_ERR_DATA.
+ */
+static int splice__iter_next(
+        splice__iter_t * it,
+        qp_unpacker_t * unpacker,
+        const unsigned char ** start)
+{
+    if (it->is_open)
+    {
+        if (unpacker->pt >= unpacker->end)
+        {
+            return 0;
+        }
+        if (*unpacker->pt == (it->is_map ? QP_MAP_CLOSE : QP_ARRAY_CLOSE))
+        {
+            unpacker->pt++;
+            return 0;
+        }
+    }
+    else if (it->count)
+    {
+        it->count--;
+    }
+    else
+    {
+        return 0;
+    }
+
+    *start = unpacker->pt;
+    if (splice__skip(unpacker))
+    {
+        return QP_SPLICE_ERR_DATA;
+    }
+    if (it->is_map)
+    {
+        it->key_end = unpacker->pt;
+        if (splice__skip(unpacker))
+        {
+            return QP_SPLICE_ERR_DATA;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Copy all elements of a container to 'packer' with a single memcpy() and
+ * add the number of elements to 'count'.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__copy(
+        splice__iter_t * it,
+        qp_unpacker_t * unpacker,
+        qp_packer_t * packer,
+        size_t * count)
+{
+    const unsigned char * start, * first = unpacker->pt, * end = first;
+    size_t n;
+    int rc;
+
+    while ((rc = splice__iter_next(it, unpacker, &start)) == 1)
+    {
+        end = unpacker->pt;
+        ++*count;
+    }
+    if (rc < 0)
+    {
+        return rc;
+    }
+
+    n = end - first;
+    if (qp_packer_reserve(packer, n))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+    memcpy(packer->buffer + packer->len, first, n);
+    packer->len += n;
+    return 0;
+}
+
+/*
+ * Concatenate the elements of containers of one type. Arrays are always
+ * accepted, maps only when 'is_map' is set.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__concat(
+        qp_unpacker_t * unpackers,
+        size_t n,
+        int is_map,
+        qp_packer_t * packer)
+{
+    splice__iter_t it;
+    size_t i, pos, count = 0;
+    int rc;
+
+    if (qp_add_open(packer, is_map ? QP_MAP_OPEN : QP_ARRAY_OPEN, &pos))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        rc = splice__iter_init(&it, &unpackers[i]);
+        if (rc || it.is_map != is_map)
+        {
+            return rc ? rc : QP_SPLICE_ERR_TYPE;
+        }
+        rc = splice__copy(&it, &unpackers[i], packer, &count);
+        if (rc)
+        {
+            return rc;
+        }
+    }
+
+    return qp_add_close(packer, pos, count) ? QP_SPLICE_ERR_ALLOC : 0;
+}
+
+typedef struct
+{
+    qp_packer_t * patch;
+    qp_path_t * path;   /* path to the current value */
+    size_t n;
+    size_t size;
+    size_t max_depth;
+    size_t ops;         /* operations in the patch */
+} splice__diff_t;
+
+typedef struct
+{
+    int found;
+    int is_map;
+    int is_open;
+    size_t * headers;   /* container headers on the path, for each step */
+    size_t header;      /* position of the container header */
+    size_t start;       /* element (or map key) start, or insert position */
+    size_t value;       /* start of the value */
+    size_t end;         /* end of the element */
+} splice__slot_t;
+
+/*
+ * Replace 'old_n' bytes at 'pos' in 'packer' by 'n' new bytes, moving the
+ * rest of the buffer once when the sizes differ.
+ *
+ * Returns 0 if successful or QP_SPLICE_ERR_ALLOC.
+ */
+static int splice__replace(
+        qp_packer_t * packer,
+        size_t pos,
+        size_t old_n,
+        const unsigned char * data,
+        size_t n)
+{
+    if (n != old_n)
+    {
+        if (n > old_n && qp_packer_reserve(packer, n - old_n))
+        {
+            return QP_SPLICE_ERR_ALLOC;
+        }
+        memmove(packer->buffer + pos + n,
+                packer->buffer + pos + old_n,
+                packer->len - pos - old_n);
+        packer->len = packer->len - old_n + n;
+    }
+    if (n)
+    {
+        memcpy(packer->buffer + pos, data, n);
+    }
+    return 0;
+}
+
+/*
+ * Add 'delta' to the integer at 'pt' without changing its size.
+ *
+ * Returns 0 if successful, QP_SPLICE_ERR_SIZE when the result does not fit
+ * or QP_SPLICE_ERR_DATA.
+ */
+static int splice__add(unsigned char * pt, int64_t delta, int check)
+{
+    int64_t val, min, max;
+    size_t n;
+
+    switch (*pt)
+    {
+    case QP_INT8:
+        n = sizeof(int8_t);
+        min = INT8_MIN;
+        max = INT8_MAX;
+        break;
+    case QP_INT16:
+        n = sizeof(int16_t);
+        min = INT16_MIN;
+        max = INT16_MAX;
+        break;
+    case QP_INT32:
+        n = sizeof(int32_t);
+        min = INT32_MIN;
+        max = INT32_MAX;
+        break;
+    case QP_INT64:
+        n = sizeof(int64_t);
+        min = INT64_MIN;
+        max = INT64_MAX;
+        break;
+    default:
+        if (*pt >= 64)
+        {
+            return QP_SPLICE_ERR_DATA;
+        }
+        /* the value is the type byte */
+        val = *pt + delta;
+        if (val < 0 || val >= 64)
+        {
+            return QP_SPLICE_ERR_SIZE;
+        }
+        if (!check)
+        {
+            *pt = (unsigned char) val;
+        }
+        return 0;
+    }
+
+    switch (n)
+    {
+    case sizeof(int8_t):
+    {
+        int8_t i8;
+        memcpy(&i8, pt + 1, n);
+        val = i8;
+        break;
+    }
+    case sizeof(int16_t):
+    {
+        int16_t i16;
+        memcpy(&i16, pt + 1, n);
+        val = i16;
+        break;
+    }
+    case sizeof(int32_t):
+    {
+        int32_t i32;
+        memcpy(&i32, pt + 1, n);
+        val = i32;
+        break;
+    }
+    default:
+        memcpy(&val, pt + 1, n);
+    }
+
+    if (delta > 0 ? val > max - delta : val < min - delta)
+    {
+        return QP_SPLICE_ERR_SIZE;
+    }
+    val += delta;
+    if (check)
+    {
+        return 0;
+    }
+
+    switch (n)
+    {
+    case sizeof(int8_t):
+    {
+        int8_t i8 = (int8_t) val;
+        memcpy(pt + 1, &i8, n);
+        break;
+    }
+    case sizeof(int16_t):
+    {
+        int16_t i16 = (int16_t) val;
+        memcpy(pt + 1, &i16, n);
+        break;
+    }
+    case sizeof(int32_t):
+    {
+        int32_t i32 = (int32_t) val;
+        memcpy(pt + 1, &i32, n);
+        break;
+    }
+    default:
+        memcpy(pt + 1, &val, n);
+    }
+    return 0;
+}
+
+/*
+ * A change of 'delta' bytes inside the containers with 'headers' must be
+ * written in the sizes of the sized containers (QP_HOOK_ARRAY, QP_HOOK_MAP),
+ * and a change of 'count' items in the last one. With 'check' set nothing is
+ * written, so a call with check can be done before changing the data and a
+ * second call without, after it.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__resize(
+        qp_packer_t * packer,
+        const size_t * headers,
+        size_t n,
+        int64_t delta,
+        int64_t count,
+        int check)
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned char * pt = packer->buffer + headers[i];
+        qp_unpacker_t unpacker;
+
+        if (pt[0] != QP_HOOK ||
+            (pt[1] != QP_HOOK_ARRAY && pt[1] != QP_HOOK_MAP))
+        {
+            continue;
+        }
+        pt += 2;
+        rc = splice__add(pt, delta, check);
+        if (rc)
+        {
+            return rc;
+        }
+        if (i + 1 < n || count == 0)
+        {
+            continue;
+        }
+
+        /* move to the count */
+        qp_unpacker_init(&unpacker, pt, packer->buffer + packer->len - pt);
+        qp_next(&unpacker, NULL);
+        rc = splice__add(unpacker.pt, count, check);
+        if (rc)
+        {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/* FNV-1a hash of the raw key bytes */
+static uint64_t splice__hash(const unsigned char * key, size_t n)
+{
+    uint64_t h = 14695981039346656037ULL;
+    while (n--)
+    {
+        h ^= *key++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/*
+ * Drop pairs with a duplicate key as defined by 'mode'. Keys are equal when
+ * their encoded bytes are equal.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__dedup(splice__pair_t * pairs, size_t n, qp_merge_t mode)
+{
+    size_t i, j, mask, size = 16;
+    size_t * slots;
+
+    while (size < n * 2)
+    {
+        size *= 2;
+    }
+    mask = size - 1;
+
+    /* slots hold the index of a pair plus one, 0 is an empty slot */
+    slots = calloc(size, sizeof(size_t));
+    if (slots == NULL)
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        splice__pair_t * pair = &pairs[i];
+        j = splice__hash(pair->start, pair->key_n) & mask;
+        for (; slots[j]; j = (j + 1) & mask)
+        {
+            splice__pair_t * prev = &pairs[slots[j] - 1];
+            if (prev->key_n == pair->key_n &&
+                memcmp(prev->start, pair->start, pair->key_n) == 0)
+            {
+                break;
+            }
+        }
+
+        if (slots[j] == 0)
+        {
+            slots[j] = i + 1;
+        }
+        else if (mode == QP_MERGE_FIRST)
+        {
+            pair->n = 0;
+        }
+        else if (mode == QP_MERGE_LAST)
+        {
+            pairs[slots[j] - 1].n = 0;
+            slots[j] = i + 1;
+        }
+        else
+        {
+            free(slots);
+            return QP_SPLICE_ERR_KEY;
+        }
+    }
+
+    free(slots);
+    return 0;
+}
+
+/*
+ * Split the map or array at the unpacker position into containers of the
+ * same type with at most 'max_bytes' bytes each. Elements are copied as is
+ * into 'chunk' and 'cb' is called for each finished chunk. At least one chunk
+ * is created, an empty container gives one empty chunk.
+ *
+ * Returns 0 if successful, a negative QP_SPLICE_ERR_* value or the non zero
+ * value returned by 'cb'.
+ */
+int qp_split(
+        qp_unpacker_t * unpacker,
+        size_t max_bytes,
+        qp_packer_t * chunk,
+        qp_split_cb cb,
+        void * arg)
+{
+    splice__iter_t it;
+    const unsigned char * start;
+    size_t pos, count = 0, n;
+    int rc;
+    qp_types_t tp;
+
+    rc = splice__iter_init(&it, unpacker);
+    if (rc)
+    {
+        return rc;
+    }
+    tp = it.is_map ? QP_MAP_OPEN : QP_ARRAY_OPEN;
+
+    chunk->len = 0;
+    if (qp_add_open(chunk, tp, &pos))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    while ((rc = splice__iter_next(&it, unpacker, &start)) == 1)
+    {
+        n = unpacker->pt - start;
+
+        /* header, elements and a close mark when more than five */
+        if (1 + n > max_bytes)
+        {
+            return QP_SPLICE_ERR_SIZE;
+        }
+        if (chunk->len + n + (count >= 5) > max_bytes)
+        {
+            if (qp_add_close(chunk, pos, count) ||
+                (rc = cb(arg, chunk->buffer, chunk->len)))
+            {
+                return rc ? rc : QP_SPLICE_ERR_ALLOC;
+            }
+            chunk->len = 0;
+            count = 0;
+            if (qp_add_open(chunk, tp, &pos))
+            {
+                return QP_SPLICE_ERR_ALLOC;
+            }
+        }
+        if (qp_packer_reserve(chunk, n))
+        {
+            return QP_SPLICE_ERR_ALLOC;
+        }
+        memcpy(chunk->buffer + chunk->len, start, n);
+        chunk->len += n;
+        count++;
+    }
+    if (rc < 0)
+    {
+        return rc;
+    }
+
+    if (qp_add_close(chunk, pos, count))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+    return cb(arg, chunk->buffer, chunk->len);
+}
+
+/*
+ * Write one array with the elements of all arrays in 'unpackers'.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_concat(
+        qp_unpacker_t * unpackers,
+        size_t n,
+        qp_packer_t * packer)
+{
+    return splice__concat(unpackers, n, 0, packer);
+}
+
+/*
+ * Write one map with the key/value pairs of all maps in 'unpackers'. With
+ * QP_MERGE_NONE all pairs are copied as is. Other modes find duplicate keys
+ * by hashing their encoded bytes; only pairs which are kept are copied.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_merge(
+        qp_unpacker_t * unpackers,
+        size_t n,
+        qp_merge_t mode,
+        qp_packer_t * packer)
+{
+    splice__iter_t it;
+    splice__pair_t * pairs = NULL, * tmp;
+    const unsigned char * start;
+    size_t i, pos, count = 0, npairs = 0, size = 0;
+    int rc = 0;
+
+    if (mode == QP_MERGE_NONE)
+    {
+        return splice__concat(unpackers, n, 1, packer);
+    }
+
+    for (i = 0; i < n && rc == 0; i++)
+    {
+        rc = splice__iter_init(&it, &unpackers[i]);
+        if (rc || !it.is_map)
+        {
+            rc = rc ? rc : QP_SPLICE_ERR_TYPE;
+            break;
+        }
+        while ((rc = splice__iter_next(&it, &unpackers[i], &start)) == 1)
+        {
+            if (npairs == size)
+            {
+                size = size ? size * 2 : 64;
+                tmp = realloc(pairs, size * sizeof(splice__pair_t));
+                if (tmp == NULL)
+                {
+                    rc = QP_SPLICE_ERR_ALLOC;
+                    break;
+                }
+                pairs = tmp;
+            }
+            pairs[npairs].start = start;
+            pairs[npairs].key_n = it.key_end - start;
+            pairs[npairs].n = unpackers[i].pt - start;
+            npairs++;
+        }
+    }
+
+    if (rc == 0)
+    {
+        rc = splice__dedup(pairs, npairs, mode);
+    }
+
+    if (rc == 0 && qp_add_open(packer, QP_MAP_OPEN, &pos))
+    {
+        rc = QP_SPLICE_ERR_ALLOC;
+    }
+
+    /* pairs which follow each other in one input are copied at once */
+    for (i = 0; i < npairs && rc == 0; i++)
+    {
+        const unsigned char * end;
+        if (pairs[i].n == 0)
+        {
+            continue;
+        }
+        start = pairs[i].start;
+        end = start + pairs[i].n;
+        count++;
+        while (i + 1 < npairs && pairs[i + 1].start == end)
+        {
+            i++;
+            if (pairs[i].n == 0)
+            {
+                break;
+            }
+            end += pairs[i].n;
+            count++;
+        }
+        if (qp_packer_reserve(packer, end - start))
+        {
+            rc = QP_SPLICE_ERR_ALLOC;
+            break;
+        }
+        memcpy(packer->buffer + packer->len, start, end - start);
+        packer->len += end - start;
+    }
+
+    free(pairs);
+    if (rc == 0 && qp_add_close(packer, pos, count))
+    {
+        rc = QP_SPLICE_ERR_ALLOC;
+    }
+    return rc;
+}
+
+/*
+ * See qp_find(). When 'headers' is not NULL, the position from 'base' of the
+ * container for each step of the path is stored in it.
+ */
+static int splice__find(
+        qp_unpacker_t * unpacker,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char ** start,
+        const unsigned char * base,
+        size_t * headers)
+{
+    splice__iter_t it;
+    const unsigned char * pt;
+    size_t i;
+    int64_t index;
+    int rc;
+
+    for (i = 0; i < n; i++)
+    {
+        if (headers != NULL)
+        {
+            headers[i] = unpacker->pt - base;
+        }
+        rc = splice__iter_init(&it, unpacker);
+        if (rc)
+        {
+            return rc == QP_SPLICE_ERR_SHARED ? rc : QP_SPLICE_ERR_PATH;
+        }
+
+        if (it.is_map)
+        {
+            if (path[i].key == NULL)
+            {
+                return QP_SPLICE_ERR_PATH;
+            }
+            while ((rc = splice__iter_next(&it, unpacker, &pt)) == 1)
+            {
+                if ((size_t) (it.key_end - pt) == path[i].key_n &&
+                    memcmp(pt, path[i].key, path[i].key_n) == 0)
+                {
+                    break;
+                }
+            }
+            if (rc != 1)
+            {
+                return rc ? rc : QP_SPLICE_ERR_PATH;
+            }
+            /* back to the start of the value */
+            unpacker->pt = (unsigned char *) it.key_end;
+            continue;
+        }
+
+        if (path[i].index < 0)
+        {
+            return QP_SPLICE_ERR_PATH;
+        }
+        for (index = path[i].index; index; index--)
+        {
+            rc = splice__iter_next(&it, unpacker, &pt);
+            if (rc != 1)
+            {
+                return rc ? rc : QP_SPLICE_ERR_PATH;
+            }
+        }
+        if (it.is_open ?
+                (unpacker->pt >= unpacker->end ||
+                 *unpacker->pt == QP_ARRAY_CLOSE) :
+                it.count == 0)
+        {
+            return QP_SPLICE_ERR_PATH;
+        }
+    }
+
+    *start = unpacker->pt;
+    return splice__skip(unpacker);
+}
+
+/*
+ * Move the unpacker to the start of the value with 'path', where each step is
+ * a map key (compared with the encoded keys) or an array index. The value
+ * itself is skipped too, so the value is found from 'start' up to the new
+ * unpacker position. An empty path is the value at the unpacker position.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_find(
+        qp_unpacker_t * unpacker,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char ** start)
+{
+    return splice__find(unpacker, path, n, start, NULL, NULL);
+}
+
+/*
+ * Replace the value with 'path' in 'packer' by the encoded 'value'. When both
+ * have the same size the bytes are overwritten in place, otherwise the rest
+ * of the buffer is moved once. The sizes of sized containers on the path are
+ * updated.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_patch(
+        qp_packer_t * packer,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char * value,
+        size_t value_n)
+{
+    qp_unpacker_t unpacker;
+    const unsigned char * start;
+    size_t pos, old_n, * headers = NULL;
+    int64_t delta;
+    int rc;
+
+    if (n && (headers = malloc(n * sizeof(size_t))) == NULL)
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    qp_unpacker_init(&unpacker, packer->buffer, packer->len);
+    rc = splice__find(&unpacker, path, n, &start, packer->buffer, headers);
+    if (rc == 0)
+    {
+        pos = start - packer->buffer;
+        old_n = unpacker.pt - start;
+        delta = (int64_t) value_n - (int64_t) old_n;
+        rc = splice__resize(packer, headers, n, delta, 0, 1);
+    }
+    if (rc == 0)
+    {
+        rc = splice__replace(packer, pos, old_n, value, value_n);
+    }
+    if (rc == 0)
+    {
+        rc = splice__resize(packer, headers, n, delta, 0, 0);
+    }
+
+    free(headers);
+    return rc;
+}
+
+/*
+ * Write a path as an array with the encoded map keys and array indexes.
+ *
+ * Returns 0 if successful or QP_SPLICE_ERR_ALLOC.
+ */
+static int splice__path(qp_packer_t * packer, const qp_path_t * path, size_t n)
+{
+    size_t i, pos;
+
+    if (qp_add_open(packer, QP_ARRAY_OPEN, &pos))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (path[i].key == NULL)
+        {
+            if (qp_add_int64(packer, path[i].index))
+            {
+                return QP_SPLICE_ERR_ALLOC;
+            }
+            continue;
+        }
+        if (qp_packer_reserve(packer, path[i].key_n))
+        {
+            return QP_SPLICE_ERR_ALLOC;
+        }
+        memcpy(packer->buffer + packer->len, path[i].key, path[i].key_n);
+        packer->len += path[i].key_n;
+    }
+    return qp_add_close(packer, pos, n) ? QP_SPLICE_ERR_ALLOC : 0;
+}
+
+/*
+ * Add an operation [op, path] or [op, path, value] to the patch.
+ *
+ * Returns 0 if successful or QP_SPLICE_ERR_ALLOC.
+ */
+static int splice__op(
+        splice__diff_t * diff,
+        qp_diff_op_t op,
+        const unsigned char * value,
+        size_t value_n)
+{
+    qp_packer_t * patch = diff->patch;
+    size_t pos;
+
+    if (qp_add_open(patch, QP_ARRAY_OPEN, &pos) ||
+        qp_add_int64(patch, op) ||
+        splice__path(patch, diff->path, diff->n) ||
+        qp_packer_reserve(patch, value_n))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+    if (value_n)
+    {
+        memcpy(patch->buffer + patch->len, value, value_n);
+        patch->len += value_n;
+    }
+    diff->ops++;
+    return qp_add_close(patch, pos, value ? 3 : 2) ? QP_SPLICE_ERR_ALLOC : 0;
+}
+
+/*
+ * Add a step to the path of the diff.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__push(
+        splice__diff_t * diff,
+        const unsigned char * key,
+        size_t key_n,
+        int64_t index)
+{
+    if (diff->n >= diff->max_depth)
+    {
+        return QP_SPLICE_ERR_DEPTH;
+    }
+    if (diff->n == diff->size)
+    {
+        qp_path_t * tmp;
+        diff->size = diff->size ? diff->size * 2 : 16;
+        tmp = realloc(diff->path, diff->size * sizeof(qp_path_t));
+        if (tmp == NULL)
+        {
+            return QP_SPLICE_ERR_ALLOC;
+        }
+        diff->path = tmp;
+    }
+    diff->path[diff->n].key = key;
+    diff->path[diff->n].key_n = key_n;
+    diff->path[diff->n].index = index;
+    diff->n++;
+    return 0;
+}
+
+static int splice__diff(
+        splice__diff_t * diff,
+        const unsigned char * a,
+        size_t a_n,
+        const unsigned char * b,
+        size_t b_n);
+
+/*
+ * Compare the pairs of two maps. Keys of the old map are found by hashing
+ * their encoded bytes.
+ */
+static int splice__diff_map(
+        splice__diff_t * diff,
+        splice__iter_t * it_a,
+        qp_unpacker_t * a,
+        splice__iter_t * it_b,
+        qp_unpacker_t * b)
+{
+    splice__pair_t * pairs = NULL, * tmp;
+    const unsigned char * start;
+    size_t i, j, mask, size = 0, npairs = 0, * slots = NULL;
+    int rc;
+
+    while ((rc = splice__iter_next(it_a, a, &start)) == 1)
+    {
+        if (npairs == size)
+        {
+            size = size ? size * 2 : 16;
+            tmp = realloc(pairs, size * sizeof(splice__pair_t));
+            if (tmp == NULL)
+            {
+                rc = QP_SPLICE_ERR_ALLOC;
+                goto done;
+            }
+            pairs = tmp;
+        }
+        pairs[npairs].start = start;
+        pairs[npairs].key_n = it_a->key_end - start;
+        pairs[npairs].n = a->pt - start;
+        npairs++;
+    }
+    if (rc < 0)
+    {
+        goto done;
+    }
+
+    /* slots hold the index of a pair plus one, 0 is an empty slot */
+    for (size = 16; size < npairs * 2; size *= 2);
+    mask = size - 1;
+    slots = calloc(size, sizeof(size_t));
+    if (slots == NULL)
+    {
+        rc = QP_SPLICE_ERR_ALLOC;
+        goto done;
+    }
+    for (i = 0; i < npairs; i++)
+    {
+        j = splice__hash(pairs[i].start, pairs[i].key_n) & mask;
+        while (slots[j])
+        {
+            j = (j + 1) & mask;
+        }
+        slots[j] = i + 1;
+    }
+
+    while ((rc = splice__iter_next(it_b, b, &start)) == 1)
+    {
+        size_t key_n = it_b->key_end - start;
+        splice__pair_t * pair = NULL;
+
+        for (j = splice__hash(start, key_n) & mask; slots[j];
+             j = (j + 1) & mask)
+        {
+            pair = &pairs[slots[j] - 1];
+            if (pair->key_n == key_n && pair->n &&
+                memcmp(pair->start, start, key_n) == 0)
+            {
+                break;
+            }
+            pair = NULL;
+        }
+
+        rc = splice__push(diff, start, key_n, -1);
+        if (rc)
+        {
+            goto done;
+        }
+        if (pair == NULL)
+        {
+            rc = splice__op(diff, QP_DIFF_SET, it_b->key_end,
+                            b->pt - it_b->key_end);
+        }
+        else
+        {
+            rc = splice__diff(
+                    diff,
+                    pair->start + key_n,
+                    pair->n - key_n,
+                    it_b->key_end,
+                    b->pt - it_b->key_end);
+            pair->n = 0;    /* seen */
+        }
+        diff->n--;
+        if (rc)
+        {
+            goto done;
+        }
+    }
+    if (rc < 0)
+    {
+        goto done;
+    }
+
+    /* keys which are not found in the new map */
+    for (i = 0; i < npairs; i++)
+    {
+        if (pairs[i].n == 0)
+        {
+            continue;
+        }
+        rc = splice__push(diff, pairs[i].start, pairs[i].key_n, -1);
+        if (rc == 0)
+        {
+            rc = splice__op(diff, QP_DIFF_DEL, NULL, 0);
+            diff->n--;
+        }
+        if (rc)
+        {
+            goto done;
+        }
+    }
+
+done:
+    free(slots);
+    free(pairs);
+    return rc;
+}
+
+/*
+ * Compare the elements of two arrays by index. Elements added to the end are
+ * set and elements removed from the end are deleted, starting with the last.
+ */
+static int splice__diff_array(
+        splice__diff_t * diff,
+        splice__iter_t * it_a,
+        qp_unpacker_t * a,
+        splice__iter_t * it_b,
+        qp_unpacker_t * b)
+{
+    const unsigned char * start_a, * start_b;
+    int64_t index = 0, len;
+    int rc_a, rc_b, rc;
+
+    for (;; index++)
+    {
+        rc_a = splice__iter_next(it_a, a, &start_a);
+        if (rc_a < 0)
+        {
+            return rc_a;
+        }
+        rc_b = splice__iter_next(it_b, b, &start_b);
+        if (rc_b < 0)
+        {
+            return rc_b;
+        }
+        if (rc_a == 0 || rc_b == 0)
+        {
+            break;
+        }
+        rc = splice__push(diff, NULL, 0, index);
+        if (rc == 0)
+        {
+            rc = splice__diff(
+                    diff,
+                    start_a,
+                    a->pt - start_a,
+                    start_b,
+                    b->pt - start_b);
+            diff->n--;
+        }
+        if (rc)
+        {
+            return rc;
+        }
+    }
+
+    /* added elements */
+    for (; rc_b == 1; index++)
+    {
+        rc = splice__push(diff, NULL, 0, index);
+        if (rc == 0)
+        {
+            rc = splice__op(diff, QP_DIFF_SET, start_b, b->pt - start_b);
+            diff->n--;
+        }
+        if (rc)
+        {
+            return rc;
+        }
+        rc_b = splice__iter_next(it_b, b, &start_b);
+        if (rc_b < 0)
+        {
+            return rc_b;
+        }
+    }
+
+    /* removed elements */
+    if (rc_a == 1)
+    {
+        for (len = index + 1; (rc_a = splice__iter_next(it_a, a, &start_a));)
+        {
+            if (rc_a < 0)
+            {
+                return rc_a;
+            }
+            len++;
+        }
+        while (len-- > index)
+        {
+            rc = splice__push(diff, NULL, 0, len);
+            if (rc == 0)
+            {
+                rc = splice__op(diff, QP_DIFF_DEL, NULL, 0);
+                diff->n--;
+            }
+            if (rc)
+            {
+                return rc;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Add the operations which change value 'a' into value 'b'. Equal values are
+ * found by comparing bytes. Maps and arrays are compared element by element
+ * unless a single set of the new value, with its operation and path, is
+ * smaller.
+ */
+static int splice__diff(
+        splice__diff_t * diff,
+        const unsigned char * a,
+        size_t a_n,
+        const unsigned char * b,
+        size_t b_n)
+{
+    qp_unpacker_t up_a, up_b;
+    splice__iter_t it_a, it_b;
+    size_t mark = diff->patch->len, ops = diff->ops, end, set_n;
+    int rc;
+
+    if (a_n == b_n && memcmp(a, b, a_n) == 0)
+    {
+        return 0;
+    }
+
+    qp_unpacker_init(&up_a, (unsigned char *) a, a_n);
+    qp_unpacker_init(&up_b, (unsigned char *) b, b_n);
+    if (splice__iter_init(&it_a, &up_a) == 0 &&
+        splice__iter_init(&it_b, &up_b) == 0 &&
+        it_a.is_map == it_b.is_map)
+    {
+        rc = it_a.is_map ?
+                splice__diff_map(diff, &it_a, &up_a, &it_b, &up_b) :
+                splice__diff_array(diff, &it_a, &up_a, &it_b, &up_b);
+        if (rc)
+        {
+            return rc;
+        }
+
+        /* compare with the set operation as it is written, with its path */
+        end = diff->patch->len;
+        rc = splice__op(diff, QP_DIFF_SET, b, b_n);
+        if (rc)
+        {
+            return rc;
+        }
+        set_n = diff->patch->len - end;
+        if (end - mark <= set_n)
+        {
+            diff->patch->len = end;
+            diff->ops--;
+            return 0;
+        }
+        memmove(diff->patch->buffer + mark,
+                diff->patch->buffer + end,
+                set_n);
+        diff->patch->len = mark + set_n;
+        diff->ops = ops + 1;
+        return 0;
+    }
+    return splice__op(diff, QP_DIFF_SET, b, b_n);
+}
+
+/*
+ * Write a patch with the operations which change the value at 'a' into the
+ * value at 'b'. The patch is an array of [QP_DIFF_SET, path, value] and
+ * [QP_DIFF_DEL, path] operations which must be applied in order; a path is
+ * an array of encoded map keys and array indexes. Subtrees with equal bytes
+ * are skipped, so the size of the patch depends on what has changed.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_diff(
+        qp_unpacker_t * a,
+        qp_unpacker_t * b,
+        qp_packer_t * patch,
+        int max_depth)
+{
+    splice__diff_t diff;
+    const unsigned char * start_a, * start_b;
+    size_t pos;
+    int rc;
+
+    start_a = a->pt;
+    start_b = b->pt;
+    if (splice__skip(a) || splice__skip(b))
+    {
+        return QP_SPLICE_ERR_DATA;
+    }
+
+    diff.patch = patch;
+    diff.path = NULL;
+    diff.n = 0;
+    diff.size = 0;
+    diff.max_depth = max_depth;
+    diff.ops = 0;
+
+    if (qp_add_open(patch, QP_ARRAY_OPEN, &pos))
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+    rc = splice__diff(
+            &diff,
+            start_a,
+            a->pt - start_a,
+            start_b,
+            b->pt - start_b);
+    free(diff.path);
+    if (rc)
+    {
+        return rc;
+    }
+    return qp_add_close(patch, pos, diff.ops) ? QP_SPLICE_ERR_ALLOC : 0;
+}
+
+/*
+ * Find the element for the last step of 'path' in its map or array. When the
+ * element does not exist, 'start' is the position where it can be added. The
+ * container headers on the path are stored in slot->headers, which must have
+ * room for 'n' positions.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+static int splice__locate(
+        qp_packer_t * packer,
+        const qp_path_t * path,
+        size_t n,
+        splice__slot_t * slot)
+{
+    qp_unpacker_t unpacker;
+    splice__iter_t it;
+    const unsigned char * parent, * start, * pos;
+    const qp_path_t * step = &path[n - 1];
+    int64_t index = 0;
+    int rc;
+
+    qp_unpacker_init(&unpacker, packer->buffer, packer->len);
+    rc = splice__find(
+            &unpacker,
+            path,
+            n - 1,
+            &parent,
+            packer->buffer,
+            slot->headers);
+    if (rc)
+    {
+        return rc;
+    }
+
+    unpacker.pt = (unsigned char *) parent;
+    rc = splice__iter_init(&it, &unpacker);
+    if (rc == QP_SPLICE_ERR_SHARED)
+    {
+        return rc;
+    }
+    if (rc || (it.is_map ? step->key == NULL : step->index < 0))
+    {
+        return QP_SPLICE_ERR_PATH;
+    }
+    slot->header = slot->headers[n - 1] = parent - packer->buffer;
+    slot->is_map = it.is_map;
+    slot->is_open = it.is_open;
+
+    for (;; index++)
+    {
+        pos = unpacker.pt;
+        rc = splice__iter_next(&it, &unpacker, &start);
+        if (rc < 0)
+        {
+            return rc;
+        }
+        if (rc == 0)
+        {
+            /* only a map key or the next array index can be added */
+            slot->found = 0;
+            slot->start = pos - packer->buffer;
+            return it.is_map || index == step->index ?
+                    0 : QP_SPLICE_ERR_PATH;
+        }
+        if (it.is_map ?
+                ((size_t) (it.key_end - start) == step->key_n &&
+                 memcmp(start, step->key, step->key_n) == 0) :
+                index == step->index)
+        {
+            slot->found = 1;
+            slot->start = start - packer->buffer;
+            slot->value = (it.is_map ? it.key_end : start) - packer->buffer;
+            slot->end = unpacker.pt - packer->buffer;
+            return 0;
+        }
+    }
+}
+
+/*
+ * Replace the value of the element found in 'slot'.
+ */
+static int splice__update(
+        qp_packer_t * packer,
+        splice__slot_t * slot,
+        size_t n,
+        const unsigned char * value,
+        size_t value_n)
+{
+    size_t old_n = slot->end - slot->value;
+    int64_t delta = (int64_t) value_n - (int64_t) old_n;
+    int rc;
+
+    rc = splice__resize(packer, slot->headers, n, delta, 0, 1);
+    if (rc == 0)
+    {
+        rc = splice__replace(packer, slot->value, old_n, value, value_n);
+    }
+    if (rc == 0)
+    {
+        rc = splice__resize(packer, slot->headers, n, delta, 0, 0);
+    }
+    return rc;
+}
+
+/*
+ * Add an element with the key of 'step' (for a map) and 'value' at the
+ * position found in 'slot'.
+ */
+static int splice__insert(
+        qp_packer_t * packer,
+        splice__slot_t * slot,
+        const qp_path_t * step,
+        size_t n,
+        const unsigned char * value,
+        size_t value_n)
+{
+    unsigned char * header = packer->buffer + slot->header;
+    size_t pos = slot->start;
+    int64_t delta;
+    int rc, close = 0;
+
+    /* a container with a fixed size of five becomes an open container */
+    if (!slot->is_open && (*header == QP_ARRAY5 || *header == QP_MAP5))
+    {
+        close = 1;
+    }
+
+    delta = (int64_t) ((slot->is_map ? step->key_n : 0) + value_n + close);
+    rc = splice__resize(packer, slot->headers, n, delta, 1, 1);
+    if (rc)
+    {
+        return rc;
+    }
+
+    if (close)
+    {
+        *header = slot->is_map ? QP_MAP_OPEN : QP_ARRAY_OPEN;
+    }
+    else if (!slot->is_open)
+    {
+        ++*header;
+    }
+
+    if (slot->is_map)
+    {
+        rc = splice__replace(packer, pos, 0, step->key, step->key_n);
+        pos += step->key_n;
+    }
+    if (rc == 0)
+    {
+        rc = splice__replace(packer, pos, 0, value, value_n);
+        pos += value_n;
+    }
+    if (rc == 0 && close)
+    {
+        unsigned char mark = slot->is_map ? QP_MAP_CLOSE : QP_ARRAY_CLOSE;
+        rc = splice__replace(packer, pos, 0, &mark, 1);
+    }
+    if (rc == 0)
+    {
+        rc = splice__resize(packer, slot->headers, n, delta, 1, 0);
+    }
+    return rc;
+}
+
+/*
+ * Set the value with 'path'. A value which does not exist is added to its
+ * map, or to the end of its array.
+ */
+static int splice__set(
+        qp_packer_t * packer,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char * value,
+        size_t value_n)
+{
+    splice__slot_t slot;
+    int rc;
+
+    if (n == 0)
+    {
+        return qp_patch(packer, path, n, value, value_n);
+    }
+
+    slot.headers = malloc(n * sizeof(size_t));
+    if (slot.headers == NULL)
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    rc = splice__locate(packer, path, n, &slot);
+    if (rc == 0)
+    {
+        rc = slot.found ?
+                splice__update(packer, &slot, n, value, value_n) :
+                splice__insert(packer, &slot, &path[n - 1], n, value, value_n);
+    }
+
+    free(slot.headers);
+    return rc;
+}
+
+/*
+ * Delete the element with 'path' from its map or array.
+ */
+static int splice__del(qp_packer_t * packer, const qp_path_t * path, size_t n)
+{
+    splice__slot_t slot;
+    int64_t delta;
+    int rc;
+
+    if (n == 0)
+    {
+        return QP_SPLICE_ERR_PATH;
+    }
+
+    slot.headers = malloc(n * sizeof(size_t));
+    if (slot.headers == NULL)
+    {
+        return QP_SPLICE_ERR_ALLOC;
+    }
+
+    rc = splice__locate(packer, path, n, &slot);
+    if (rc == 0 && !slot.found)
+    {
+        rc = QP_SPLICE_ERR_PATH;
+    }
+    if (rc == 0)
+    {
+        delta = -(int64_t) (slot.end - slot.start);
+        rc = splice__resize(packer, slot.headers, n, delta, -1, 1);
+    }
+    if (rc == 0)
+    {
+        if (!slot.is_open)
+        {
+            packer->buffer[slot.header]--;
+        }
+        rc = splice__replace(
+                packer,
+                slot.start,
+                slot.end - slot.start,
+                NULL,
+                0);
+    }
+    if (rc == 0)
+    {
+        rc = splice__resize(packer, slot.headers, n, delta, -1, 0);
+    }
+
+    free(slot.headers);
+    return rc;
+}
+
+/*
+ * Apply a patch created with qp_diff() to the value in 'packer'.
+ *
+ * Returns 0 if successful or a negative QP_SPLICE_ERR_* value.
+ */
+int qp_apply(qp_packer_t * packer, qp_unpacker_t * patch)
+{
+    splice__iter_t ops, op, steps;
+    qp_unpacker_t step, key;
+    qp_obj_t obj;
+    qp_path_t * path = NULL, * tmp;
+    const unsigned char * start, * value;
+    size_t n, size = 0;
+    int rc;
+
+    if (splice__iter_init(&ops, patch) || ops.is_map)
+    {
+        return QP_SPLICE_ERR_DATA;
+    }
+
+    while ((rc = splice__iter_next(&ops, patch, &start)) == 1)
+    {
+        qp_diff_op_t code;
+        qp_unpacker_init(&step, (unsigned char *) start, patch->pt - start);
+
+        /* [op, path, value?] */
+        if (splice__iter_init(&op, &step) || op.is_map ||
+            qp_next(&step, &obj) != QP_INT64 ||
+            splice__iter_init(&steps, &step) || steps.is_map)
+        {
+            rc = QP_SPLICE_ERR_DATA;
+            break;
+        }
+        code = (qp_diff_op_t) obj.via.int64;
+        for (n = 0; (rc = splice__iter_next(&steps, &step, &value)) == 1; n++)
+        {
+            if (n == size)
+            {
+                size = size ? size * 2 : 16;
+                tmp = realloc(path, size * sizeof(qp_path_t));
+                if (tmp == NULL)
+                {
+                    rc = QP_SPLICE_ERR_ALLOC;
+                    break;
+                }
+                path = tmp;
+            }
+            path[n].key = value;
+            path[n].key_n = step.pt - value;
+            qp_unpacker_init(&key, (unsigned char *) value, path[n].key_n);
+            path[n].index = qp_next(&key, &obj) == QP_INT64 ?
+                    obj.via.int64 : -1;
+        }
+        if (rc)
+        {
+            break;
+        }
+
+        if (code == QP_DIFF_SET)
+        {
+            value = step.pt;
+            rc = splice__skip(&step) ? QP_SPLICE_ERR_DATA : splice__set(
+                    packer,
+                    path,
+                    n,
+                    value,
+                    step.pt - value);
+        }
+        else if (code == QP_DIFF_DEL)
+        {
+            rc = splice__del(packer, path, n);
+        }
+        else
+        {
+            rc = QP_SPLICE_ERR_DATA;
+        }
+        if (rc)
+        {
+            break;
+        }
+    }
+
+    free(path);
+    return rc < 0 ? rc : 0;
+}
+
+const char * qp_splice_strerror(int err)
+{
+    switch ((qp_splice_err_t) err)
+    {
+    case QP_SPLICE_OK:
+        return "no error";
+    case QP_SPLICE_ERR_ALLOC:
+        return "memory allocation error";
+    case QP_SPLICE_ERR_DATA:
+        return "invalid or truncated data";
+    case QP_SPLICE_ERR_TYPE:
+        return "not a map or array";
+    case QP_SPLICE_ERR_SIZE:
+        return "element larger than the maximum size";
+    case QP_SPLICE_ERR_KEY:
+        return "duplicate map key";
+    case QP_SPLICE_ERR_PATH:
+        return "path not found";
+    case QP_SPLICE_ERR_DEPTH:
+        return "excessive nesting";
+    case QP_SPLICE_ERR_SHARED:
+        return "shared-table data is not supported";
+    }
+    return "unknown error";
+}
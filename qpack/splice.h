@@ -0,0 +1,88 @@
+/*
+ * splice.h - Operate on encoded maps and arrays by copying raw bytes.
+ */
+#ifndef QP_SPLICE_H_
+#define QP_SPLICE_H_
+
+#include <qpack/qpack.h>
+
+typedef enum
+{
+    QP_SPLICE_OK,
+    QP_SPLICE_ERR_ALLOC     =-1,    /* memory allocation error          */
+    QP_SPLICE_ERR_DATA      =-2,    /* invalid or truncated data        */
+    QP_SPLICE_ERR_TYPE      =-3,    /* not a map or array               */
+    QP_SPLICE_ERR_SIZE      =-4,    /* element larger than the maximum  */
+    QP_SPLICE_ERR_KEY       =-5,    /* duplicate map key                */
+    QP_SPLICE_ERR_PATH      =-6,    /* path not found                   */
+    QP_SPLICE_ERR_DEPTH     =-7,    /* maximum nesting depth reached    */
+    QP_SPLICE_ERR_SHARED    =-8,    /* shared-table data (QP_HOOK_SHARED) */
+} qp_splice_err_t;
+
+typedef enum
+{
+    QP_DIFF_SET,                    /* [QP_DIFF_SET, path, value]       */
+    QP_DIFF_DEL,                    /* [QP_DIFF_DEL, path]              */
+} qp_diff_op_t;
+
+/* one step in a path: a map key or an array index */
+typedef struct
+{
+    const unsigned char * key;      /* encoded map key or NULL          */
+    size_t key_n;
+    int64_t index;                  /* array index from 0, or -1        */
+} qp_path_t;
+
+typedef enum
+{
+    QP_MERGE_NONE,                  /* copy all pairs, also duplicates  */
+    QP_MERGE_FIRST,                 /* keep the first value of a key    */
+    QP_MERGE_LAST,                  /* keep the last value of a key     */
+    QP_MERGE_ERROR,                 /* fail with QP_SPLICE_ERR_KEY      */
+} qp_merge_t;
+
+/* called with each chunk, a non zero return value stops qp_split() */
+typedef int (*qp_split_cb)(void * arg, const unsigned char * chunk, size_t n);
+
+int qp_split(
+        qp_unpacker_t * unpacker,
+        size_t max_bytes,
+        qp_packer_t * chunk,
+        qp_split_cb cb,
+        void * arg);
+
+int qp_concat(
+        qp_unpacker_t * unpackers,
+        size_t n,
+        qp_packer_t * packer);
+
+int qp_merge(
+        qp_unpacker_t * unpackers,
+        size_t n,
+        qp_merge_t mode,
+        qp_packer_t * packer);
+
+int qp_find(
+        qp_unpacker_t * unpacker,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char ** start);
+
+int qp_patch(
+        qp_packer_t * packer,
+        const qp_path_t * path,
+        size_t n,
+        const unsigned char * value,
+        size_t value_n);
+
+int qp_diff(
+        qp_unpacker_t * a,
+        qp_unpacker_t * b,
+        qp_packer_t * patch,
+        int max_depth);
+
+int qp_apply(qp_packer_t * packer, qp_unpacker_t * patch);
+
+const char * qp_splice_strerror(int err);
+
+#endif  /* QP_SPLICE_H_ */
@@ -0,0 +1,15 @@
+-- Example schema for tools/qpgen.lua, built with 'make gen'.
+return {
+    {'point',
+        {'x', 'number'},
+        {'y', 'number'}},
+    {'reading',
+        {'ts', 'int'},
+        {'sensor', 'string'},
+        {'value', 'number'},
+        {'ok', 'boolean'},
+        {'pos', 'point'},
+        {'history', {'array', 'number'}},
+        {'flags', {'array', 'string'}},
+        {'path', {'array', 'point'}}},
+}
@@ -0,0 +1,286 @@
+/*
+ * test.cpp - Tests for the C++ headers: qpack::reader, QPACK_FIELDS() and
+ * qpack::builder<N>.
+ *
+ *      make test
+ */
+#undef NDEBUG
+#include <qpack/builder.hpp>
+#include <qpack/fields.hpp>
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+int siri_err = 0;
+
+/* Evaluates to true when expr throws qpack::error */
+#define THROWS(expr) [&]() { try { expr; } catch (qpack::error &) \
+        { return true; } return false; }()
+
+namespace app
+{
+struct point
+{
+    double x = 0, y = 0;
+};
+QPACK_FIELDS(point, x, y)
+
+struct sensor
+{
+    int64_t id = 0;
+    std::string name;
+    bool ok = false;
+    uint16_t port = 0;
+    std::vector<point> path;
+    std::array<int, 3> rgb{};
+    std::optional<std::string> note;
+    point pos;
+    std::vector<bool> flags;
+};
+QPACK_FIELDS(sensor, id, name, ok, port, path, rgb, note, pos, flags)
+}  /* namespace app */
+
+static void test_reader()
+{
+    qp_packer_t * pk = qp_packer_new(64);
+    size_t pos;
+
+    /* [{"a": [1, 2], "b": 300 x 'x'}, -3, 1.5, true, null, {0: 0.0 ...}] */
+    qp_add_type(pk, QP_ARRAY_OPEN);
+    qp_add_type(pk, QP_MAP2);
+    qp_add_string(pk, "a");
+    qp_add_type(pk, QP_ARRAY2);
+    qp_add_int64(pk, 1);
+    qp_add_int64(pk, 300000);
+    qp_add_string(pk, "b");
+    qp_add_string(pk, std::string(300, 'x').c_str());
+    qp_add_int64(pk, -3);
+    qp_add_double(pk, 1.5);
+    qp_add_true(pk);
+    qp_add_null(pk);
+    qp_add_type(pk, QP_MAP_OPEN);
+    for (int i = 0; i < 7; i++)
+    {
+        qp_add_int64(pk, i);
+        qp_add_double(pk, i * 2.0);
+    }
+    qp_add_type(pk, QP_MAP_CLOSE);
+    qp_add_type(pk, QP_ARRAY_CLOSE);
+    qp_add_int64(pk, 42);
+
+    qpack::reader r(pk->buffer, pk->len);
+    int i = 0;
+    for (auto & v : r.next().array())
+    {
+        switch (i++)
+        {
+        case 0:
+            for (auto & [k, val] : v.map())
+            {
+                if (k.as<std::string_view>() == "a")
+                {
+                    /* leave the nested array early */
+                    for (auto & e : val.array())
+                    {
+                        assert(e.as<int>() == 1);
+                        break;
+                    }
+                }
+                else
+                {
+                    assert(val.as<std::string_view>().size() == 300);
+                }
+            }
+            break;
+        case 1:
+            assert(v.as<int8_t>() == -3 && v.as<double>() == -3.0);
+            assert(THROWS(v.as<uint8_t>()));
+            assert(THROWS(v.as<std::string_view>()));
+            break;
+        case 2:
+            assert(v.as<double>() == 1.5);
+            assert(THROWS(v.as<int64_t>()));
+            break;
+        case 3:
+            assert(v.as<bool>());
+            break;
+        case 4:
+            assert(v.is_null());
+            break;
+        case 5:
+        {
+            double sum = 0;
+            for (auto & [k, val] : v.map())
+                sum += k.as<int>() * val.as<double>();
+            assert(sum == 182.0);
+            break;
+        }
+        }
+    }
+    assert(i == 6);
+    assert(!r.at_end());
+    assert(r.next().as<int>() == 42);
+    assert(r.at_end());
+
+    /* a reader continues where an unpacker is, and sync() moves it on */
+    qp_unpacker_t up;
+    qp_obj_t obj;
+    qp_unpacker_init(&up, pk->buffer, pk->len);
+    qpack::reader r2(up);
+    r2.skip();
+    r2.sync(up);
+    assert(qp_next(&up, &obj) == QP_INT64 && obj.via.int64 == 42);
+
+    /* truncated data throws instead of reading past the end */
+    for (size_t n = 1; n < pk->len - 1; n++)
+    {
+        qpack::reader t(pk->buffer, n);
+        assert(THROWS(
+            for (auto & v : t.next().array())
+                for (auto & e : v.array())
+                    (void) e;
+            t.next()));
+    }
+
+    /* a sized array reports its count */
+    pk->len = 0;
+    qp_add_open_sized(pk, QP_ARRAY_OPEN, &pos);
+    for (i = 0; i < 1000; i++)
+        qp_add_int64(pk, i);
+    qp_add_close(pk, pos, 1000);
+    qpack::reader r3(pk->buffer, pk->len);
+    auto & sized = r3.next();
+    assert(sized.is_array() && sized.sized_count() == 1000);
+    i = 0;
+    for (auto & v : sized.array())
+        assert(v.as<int>() == i++);
+    assert(i == 1000 && r3.at_end());
+
+    qp_packer_free(pk);
+}
+
+static void test_fields()
+{
+    app::sensor s;
+    s.id = 123456789012;
+    s.name = "sensor";
+    s.ok = true;
+    s.port = 8080;
+    s.path = {{1, 2}, {3, 4}};
+    s.rgb = {1, 2, 3};
+    s.pos = {9, 10};
+    s.flags = {true, false, false, true, true, false, true};
+
+    qp_packer_t * pk = qp_packer_new(64);
+    qpack::encode(pk, s);
+    auto d = qpack::decode<app::sensor>(pk->buffer, pk->len);
+    assert(d.id == s.id && d.name == s.name && d.ok && d.port == 8080);
+    assert(d.path.size() == 2 && d.path[1].y == 4);
+    assert(d.rgb == s.rgb && !d.note && d.pos.x == 9);
+    assert(d.flags == s.flags);
+
+    /* a struct with a few fields gets a QP_MAPn header */
+    pk->len = 0;
+    qpack::encode(pk, app::point{1.5, 2});
+    assert(pk->buffer[0] == QP_MAP2);
+
+    /* fields in another order, unknown keys are skipped */
+    pk->len = 0;
+    qp_add_type(pk, QP_MAP_OPEN);
+    qp_add_string(pk, "extra");
+    qp_add_type(pk, QP_ARRAY2);
+    qp_add_int64(pk, 1);
+    qp_add_int64(pk, 2);
+    qp_add_string(pk, "note");
+    qp_add_string(pk, "hi");
+    qp_add_string(pk, "id");
+    qp_add_int64(pk, 5);
+    qp_add_int64(pk, 7);
+    qp_add_int64(pk, 8);
+    qp_add_type(pk, QP_MAP_CLOSE);
+    auto e = qpack::decode<app::sensor>(pk->buffer, pk->len);
+    assert(e.id == 5 && e.note && *e.note == "hi" && e.name.empty());
+
+    /* out of range and mismatching values throw */
+    pk->len = 0;
+    qp_add_type(pk, QP_MAP1);
+    qp_add_string(pk, "port");
+    qp_add_int64(pk, 70000);
+    assert(THROWS(qpack::decode<app::sensor>(pk->buffer, pk->len)));
+    pk->len = 0;
+    qp_add_type(pk, QP_MAP1);
+    qp_add_string(pk, "rgb");
+    qp_add_type(pk, QP_ARRAY2);
+    qp_add_int64(pk, 1);
+    qp_add_int64(pk, 2);
+    assert(THROWS(qpack::decode<app::sensor>(pk->buffer, pk->len)));
+    assert(THROWS(qpack::decode<app::sensor>(pk->buffer, 3)));
+
+    qp_packer_free(pk);
+}
+
+static void test_builder()
+{
+    qpack::builder<32> ids;
+    ids.array(1, 2, 3);
+
+    qpack::builder<64> b;
+    b.map({{"status", 200}, {"msg", "ok"}, {"ids", ids}, {"ratio", 0.25},
+           {"none", nullptr}});
+    assert(!b.on_heap());
+
+    qpack::reader r(b.data(), b.size());
+    int n = 0;
+    for (auto & [k, v] : r.next().map())
+    {
+        auto key = k.as<std::string_view>();
+        if (key == "status")
+            assert(v.as<int>() == 200);
+        else if (key == "msg")
+            assert(v.as<std::string_view>() == "ok");
+        else if (key == "ids")
+        {
+            int sum = 0;
+            for (auto & e : v.array())
+                sum += e.as<int>();
+            assert(sum == 6);
+        }
+        else if (key == "ratio")
+            assert(v.as<double>() == 0.25);
+        else
+            assert(key == "none" && v.is_null());
+        n++;
+    }
+    assert(n == 5 && r.at_end());
+
+    /* step by step, growing beyond the inline buffer */
+    b.clear();
+    b.open_array();
+    for (int i = 0; i < 100; i++)
+        b.add(i * 1000);
+    b.close_array();
+    assert(b.on_heap());
+
+    /* moving a builder on the heap takes over its data */
+    qpack::builder<64> moved(std::move(b));
+    assert(moved.on_heap() && b.size() == 0);
+    qp_unpacker_t up;
+    qp_obj_t obj;
+    qp_unpacker_init(&up, const_cast<unsigned char *>(moved.data()),
+                     moved.size());
+    assert(qp_next(&up, &obj) == QP_ARRAY_OPEN);
+    for (int i = 0; i < 100; i++)
+        assert(qp_next(&up, &obj) == QP_INT64 && obj.via.int64 == i * 1000);
+    assert(qp_next(&up, &obj) == QP_ARRAY_CLOSE);
+
+    assert(THROWS(b.add(uint64_t(1) << 63)));
+}
+
+int main()
+{
+    test_reader();
+    test_fields();
+    test_builder();
+    printf("done\n");
+    return 0;
+}
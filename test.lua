@@ -16,3 +16,485 @@ if not t2 then
 end
 
 print(cjson.encode(t2))
+
+-- hostile headers are rejected without allocating what they claim
+local function unhex(s)
+	return (s:gsub('%x%x', function(c) return string.char(tonumber(c, 16)) end))
+end
+
+-- dictionary array of 20M zero width indexes in a 12 byte message
+assert(not qpack.decode(unhex('7c0b09ea002d310101816100')))
+
+-- array with runs claiming 20M values but holding only one
+assert(not qpack.decode(unhex('7c0907ea002d31018161')))
+
+-- decimal array of 20M zero width deltas
+assert(not qpack.decode(unhex('7c080900ea002d3101010000')))
+
+-- the converters expand hooks to the plain values they stand for
+local enc = qpack.compile({{'hist', {'array', 'decimal(2)'}}})
+local data = enc({hist = {1.25, 1.5, 2, -3.01}})
+assert(qpack.to_json(data) == '{"hist":[1.25,1.5,2.0,-3.01]}')
+local t3 = qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data)))
+assert(#t3.hist == 4 and t3.hist[4] == -3.01)
+
+qpack.encode_run_length(true)
+local runs = {}
+for i = 1, 20 do
+	runs[i] = i <= 10 and 'a' or 1.5
+end
+runs[21] = {x = 1}
+data = qpack.encode(runs)
+qpack.encode_run_length(false)
+assert(data:byte(1) == 124 and data:byte(2) == 9)
+local json = qpack.to_json(data)
+assert(json == '[' .. string.rep('"a",', 10) .. string.rep('1.5,', 10) .. '{"x":1}]')
+t3 = qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data)))
+assert(#t3 == 21 and t3[10] == 'a' and t3[20] == 1.5 and t3[21].x == 1)
+assert(not qpack.to_json(unhex('7c0907ea002d31018161')))
+assert(not qpack.to_msgpack(unhex('7c0907ea002d31018161')))
+
+qpack.encode_packed_bools(true)
+local bools = {}
+for i = 1, 20 do
+	bools[i] = i % 3 == 0
+end
+data = qpack.encode(bools)
+qpack.encode_packed_bools(false)
+assert(data:byte(1) == 124 and data:byte(2) == 10)
+assert(qpack.to_json(data) == cjson.encode(bools))
+t3 = qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data)))
+for i = 1, 20 do
+	assert(t3[i] == bools[i])
+end
+
+qpack.encode_dict_strings(true)
+local names = {}
+for i = 1, 30 do
+	names[i] = ({'north', 'east', 'south', 'west'})[i % 4 + 1]
+end
+data = qpack.encode(names)
+qpack.encode_dict_strings(false)
+assert(data:byte(1) == 124 and data:byte(2) == 11)
+assert(qpack.to_json(data) == cjson.encode(names))
+t3 = qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data)))
+assert(#t3 == 30 and t3[30] == names[30])
+
+qpack.encode_shared_tables(true)
+local point = {x = 1, y = 2}
+local line = {from = point, to = point, via = {point, point}}
+data = qpack.encode(line)
+local cycle = {name = 'loop'}
+cycle.self = cycle
+local cyclic = qpack.encode(cycle)
+qpack.encode_shared_tables(false)
+assert(data:byte(1) == 124 and data:byte(2) == 12)
+t3 = cjson.decode(qpack.to_json(data))
+assert(t3.to.y == 2 and t3.via[2].x == 1 and t3.from ~= t3.to)
+t3 = qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data)))
+assert(t3.to.y == 2 and t3.via[2].x == 1 and t3.from ~= t3.to)
+local json, err = qpack.to_json(cyclic)
+assert(not json and err:find('cyclic'))
+assert(not qpack.to_msgpack(cyclic))
+
+local Point = {}
+qpack.register_ext(1, function(p)
+	return string.pack('<dd', p.x, p.y)
+end, function(s)
+	local x, y = string.unpack('<dd', s)
+	return setmetatable({x = x, y = y}, Point)
+end, Point)
+data = qpack.encode({at = setmetatable({x = 1.5, y = -2}, Point)})
+local mp = qpack.to_msgpack(data)
+assert(mp:find('\216\1', 1, true))
+t3 = qpack.decode(qpack.from_msgpack(mp))
+assert(getmetatable(t3.at) == Point and t3.at.y == -2)
+json, err = qpack.to_json(data)
+assert(not json and err:find('extension'))
+qpack.register_ext(1)
+
+-- encode_yieldable honours the same options as encode
+local function yieldable(v)
+	local co = coroutine.wrap(function() return qpack.encode_yieldable(v, 2) end)
+	local res = co()
+	while res == nil do
+		res = co()
+	end
+	return res
+end
+
+qpack.encode_run_length(true)
+assert(yieldable(runs) == qpack.encode(runs))
+assert(yieldable({runs, {runs}}) == qpack.encode({runs, {runs}}))
+qpack.encode_run_length(false)
+qpack.encode_packed_bools(true)
+assert(yieldable({bools, 1}) == qpack.encode({bools, 1}))
+qpack.encode_packed_bools(false)
+qpack.encode_dict_strings(true)
+assert(yieldable({names}) == qpack.encode({names}))
+qpack.encode_dict_strings(false)
+qpack.encode_shared_tables(true)
+assert(yieldable(line) == qpack.encode(line))
+t3 = qpack.decode(yieldable(cycle))
+assert(t3.self == t3 and t3.name == 'loop')
+assert(yieldable(cycle) == qpack.encode(cycle))
+qpack.encode_shared_tables(false)
+
+-- splicing shared-table data is refused instead of failing as a bad path
+qpack.encode_shared_tables(true)
+data = qpack.encode(line)
+qpack.encode_shared_tables(false)
+local patched
+patched, err = qpack.patch(data, 'to', 1)
+assert(not patched and err:find('shared%-table'))
+patched, err = qpack.split(data, 16)
+assert(not patched and err:find('shared%-table'))
+-- {n = 1, line = line} with the shared tables in the value of line
+data = '\245' .. qpack.encode('n') .. qpack.encode(1) .. qpack.encode('line') .. data
+assert(qpack.decode(data).line.to.y == 2)
+patched, err = qpack.patch(data, {'line', 'to'}, 1)
+assert(not patched and err:find('shared%-table'))
+assert(qpack.decode(qpack.patch(data, 'n', 2)).n == 2)
+
+-- an appender only opens files which hold an open array
+local fn = os.tmpname()
+local f = io.open(fn, 'wb')
+f:write('not qpack')
+f:close()
+local app, msg, code = qpack.append(fn)
+assert(not app and msg:find(fn, 1, true) and code == 22)
+os.remove(fn)
+
+-- a template message must hold exactly the values of its slots
+local tpl = qpack.template({a = 1, b = {2, 3}})
+local msg = tpl:encode({4, 5, 6})
+t3 = tpl:decode(msg)
+assert(t3.a and t3.b[2])
+local short = '\252' .. qpack.encode(tpl:id()) .. qpack.encode(4) .. qpack.encode(5)
+local ok
+ok, err = pcall(tpl.decode, tpl, short)
+assert(not ok and err:find('too few values'))
+ok, err = pcall(tpl.decode, tpl, short .. '\254')
+assert(not ok and err:find('too few values'))
+ok, err = pcall(tpl.decode, tpl, msg .. '\0')
+assert(not ok and err:find('trailing'))
+ok, err = pcall(tpl.decode, tpl, short .. qpack.encode(6) .. '\254\0')
+assert(not ok and err:find('trailing'))
+assert(tpl:decode(short .. qpack.encode(6)).a == 4)
+
+-- a diff is no larger than setting the changed container as a whole
+for _, c in ipairs({
+	{{k = {1, 2}}, {k = {3, 4}}},
+	{{long_key_name = {x = 1, y = 2}}, {long_key_name = {x = 3, y = 4}}},
+}) do
+	local a, b = qpack.encode(c[1]), qpack.encode(c[2])
+	local key = next(c[1])
+	local set = qpack.encode({{0, {key}, c[2][key]}})
+	local p = qpack.diff(a, b)
+	assert(#p <= #set)
+	assert(qpack.apply(a, p) == b)
+end
+
+-- a value which fails to encode leaves the writer as it was
+local w = qpack.writer()
+w:map_open()
+w:key('ok'):value({1, 2})
+ok, err = pcall(w.value, w:key('bad'), {1, 2, {f = print}})
+assert(not ok and err:find('Cannot serialise'))
+-- the key stays and still expects its value
+w:value('fixed')
+w:key('next'):value(3)
+w:close()
+t3 = qpack.decode(w:finish())
+assert(t3.ok[2] == 2 and t3.bad == 'fixed' and t3.next == 3)
+
+-- to_json escapes what it must, refuses what JSON cannot hold and
+-- fails on truncated input
+local function same(a, b)
+	if type(a) ~= 'table' or type(b) ~= 'table' then
+		return a == b
+	end
+	for k, v in pairs(a) do
+		if not same(v, b[k]) then
+			return false
+		end
+	end
+	for k in pairs(b) do
+		if a[k] == nil then
+			return false
+		end
+	end
+	return true
+end
+
+assert(qpack.to_json(qpack.encode('a/b"\n\1')) == '"a\\/b\\"\\n\\u0001"')
+assert(qpack.to_json(qpack.encode('a/b'), {escape_slash = false}) == '"a/b"')
+json, err = qpack.to_json(qpack.encode(0/0))
+assert(not json and err:find('NaN'))
+assert(qpack.to_json(qpack.encode({1/0}), {invalid_numbers = true}) == '[Infinity]')
+local rec = {id = 1, name = 'n', list = {1, 2.5, 'x', {false}}, flag = true}
+data = qpack.encode(rec)
+assert(same(cjson.decode(qpack.to_json(data)), rec))
+assert(not qpack.to_json(''))
+-- open containers may end with the data, values may not
+assert(qpack.to_json(unhex('fd816bfc01')) == '{"k":[1]}')
+assert(not qpack.to_json(qpack.encode('hello'):sub(1, 3)))
+assert(not qpack.to_json(qpack.encode({2.5}):sub(1, 5)))
+
+-- from_json reads what to_json writes and names where bad input fails
+t3 = qpack.decode(qpack.from_json('{"a":[1,2.5,"x\\u00e9\\ud83d\\ude00",true],"b":{}}'))
+assert(same(t3, {a = {1, 2.5, 'x\195\169\240\159\152\128', true}, b = {}}))
+assert(math.type(t3.a[1]) == 'integer' and math.type(t3.a[2]) == 'float')
+assert(same(qpack.decode(qpack.from_json(qpack.to_json(qpack.encode(rec)))), rec))
+for _, s in ipairs({'', '{"a":', '[1,]', '"\\ud800"', '1 2', '{"a" 1}', 'nul'}) do
+	assert(not qpack.from_json(s))
+end
+data, err = qpack.from_json(string.rep('[', 100000))
+assert(not data and err:find('nesting'))
+
+-- to_msgpack writes the smallest msgpack forms and from_msgpack reads
+-- them back
+assert(qpack.to_msgpack(qpack.encode({1, 'a', true, -1, 300})) ==
+		unhex('9501a161c3ffcd012c'))
+assert(qpack.to_msgpack(qpack.encode({k = {}})) == unhex('81a16b80'))
+assert(same(qpack.decode(qpack.from_msgpack(qpack.to_msgpack(qpack.encode(rec)))), rec))
+for _, s in ipairs({'', '\193', '\146\1', '\220\255\255', '\217\9abc'}) do
+	assert(not qpack.from_msgpack(s))
+end
+data, err = qpack.from_msgpack(string.rep('\145', 100000))
+assert(not data and err:find('nesting'))
+
+-- a writer with a sink hands over the message in chunks
+local big = {}
+for i = 1, 200 do
+	big[i] = {id = i, name = 'n' .. i}
+end
+local chunks = {}
+w = qpack.writer(function(s) chunks[#chunks + 1] = s end)
+w:map_open():key('list'):value(big):key('n'):int(7):close()
+assert(w:finish() == #table.concat(chunks))
+assert(same(qpack.decode(table.concat(chunks)), {list = big, n = 7}))
+
+-- the yieldable variants give what encode() and decode() give, pausing
+-- between budgets of work when run in a coroutine
+data = qpack.encode({list = big, rec = rec})
+assert(yieldable({list = big, rec = rec}) == data)
+local yields = 0
+local co = coroutine.wrap(function() return qpack.decode_yieldable(data, 50) end)
+t3 = co()
+while t3 == nil do
+	yields = yields + 1
+	t3 = co()
+end
+assert(yields > 5 and same(t3, {list = big, rec = rec}))
+assert(same(qpack.decode_yieldable(data), {list = big, rec = rec}))
+assert(not qpack.decode_yieldable(unhex('fc8261')))
+
+-- a reader hands out the elements of an array one at a time
+fn = os.tmpname()
+f = io.open(fn, 'wb')
+f:write(qpack.encode(big))
+f:close()
+local rd = assert(qpack.open(fn))
+local seen = {}
+for v in rd:elements() do
+	seen[#seen + 1] = v
+end
+rd:close()
+assert(same(seen, big))
+os.remove(fn)
+
+-- appending to a file extends the array written before
+fn = os.tmpname()
+os.remove(fn)
+app = assert(qpack.append(fn))
+app:add(1)
+app:add({a = 'b'})
+app:close()
+app = assert(qpack.append(fn))
+app:add(true)
+app:close()
+f = io.open(fn, 'rb')
+t3 = qpack.decode(f:read('a'))
+f:close()
+assert(same(t3, {1, {a = 'b'}, true}))
+os.remove(fn)
+
+-- split cuts an array into valid chunks of bounded size
+data = qpack.encode(big)
+local parts = qpack.split(data, 256)
+assert(#parts > 1)
+t3 = {}
+for _, p in ipairs(parts) do
+	assert(#p <= 256)
+	for _, v in ipairs(qpack.decode(p)) do
+		t3[#t3 + 1] = v
+	end
+end
+assert(same(t3, big))
+assert(not qpack.split('\1', 10))
+
+-- concat and merge splice the encoded bytes together
+assert(same(qpack.decode(qpack.concat_arrays(table.unpack(parts))), big))
+t3 = qpack.decode(qpack.merge_maps({qpack.encode({a = 1, b = 2}),
+		qpack.encode({b = 3, c = 4})}, 'last'))
+assert(same(t3, {a = 1, b = 3, c = 4}))
+assert(not qpack.merge_maps({qpack.encode({a = 1}), qpack.encode({a = 2})}, 'error'))
+
+-- patch replaces the value at an existing path
+assert(qpack.decode(qpack.patch(data, {1, 'id'}, 'x'))[1].id == 'x')
+assert(same(qpack.decode(qpack.patch(data, {2, 'name'}, {1, 2}))[2].name, {1, 2}))
+assert(not qpack.patch(data, {999, 'id'}, 1))
+assert(not qpack.patch(data, {1, 'missing'}, 1))
+
+-- applying a diff turns the old message into the new one
+local changed = qpack.decode(data)
+changed[5].name = 'five'
+changed[200] = nil
+changed[3].extra = {true}
+local delta = qpack.diff(data, qpack.encode(changed))
+assert(same(qpack.decode(qpack.apply(data, delta)), changed))
+assert(not qpack.apply(data, '\1'))
+
+-- compiled encoders give the bytes decode() reads back
+local cenc, cdec = qpack.compile({{'id', 'int'}, {'name', 'string'},
+		{'tags', {'array', 'string'}}, {'at', {{'x', 'number'}, {'y', 'number'}}}})
+local crec = {id = 1, name = 'a', tags = {'x', 'y'}, at = {x = 0.5, y = 2}}
+assert(same(qpack.decode(cenc(crec)), crec))
+assert(same(cdec(cenc(crec)), crec))
+assert(same(cdec(qpack.encode(crec)), crec))
+ok, err = pcall(cenc, {id = 'one'})
+assert(not ok and err:find('int'))
+assert(not pcall(cdec, cenc(crec):sub(1, 5)))
+
+-- modules generated by tools/qpgen.lua read and write what decode() and
+-- encode() do; 'make test' builds them first
+package.cpath = 'gen/?.so;' .. package.cpath
+local sensor = require 'sensor'
+local reading = {ts = 1637979480080, sensor = 's1', value = 29.5, ok = true,
+	pos = {x = 1, y = 2.5}, history = {1.5, 2}, flags = {'a'},
+	path = {{x = 0, y = 0}, {x = 3, y = 4}}}
+data = sensor.encode_reading(reading)
+assert(same(qpack.decode(data), reading))
+assert(same(sensor.decode_reading(data), reading))
+assert(same(sensor.decode_reading(qpack.encode(reading)), reading))
+assert(not pcall(sensor.decode_reading, data:sub(1, 10)))
+assert(not pcall(sensor.encode_reading, {ts = 'now'}))
+
+-- integral doubles are written as ints, keeping or dropping their float
+-- type, and every converter gives the plain value back
+local function roundtrip(data, value)
+	assert(same(qpack.decode(data), value))
+	assert(same(cjson.decode(qpack.to_json(data)), value))
+	assert(same(qpack.decode(qpack.from_msgpack(qpack.to_msgpack(data))), value))
+	assert(same(qpack.decode_yieldable(data), value))
+end
+
+local doubles = {3.0, 0.5, 1e15, 0.1, 2^40, -2.25}
+qpack.encode_compact_doubles(true)
+data = qpack.encode(doubles)
+qpack.encode_compact_doubles(false)
+assert(#data < #qpack.encode(doubles))
+roundtrip(data, doubles)
+qpack.encode_compact_doubles('keep_float')
+data = qpack.encode(doubles)
+qpack.encode_compact_doubles('off')
+assert(data:find('\124\1', 1, true))
+roundtrip(data, doubles)
+assert(math.type(qpack.decode(data)[1]) == 'float')
+for _, h in ipairs({'7c', '7c01', '7c0182', '7c10', '7c10ff'}) do
+	assert(not qpack.decode(unhex(h)))
+	assert(not qpack.to_json(unhex(h)))
+	assert(not qpack.to_msgpack(unhex(h)))
+end
+
+-- decimals from the writer read back as the doubles they stand for
+w = qpack.writer()
+w:array_open():decimal(1.25, 2):decimal({0.5, 0.75, 1}, 2):close()
+roundtrip(w:finish(), {1.25, {0.5, 0.75, 1}})
+for _, h in ipairs({'7c02', '7c02ff', '7c0202', '7c08', '7c080302'}) do
+	assert(not qpack.decode(unhex(h)))
+	assert(not qpack.to_json(unhex(h)))
+	assert(not qpack.to_msgpack(unhex(h)))
+end
+
+-- references to tables which were never written, and unknown hooks, are
+-- errors
+for _, h in ipairs({'7c03', '7c04', '7c0305', '7c0405', '7c05', '7c0cff'}) do
+	assert(not qpack.decode(unhex(h)))
+	assert(not qpack.to_json(unhex(h)))
+	assert(not qpack.to_msgpack(unhex(h)))
+end
+
+-- extensions with a bad header or no codec are errors
+for _, h in ipairs({'7c0d', '7c0d00', '7c0d0501'}) do
+	assert(not qpack.decode(unhex(h)))
+	assert(not qpack.to_json(unhex(h)))
+	assert(not qpack.to_msgpack(unhex(h)))
+end
+
+-- sized containers read back as plain ones and a cut anywhere fails
+qpack.encode_sized_containers(true)
+data = qpack.encode({items = big})
+qpack.encode_sized_containers(false)
+assert(data:byte(1) == 124 and data:byte(2) == 15)
+roundtrip(data, {items = big})
+for _, h in ipairs({'7c0e', '7c0e05', '7c0f0501', '7c0e02fc'}) do
+	assert(not qpack.decode(unhex(h)))
+	assert(not qpack.to_json(unhex(h)))
+	assert(not qpack.to_msgpack(unhex(h)))
+end
+for n = 1, #data - 1 do
+	assert(not qpack.decode(data:sub(1, n)))
+	assert(not qpack.to_json(data:sub(1, n)))
+end
+
+-- the integer after a hook is read without following another hook, so a
+-- chain of hooks is an error instead of a recursion per hook
+for _, h in ipairs({'\124\1', '\124\2\2'}) do
+	data = string.rep(h, 1000000) .. '\1'
+	assert(not qpack.decode(data))
+	assert(not qpack.to_json(data))
+	assert(not qpack.to_msgpack(data))
+end
+
+-- the same holds for the sizes and counts in sized, repeat and ref hooks
+for _, h in ipairs({'\124\14', '\124\15', '\124\13', '\124\3', '\124\4'}) do
+	data = string.rep(h, 1000000) .. '\1'
+	assert(not qpack.decode(data))
+	assert(not qpack.to_json(data))
+	assert(not qpack.to_msgpack(data))
+end
+
+-- open containers get the smallest msgpack header for their count without
+-- a scan ahead, and deep nesting stops at the maximum depth
+assert(qpack.to_msgpack(unhex('fc01fd8161fc02fefffe')) == unhex('9201' .. '81a1619102'))
+data = qpack.to_msgpack('\252' .. string.rep('\1', 70000))
+assert(data:sub(1, 5) == unhex('dd00011170') and #data == 70005)
+assert(qpack.to_msgpack(qpack.from_msgpack(data)) == data)
+qpack.decode_max_depth(100)
+data, err = qpack.to_msgpack(string.rep('\252', 1000000))
+qpack.decode_max_depth(1000)
+assert(not data and err:find('nesting'))
+assert(not qpack.to_msgpack(unhex('fd8161ff')))
+
+-- diff stops at the maximum depth, not at the next growth of its path
+local function nest(n, v)
+	local t = {k = v}
+	for _ = 2, n do
+		t = {k = t}
+	end
+	return t
+end
+qpack.decode_max_depth(20)
+assert(qpack.diff(qpack.encode(nest(20, 1)), qpack.encode(nest(20, 2))))
+data, err = qpack.diff(qpack.encode(nest(21, 1)), qpack.encode(nest(21, 2)))
+qpack.decode_max_depth(1000)
+assert(not data and err:find('nesting'))
+
+-- a raw length past the end of the data is an error, also when adding it
+-- to the position would wrap around
+data = '\231' .. string.pack('<i8', -256) .. 'abc'
+assert(not qpack.decode(data))
+assert(not qpack.to_json(data))
+assert(not qpack.to_msgpack(data))
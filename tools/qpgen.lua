@@ -0,0 +1,1143 @@
+-- Generate C encoders and decoders for the messages in a schema file.
+--
+-- Usage: lua tools/qpgen.lua schema/name.lua outdir
+--
+-- The schema file returns a list of messages. Each message is a name
+-- followed by its fields; a field is {name, type} where type is 'int',
+-- 'number', 'string', 'boolean', the name of a message listed before it, or
+-- {'array', type} with one of the other types:
+--
+--     return {
+--         {'point', {'x', 'number'}, {'y', 'number'}},
+--         {'reading', {'id', 'int'}, {'pos', 'point'},
+--                     {'path', {'array', 'point'}}},
+--     }
+--
+-- For schema/name.lua this writes to outdir:
+--
+--   name.h / name.c   a C struct name_<msg>_t for each message with
+--                     name_<msg>_encode(), name_<msg>_decode() and
+--                     name_<msg>_free(), and the Lua module 'name' with
+--                     encode_<msg>(t) and decode_<msg>(data), unless
+--                     QPGEN_NO_LUA is defined.
+--   name_bench.lua    compares the Lua module with qpack.encode() and
+--                     qpack.decode().
+--
+-- The generated code is straight-line: maps are written in schema order with
+-- the key bytes prepared here, and buffer space is reserved once for each
+-- run of fixed size fields. Decoding expects the keys in schema order but
+-- accepts any order and skips unknown keys; of a repeated key the last value
+-- is kept. Strings are decoded without a
+-- copy and point into the data; arrays are allocated and released with
+-- name_<msg>_free().
+
+local schema_fn, outdir = arg[1], arg[2]
+if not schema_fn or not outdir then
+    io.stderr:write('usage: lua tools/qpgen.lua schema.lua outdir\n')
+    os.exit(1)
+end
+
+local prefix = schema_fn:match('([%w_]+)%.lua$')
+if not prefix then
+    error('schema file name must be <name>.lua: ' .. schema_fn)
+end
+
+local schema = dofile(schema_fn)
+local scalars = {int = true, number = true, string = true, boolean = true}
+
+-- bytes needed for a value of a fixed size type, nil for other types
+local fixed_size = {int = 9, number = 9, boolean = 1}
+
+local messages, by_name = {}, {}
+
+local function check_type(t, where)
+    if type(t) == 'table' then
+        if t[1] ~= 'array' or type(t[2]) ~= 'string' then
+            error(where .. ': array type must be {"array", type}')
+        end
+        check_type(t[2], where)
+        return
+    end
+    if not scalars[t] and not by_name[t] then
+        error(where .. ': unknown type ' .. tostring(t))
+    end
+end
+
+for _, def in ipairs(schema) do
+    local name = def[1]
+    if type(name) ~= 'string' or not name:match('^[%a_][%w_]*$') then
+        error('invalid message name ' .. tostring(name))
+    end
+    if by_name[name] or scalars[name] then
+        error('duplicate message name ' .. name)
+    end
+    local msg = {name = name, fields = {}, has_array = false}
+    local seen = {}
+    for i = 2, #def do
+        local f = {name = def[i][1], type = def[i][2], index = i - 2}
+        local where = name .. '.' .. tostring(f.name)
+        if type(f.name) ~= 'string' or not f.name:match('^[%a_][%w_]*$') then
+            error(where .. ': field name must be a C identifier')
+        end
+        if #f.name >= 100 or seen[f.name] then
+            error(where .. ': field name too long or duplicate')
+        end
+        seen[f.name] = true
+        check_type(f.type, where)
+        f.array = type(f.type) == 'table'
+        f.elem = f.array and f.type[2] or f.type
+        f.fixed = not f.array and fixed_size[f.type]
+        msg.has_array = msg.has_array or f.array
+        msg.fields[#msg.fields + 1] = f
+    end
+    messages[#messages + 1] = msg
+    by_name[name] = msg
+end
+
+-- key bytes: a fixed size raw header followed by the name
+local keys, key_pos = {}, 0
+for _, msg in ipairs(messages) do
+    for _, f in ipairs(msg.fields) do
+        f.key_pos, f.key_len = key_pos, #f.name + 1
+        keys[#keys + 1] = string.format('"\\%03o" "%s"', 128 + #f.name, f.name)
+        key_pos = key_pos + f.key_len
+    end
+end
+
+-- Split the fields in runs which need a single reserve: a run ends after the
+-- key of a field which is not of a fixed size.
+for _, msg in ipairs(messages) do
+    local run = {size = 1}
+    msg.runs = {run}
+    for _, f in ipairs(msg.fields) do
+        if run.closed then
+            run = {size = 0}
+            msg.runs[#msg.runs + 1] = run
+        end
+        run[#run + 1] = f
+        run.size = run.size + f.key_len + (f.fixed or 0)
+        run.closed = not f.fixed
+    end
+end
+
+local out = {}
+local function w(...)
+    out[#out + 1] = string.format(...)
+end
+-- write a block of C, replacing $ with the prefix
+local function block(s)
+    out[#out + 1] = (s:gsub('%$', prefix))
+end
+local function flush(fn)
+    local fp = assert(io.open(outdir .. '/' .. fn, 'w'))
+    fp:write(table.concat(out, '\n'), '\n')
+    fp:close()
+    out = {}
+end
+
+local function ctype(t)
+    if t == 'int' then return 'int64_t' end
+    if t == 'number' then return 'double' end
+    if t == 'boolean' then return 'int' end
+    if t == 'string' then return prefix .. '_str_t' end
+    return prefix .. '_' .. t .. '_t'
+end
+
+------------------------------------------------------------------ header --
+local guard = prefix:upper() .. '_H_'
+w('/*')
+w(' * %s.h - Generated by tools/qpgen.lua from %s, do not edit.', prefix,
+  schema_fn)
+w(' */')
+w('#ifndef %s', guard)
+w('#define %s', guard)
+w('')
+w('#include <qpack/qpack.h>')
+w('')
+w('/* string in the decoded data, not terminated; pt is NULL for null */')
+w('typedef struct')
+w('{')
+w('    const char * pt;')
+w('    size_t len;')
+w('} %s_str_t;', prefix)
+for _, msg in ipairs(messages) do
+    w('')
+    w('typedef struct')
+    w('{')
+    for _, f in ipairs(msg.fields) do
+        if f.array then
+            w('    %s * %s;', ctype(f.elem), f.name)
+            w('    size_t %s_n;', f.name)
+        else
+            w('    %s %s;', ctype(f.type), f.name)
+        end
+    end
+    if #msg.fields == 0 then
+        w('    char unused_;')
+    end
+    w('} %s_%s_t;', prefix, msg.name)
+end
+w('')
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+    w('int %s_encode(qp_packer_t * packer, const %s_t * m);', n, n)
+    w('int %s_decode(qp_unpacker_t * unpacker, %s_t * m);', n, n)
+    w('void %s_free(%s_t * m);', n, n)
+end
+w('')
+w('#ifndef QPGEN_NO_LUA')
+w('#include <lua.h>')
+w('int luaopen_%s(lua_State * L);', prefix)
+w('#endif')
+w('')
+w('#endif  /* %s */', guard)
+flush(prefix .. '.h')
+
+---------------------------------------------------------------- helpers --
+w('/*')
+w(' * %s.c - Generated by tools/qpgen.lua from %s, do not edit.', prefix,
+  schema_fn)
+w(' */')
+w('#include "%s.h"', prefix)
+w('#include <stdlib.h>')
+w('#include <string.h>')
+w('')
+w('static const unsigned char %s__keys[] =', prefix)
+for i, k in ipairs(keys) do
+    w('    %s%s', k, i == #keys and ';' or '')
+end
+if #keys == 0 then
+    w('    "";')
+end
+w('')
+block([[
+/* The put functions write to space which is already reserved */
+static inline void $__put_key(qp_packer_t * packer, size_t pos, size_t len)
+{
+    memcpy(packer->buffer + packer->len, $__keys + pos, len);
+    packer->len += len;
+}
+
+static inline void $__put_int(qp_packer_t * packer, int64_t v)
+{
+    unsigned char * pt = packer->buffer + packer->len;
+    if (v >= 0 && v < 64)
+    {
+        *pt = (unsigned char) v;
+        packer->len++;
+    }
+    else if (v >= -60 && v < 0)
+    {
+        *pt = (unsigned char) (63 - v);
+        packer->len++;
+    }
+    else if (v == (int8_t) v)
+    {
+        int8_t i8 = (int8_t) v;
+        *pt = QP_INT8;
+        memcpy(pt + 1, &i8, sizeof(int8_t));
+        packer->len += 1 + sizeof(int8_t);
+    }
+    else if (v == (int16_t) v)
+    {
+        int16_t i16 = (int16_t) v;
+        *pt = QP_INT16;
+        memcpy(pt + 1, &i16, sizeof(int16_t));
+        packer->len += 1 + sizeof(int16_t);
+    }
+    else if (v == (int32_t) v)
+    {
+        int32_t i32 = (int32_t) v;
+        *pt = QP_INT32;
+        memcpy(pt + 1, &i32, sizeof(int32_t));
+        packer->len += 1 + sizeof(int32_t);
+    }
+    else
+    {
+        *pt = QP_INT64;
+        memcpy(pt + 1, &v, sizeof(int64_t));
+        packer->len += 1 + sizeof(int64_t);
+    }
+}
+
+static inline void $__put_number(qp_packer_t * packer, double v)
+{
+    unsigned char * pt = packer->buffer + packer->len;
+    if (v == 0.0 || v == 1.0 || v == -1.0)
+    {
+        *pt = (unsigned char) (QP_DOUBLE_0 + (int) v);
+        packer->len++;
+    }
+    else
+    {
+        *pt = QP_DOUBLE;
+        memcpy(pt + 1, &v, sizeof(double));
+        packer->len += 1 + sizeof(double);
+    }
+}
+
+static inline void $__put_boolean(qp_packer_t * packer, int v)
+{
+    packer->buffer[packer->len++] = v ? QP_TRUE : QP_FALSE;
+}
+
+static int $__add_string(qp_packer_t * packer, $_str_t s)
+{
+    return s.pt == NULL ?
+            qp_add_null(packer) :
+            qp_add_raw(packer, (const unsigned char *) s.pt, s.len);
+}
+
+/* Consume the key bytes at pos if they are next in the data */
+static inline int $__at(qp_unpacker_t * unpacker, size_t pos, size_t len)
+{
+    if ((size_t) (unpacker->end - unpacker->pt) >= len &&
+        memcmp(unpacker->pt, $__keys + pos, len) == 0)
+    {
+        unpacker->pt += len;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * The get functions read the expected encoding inline and leave anything
+ * else to qp_next(). They return -1 when the value has another type.
+ */
+static inline int $__get_int(qp_unpacker_t * unpacker, int64_t * v)
+{
+    qp_obj_t obj;
+    if (unpacker->pt < unpacker->end && *unpacker->pt < 64)
+    {
+        *v = *unpacker->pt++;
+        return 0;
+    }
+    if (qp_next(unpacker, &obj) != QP_INT64)
+    {
+        return -1;
+    }
+    *v = obj.via.int64;
+    return 0;
+}
+
+static inline int $__get_number(qp_unpacker_t * unpacker, double * v)
+{
+    qp_obj_t obj;
+    if (unpacker->end - unpacker->pt > (int) sizeof(double) &&
+        *unpacker->pt == QP_DOUBLE)
+    {
+        memcpy(v, unpacker->pt + 1, sizeof(double));
+        unpacker->pt += 1 + sizeof(double);
+        return 0;
+    }
+    switch (qp_next(unpacker, &obj))
+    {
+    case QP_DOUBLE:
+        *v = obj.via.real;
+        return 0;
+    case QP_INT64:
+        *v = (double) obj.via.int64;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static inline int $__get_boolean(qp_unpacker_t * unpacker, int * v)
+{
+    switch (qp_next(unpacker, NULL))
+    {
+    case QP_TRUE:
+        *v = 1;
+        return 0;
+    case QP_FALSE:
+        *v = 0;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static inline int $__get_string(qp_unpacker_t * unpacker, $_str_t * v)
+{
+    qp_obj_t obj;
+    if (unpacker->pt < unpacker->end &&
+        *unpacker->pt >= 128 && *unpacker->pt < 228 &&
+        unpacker->end - unpacker->pt > *unpacker->pt - 128)
+    {
+        v->len = *unpacker->pt - 128;
+        v->pt = (const char *) unpacker->pt + 1;
+        unpacker->pt += 1 + v->len;
+        return 0;
+    }
+    switch (qp_next(unpacker, &obj))
+    {
+    case QP_RAW:
+        v->pt = (const char *) obj.via.raw;
+        v->len = obj.len;
+        return 0;
+    case QP_NULL:
+        v->pt = NULL;
+        v->len = 0;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Read a container header. Returns the number of elements (or pairs), -1
+ * for an open container or -2 for another type.
+ */
+static int $__container(qp_unpacker_t * unpacker, int is_map)
+{
+    qp_types_t tp = qp_next(unpacker, NULL);
+    if (is_map)
+    {
+        return tp == QP_MAP_OPEN ? -1 :
+               tp >= QP_MAP0 && tp <= QP_MAP5 ? (int) (tp - QP_MAP0) : -2;
+    }
+    return tp == QP_ARRAY_OPEN ? -1 :
+           tp >= QP_ARRAY0 && tp <= QP_ARRAY5 ? (int) (tp - QP_ARRAY0) : -2;
+}
+
+/* Returns 1 at the close of an open container (or the end of the data) */
+static inline int $__closed(qp_unpacker_t * unpacker, uint8_t close)
+{
+    if (unpacker->pt >= unpacker->end)
+    {
+        return 1;
+    }
+    if (*unpacker->pt == close)
+    {
+        unpacker->pt++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Make room for element i in an array which grows 4, 8, 16, ... */
+static int $__grow(void * arr, size_t i, size_t size)
+{
+    void * tmp;
+    if (i && (i < 4 || (i & (i - 1))))
+    {
+        return 0;
+    }
+    tmp = realloc(*(void **) arr, (i < 4 ? 4 : i * 2) * size);
+    if (tmp == NULL)
+    {
+        return -1;
+    }
+    *(void **) arr = tmp;
+    return 0;
+}]])
+
+-- Read the key of a field; the next field in schema order is tried first
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+    w('')
+    w('/*')
+    w(' * Read a key of %s. Returns the field index, -1 for an unknown key',
+      msg.name)
+    w(' * or -2 if the key is not a string.')
+    w(' */')
+    w('static int %s__field(qp_unpacker_t * unpacker, int next)', n)
+    w('{')
+    w('    qp_obj_t key;')
+    w('')
+    if #msg.fields > 0 then
+        w('    switch (next)')
+        w('    {')
+        for _, f in ipairs(msg.fields) do
+            w('    case %d:', f.index)
+            w('        if (%s__at(unpacker, %d, %d))', prefix, f.key_pos,
+              f.key_len)
+            w('        {')
+            w('            return %d;', f.index)
+            w('        }')
+            w('        break;')
+        end
+        w('    }')
+    else
+        w('    (void) next;')
+    end
+    w('    if (qp_next(unpacker, &key) != QP_RAW)')
+    w('    {')
+    w('        return -2;')
+    w('    }')
+    if #msg.fields > 0 then
+        local by_len, lens = {}, {}
+        for _, f in ipairs(msg.fields) do
+            if not by_len[#f.name] then
+                by_len[#f.name] = {}
+                lens[#lens + 1] = #f.name
+            end
+            table.insert(by_len[#f.name], f)
+        end
+        table.sort(lens)
+        w('    switch (key.len)')
+        w('    {')
+        for _, len in ipairs(lens) do
+            w('    case %d:', len)
+            for _, f in ipairs(by_len[len]) do
+                w('        if (memcmp(key.via.raw, "%s", %d) == 0)', f.name,
+                  len)
+                w('        {')
+                w('            return %d;', f.index)
+                w('        }')
+            end
+            w('        break;')
+        end
+        w('    }')
+    end
+    w('    return -1;')
+    w('}')
+end
+
+------------------------------------------------------------- C encoders --
+local function c_put(t, expr, indent)
+    if fixed_size[t] then
+        w('%s%s__put_%s(packer, %s);', indent, prefix, t, expr)
+        return
+    end
+    if t == 'string' then
+        w('%sif (%s__add_string(packer, %s))', indent, prefix, expr)
+    else
+        w('%sif (%s_%s_encode(packer, &%s))', indent, prefix, t, expr)
+    end
+    w('%s{', indent)
+    w('%s    return -1;', indent)
+    w('%s}', indent)
+end
+
+local function c_get(t, expr)
+    if scalars[t] then
+        return string.format('%s__get_%s(unpacker, &%s)', prefix, t, expr)
+    end
+    return string.format('%s_%s_decode(unpacker, &%s)', prefix, t, expr)
+end
+
+-- Release what field f of m owns; returns false when it owns nothing. The
+-- loop variable i is declared unless has_i is set.
+local function c_free(f, indent, has_i)
+    if f.array and by_name[f.elem] then
+        w('%sfor (%si = 0; i < m->%s_n; i++)', indent,
+          has_i and '' or 'size_t ', f.name)
+        w('%s{', indent)
+        w('%s    %s_%s_free(&m->%s[i]);', indent, prefix, f.elem, f.name)
+        w('%s}', indent)
+    end
+    if f.array then
+        w('%sfree(m->%s);', indent, f.name)
+        w('%sm->%s = NULL;', indent, f.name)
+        w('%sm->%s_n = 0;', indent, f.name)
+        return true
+    elseif by_name[f.type] then
+        w('%s%s_%s_free(&m->%s);', indent, prefix, f.type, f.name)
+        return true
+    end
+    return false
+end
+
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+    local nf = #msg.fields
+
+    w('')
+    w('void %s_free(%s_t * m)', n, n)
+    w('{')
+    local frees = 0
+    for _, f in ipairs(msg.fields) do
+        if c_free(f, '    ') then
+            frees = frees + 1
+        end
+    end
+    if frees == 0 then
+        w('    (void) m;')
+    end
+    w('}')
+
+    w('')
+    w('int %s_encode(qp_packer_t * packer, const %s_t * m)', n, n)
+    w('{')
+    if msg.has_array then
+        w('    size_t i, pos;')
+        w('')
+    end
+    if nf == 0 then
+        w('    (void) m;')
+    end
+    for ri, run in ipairs(msg.runs) do
+        w('    if (qp_packer_reserve(packer, %d))', run.size)
+        w('    {')
+        w('        return -1;')
+        w('    }')
+        if ri == 1 then
+            w('    packer->buffer[packer->len++] = %s;',
+              nf <= 5 and ('QP_MAP' .. nf) or 'QP_MAP_OPEN')
+        end
+        for _, f in ipairs(run) do
+            w('    %s__put_key(packer, %d, %d);', prefix, f.key_pos, f.key_len)
+            if f.array then
+                if not fixed_size[f.elem] then
+                    w('    if (qp_add_open(packer, QP_ARRAY_OPEN, &pos))')
+                else
+                    w('    if (qp_add_open(packer, QP_ARRAY_OPEN, &pos) ||')
+                    w('        qp_packer_reserve(packer, m->%s_n * %d))',
+                      f.name, fixed_size[f.elem])
+                end
+                w('    {')
+                w('        return -1;')
+                w('    }')
+                w('    for (i = 0; i < m->%s_n; i++)', f.name)
+                w('    {')
+                c_put(f.elem, 'm->' .. f.name .. '[i]', '        ')
+                w('    }')
+                w('    if (qp_add_close(packer, pos, m->%s_n))', f.name)
+                w('    {')
+                w('        return -1;')
+                w('    }')
+            else
+                c_put(f.type, 'm->' .. f.name, '    ')
+            end
+        end
+    end
+    if nf > 5 then
+        w('    return qp_add_type(packer, QP_MAP_CLOSE);')
+    else
+        w('    return 0;')
+    end
+    w('}')
+
+    w('')
+    w('int %s_decode(qp_unpacker_t * unpacker, %s_t * m)', n, n)
+    w('{')
+    w('    int count = %s__container(unpacker, 1);', prefix)
+    w('    int field = -1;')
+    if msg.has_array then
+        w('    int n;')
+        w('    size_t i;')
+    end
+    w('')
+    w('    memset(m, 0, sizeof(*m));')
+    w('    if (count == -2)')
+    w('    {')
+    w('        return -1;')
+    w('    }')
+    w('    while (count < 0 ?')
+    w('           !%s__closed(unpacker, QP_MAP_CLOSE) : count--)', prefix)
+    w('    {')
+    w('        switch ((field = %s__field(unpacker, field + 1)))', n)
+    w('        {')
+    for _, f in ipairs(msg.fields) do
+        w('        case %d:', f.index)
+        -- the last of repeated keys wins
+        c_free(f, '            ', true)
+        if f.array then
+            w('            n = %s__container(unpacker, 0);', prefix)
+            w('            if (n == -2)')
+            w('            {')
+            w('                goto fail;')
+            w('            }')
+            w('            for (i = 0; n < 0 ?')
+            w('                 !%s__closed(unpacker, QP_ARRAY_CLOSE) :', prefix)
+            w('                 i < (size_t) n; i++)')
+            w('            {')
+            w('                if (%s__grow(&m->%s, i, sizeof(*m->%s)) ||',
+              prefix, f.name, f.name)
+            w('                    %s)',
+              c_get(f.elem, 'm->' .. f.name .. '[i]'))
+            w('                {')
+            w('                    goto fail;')
+            w('                }')
+            w('                m->%s_n = i + 1;', f.name)
+            w('            }')
+        else
+            w('            if (%s)', c_get(f.type, 'm->' .. f.name))
+            w('            {')
+            w('                goto fail;')
+            w('            }')
+        end
+        w('            break;')
+    end
+    w('        case -1:')
+    w('            qp_skip_next(unpacker);')
+    w('            break;')
+    w('        default:')
+    w('            goto fail;')
+    w('        }')
+    w('    }')
+    w('    return 0;')
+    w('')
+    w('fail:')
+    w('    %s_free(m);', n)
+    w('    return -1;')
+    w('}')
+end
+
+------------------------------------------------------------- Lua module --
+w('')
+w('#ifndef QPGEN_NO_LUA')
+w('')
+w('#include <lauxlib.h>')
+w('')
+w('/* the module links qpack/qpack.o itself, like lua_qpack.c */')
+w('int siri_err;')
+w('')
+w('#define %s__LUA_MT "%s.buffer"', prefix:upper(), prefix)
+w('')
+block([[
+static void $__lua_check(lua_State * L, int rc)
+{
+    if (rc)
+    {
+        luaL_error(L, "Memory allocation error in $");
+    }
+}
+
+static void $__lua_type_error(lua_State * L, const char * field,
+                               const char * expected)
+{
+    luaL_error(L, "Cannot serialise field '%s': %s expected, got %s",
+               field, expected, luaL_typename(L, -1));
+}
+
+/*
+ * The lua_put functions check the type of the value on the top of the stack
+ * and write it; space for int, number and boolean is already reserved.
+ */
+static inline void $__lua_put_int(lua_State * L, qp_packer_t * packer,
+                                   const char * field)
+{
+    int isint;
+    lua_Integer v = lua_tointegerx(L, -1, &isint);
+    if (!isint || lua_type(L, -1) != LUA_TNUMBER)
+    {
+        $__lua_type_error(L, field, "int");
+    }
+    $__put_int(packer, v);
+}
+
+static inline void $__lua_put_number(lua_State * L, qp_packer_t * packer,
+                                      const char * field)
+{
+    if (lua_type(L, -1) != LUA_TNUMBER)
+    {
+        $__lua_type_error(L, field, "number");
+    }
+    if (lua_isinteger(L, -1))
+    {
+        $__put_int(packer, lua_tointeger(L, -1));
+    }
+    else
+    {
+        $__put_number(packer, lua_tonumber(L, -1));
+    }
+}
+
+static inline void $__lua_put_boolean(lua_State * L, qp_packer_t * packer,
+                                       const char * field)
+{
+    if (lua_type(L, -1) != LUA_TBOOLEAN)
+    {
+        $__lua_type_error(L, field, "boolean");
+    }
+    $__put_boolean(packer, lua_toboolean(L, -1));
+}
+
+static inline void $__lua_put_string(lua_State * L, qp_packer_t * packer,
+                                      const char * field)
+{
+    size_t len;
+    const char * s;
+    if (lua_type(L, -1) != LUA_TSTRING)
+    {
+        $__lua_type_error(L, field, "string");
+    }
+    s = lua_tolstring(L, -1, &len);
+    $__lua_check(L, qp_add_raw(packer, (const unsigned char *) s, len));
+}
+
+static void $__lua_decode_error(lua_State * L, const char * field,
+                                const char * expected)
+{
+    luaL_error(L, "Cannot deserialise field '%s': %s expected",
+               field, expected);
+}
+
+/*
+ * The lua_push functions push the next value; null is pushed as nil. Like
+ * the get functions, they read the expected encoding inline.
+ */
+static void $__lua_push_other(lua_State * L, qp_unpacker_t * unpacker,
+                               const char * field, const char * expected)
+{
+    qp_obj_t obj;
+    switch (qp_next(unpacker, &obj))
+    {
+    case QP_INT64:
+        if (expected[0] == 'i' || expected[0] == 'n')
+        {
+            lua_pushinteger(L, obj.via.int64);
+            return;
+        }
+        break;
+    case QP_DOUBLE:
+        if (expected[0] == 'n')
+        {
+            lua_pushnumber(L, obj.via.real);
+            return;
+        }
+        break;
+    case QP_RAW:
+        if (expected[0] == 's')
+        {
+            lua_pushlstring(L, (const char *) obj.via.raw, obj.len);
+            return;
+        }
+        break;
+    case QP_TRUE:
+    case QP_FALSE:
+        if (expected[0] == 'b')
+        {
+            lua_pushboolean(L, obj.tp == QP_TRUE);
+            return;
+        }
+        break;
+    case QP_NULL:
+        lua_pushnil(L);
+        return;
+    default:
+        break;
+    }
+    $__lua_decode_error(L, field, expected);
+}
+
+static inline void $__lua_push_int(lua_State * L, qp_unpacker_t * unpacker,
+                                    const char * field)
+{
+    if (unpacker->pt < unpacker->end && *unpacker->pt < 64)
+    {
+        lua_pushinteger(L, *unpacker->pt++);
+        return;
+    }
+    $__lua_push_other(L, unpacker, field, "int");
+}
+
+static inline void $__lua_push_number(lua_State * L,
+                                       qp_unpacker_t * unpacker,
+                                       const char * field)
+{
+    double v;
+    if (unpacker->end - unpacker->pt > (int) sizeof(double) &&
+        *unpacker->pt == QP_DOUBLE)
+    {
+        memcpy(&v, unpacker->pt + 1, sizeof(double));
+        unpacker->pt += 1 + sizeof(double);
+        lua_pushnumber(L, v);
+        return;
+    }
+    $__lua_push_other(L, unpacker, field, "number");
+}
+
+static inline void $__lua_push_boolean(lua_State * L,
+                                        qp_unpacker_t * unpacker,
+                                        const char * field)
+{
+    $__lua_push_other(L, unpacker, field, "boolean");
+}
+
+static inline void $__lua_push_string(lua_State * L,
+                                       qp_unpacker_t * unpacker,
+                                       const char * field)
+{
+    size_t len;
+    if (unpacker->pt < unpacker->end &&
+        *unpacker->pt >= 128 && *unpacker->pt < 228 &&
+        unpacker->end - unpacker->pt > *unpacker->pt - 128)
+    {
+        len = *unpacker->pt - 128;
+        lua_pushlstring(L, (const char *) unpacker->pt + 1, len);
+        unpacker->pt += 1 + len;
+        return;
+    }
+    $__lua_push_other(L, unpacker, field, "string");
+}
+
+static int $__lua_container(lua_State * L, qp_unpacker_t * unpacker,
+                             int is_map, const char * field)
+{
+    int n = $__container(unpacker, is_map);
+    if (n == -2)
+    {
+        $__lua_decode_error(L, field, is_map ? "map" : "array");
+    }
+    return n;
+}
+
+static qp_packer_t * $__lua_buffer(lua_State * L)
+{
+    qp_packer_t ** pk = lua_touserdata(L, lua_upvalueindex(1));
+    (*pk)->len = 0;
+    return *pk;
+}]])
+w('')
+w('static int %s__lua_gc(lua_State * L)', prefix)
+w('{')
+w('    qp_packer_t ** pk = luaL_checkudata(L, 1, %s__LUA_MT);', prefix:upper())
+w('    if (*pk != NULL)')
+w('    {')
+w('        qp_packer_free(*pk);')
+w('        *pk = NULL;')
+w('    }')
+w('    return 0;')
+w('}')
+
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+    w('')
+    w('static void %s__lua_encode(lua_State * L, qp_packer_t * packer);', n)
+    w('static void %s__lua_decode(lua_State * L, qp_unpacker_t * unpacker);', n)
+end
+
+local function lua_put(t, field, indent)
+    if scalars[t] then
+        w('%s%s__lua_put_%s(L, packer, "%s");', indent, prefix, t, field)
+    else
+        w('%sif (lua_type(L, -1) != LUA_TTABLE)', indent)
+        w('%s{', indent)
+        w('%s    %s__lua_type_error(L, "%s", "table");', indent, prefix, field)
+        w('%s}', indent)
+        w('%s%s_%s__lua_encode(L, packer);', indent, prefix, t)
+    end
+end
+
+local function lua_push(t, field, indent)
+    if scalars[t] then
+        w('%s%s__lua_push_%s(L, unpacker, "%s");', indent, prefix, t, field)
+    else
+        w('%s%s_%s__lua_decode(L, unpacker);', indent, prefix, t)
+    end
+end
+
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+
+    w('')
+    w('/* Encode the table on the top of the stack, absent fields are left out */')
+    w('static void %s__lua_encode(lua_State * L, qp_packer_t * packer)', n)
+    w('{')
+    w('    int top = lua_gettop(L);')
+    w('    size_t pos = 0, count = 0;')
+    if msg.has_array then
+        w('    size_t i, len, apos;')
+    end
+    w('')
+    w('    luaL_checkstack(L, %d, "excessive nesting");', #msg.fields + 2)
+    for ri, run in ipairs(msg.runs) do
+        w('    %s__lua_check(L, qp_packer_reserve(packer, %d));', prefix,
+          run.size)
+        if ri == 1 then
+            w('    pos = packer->len;')
+            w('    packer->buffer[packer->len++] = QP_MAP_OPEN;')
+        end
+        for _, f in ipairs(run) do
+            w('    if (lua_getfield(L, top, "%s") != LUA_TNIL)', f.name)
+            w('    {')
+            w('        %s__put_key(packer, %d, %d);', prefix, f.key_pos,
+              f.key_len)
+            if f.array then
+                w('        if (lua_type(L, -1) != LUA_TTABLE)')
+                w('        {')
+                w('            %s__lua_type_error(L, "%s", "array");', prefix,
+                  f.name)
+                w('        }')
+                w('        len = lua_rawlen(L, -1);')
+                w('        %s__lua_check(L, qp_add_open(packer, QP_ARRAY_OPEN, &apos));',
+                  prefix)
+                if fixed_size[f.elem] then
+                    w('        %s__lua_check(L, qp_packer_reserve(packer, len * %d));',
+                      prefix, fixed_size[f.elem])
+                end
+                w('        for (i = 1; i <= len; i++)')
+                w('        {')
+                w('            lua_rawgeti(L, -1, i);')
+                lua_put(f.elem, f.name, '            ')
+                w('            lua_pop(L, 1);')
+                w('        }')
+                w('        %s__lua_check(L, qp_add_close(packer, apos, len));',
+                  prefix)
+            else
+                lua_put(f.type, f.name, '        ')
+            end
+            w('        count++;')
+            w('    }')
+        end
+    end
+    w('    lua_settop(L, top);')
+    w('    %s__lua_check(L, qp_add_close(packer, pos, count));', prefix)
+    w('}')
+
+    w('')
+    w('/* Push the map at the position of the unpacker as a table */')
+    w('static void %s__lua_decode(lua_State * L, qp_unpacker_t * unpacker)', n)
+    w('{')
+    w('    int count = %s__lua_container(L, unpacker, 1, "%s");', prefix,
+      msg.name)
+    w('    int field = -1;')
+    if msg.has_array then
+        w('    int n;')
+        w('    size_t i;')
+    end
+    w('')
+    w('    luaL_checkstack(L, 4, "excessive nesting");')
+    w('    lua_createtable(L, 0, %d);', #msg.fields)
+    w('    while (count < 0 ?')
+    w('           !%s__closed(unpacker, QP_MAP_CLOSE) : count--)', prefix)
+    w('    {')
+    w('        switch ((field = %s__field(unpacker, field + 1)))', n)
+    w('        {')
+    for _, f in ipairs(msg.fields) do
+        w('        case %d:', f.index)
+        if f.array then
+            w('            n = %s__lua_container(L, unpacker, 0, "%s");',
+              prefix, f.name)
+            w('            lua_createtable(L, n > 0 ? n : 0, 0);')
+            w('            for (i = 1; n < 0 ?')
+            w('                 !%s__closed(unpacker, QP_ARRAY_CLOSE) :',
+              prefix)
+            w('                 i <= (size_t) n; i++)')
+            w('            {')
+            lua_push(f.elem, f.name, '                ')
+            w('                lua_rawseti(L, -2, i);')
+            w('            }')
+        else
+            lua_push(f.type, f.name, '            ')
+        end
+        w('            lua_setfield(L, -2, "%s");', f.name)
+        w('            break;')
+    end
+    w('        case -1:')
+    w('            qp_skip_next(unpacker);')
+    w('            break;')
+    w('        default:')
+    w('            luaL_error(L, "Cannot deserialise %s: invalid key");',
+      msg.name)
+    w('        }')
+    w('    }')
+    w('}')
+
+    w('')
+    w('static int %s__lua_encode_fn(lua_State * L)', n)
+    w('{')
+    w('    qp_packer_t * packer = %s__lua_buffer(L);', prefix)
+    w('')
+    w('    luaL_checktype(L, 1, LUA_TTABLE);')
+    w('    lua_settop(L, 1);')
+    w('    %s__lua_encode(L, packer);', n)
+    w('    lua_pushlstring(L, (const char *) packer->buffer, packer->len);')
+    w('    return 1;')
+    w('}')
+
+    w('')
+    w('static int %s__lua_decode_fn(lua_State * L)', n)
+    w('{')
+    w('    qp_unpacker_t unpacker;')
+    w('    size_t len;')
+    w('    const char * data = luaL_checklstring(L, 1, &len);')
+    w('')
+    w('    qp_unpacker_init(&unpacker, (unsigned char *) data, len);')
+    w('    %s__lua_decode(L, &unpacker);', n)
+    w('    return 1;')
+    w('}')
+end
+
+w('')
+w('int luaopen_%s(lua_State * L)', prefix)
+w('{')
+w('    static const luaL_Reg funcs[] = {')
+for _, msg in ipairs(messages) do
+    local n = prefix .. '_' .. msg.name
+    w('        { "encode_%s", %s__lua_encode_fn },', msg.name, n)
+    w('        { "decode_%s", %s__lua_decode_fn },', msg.name, n)
+end
+w('        { NULL, NULL }')
+w('    };')
+w('    qp_packer_t ** pk;')
+w('')
+w('    luaL_newlibtable(L, funcs);')
+w('    pk = lua_newuserdata(L, sizeof(qp_packer_t *));')
+w('    *pk = NULL;')
+w('    if (luaL_newmetatable(L, %s__LUA_MT))', prefix:upper())
+w('    {')
+w('        lua_pushcfunction(L, %s__lua_gc);', prefix)
+w('        lua_setfield(L, -2, "__gc");')
+w('    }')
+w('    lua_setmetatable(L, -2);')
+w('    *pk = qp_packer_new(QP_SUGGESTED_SIZE);')
+w('    if (*pk == NULL)')
+w('    {')
+w('        luaL_error(L, "Memory allocation error in %s");', prefix)
+w('    }')
+w('    luaL_setfuncs(L, funcs, 1);')
+w('    return 1;')
+w('}')
+w('')
+w('#endif  /* QPGEN_NO_LUA */')
+flush(prefix .. '.c')
+
+-------------------------------------------------------------- benchmark --
+local function sample(t)
+    if t == 'int' then return '1637979480080' end
+    if t == 'number' then return '29.1100001' end
+    if t == 'string' then return "'sensor-0042'" end
+    if t == 'boolean' then return 'true' end
+    if type(t) == 'table' then
+        local e = sample(t[2])
+        return '{' .. e .. ', ' .. e .. ', ' .. e .. '}'
+    end
+    local parts = {}
+    for _, f in ipairs(by_name[t].fields) do
+        parts[#parts + 1] = f.name .. ' = ' .. sample(f.type)
+    end
+    return '{' .. table.concat(parts, ', ') .. '}'
+end
+
+w('-- %s_bench.lua - Generated by tools/qpgen.lua from %s, do not edit.',
+  prefix, schema_fn)
+w('--')
+w('-- Compare the generated module with qpack.encode() and qpack.decode().')
+w('--')
+w('-- Usage: lua %s/%s_bench.lua [rounds]', outdir, prefix)
+w('package.cpath = \'%s/?.so;\' .. package.cpath', outdir)
+w('local qpack = require \'qpack\'')
+w('local %s = require \'%s\'', prefix, prefix)
+w('')
+w('local rounds = tonumber(arg and arg[1]) or 200000')
+w('')
+w('local function bench(fn, v)')
+w('    local start = os.clock()')
+w('    for _ = 1, rounds do')
+w('        fn(v)')
+w('    end')
+w('    return (os.clock() - start) * 1e9 / rounds')
+w('end')
+w('')
+w('local function report(name, generic, generated)')
+w('    print(string.format(\'%%-24s %%8.1f ns %%8.1f ns %%6.2fx\',')
+w('                        name, generic, generated, generic / generated))')
+w('end')
+w('')
+w('print(string.format(\'%%-24s %%11s %%11s\', \'\', \'qpack\', \'%s\'))', prefix)
+for _, msg in ipairs(messages) do
+    w('do')
+    w('    local v = %s', sample(msg.name))
+    w('    local data = %s.encode_%s(v)', prefix, msg.name)
+    w('    report(\'encode %s\', bench(qpack.encode, v),', msg.name)
+    w('           bench(%s.encode_%s, v))', prefix, msg.name)
+    w('    report(\'decode %s\', bench(qpack.decode, data),', msg.name)
+    w('           bench(%s.decode_%s, data))', prefix, msg.name)
+    w('end')
+end
+flush(prefix .. '_bench.lua')